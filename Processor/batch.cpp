@@ -0,0 +1,245 @@
+#include "vm.h"
+#include "batch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define BATCH_LIVE 1024
+
+struct batch_result
+{
+	struct vm *vm;
+	int fd;
+	char *text;
+	size_t len;
+	enum vm_status status;
+	bool done;
+	struct batch_result *next;
+};
+
+/*
+ * One program run over many input files.  The code is decoded once into
+ * proto and shared read-only, every run gets a VM of its own.  Workers
+ * take the next input from next, results go out in input order.
+ *
+ * With a slice a run is suspended after that many commands and queued
+ * behind the others, so up to BATCH_LIVE runs share the workers fairly
+ * and a long one does not hold a worker up.  fuel limits every run.
+ */
+struct batch
+{
+	const struct vm_config *config;
+	const struct vm *proto;
+	char *const *inputs;
+	size_t num;
+	size_t next;
+	size_t live;
+	uint64_t fuel;
+	uint64_t slice;
+	struct batch_result *results;
+	struct batch_result *head;
+	struct batch_result *tail;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static void *batch_worker (void *arg);
+static struct batch_result *take_job (struct batch *batch);
+static void run_job (struct batch *batch, struct batch_result *result);
+static int start_job (struct batch *batch, struct batch_result *result);
+static int write_all (const char *text, const size_t len);
+
+int run_batch (const struct vm_config *config, const char *byte_code, const size_t len,
+	       const uint32_t flags, char *const *inputs, const size_t num, size_t jobs,
+	       const uint64_t fuel, const uint64_t slice)
+{
+	struct batch batch = {};
+	struct vm proto = {};
+	pthread_t *threads = NULL;
+	size_t started = 0, failed = 0;
+	int res = 1;
+
+	if (jobs == 0) {
+		long cpus = sysconf (_SC_NPROCESSORS_ONLN);
+		jobs = (cpus > 0) ? (size_t) cpus : 1;
+	}
+	if (jobs > num)
+		jobs = (num) ? num : 1;
+
+	if (vm_ctor (&proto, config) || vm_load (&proto, byte_code, len, flags))
+		goto out;
+
+	batch.config = config;
+	batch.proto = &proto;
+	batch.inputs = inputs;
+	batch.num = num;
+	batch.fuel = fuel;
+	batch.slice = slice;
+	batch.results = (struct batch_result *) calloc (num + 1, sizeof (struct batch_result));
+	threads = (pthread_t *) calloc (jobs, sizeof (pthread_t));
+	if (!batch.results || !threads) {
+		fprintf (stderr, "Processor: can't allocate a batch of %zu runs\n", num);
+		goto out;
+	}
+	pthread_mutex_init (&batch.lock, NULL);
+	pthread_cond_init (&batch.cond, NULL);
+
+	for (started = 0; started < jobs; started++)
+		if (pthread_create (&threads[started], NULL, batch_worker, &batch)) {
+			fprintf (stderr, "Processor: can't start worker thread\n");
+			break;
+		}
+	if (!started)
+		batch_worker (&batch);
+
+	for (size_t i = 0; i < num; i++) {
+		pthread_mutex_lock (&batch.lock);
+		while (!batch.results[i].done)
+			pthread_cond_wait (&batch.cond, &batch.lock);
+		pthread_mutex_unlock (&batch.lock);
+
+		if (write_all (batch.results[i].text, batch.results[i].len))
+			batch.results[i].status = VM_ERR_IO;
+		if (batch.results[i].status != VM_HALTED) {
+			fprintf (stderr, "Processor: run on %s failed\n", inputs[i]);
+			failed++;
+		}
+		free (batch.results[i].text);
+		batch.results[i].text = NULL;
+	}
+
+	for (size_t i = 0; i < started; i++)
+		pthread_join (threads[i], NULL);
+	pthread_cond_destroy (&batch.cond);
+	pthread_mutex_destroy (&batch.lock);
+	res = (failed) ? 1 : 0;
+
+out:
+	free (threads);
+	free (batch.results);
+	vm_dtor (&proto);
+	return res;
+}
+
+static void *batch_worker (void *arg)
+{
+	struct batch *batch = (struct batch *) arg;
+	struct batch_result *result = NULL;
+
+	while ((result = take_job (batch)))
+		run_job (batch, result);
+	return NULL;
+}
+
+/* New inputs start while there is room, the suspended runs go round */
+static struct batch_result *take_job (struct batch *batch)
+{
+	struct batch_result *result = NULL;
+
+	pthread_mutex_lock (&batch->lock);
+	while (true) {
+		if (batch->head && (batch->live >= BATCH_LIVE || batch->next == batch->num)) {
+			result = batch->head;
+			batch->head = result->next;
+			break;
+		}
+		if (batch->next < batch->num) {
+			result = &batch->results[batch->next++];
+			batch->live++;
+			break;
+		}
+		if (!batch->live)
+			break;
+		pthread_cond_wait (&batch->cond, &batch->lock);
+	}
+	pthread_mutex_unlock (&batch->lock);
+	return result;
+}
+
+static void run_job (struct batch *batch, struct batch_result *result)
+{
+	struct vm *vm = result->vm;
+	uint64_t budget = batch->slice;
+	int failed = 0;
+
+	if (!vm) {
+		failed = start_job (batch, result);
+		vm = result->vm;
+		if (failed)
+			goto out;
+	}
+
+	if (batch->fuel - vm->fuel_used < budget)
+		budget = batch->fuel - vm->fuel_used;
+	result->status = vm_run (vm, budget);
+	if (result->status == VM_SUSPENDED && vm->fuel_used < batch->fuel) {
+		pthread_mutex_lock (&batch->lock);
+		result->next = NULL;
+		if (batch->head)
+			batch->tail->next = result;
+		else
+			batch->head = result;
+		batch->tail = result;
+		pthread_cond_signal (&batch->cond);
+		pthread_mutex_unlock (&batch->lock);
+		return;
+	}
+	if (result->status == VM_SUSPENDED)
+		fprintf (stderr, "Processor: out of fuel after %" PRIu64 " commands\n", vm->fuel_used);
+	result->text = io_take_output (&vm->io, &result->len);
+
+out:
+	vm_destroy (vm);
+	result->vm = NULL;
+	if (result->fd >= 0)
+		close (result->fd);
+
+	pthread_mutex_lock (&batch->lock);
+	result->done = true;
+	batch->live--;
+	pthread_cond_broadcast (&batch->cond);
+	pthread_mutex_unlock (&batch->lock);
+}
+
+static int start_job (struct batch *batch, struct batch_result *result)
+{
+	const size_t job = (size_t) (result - batch->results);
+	struct vm_config config = *batch->config;
+
+	result->status = VM_ERR_IO;
+	result->fd = open (batch->inputs[job], O_RDONLY);
+	if (result->fd < 0) {
+		fprintf (stderr, "Processor: can't open %s: %s\n", batch->inputs[job], strerror (errno));
+		return 1;
+	}
+
+	config.in_fd = result->fd;
+	config.capture = true;
+	result->status = VM_ERR_MEMORY;
+	result->vm = vm_create (&config);
+	return (!result->vm || vm_share_code (result->vm, batch->proto)) ? 1 : 0;
+}
+
+static int write_all (const char *text, const size_t len)
+{
+	size_t done = 0;
+	ssize_t part = 0;
+
+	while (done < len) {
+		part = write (STDOUT_FILENO, text + done, len - done);
+		if (part < 0 && errno == EINTR)
+			continue;
+		if (part <= 0) {
+			fprintf (stderr, "Processor: can't write output: %s\n", strerror (errno));
+			return 1;
+		}
+		done += (size_t) part;
+	}
+	return 0;
+}
@@ -0,0 +1,13 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "vm.h"
+
+#include <stdio.h>
+#include <stdint.h>
+
+int run_batch (const struct vm_config *config, const char *byte_code, const size_t len,
+	       const uint32_t flags, char *const *inputs, const size_t num, size_t jobs,
+	       const uint64_t fuel, const uint64_t slice);
+
+#endif // BATCH_H
@@ -0,0 +1,56 @@
+#!/bin/sh
+# Assembler throughput: generates a source with many labels and
+# forward/backward jumps, assembles it and prints lines per second.
+#
+# Usage: bench/asm_throughput.sh [compiler] [lines]
+
+COMPILER=${1:-./compiler}
+LINES=${2:-1000000}
+SRC=$(mktemp /tmp/asm_bench.XXXXXX)
+OUT=$(mktemp /tmp/asm_bench.XXXXXX)
+
+awk -v n="$LINES" '
+function name(i,   s)
+{
+	s = ""
+	do {
+		s = s sprintf ("%c", 97 + i % 26)
+		i = int (i / 26)
+	} while (i > 0)
+	return "l" s
+}
+BEGIN {
+	for (i = 0; i < n / 8; i++) {
+		print name(i) ":"
+		print "push ax"
+		print "push " i
+		print "jb " name(i + 1)
+		print "push ax"
+		print "push 1"
+		print "add"
+		print "jmp " name(int (i / 2))
+	}
+	print name(i) ":"
+	print "hlt"
+}' > "$SRC"
+
+lines=$(wc -l < "$SRC")
+bytes=$(wc -c < "$SRC")
+
+start=$(date +%s.%N)
+"$COMPILER" "$SRC" "$OUT"
+status=$?
+end=$(date +%s.%N)
+
+if [ $status -eq 0 ]; then
+	awk -v l="$lines" -v b="$bytes" -v s="$start" -v e="$end" 'BEGIN {
+		t = e - s
+		printf ("%d lines, %.1f MB in %.3f s: %.0f lines/s, %.1f MB/s\n",
+			l, b / 1048576, t, l / t, b / 1048576 / t)
+	}'
+else
+	echo "$COMPILER failed with status $status" >&2
+fi
+
+rm -f "$SRC" "$OUT"
+exit $status
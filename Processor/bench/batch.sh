@@ -0,0 +1,88 @@
+#!/bin/sh
+# One process per input against processor --batch: a recursive fib over
+# RUNS input files, batch mode with 1, 2, 4 ... jobs up to the number of
+# CPUs.
+#
+# Usage: bench/batch.sh [compiler] [processor] [runs] [n]
+
+COMPILER=${1:-./compiler}
+PROCESSOR=${2:-./processor}
+RUNS=${3:-1000}
+N=${4:-18}
+DIR=$(mktemp -d /tmp/batch_bench.XXXXXX)
+CPUS=$(getconf _NPROCESSORS_ONLN 2> /dev/null || echo 1)
+
+cat > "$DIR/fib.asm" << EOF
+	in
+	pop ax
+	call fib
+	out
+	hlt
+fib:
+	push ax
+	push 2
+	jb small
+	push ax
+	push ax
+	push 1
+	sub
+	pop ax
+	call fib
+	pop bx
+	pop ax
+	push bx
+	push ax
+	push 2
+	sub
+	pop ax
+	call fib
+	add
+	ret
+small:
+	push ax
+	ret
+EOF
+
+# $1: command...; prints seconds
+run ()
+{
+	start=$(date +%s.%N)
+	"$@" > "$DIR/out" || return 1
+	end=$(date +%s.%N)
+	awk -v s="$start" -v e="$end" 'BEGIN { printf ("%.3f", e - s) }'
+}
+
+# one process per input, the way it is done without --batch
+each ()
+{
+	for f in "$DIR"/in.*; do
+		"$PROCESSOR" --io text "$DIR/fib.byte" < "$f" || return 1
+	done
+}
+
+status=0
+if "$COMPILER" "$DIR/fib.asm" "$DIR/fib.byte"; then
+	i=0
+	while [ $i -lt "$RUNS" ]; do
+		echo $((N + i % 3)) > "$DIR/in.$(printf %06d $i)"
+		i=$((i + 1))
+	done
+
+	echo "$RUNS runs of fib($N..$((N + 2))), $CPUS CPUs"
+	t=$(run each) || status=1
+	printf "process per input: %s s\n" "$t"
+	jobs=1
+	while [ $status -eq 0 ]; do
+		t=$(run "$PROCESSOR" --batch --jobs $jobs "$DIR/fib.byte" "$DIR"/in.*) || { status=1; break; }
+		printf "batch, %d jobs: %s s\n" $jobs "$t"
+		[ $jobs -ge "$CPUS" ] && break
+		jobs=$((jobs * 2))
+		[ $jobs -gt "$CPUS" ] && jobs=$CPUS
+	done
+else
+	echo "$COMPILER failed" >&2
+	status=1
+fi
+
+rm -rf "$DIR"
+exit $status
@@ -0,0 +1,135 @@
+#!/bin/sh
+# Fixed against compact (--compact) byte code: size of the code section,
+# assembly time and time to load and run a generated program of BLOCKS
+# blocks with small immediates and short jumps, then an insertion sort of
+# WORDS words.  Both encodings have to print the same.
+#
+# Usage: bench/compact.sh [compiler] [processor] [blocks] [words]
+
+COMPILER=${1:-./compiler}
+PROCESSOR=${2:-./processor}
+BLOCKS=${3:-100000}
+WORDS=${4:-3000}
+DIR=$(mktemp -d /tmp/compact_bench.XXXXXX)
+
+awk -v n="$BLOCKS" '
+BEGIN {
+	print "\tpush 0"
+	print "\tpop ax"
+	for (i = 0; i < n; i++) {
+		printf ("b%d:\n", i)
+		print "\tpush ax"
+		printf ("\tpush %d\n", i % 100)
+		print "\tadd"
+		print "\tpop ax"
+		print "\tpush ax"
+		print "\tpush 0"
+		printf ("\tjb b%d\n", i)
+		printf ("\tpush [%d]\n", i % 64)
+		print "\tpop bx"
+	}
+	print "\tpush ax"
+	print "\tout"
+	print "\thlt"
+}' > "$DIR/blocks.asm"
+
+cat > "$DIR/sort.asm" << EOF
+	in
+	pop cx
+	push 0
+	pop ax
+	push 12345
+	pop dx
+fill:
+	push dx
+	push 1103515245
+	mul
+	push 12345
+	add
+	pop dx
+	push dx
+	pop [ax+1]
+	push ax
+	push 1
+	add
+	pop ax
+	push ax
+	push cx
+	jb fill
+	push 1
+	pop ax
+outer:
+	push ax
+	push cx
+	jae sorted
+	push [ax+1]
+	pop dx
+	push ax
+	pop bx
+inner:
+	push bx
+	push 0
+	jbe place
+	push [bx]
+	push dx
+	jbe place
+	push [bx]
+	pop [bx+1]
+	push bx
+	push 1
+	sub
+	pop bx
+	jmp inner
+place:
+	push dx
+	pop [bx+1]
+	push ax
+	push 1
+	add
+	pop ax
+	jmp outer
+sorted:
+	push [1]
+	out
+	push [cx]
+	out
+	hlt
+EOF
+
+# Size of SECT_CODE, the first entry of the section table
+code_size ()
+{
+	od -An -tu8 -j48 -N8 "$1" | tr -d ' '
+}
+
+# $1: what to print, $2: command, prints its seconds
+timed ()
+{
+	start=$(date +%s.%N)
+	sh -c "$2" > /dev/null || return 1
+	end=$(date +%s.%N)
+	awk -v s="$start" -v e="$end" -v w="$1" 'BEGIN { printf ("%s %.3f s", w, e - s) }'
+}
+
+# $1: name, $2: source, $3: input
+compare ()
+{
+	for mode in fixed compact; do
+		flag=$([ $mode = compact ] && echo --compact)
+		asm=$(timed "asm" "\"$COMPILER\" $flag \"$2\" \"$DIR/$mode.byte\"") || return 1
+		echo "$3" | "$PROCESSOR" "$DIR/$mode.byte" > "$DIR/out.$mode" || return 1
+		run=$(timed "run" "echo \"$3\" | \"$PROCESSOR\" \"$DIR/$mode.byte\"") || return 1
+		printf "%-14s %-8s %10s bytes   %s   %s\n" "$1" "$mode" "$(code_size "$DIR/$mode.byte")" "$asm" "$run"
+	done
+	if ! cmp -s "$DIR/out.fixed" "$DIR/out.compact"; then
+		echo "$1: the encodings disagree" >&2
+		return 1
+	fi
+}
+
+status=0
+compare "blocks($BLOCKS)" "$DIR/blocks.asm" "" || status=1
+compare "sort($WORDS)" "$DIR/sort.asm" "$WORDS" || status=1
+
+rm -rf "$DIR"
+exit $status
@@ -0,0 +1,70 @@
+#!/bin/sh
+# End-to-end runs of the programs in bench/programs: every NAME.asm is
+# assembled, run RUNS times on each engine with NAME.in as input and its
+# output checked against NAME.out.  Prints JSON, one result per program
+# and engine: commands (--count), mean and best wall time of a run and
+# commands per second of the best one.  Build with make release first to
+# measure without the sanitizers.
+#
+# Usage: bench/corpus.sh [compiler] [processor] [runs]
+
+COMPILER=${1:-./release/compiler}
+PROCESSOR=${2:-./release/processor}
+RUNS=${3:-5}
+PROGRAMS=$(dirname "$0")/programs
+DIR=$(mktemp -d /tmp/corpus_bench.XXXXXX)
+
+# $1: engine, $2: program name; prints "commands mean best ok"
+measure ()
+{
+	i=0
+	times=""
+	ok=true
+	while [ $i -lt "$RUNS" ]; do
+		start=$(date +%s.%N)
+		"$PROCESSOR" --engine "$1" --count "$DIR/$2.byte" < "$PROGRAMS/$2.in" \
+			> "$DIR/out" 2> "$DIR/err" || ok=false
+		end=$(date +%s.%N)
+		cmp -s "$DIR/out" "$PROGRAMS/$2.out" || ok=false
+		times="$times $start $end"
+		i=$((i + 1))
+	done
+	count=$(sed -n 's/^Processor: \([0-9]*\) commands$/\1/p' "$DIR/err")
+	echo "$times" | awk -v c="${count:-0}" -v ok="$ok" '{
+		best = -1
+		for (i = 1; i < NF; i += 2) {
+			t = $(i + 1) - $i
+			sum += t
+			if (best < 0 || t < best)
+				best = t
+		}
+		printf ("%s %.6f %.6f %s\n", c, sum / ((NF) / 2), best, ok)
+	}'
+}
+
+status=0
+first=true
+printf '{\n  "processor": "%s",\n  "runs": %d,\n  "results": [' "$PROCESSOR" "$RUNS"
+for src in "$PROGRAMS"/*.asm; do
+	name=$(basename "$src" .asm)
+	if ! "$COMPILER" "$src" "$DIR/$name.byte" > /dev/null; then
+		echo "$COMPILER $src failed" >&2
+		status=1
+		continue
+	fi
+	for engine in stack reg; do
+		set -- $(measure "$engine" "$name")
+		[ "$4" = true ] || status=1
+		[ "$first" = true ] || printf ','
+		first=false
+		printf '\n    {"program": "%s", "engine": "%s", "commands": %s, "mean_s": %s, "best_s": %s, ' \
+		       "$name" "$engine" "$1" "$2" "$3"
+		awk -v c="$1" -v t="$3" -v ok="$4" 'BEGIN {
+			printf ("\"commands_per_s\": %.0f, \"ok\": %s}", (t > 0) ? c / t : 0, ok)
+		}'
+	done
+done
+printf '\n  ]\n}\n'
+
+rm -rf "$DIR"
+exit $status
@@ -0,0 +1,53 @@
+#!/bin/sh
+# Disassembly throughput: a generated program of BLOCKS blocks with every
+# kind of operand is assembled in both encodings, then disassembled and
+# listed.  Prints megabytes of code per second.  Build with make release
+# first to measure without the sanitizers.
+#
+# Usage: bench/disasm.sh [release dir] [blocks]
+
+TOOLS=${1:-./release}
+BLOCKS=${2:-400000}
+DIR=$(mktemp -d /tmp/disasm_bench.XXXXXX)
+
+awk -v n="$BLOCKS" 'BEGIN {
+	for (i = 0; i < n; i++) {
+		printf ("b%d:\n\tpush ax\n\tpush %d\n\tadd\n\tpop ax\n", i, i % 100)
+		printf ("\tpush [ax+%d]\n\tpop bx\n\tpush bx\n\tpush 3\n\tjb b%d\n", i % 7, i)
+		printf ("\tpush.q %d\n\tout.q\n\tcall b%d\n", i, i / 2)
+	}
+	print "\thlt"
+}' > "$DIR/prog.asm"
+
+# Size of SECT_CODE, the first entry of the section table
+code_size ()
+{
+	od -An -tu8 -j48 -N8 "$1" | tr -d ' '
+}
+
+# $1: what to print, $2: tool, $3: byte code.  The output is removed
+# first, truncating a file just written makes ext4 flush it at close.
+timed ()
+{
+	rm -f "$DIR/out"
+	start=$(date +%s.%N)
+	"$TOOLS/$2" "$3" "$DIR/out" || return 1
+	end=$(date +%s.%N)
+	awk -v s="$start" -v e="$end" -v w="$1" -v b="$(code_size "$3")" \
+		'BEGIN { printf ("%s %.3f s (%.0f MB/s)", w, e - s, b / (e - s) / 1e6) }'
+}
+
+status=0
+for mode in fixed compact; do
+	flag=$([ $mode = compact ] && echo --compact)
+	if ! "$TOOLS/compiler" $flag "$DIR/prog.asm" "$DIR/$mode.byte" > /dev/null; then
+		status=1
+		continue
+	fi
+	dasm=$(timed "disassembler" disassembler "$DIR/$mode.byte") || status=1
+	lst=$(timed "listing" listing "$DIR/$mode.byte") || status=1
+	printf "%-8s %10s bytes   %s   %s\n" "$mode" "$(code_size "$DIR/$mode.byte")" "$dasm" "$lst"
+done
+
+rm -rf "$DIR"
+exit $status
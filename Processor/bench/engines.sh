@@ -0,0 +1,149 @@
+#!/bin/sh
+# Stack engine against register engine: commands run (--count) and wall
+# time of the examples, an insertion sort of WORDS pseudo-random words in
+# RAM and a recursive fib(N).  Both engines have to print the same.
+#
+# Usage: bench/engines.sh [compiler] [processor] [words] [n]
+
+COMPILER=${1:-./compiler}
+PROCESSOR=${2:-./processor}
+WORDS=${3:-3000}
+N=${4:-30}
+DIR=$(mktemp -d /tmp/engines_bench.XXXXXX)
+
+# a[1..WORDS] from a linear congruential generator, prints a[1] and a[WORDS]
+cat > "$DIR/sort.asm" << EOF
+	in
+	pop cx
+	push 0
+	pop ax
+	push 12345
+	pop dx
+fill:
+	push dx
+	push 1103515245
+	mul
+	push 12345
+	add
+	pop dx
+	push dx
+	pop [ax+1]
+	push ax
+	push 1
+	add
+	pop ax
+	push ax
+	push cx
+	jb fill
+	push 1
+	pop ax
+outer:
+	push ax
+	push cx
+	jae sorted
+	push [ax+1]
+	pop dx
+	push ax
+	pop bx
+inner:
+	push bx
+	push 0
+	jbe place
+	push [bx]
+	push dx
+	jbe place
+	push [bx]
+	pop [bx+1]
+	push bx
+	push 1
+	sub
+	pop bx
+	jmp inner
+place:
+	push dx
+	pop [bx+1]
+	push ax
+	push 1
+	add
+	pop ax
+	jmp outer
+sorted:
+	push [1]
+	out
+	push [cx]
+	out
+	hlt
+EOF
+
+cat > "$DIR/fib.asm" << EOF
+	in
+	pop ax
+	call fib
+	out
+	hlt
+fib:
+	push ax
+	push 2
+	jb small
+	push ax
+	push ax
+	push 1
+	sub
+	pop ax
+	call fib
+	pop bx
+	pop ax
+	push bx
+	push ax
+	push 2
+	sub
+	pop ax
+	call fib
+	add
+	ret
+small:
+	push ax
+	ret
+EOF
+
+# $1: engine, $2: byte code, $3: input; prints commands and seconds
+run ()
+{
+	start=$(date +%s.%N)
+	echo "$3" | "$PROCESSOR" --engine "$1" --count "$2" > "$DIR/out.$1" 2> "$DIR/err" || return 1
+	end=$(date +%s.%N)
+	count=$(sed -n 's/^Processor: \([0-9]*\) commands$/\1/p' "$DIR/err")
+	awk -v c="$count" -v s="$start" -v e="$end" 'BEGIN { printf ("%12s %8.3f s", c, e - s) }'
+}
+
+# $1: name, $2: byte code, $3: input
+compare ()
+{
+	stack=$(run stack "$2" "$3") && reg=$(run reg "$2" "$3") || return 1
+	if ! cmp -s "$DIR/out.stack" "$DIR/out.reg"; then
+		echo "$1: the engines disagree" >&2
+		return 1
+	fi
+	printf "%-10s %s   %s\n" "$1" "$stack" "$reg"
+}
+
+status=0
+printf "%-10s %23s   %23s\n" "" "stack: commands, time" "reg: commands, time"
+for name in example example3 example4 example5; do
+	if "$COMPILER" "$name.asm" "$DIR/$name.byte" > /dev/null; then
+		compare "$name" "$DIR/$name.byte" "5 3 7 2 1 4" || status=1
+	else
+		echo "$COMPILER $name.asm failed" >&2
+		status=1
+	fi
+done
+if "$COMPILER" "$DIR/sort.asm" "$DIR/sort.byte" && "$COMPILER" "$DIR/fib.asm" "$DIR/fib.byte"; then
+	compare "sort($WORDS)" "$DIR/sort.byte" "$WORDS" || status=1
+	compare "fib($N)" "$DIR/fib.byte" "$N" || status=1
+else
+	echo "$COMPILER failed" >&2
+	status=1
+fi
+
+rm -rf "$DIR"
+exit $status
@@ -0,0 +1,105 @@
+#!/bin/sh
+# Fuel accounting: a counting loop of LOOPS iterations, the shortest runs
+# of commands there are, with and without --fuel and on a baseline
+# processor built without fuel if one is given.  Then suspend and resume:
+# batch over RUNS inputs of fib(18..20) in slices of fewer and fewer
+# commands.
+#
+# Usage: bench/fuel.sh [compiler] [processor] [baseline] [loops] [runs]
+
+COMPILER=${1:-./compiler}
+PROCESSOR=${2:-./processor}
+BASELINE=$3
+LOOPS=${4:-100000000}
+RUNS=${5:-300}
+DIR=$(mktemp -d /tmp/fuel_bench.XXXXXX)
+
+cat > "$DIR/loop.asm" << EOF
+	in
+	pop ax
+loop:
+	push ax
+	push 1
+	sub
+	pop ax
+	push ax
+	push 0
+	ja loop
+	hlt
+EOF
+
+cat > "$DIR/fib.asm" << EOF
+	in
+	pop ax
+	call fib
+	out
+	hlt
+fib:
+	push ax
+	push 2
+	jb small
+	push ax
+	push ax
+	push 1
+	sub
+	pop ax
+	call fib
+	pop bx
+	pop ax
+	push bx
+	push ax
+	push 2
+	sub
+	pop ax
+	call fib
+	add
+	ret
+small:
+	push ax
+	ret
+EOF
+
+# $1: input file, $2: command...; prints seconds
+run ()
+{
+	input=$1
+	shift
+	start=$(date +%s.%N)
+	"$@" < "$input" > "$DIR/out" || return 1
+	end=$(date +%s.%N)
+	awk -v s="$start" -v e="$end" 'BEGIN { printf ("%.3f", e - s) }'
+}
+
+status=0
+if "$COMPILER" "$DIR/loop.asm" "$DIR/loop.byte" && "$COMPILER" "$DIR/fib.asm" "$DIR/fib.byte"; then
+	echo "$LOOPS" > "$DIR/loops"
+	echo "$LOOPS loop iterations"
+	if [ -n "$BASELINE" ]; then
+		t=$(run "$DIR/loops" "$BASELINE" --io text "$DIR/loop.byte") || status=1
+		printf "baseline: %s s\n" "$t"
+	fi
+	t=$(run "$DIR/loops" "$PROCESSOR" --io text "$DIR/loop.byte") || status=1
+	printf "no fuel: %s s\n" "$t"
+	t=$(run "$DIR/loops" "$PROCESSOR" --io text --fuel 4G "$DIR/loop.byte") || status=1
+	printf "fuel: %s s\n" "$t"
+
+	i=0
+	while [ $i -lt "$RUNS" ]; do
+		echo $((18 + i % 3)) > "$DIR/in.$(printf %06d $i)"
+		i=$((i + 1))
+	done
+	echo "$RUNS runs of fib(18..20)"
+	t=$(run /dev/null "$PROCESSOR" --batch "$DIR/fib.byte" "$DIR"/in.*) || status=1
+	printf "batch: %s s\n" "$t"
+	for slice in 1M 10K 1K 100; do
+		[ $status -eq 0 ] || break
+		t=$(run /dev/null "$PROCESSOR" --batch --slice $slice "$DIR/fib.byte" "$DIR"/in.*) || status=1
+		printf "batch, slices of %s: %s s\n" $slice "$t"
+	done
+else
+	echo "$COMPILER failed" >&2
+	status=1
+fi
+
+rm -rf "$DIR"
+exit $status
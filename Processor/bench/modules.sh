@@ -0,0 +1,67 @@
+#!/bin/sh
+# Separate assembly: a program of MODULES generated modules of LINES
+# lines each is built through make with 1 and with all CPUs, then one
+# module is touched and the program rebuilt.  The linked program has to
+# print the same as the modules assembled as one file.
+#
+# Usage: bench/modules.sh [modules] [lines]
+
+MODULES=${1:-16}
+LINES=${2:-100000}
+DIR=$(mktemp -d /tmp/modules_bench.XXXXXX)
+CPUS=$(getconf _NPROCESSORS_ONLN 2> /dev/null || echo 1)
+
+# Module 0 calls f1 ... fN-1 in turn, each adds its blocks to ax
+{
+	echo "	push 0"
+	echo "	pop ax"
+	i=1
+	while [ $i -lt "$MODULES" ]; do
+		echo "	call f$i"
+		i=$((i + 1))
+	done
+	echo "	push ax"
+	echo "	out"
+	echo "	hlt"
+} > "$DIR/m0.asm"
+i=1
+while [ $i -lt "$MODULES" ]; do
+	awk -v m="$i" -v n="$LINES" 'BEGIN {
+		printf ("f%d:\n", m)
+		for (j = 0; j < n / 6; j++) {
+			printf ("f%d_%d:\n\tpush ax\n\tpush %d\n\tadd\n\tpop ax\n\tjmp f%d_%d\n", m, j, j % 10, m, j + 1)
+		}
+		printf ("f%d_%d:\n\tret\n", m, j)
+	}' > "$DIR/m$i.asm"
+	i=$((i + 1))
+done
+SOURCES=$(i=0; while [ $i -lt "$MODULES" ]; do printf "%s " "$DIR/m$i.asm"; i=$((i + 1)); done)
+
+# $1: jobs; prints seconds of make
+build ()
+{
+	start=$(date +%s.%N)
+	make -s -j"$1" "$DIR/prog.byte" MODULES="$SOURCES" > /dev/null || return 1
+	end=$(date +%s.%N)
+	awk -v s="$start" -v e="$end" 'BEGIN { printf ("%.3f", e - s) }'
+}
+
+status=0
+echo "$MODULES modules of $LINES lines"
+if serial=$(build 1) && rm -f "$DIR"/*.obj "$DIR/prog.byte" && parallel=$(build "$CPUS"); then
+	echo "make -j1: $serial s, make -j$CPUS: $parallel s"
+	touch "$DIR/m1.asm"
+	echo "one module changed: $(build "$CPUS") s"
+	cat $SOURCES > "$DIR/all.asm"
+	./compiler "$DIR/all.asm" "$DIR/all.byte"
+	if [ "$(./processor "$DIR/prog.byte")" != "$(./processor "$DIR/all.byte")" ]; then
+		echo "linked and single file programs disagree" >&2
+		status=1
+	fi
+else
+	echo "make failed" >&2
+	status=1
+fi
+
+rm -rf "$DIR"
+exit $status
@@ -0,0 +1,61 @@
+; Bubble sort of n words from a linear congruential generator in [1..n],
+; prints the smallest and the largest
+	in
+	pop cx
+	push 0
+	pop ax
+	push 12345
+	pop dx
+fill:
+	push dx
+	push 1103515245
+	mul
+	push 12345
+	add
+	pop dx
+	push dx
+	pop [ax+1]
+	push ax
+	push 1
+	add
+	pop ax
+	push ax
+	push cx
+	jb fill
+	push cx
+	pop ax
+pass:
+	push ax
+	push 1
+	jbe sorted
+	push 1
+	pop bx
+step:
+	push bx
+	push ax
+	jae next
+	push [bx]
+	push [bx+1]
+	jbe keep
+	push [bx]
+	push [bx+1]
+	pop [bx]
+	pop [bx+1]
+keep:
+	push bx
+	push 1
+	add
+	pop bx
+	jmp step
+next:
+	push ax
+	push 1
+	sub
+	pop ax
+	jmp pass
+sorted:
+	push [1]
+	out
+	push [cx]
+	out
+	hlt
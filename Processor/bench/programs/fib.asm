@@ -0,0 +1,29 @@
+; Recursive Fibonacci
+	in
+	pop ax
+	call fib
+	out
+	hlt
+fib:
+	push ax
+	push 2
+	jb small
+	push ax
+	push ax
+	push 1
+	sub
+	pop ax
+	call fib
+	pop bx
+	pop ax
+	push bx
+	push ax
+	push 2
+	sub
+	pop ax
+	call fib
+	add
+	ret
+small:
+	push ax
+	ret
@@ -0,0 +1,36 @@
+; Nested loops: sum of i * j + i for i, j < n, wrapped to 32 bits
+	in
+	pop cx
+	push 0
+	pop dx
+	push 0
+	pop ax
+outer:
+	push 0
+	pop bx
+inner:
+	push ax
+	push bx
+	mul
+	push ax
+	add
+	push dx
+	add
+	pop dx
+	push bx
+	push 1
+	add
+	pop bx
+	push bx
+	push cx
+	jb inner
+	push ax
+	push 1
+	add
+	pop ax
+	push ax
+	push cx
+	jb outer
+	push dx
+	out
+	hlt
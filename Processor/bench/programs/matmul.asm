@@ -0,0 +1,116 @@
+; C = A * B for n x n matrices A[i][j] = i + j and B[i][j] = i - j,
+; prints C[0][0], C[n-1][n-1] and the sum of C wrapped to 32 bits.
+; n is kept in [0], the running sum in [1], the total in [2].
+	in
+	pop [0]
+	push 0
+	pop ax
+fill_row:
+	push 0
+	pop bx
+fill_col:
+	push ax
+	push [0]
+	mul
+	push bx
+	add
+	pop dx
+	push ax
+	push bx
+	add
+	pop [dx+100000]
+	push ax
+	push bx
+	sub
+	pop [dx+200000]
+	push bx
+	push 1
+	add
+	pop bx
+	push bx
+	push [0]
+	jb fill_col
+	push ax
+	push 1
+	add
+	pop ax
+	push ax
+	push [0]
+	jb fill_row
+	push 0
+	pop [2]
+	push 0
+	pop ax
+row:
+	push 0
+	pop bx
+col:
+	push 0
+	pop [1]
+	push 0
+	pop cx
+dot:
+	push ax
+	push [0]
+	mul
+	push cx
+	add
+	pop dx
+	push [dx+100000]
+	push cx
+	push [0]
+	mul
+	push bx
+	add
+	pop dx
+	push [dx+200000]
+	mul
+	push [1]
+	add
+	pop [1]
+	push cx
+	push 1
+	add
+	pop cx
+	push cx
+	push [0]
+	jb dot
+	push ax
+	push [0]
+	mul
+	push bx
+	add
+	pop dx
+	push [1]
+	pop [dx+300000]
+	push [1]
+	push [2]
+	add
+	pop [2]
+	push bx
+	push 1
+	add
+	pop bx
+	push bx
+	push [0]
+	jb col
+	push ax
+	push 1
+	add
+	pop ax
+	push ax
+	push [0]
+	jb row
+	push [300000]
+	out
+	push [0]
+	push [0]
+	mul
+	push 1
+	sub
+	pop dx
+	push [dx+300000]
+	out
+	push [2]
+	out
+	hlt
@@ -0,0 +1,114 @@
+; Recursive quicksort of n words in [1..n], prints the smallest, the
+; largest and the number of unordered neighbours, which is 0
+	in
+	pop cx
+	push 0
+	pop ax
+	push 12345
+	pop dx
+fill:
+	push dx
+	push 1103515245
+	mul
+	push 12345
+	add
+	pop dx
+	push dx
+	pop [ax+1]
+	push ax
+	push 1
+	add
+	pop ax
+	push ax
+	push cx
+	jb fill
+	push 1
+	pop ax
+	push cx
+	pop bx
+	push cx
+	call qsort
+	pop cx
+	push 0
+	pop dx
+	push 1
+	pop ax
+check:
+	push ax
+	push cx
+	jae checked
+	push [ax]
+	push [ax+1]
+	jbe ordered
+	push dx
+	push 1
+	add
+	pop dx
+ordered:
+	push ax
+	push 1
+	add
+	pop ax
+	jmp check
+checked:
+	push [1]
+	out
+	push [cx]
+	out
+	push dx
+	out
+	hlt
+
+; sorts [ax..bx], the pivot is kept in [0]
+qsort:
+	push ax
+	push bx
+	jae done
+	push [bx]
+	pop [0]
+	push ax
+	pop cx
+	push ax
+	pop dx
+part:
+	push dx
+	push bx
+	jae placed
+	push [dx]
+	push [0]
+	jae skip
+	push [cx]
+	push [dx]
+	pop [cx]
+	pop [dx]
+	push cx
+	push 1
+	add
+	pop cx
+skip:
+	push dx
+	push 1
+	add
+	pop dx
+	jmp part
+placed:
+	push [cx]
+	push [bx]
+	pop [cx]
+	pop [bx]
+	push bx
+	push cx
+	push cx
+	push 1
+	sub
+	pop bx
+	call qsort
+	pop cx
+	pop bx
+	push cx
+	push 1
+	add
+	pop ax
+	call qsort
+done:
+	ret
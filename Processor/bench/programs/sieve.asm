@@ -0,0 +1,48 @@
+; Sieve of Eratosthenes, prints the number of primes below n
+	in
+	pop cx
+	push 0
+	pop dx
+	push 2
+	pop ax
+next:
+	push ax
+	push cx
+	jae done
+	push [ax]
+	push 0
+	jne advance
+	push dx
+	push 1
+	add
+	pop dx
+	push ax
+	push cx
+	push ax
+	div
+	ja advance
+	push ax
+	push ax
+	mul
+	pop bx
+mark:
+	push bx
+	push cx
+	jae advance
+	push 1
+	pop [bx]
+	push bx
+	push ax
+	add
+	pop bx
+	jmp mark
+advance:
+	push ax
+	push 1
+	add
+	pop ax
+	jmp next
+done:
+	push dx
+	out
+	hlt
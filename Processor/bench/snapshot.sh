@@ -0,0 +1,97 @@
+#!/bin/sh
+# Warm starts: a program that fills a table of WORDS squares in RAM before
+# it answers a lookup, RUNS processes started cold and RUNS restored from
+# a snapshot taken once the table is there.  Squares are 32-bit, so WORDS
+# stays under 46341.
+#
+# Usage: bench/snapshot.sh [compiler] [processor] [words] [runs]
+
+COMPILER=${1:-./compiler}
+PROCESSOR=${2:-./processor}
+WORDS=${3:-40000}
+RUNS=${4:-100}
+DIR=$(mktemp -d /tmp/snapshot_bench.XXXXXX)
+
+# [0] is 1 once the table is filled.  A run answers the lookup it reads
+# or, given -1, only fills the table for the snapshot.
+cat > "$DIR/table.asm" << EOF
+	in
+	pop bx
+	push [0]
+	push 1
+	je ready
+	push 0
+	pop ax
+fill:
+	push ax
+	push ax
+	mul
+	pop [ax+16]
+	push ax
+	push 1
+	add
+	pop ax
+	push ax
+	push $WORDS
+	jb fill
+	push 1
+	pop [0]
+	push bx
+	push 0
+	jb done
+ready:
+	push [bx+16]
+	out
+done:
+	hlt
+EOF
+
+# $1: processor options; prints seconds for RUNS runs
+run ()
+{
+	start=$(date +%s.%N)
+	i=0
+	while [ $i -lt "$RUNS" ]; do
+		echo $((i % WORDS)) | "$PROCESSOR" --io text $1 "$DIR/table.byte" > "$DIR/out" || return 1
+		[ "$(cat "$DIR/out")" = "out: $(((i % WORDS) * (i % WORDS)))" ] || return 1
+		i=$((i + 1))
+	done
+	end=$(date +%s.%N)
+	awk -v s="$start" -v e="$end" 'BEGIN { printf ("%.3f", e - s) }'
+}
+
+status=0
+if "$COMPILER" "$DIR/table.asm" "$DIR/table.byte"; then
+	echo "$RUNS runs over a table of $WORDS words"
+	if t=$(run ""); then
+		printf "cold: %s s\n" "$t"
+	else
+		echo "cold runs failed" >&2
+		status=1
+	fi
+	if echo -1 | "$PROCESSOR" --io text --snapshot "$DIR/table.snap" "$DIR/table.byte" &&
+	   t=$(run "--restore $DIR/table.snap"); then
+		printf "snapshot: %s bytes\n" "$(wc -c < "$DIR/table.snap")"
+		printf "warm: %s s\n" "$t"
+	else
+		echo "warm runs failed" >&2
+		status=1
+	fi
+	# A run out of fuel is resumed and saved into the file it came from,
+	# once out of fuel again and once to the end
+	if ! { echo -1 | "$PROCESSOR" --io text --fuel 1000 --snapshot "$DIR/part.snap" "$DIR/table.byte" &&
+	       "$PROCESSOR" --io text --fuel 1000 --restore "$DIR/part.snap" \
+	                 --snapshot "$DIR/part.snap" "$DIR/table.byte" < /dev/null &&
+	       "$PROCESSOR" --io text --restore "$DIR/part.snap" \
+	                 --snapshot "$DIR/part.snap" "$DIR/table.byte" < /dev/null &&
+	       [ "$(echo 7 | "$PROCESSOR" --io text --restore "$DIR/part.snap" "$DIR/table.byte")" = "out: 49" ]; }; then
+		echo "snapshot resumed into its own file failed" >&2
+		status=1
+	fi
+else
+	echo "$COMPILER failed" >&2
+	status=1
+fi
+
+rm -rf "$DIR"
+exit $status
@@ -0,0 +1,104 @@
+#!/bin/sh
+# Many concurrent tasks: the program spawns TASKS tasks, which are all
+# alive at once, every one yields YIELDS times and sends its number over
+# a channel the program sums them from.  Runs with 1, 2, 4 ... workers up
+# to the number of CPUs.
+#
+# Usage: bench/tasks.sh [compiler] [processor] [tasks] [yields]
+
+COMPILER=${1:-./compiler}
+PROCESSOR=${2:-./processor}
+TASKS=${3:-100000}
+YIELDS=${4:-4}
+DIR=$(mktemp -d /tmp/tasks_bench.XXXXXX)
+CPUS=$(getconf _NPROCESSORS_ONLN 2> /dev/null || echo 1)
+
+cat > "$DIR/tasks.asm" << EOF
+	in
+	pop dx
+	in
+	pop cx
+	push 16
+	chan
+	pop bx
+	push 0
+	pop ax
+spawn_loop:
+	push ax
+	push dx
+	jae spawned
+	push ax
+	spawn worker
+	pop [0]
+	push ax
+	push 1
+	add
+	pop ax
+	jmp spawn_loop
+spawned:
+	push 0
+	pop ax
+	push 0
+recv_loop:
+	push ax
+	push dx
+	jae done
+	push bx
+	recv
+	add.q
+	push ax
+	push 1
+	add
+	pop ax
+	jmp recv_loop
+done:
+	out.q
+	hlt
+worker:
+	pop ax
+yield_loop:
+	push cx
+	push 0
+	jbe send
+	yield
+	push cx
+	push 1
+	sub
+	pop cx
+	jmp yield_loop
+send:
+	push bx
+	push ax
+	send
+	push 0
+	hlt
+EOF
+
+# $1: workers; prints seconds
+run ()
+{
+	start=$(date +%s.%N)
+	echo "$TASKS $YIELDS" | "$PROCESSOR" --io text --workers "$1" "$DIR/tasks.byte" > "$DIR/out" || return 1
+	end=$(date +%s.%N)
+	[ "$(cat "$DIR/out")" = "out: $((TASKS * (TASKS - 1) / 2))" ] || return 1
+	awk -v s="$start" -v e="$end" 'BEGIN { printf ("%.3f", e - s) }'
+}
+
+status=0
+if "$COMPILER" "$DIR/tasks.asm" "$DIR/tasks.byte"; then
+	echo "$TASKS tasks, $YIELDS yields each, $CPUS CPUs"
+	workers=1
+	while true; do
+		t=$(run $workers) || { echo "run with $workers workers failed" >&2; status=1; break; }
+		printf "%d workers: %s s\n" $workers "$t"
+		[ $workers -ge "$CPUS" ] && break
+		workers=$((workers * 2))
+		[ $workers -gt "$CPUS" ] && workers=$CPUS
+	done
+else
+	echo "$COMPILER failed" >&2
+	status=1
+fi
+
+rm -rf "$DIR"
+exit $status
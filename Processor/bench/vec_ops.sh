@@ -0,0 +1,81 @@
+#!/bin/sh
+# Vector commands against scalar byte code loops: c[i] = a[i] + b[i] and
+# the dot product of a and b over arrays of N words, repeated REPS times.
+# The vector programs are run with every SIMD kernel set the CPU supports.
+#
+# Usage: bench/vec_ops.sh [compiler] [processor] [N] [reps]
+
+COMPILER=${1:-./compiler}
+PROCESSOR=${2:-./processor}
+N=${3:-4096}
+REPS=${4:-2000}
+DIR=$(mktemp -d /tmp/vec_bench.XXXXXX)
+
+# $1: name, $2: loop body over i = ax, $3: vector command
+gen ()
+{
+	awk -v n="$N" -v reps="$REPS" -v body="$2" '
+	BEGIN {
+		print "push 0\npop ax\npush " n "\npop bx\npush " 2 * n "\npop cx\npush " n "\npop dx"
+		print "push 3\nvfill ax, dx\npush 5\nvfill bx, dx"
+		print "push 0\npop bx"
+		print "rep:\npush 0\npush 0\npop ax"
+		print "loop:"
+		gsub (/N2/, 2 * n, body)
+		gsub (/N/, n, body)
+		print body
+		print "push ax\npush 1\nadd\npop ax"
+		print "push ax\npush " n "\njb loop"
+		print "pop cx"
+		print "push bx\npush 1\nadd\npop bx"
+		print "push bx\npush " reps "\njb rep\nhlt"
+	}' > "$DIR/$1_scalar.asm"
+
+	awk -v n="$N" -v reps="$REPS" -v cmd="$3" '
+	BEGIN {
+		print "push 0\npop ax\npush " n "\npop bx\npush " 2 * n "\npop cx\npush " n "\npop dx"
+		print "push 3\nvfill ax, dx\npush 5\nvfill bx, dx"
+		print "push 0\npop [" 3 * n "]"
+		print "rep:"
+		print cmd
+		print "push [" 3 * n "]\npush 1\nadd\npop [" 3 * n "]"
+		print "push [" 3 * n "]\npush " reps "\njb rep\nhlt"
+	}' > "$DIR/$1_vector.asm"
+
+	"$COMPILER" "$DIR/$1_scalar.asm" "$DIR/$1_scalar.byte" &&
+	"$COMPILER" "$DIR/$1_vector.asm" "$DIR/$1_vector.byte"
+}
+
+# $1: byte code, $2...: processor options; prints seconds
+run ()
+{
+	code=$1
+	shift
+	start=$(date +%s.%N)
+	"$PROCESSOR" "$@" "$code" > /dev/null || return 1
+	end=$(date +%s.%N)
+	awk -v s="$start" -v e="$end" 'BEGIN { printf ("%.3f", e - s) }'
+}
+
+status=0
+gen add "push [ax]\npush [ax+N]\nadd\npop [ax+N2]" "vadd cx, ax, bx, dx" || status=1
+gen dot "push [ax]\npush [ax+N]\nmul\nadd" "vdot ax, bx, dx\npop cx" || status=1
+
+if [ $status -eq 0 ]; then
+	echo "$N words x $REPS repetitions"
+	for test in add dot; do
+		base=$(run "$DIR/${test}_scalar.byte") || { status=1; break; }
+		printf "%s: byte code loop %s s" "$test" "$base"
+		for simd in scalar sse2 avx2; do
+			t=$(run "$DIR/${test}_vector.byte" --simd "$simd" 2> /dev/null) || continue
+			awk -v s="$simd" -v t="$t" -v b="$base" \
+				'BEGIN { printf (", %s %s s (x%.0f)", s, t, (t > 0) ? b / t : 0) }'
+		done
+		echo
+	done
+else
+	echo "$COMPILER failed" >&2
+fi
+
+rm -rf "$DIR"
+exit $status
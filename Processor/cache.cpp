@@ -0,0 +1,155 @@
+#include "cache.h"
+#include "loader.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/*
+ * Bump CACHE_CODEGEN when the compiler starts to emit other code for the
+ * same source, entries of the old one are then never looked up.  The
+ * host compiler is in the salt too, the build time is not: every rebuild
+ * would empty a shared cache.
+ */
+#define CACHE_CODEGEN "1"
+
+static const char cache_salt[] = "KMv5 codegen " CACHE_CODEGEN " " __VERSION__;
+
+static int cache_path (char *path, const char *dir, const uint64_t key);
+static int write_atomic (const char *data, const size_t len, const char *file_name);
+static bool same_contents (const char *data, const size_t len, const char *file_name);
+
+uint64_t cache_key (const uint64_t source_hash, const uint32_t flags)
+{
+	const uint64_t h = hash64 (cache_salt, sizeof (cache_salt) - 1, source_hash);
+
+	return hash64 (&flags, sizeof (flags), h);
+}
+
+/*
+ * Copies the entry of key to output, or just touches output if it is the
+ * same already: renaming over a file makes ext4 flush the new one.  An
+ * entry that fails the checksum or was built from another source or with
+ * other flags is removed.
+ * Returns 0 on a hit.
+ */
+int cache_fetch (const char *dir, const uint64_t key, const uint64_t source_hash, const uint32_t flags,
+		 const char *output)
+{
+	char path[PATH_MAX];
+	struct byte_code_file file = {};
+	int res = 1;
+
+	if (cache_path (path, dir, key) || access (path, F_OK))
+		return 1;
+
+	if (load_byte_code (&file, path, true)) {
+		fprintf (stderr, "Compiler: removing corrupt cache entry %s\n", path);
+		unlink (path);
+		return 1;
+	}
+	if (file.version != 5 || file.source_hash != source_hash || file.flags != flags) {
+		fprintf (stderr, "Compiler: removing stale cache entry %s\n", path);
+		unlink (path);
+	} else if (same_contents ((const char *) file.map, file.map_len, output)) {
+		res = (utimensat (AT_FDCWD, output, NULL, 0)) ? 1 : 0;
+	} else {
+		res = write_atomic ((const char *) file.map, file.map_len, output);
+	}
+
+	unload_byte_code (&file);
+	return res;
+}
+
+/* Failures only cost the next build a parse, so they are not errors */
+void cache_store (const char *dir, const uint64_t key, const char *output)
+{
+	char path[PATH_MAX];
+	struct byte_code_file file = {};
+
+	if (mkdir (dir, 0777) && errno != EEXIST) {
+		fprintf (stderr, "Compiler: can't create cache directory %s\n", dir);
+		return ;
+	}
+	if (cache_path (path, dir, key) || load_byte_code (&file, output, false))
+		return ;
+
+	if (write_atomic ((const char *) file.map, file.map_len, path))
+		fprintf (stderr, "Compiler: can't write cache entry %s\n", path);
+	unload_byte_code (&file);
+}
+
+static int cache_path (char *path, const char *dir, const uint64_t key)
+{
+	const int len = snprintf (path, PATH_MAX, "%s/%016" PRIx64 ".byte", dir, key);
+
+	if (len < 0 || len >= PATH_MAX) {
+		fprintf (stderr, "Compiler: cache directory name %s is too long\n", dir);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * tmp gets a name next to file_name, PATH_MAX long.  Nobody reads the
+ * file, a concurrent build neither, until atomic_close () renames it over.
+ */
+FILE *atomic_open (const char *file_name, char *tmp)
+{
+	const int tmp_len = snprintf (tmp, PATH_MAX, "%s.%ld.tmp", file_name, (long) getpid ());
+
+	if (tmp_len < 0 || tmp_len >= PATH_MAX)
+		return NULL;
+	return fopen (tmp, "w");
+}
+
+/* The temporary file is removed if it can't be written or renamed */
+int atomic_close (FILE *file, const char *tmp, const char *file_name)
+{
+	if (fclose (file) || rename (tmp, file_name)) {
+		unlink (tmp);
+		return 1;
+	}
+	return 0;
+}
+
+static int write_atomic (const char *data, const size_t len, const char *file_name)
+{
+	char tmp[PATH_MAX];
+	FILE *file = atomic_open (file_name, tmp);
+
+	if (!file)
+		return 1;
+	if (fwrite (data, 1, len, file) != len) {
+		fclose (file);
+		unlink (tmp);
+		return 1;
+	}
+	return atomic_close (file, tmp, file_name);
+}
+
+static bool same_contents (const char *data, const size_t len, const char *file_name)
+{
+	struct stat st = {};
+	void *map = MAP_FAILED;
+	bool same = false;
+	const int fd = open (file_name, O_RDONLY);
+
+	if (fd < 0)
+		return false;
+	if (!fstat (fd, &st) && (size_t) st.st_size == len && len)
+		map = mmap (NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close (fd);
+
+	if (map != MAP_FAILED) {
+		same = !memcmp (map, data, len);
+		munmap (map, len);
+	}
+	return same;
+}
@@ -0,0 +1,22 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "processor.h"
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * compiler --cache dir: byte code is kept in dir under the hash of the
+ * source and of everything else that changes the output, entries are
+ * checked like any byte code before they are used.
+ */
+uint64_t cache_key (const uint64_t source_hash, const uint32_t flags);
+int cache_fetch (const char *dir, const uint64_t key, const uint64_t source_hash, const uint32_t flags,
+		 const char *output);
+void cache_store (const char *dir, const uint64_t key, const char *output);
+
+FILE *atomic_open (const char *file_name, char *tmp);
+int atomic_close (FILE *file, const char *tmp, const char *file_name);
+
+#endif // CACHE_H
@@ -1,462 +1,507 @@
 #include "processor.h"
+#include "symtab.h"
+#include "lexer.h"
+#include "cache.h"
 
 #include <stdio.h>
 #include <string.h>
-#include <sys/stat.h>
-#include <sys/types.h>
-#include <unistd.h>
 #include <stdlib.h>
-#include <ctype.h>
+#include <limits.h>
 #include <assert.h>
+#include <unistd.h>
 
-#define MAX_LABELS_NUM 20
-#define MAX_LABEL_LEN 32
-
-#define MAX_LINE_LEN 20
-#define MAX_CMD_LEN MAX_LABEL_LEN
-#define MAX_REG_LEN 5
+#define PEEPHOLE_WINDOW 4
+#define MAX_INSTR_LEN 16
 
-enum parse_str_to_cmd_return
+enum parse_line_return
 {
 	RET_ERR,
 	RET_CMD,
-	RET_LABEL
+	RET_LABEL,
+	RET_EMPTY,
+	RET_EOF
 };
 
-enum label_entry
+struct symtab labels = {};
+bool emit_failed = false;
+bool compact = false;
+bool object = false;
+
+char *lines = NULL;
+size_t lines_len = 0, lines_cap = 0;
+
+enum match_result
 {
-	LABEL_EMPTY,
-	LABEL_NAME_ONLY,
-	LABEL_SHIFT_ONLY,
-	LABEL_VALID
+	MATCH_NONE,
+	MATCH_PREFIX,
+	MATCH_FULL
 };
 
-struct label
+struct instr
 {
-	enum label_entry status = LABEL_EMPTY;
-	int shift = -1;
-	char name[MAX_LABEL_LEN] = {};
+	char cmd = 0;
+	char reg_num = 0;
+	char src_reg = 0;
+	char src_reg2 = 0;
+	char type = 0;
+	int arg = 0;
+	int64_t imm = 0;
+	int label = 0;
+	int line = 0;
+	int fused_lines[PEEPHOLE_WINDOW - 1] = {};	// The other lines of a fused command
 };
 
-struct label labels[MAX_LABELS_NUM] = {};
-
-static enum parse_str_to_cmd_return parse_str_to_cmd (const char *str, char *cmd_ptr, char *reg_num_ptr, int *arg_ptr);
-static int register_label_by_name (const char *label_name);
-char choose_cmd (const char *cmd_str);
-static int parse_reg_and_arg (const char *str, char *reg_num_ptr, int *arg_ptr);
-int get_reg_num (const char *reg);
+struct instr pending[PEEPHOLE_WINDOW] = {};
+int pending_num = 0;
+
+/* --compact: the commands are laid out after parsing, labels are their indices until then */
+struct instr *prog = NULL;
+size_t prog_num = 0, prog_cap = 0;
+int target_bias = 0;
+
+static enum parse_line_return parse_line (struct lexer *lex, struct instr *ins);
+static int parse_operand (struct lexer *lex, struct token *tok, struct instr *ins, struct token *num);
+static int parse_cmd (const struct lexer *lex, const struct token *tok, struct instr *ins);
+static int parse_vec_operands (struct lexer *lex, struct instr *ins);
+static int set_number (const struct lexer *lex, const struct token *num, struct instr *ins, const int mode);
+static bool expect_line_end (struct lexer *lex);
+static void parse_error (const struct lexer *lex, const char *msg, const struct token *tok);
+static int register_label_by_name (const char *label_name, const size_t len);
+static int reserve_buf (char **buf, size_t *cap, const size_t len);
 static bool is_jump (const char cmd);
-static void dump_labels (void);
-static int verify_labels (void);
+static size_t queue_instr (char *byte_code, size_t pc, const struct instr *ins);
+static size_t flush_instrs (char *byte_code, size_t pc);
+static size_t put_instr (char *byte_code, size_t pc, const struct instr *ins);
+static size_t layout_compact (char **byte_code, size_t *byte_code_cap);
+static size_t emit_instr (char *byte_code, size_t pc, const struct instr *ins);
+static size_t emit_int (char *byte_code, size_t pc, const int val);
+static size_t emit_target (char *byte_code, size_t pc, const int label);
+static enum match_result match_pattern (const struct instr *seq, const int len);
+static void fuse_pattern (struct instr *seq, int *len);
 
 int main (int argc, char *argv[])
 {
-	FILE *input = NULL, *output = NULL;
-	char str[MAX_LINE_LEN];
-	char cmd = 0, reg_num = 0;
-	int arg = 0;
+	FILE *output = NULL;
+	char output_tmp[PATH_MAX];
+	struct lexer lex = {};
 	char *byte_code = NULL;
-	struct stat st = {};
-	size_t pc = 0;
-	bool first_pass = true;
-
-	if (argc != 3) {
-		fprintf (stderr, "Usage: %s input output\n", argv[0]);
+	size_t byte_code_cap = 0, pc = 0;
+	struct instr ins = {};
+	enum parse_line_return ret = RET_EMPTY;
+	struct section_buf sections[SECT_NUM] = {};
+	char *symbols = NULL, *relocs = NULL;
+	size_t symbols_len = 0, relocs_len = 0;
+	const char *prog_name = argv[0], *cache_dir = NULL;
+	uint64_t source_hash = 0, cache_id = 0;
+	uint32_t flags = 0;
+
+	while (argc > 3) {
+		if (!strcmp (argv[1], "--compact")) {
+			compact = true;
+			argc--;
+			argv++;
+		} else if (!strcmp (argv[1], "-c")) {
+			object = true;
+			argc--;
+			argv++;
+		} else if (!strcmp (argv[1], "--cache") && argc > 4) {
+			cache_dir = argv[2];
+			argc -= 2;
+			argv += 2;
+		} else {
+			break;
+		}
+	}
+	if (argc != 3 || (compact && object)) {
+		fprintf (stderr, "Usage: %s [--compact | -c] [--cache dir] input output\n", prog_name);
 		return 1;
 	}
+	flags = (compact) ? FILE_COMPACT : (object) ? FILE_OBJECT : 0;
 
-	input = fopen (argv[1], "r");
-	if (!input) {
-		fprintf (stderr, "Can't open file %s\n", argv[1]);
+	if (lexer_open (&lex, argv[1]))
 		return 1;
+
+	/* A hit costs a hash of the source, there is no parsing */
+	source_hash = hash64 (lex.begin, lex.size, 0);
+	cache_id = cache_key (source_hash, flags);
+	if (cache_dir && !cache_fetch (cache_dir, cache_id, source_hash, flags, argv[2])) {
+		lexer_close (&lex);
+		return 0;
 	}
 
-	output = fopen (argv[2], "w");
+	/* Written aside and renamed, so a make killed midway leaves no half file */
+	output = atomic_open (argv[2], output_tmp);
 	if (!output) {
 		fprintf (stderr, "Can't open file %s\n", argv[2]);
-		fclose (input);
+		lexer_close (&lex);
 		return 1;
 	}
 
-	if (stat (argv[1], &st) < 0) {
-		fprintf (stderr, "Stat syscall failed\n");
-		fclose (input);
+	if (reserve_buf (&byte_code, &byte_code_cap, lex.size + MAX_INSTR_LEN * PEEPHOLE_WINDOW)) {
+		lexer_close (&lex);
 		fclose (output);
+		unlink (output_tmp);
 		return 1;
 	}
 
-	byte_code = (char *) calloc ((size_t) st.st_size, 1 + sizeof (int));
-	if (!byte_code) {
-		fprintf (stderr, "Can't allocate memory\n");
-		fclose (input);
+	if (symtab_ctor (&labels)) {
+		free (byte_code);
+		lexer_close (&lex);
 		fclose (output);
+		unlink (output_tmp);
 		return 1;
 	}
 
-next_pass:
-	while (fgets (str, MAX_LINE_LEN, input)) {
-		char *c = strchr (str, '\n');
-		if (c)
-			*c = '\0';
-
-		switch (parse_str_to_cmd (str, &cmd, &reg_num, &arg))
+	while ((ret = parse_line (&lex, &ins)) != RET_EOF) {
+		switch (ret)
 		{
 			case RET_CMD:
 				break;
+			case RET_EMPTY:
+				continue;
+				break;
 			case RET_LABEL:
-				labels[arg].shift = (int) pc;
-				labels[arg].status = LABEL_VALID;
+				pc = flush_instrs (byte_code, pc);
+				if (ins.arg < 0 || symtab_define (&labels, ins.arg, (int) pc))
+					goto out_err;
 				continue;
 				break;
+			case RET_EOF:
 			case RET_ERR:
 			default:
-				fprintf (stderr, "Compiler: parsing command \"%s\" failed\n", str);
 				goto out_err;
 				break;
 		}
 
-		if (is_jump (cmd)) {
-			byte_code[pc++] = cmd;
-			if (labels[arg].status == LABEL_VALID) {
-				*(int *) (byte_code + pc) =
-					labels[arg].shift;
-			}
-			pc += sizeof (int);
-			continue;
-		}
-
-		bool imm = false, reg = false;
-		imm = (cmd & IMM);
-		reg = (cmd & REG);
-
-		/*
-		bool mem = false;
-		mem = (cmd & MEM);
-
-		printf ("imm = %d, reg = %d, mem = %d, cmd: %c%c%c%c%c%c%c%c\n", imm, reg, mem,
-			(cmd & 0x80) ? '1' : '0',
-			(cmd & 0x40) ? '1' : '0',
-			(cmd & 0x20) ? '1' : '0',
-			(cmd & 0x10) ? '1' : '0',
-			(cmd & 0x08) ? '1' : '0',
-			(cmd & 0x04) ? '1' : '0',
-			(cmd & 0x02) ? '1' : '0',
-			(cmd & 0x01) ? '1' : '0'
-			);
-		*/
-
-		byte_code[pc++] = cmd;
-		if (imm) {
-			*(int *)(byte_code + pc) = arg;
-			pc += sizeof (int);
-		}
-		if (reg) {
-			*(byte_code + pc) = reg_num;
-			pc++;
-		}
+		if (reserve_buf (&byte_code, &byte_code_cap, pc + MAX_INSTR_LEN * PEEPHOLE_WINDOW))
+			goto out_err;
 
-		memset (str, '\0', MAX_LINE_LEN);
-	}
-	if (first_pass) {
-		pc = 0;
-		fseek (input, 0, SEEK_SET);
-		if (verify_labels () < 0) {
-			fprintf (stderr, "Labels table is incorrect after first pass\n");
-			dump_labels ();
+		pc = queue_instr (byte_code, pc, &ins);
+		if (emit_failed)
 			goto out_err;
-		}
-		first_pass = false;
-		goto next_pass;
 	}
+	pc = flush_instrs (byte_code, pc);
+	if (compact && !emit_failed)
+		pc = layout_compact (&byte_code, &byte_code_cap);
 
-	if (write_sign_and_ver (output)) {
-		fprintf (stderr, "Failed to write signature and version to %s\n", argv[2]);
+	/* Targets of an object are left to the linker */
+	if (emit_failed || (!object && symtab_resolve (&labels, byte_code))) {
+		fprintf (stderr, "Compiler: failed to resolve labels\n");
 		goto out_err;
 	}
 
-	if (fwrite (byte_code, sizeof (char), pc, output) < pc) {
+	symbols = symtab_serialize (&labels, &symbols_len, object);
+	if (!symbols || (object && !(relocs = symtab_relocs (&labels, &relocs_len))))
+		goto out_err;
+
+	sections[SECT_CODE].data = byte_code;
+	sections[SECT_CODE].len = pc;
+	sections[SECT_SYMBOLS].data = symbols;
+	sections[SECT_SYMBOLS].len = symbols_len;
+	sections[SECT_LINES].data = lines;
+	sections[SECT_LINES].len = lines_len;
+	sections[SECT_RELOCS].data = relocs;
+	sections[SECT_RELOCS].len = relocs_len;
+
+	if (write_byte_code (output, sections, source_hash, flags)) {
 		fprintf (stderr, "Failed to write byte_code to %s\n", argv[2]);
 		goto out_err;
 	}
 
+	free (symbols);
+	free (relocs);
+	free (lines);
+	free (prog);
+	symtab_dtor (&labels);
 	free (byte_code);
-	fclose (input);
-	fclose (output);
+	lexer_close (&lex);
+	if (atomic_close (output, output_tmp, argv[2])) {
+		fprintf (stderr, "Failed to write byte_code to %s\n", argv[2]);
+		return 1;
+	}
+	if (cache_dir)
+		cache_store (cache_dir, cache_id, argv[2]);
 	return 0;
 
 out_err:
+	free (symbols);
+	free (relocs);
+	free (lines);
+	free (prog);
+	symtab_dtor (&labels);
 	free (byte_code);
-	fclose (input);
+	lexer_close (&lex);
 	fclose (output);
+	unlink (output_tmp);
 	return 1;
 }
 
-static enum parse_str_to_cmd_return parse_str_to_cmd (const char *str, char *cmd_ptr, char *reg_num_ptr, int *arg_ptr)
+static enum parse_line_return parse_line (struct lexer *lex, struct instr *ins)
 {
-	assert (str);
-	assert (cmd_ptr);
-	assert (reg_num_ptr);
-	assert (arg_ptr);
-	int cmd = 0, ptr = 0, ptr1 = 0;
-	int scanf_ok = 0;
-	int cmd_reg_and_arg = 0;
-	char cmd_str[MAX_CMD_LEN + 1];
-	char reg_and_arg_str[MAX_LINE_LEN + 1];
-	memset (cmd_str, '\0', MAX_CMD_LEN + 1);
-	memset (reg_and_arg_str, '\0', MAX_LINE_LEN + 1);
-
-	while (isspace (str[ptr]))
-		ptr++;
-
-	while ( islower (str[ptr]) &&
-		str[ptr] != '\0' &&
-		ptr != MAX_CMD_LEN) {
-
-		cmd_str[ptr1] = str[ptr];
-		ptr++;
-		ptr1++;
-	}
-	if (str[ptr] == ':') {
-		*arg_ptr = register_label_by_name (cmd_str);
-		return RET_LABEL;
-	} else {
-		cmd = choose_cmd (cmd_str);
-		if (cmd < 0) {
-			fprintf (stderr, "parse_str_to_cmd failed: can't recognize command %s\n", cmd_str);
-			return RET_ERR;
-		}
+	assert (lex);
+	assert (ins);
+	struct token tok = {}, next = {}, num = {};
+	int cmd = 0, mode = 0;
+
+	*ins = {};
+	ins->line = lex->line;
+	lexer_next (lex, &tok);
+	if (tok.type == TOK_EOF)
+		return RET_EOF;
+	if (tok.type == TOK_NEWLINE)
+		return RET_EMPTY;
+	if (tok.type != TOK_IDENT) {
+		parse_error (lex, "command or label expected", &tok);
+		return RET_ERR;
+	}
+
+	lexer_peek (lex, &next);
+	if (next.type == TOK_COLON) {
+		lexer_next (lex, &next);
+		ins->arg = register_label_by_name (tok.str, tok.len);
+		return expect_line_end (lex) ? RET_LABEL : RET_ERR;
 	}
 
-	if (is_jump ((char) cmd)) {
-		while (isspace (str[ptr]))
-			ptr++;
-		memset (cmd_str, '\0', MAX_CMD_LEN);
-		ptr1 = 0;
-		while ( islower (str[ptr]) &&
-			str[ptr] != '\0' &&
-			ptr != MAX_CMD_LEN) {
+	cmd = parse_cmd (lex, &tok, ins);
+	if (cmd < 0)
+		return RET_ERR;
+	ins->cmd = (char) cmd;
+
+	if ((cmd & CMD) == CMD_VEC)
+		return (parse_vec_operands (lex, ins)) ? RET_ERR : RET_CMD;
 
-			cmd_str[ptr1] = str[ptr];
-			ptr++;
-			ptr1++;
+	if (is_jump ((char) cmd) || cmd == (CMD_TASK | (TASK_SPAWN << 5))) {
+		lexer_next (lex, &tok);
+		if (tok.type != TOK_IDENT) {
+			parse_error (lex, "label expected", &tok);
+			return RET_ERR;
 		}
-		*arg_ptr = register_label_by_name (cmd_str);
-		*cmd_ptr = (char) cmd;
-		return RET_CMD;
+		ins->arg = register_label_by_name (tok.str, tok.len);
+		return expect_line_end (lex) ? RET_CMD : RET_ERR;
 	}
 
-	while (isspace (str[ptr]))
-		ptr++;
-	if (str[ptr] == '\0') {
-		*cmd_ptr = (char) cmd;
+	lexer_next (lex, &tok);
+	if (tok.type == TOK_NEWLINE || tok.type == TOK_EOF)
 		return RET_CMD;
+
+	if (cmd != CMD_PUSH && cmd != CMD_POP) {
+		parse_error (lex, "command takes no operand", &tok);
+		return RET_ERR;
 	}
 
-	if (sscanf (str + ptr, "[%[^]]]%n", reg_and_arg_str, &scanf_ok) && scanf_ok) {
-		if ((cmd_reg_and_arg = parse_reg_and_arg (reg_and_arg_str, reg_num_ptr, arg_ptr)) < 0) {
-			fprintf (stderr, "parse_str_to_cmd failed: register and argment parsing error\n");
+	if (tok.type == TOK_LBRACKET) {
+		lexer_next (lex, &tok);
+		if ((mode = parse_operand (lex, &tok, ins, &num)) < 0)
 			return RET_ERR;
-		}
-		cmd = cmd | MEM;
-		if (cmd_reg_and_arg & IMM) cmd = cmd | IMM;
-		if (cmd_reg_and_arg & REG) cmd = cmd | REG;
-		*cmd_ptr = (char) cmd;
-		return RET_CMD;
-	} else if (sscanf (str + ptr, "%s", reg_and_arg_str)) {
-		if ((cmd_reg_and_arg = parse_reg_and_arg (reg_and_arg_str, reg_num_ptr, arg_ptr)) < 0) {
-			fprintf (stderr, "parse_str_to_cmd failed: register and argment parsing error\n");
+		lexer_next (lex, &tok);
+		if (tok.type != TOK_RBRACKET) {
+			parse_error (lex, "']' expected", &tok);
 			return RET_ERR;
 		}
-		if (cmd_reg_and_arg & IMM) cmd = cmd | IMM;
-		if (cmd_reg_and_arg & REG) cmd = cmd | REG;
-		*cmd_ptr = (char) cmd;
-		return RET_CMD;
-	} else {
-		fprintf (stderr, "parse_str_to_cmd failed: can't parse \"%s\"\n", str + ptr);
+		mode |= MEM;
+	} else if ((mode = parse_operand (lex, &tok, ins, &num)) < 0) {
 		return RET_ERR;
 	}
 
-	return RET_CMD;
+	// pop stores to a register or to memory, a number is only an address
+	if (cmd == CMD_POP && (mode & IMM) && !(mode & MEM)) {
+		parse_error (lex, "pop can't store to a number, use [ ]", &num);
+		return RET_ERR;
+	}
+	if ((mode & IMM) && set_number (lex, &num, ins, mode))
+		return RET_ERR;
+	ins->cmd = (char) (cmd | mode);
+	return expect_line_end (lex) ? RET_CMD : RET_ERR;
 }
 
-static int register_label_by_name (const char *label_name)
+/*
+ * Mnemonic with an optional type suffix: add.q, push.d, jb.q.
+ */
+static int parse_cmd (const struct lexer *lex, const struct token *tok, struct instr *ins)
 {
-	int i = 0;
-	enum label_entry st = LABEL_EMPTY;
-	for (i = 0; i < MAX_LABELS_NUM; i++) {
-		st = labels[i].status;
-		if (st == LABEL_VALID) {
-			if (!strcmp (labels[i].name, label_name))
-				return i;
-			continue;
-		}
-		else if (st == LABEL_NAME_ONLY) {
-			if (!strcmp (labels[i].name, label_name)) {
-				return i;
-			} else {
-				continue;
-			}
-		} else if (st == LABEL_SHIFT_ONLY) {
-			fprintf (stderr, "register_label_by_name error: "
-					"status field is LABEL_SHIFT_ONLY, "
-					"that's incorrect\n");
-			return -1;
-		} else if (st == LABEL_EMPTY) {
-			strncpy (labels[i].name, label_name, MAX_LABEL_LEN);
-			labels[i].status = LABEL_NAME_ONLY;
-			return i;
-		} else {
-			fprintf (stderr, "register_label_by_name error: "
-					"status doesn't match any of "
-					"possible values\n");
-			return -1;
-		}
+	assert (lex);
+	assert (tok);
+	assert (ins);
+	const char *dot = (const char *) memchr (tok->str, '.', tok->len);
+	size_t len = (dot) ? (size_t) (dot - tok->str) : tok->len;
+	int cmd = lexer_find_cmd (tok->str, len);
+
+	if (cmd < 0) {
+		parse_error (lex, "unknown command", tok);
+		return -1;
 	}
-	fprintf (stderr, "register_label_by_name error: maximum number of labels exceeded\n");
-	return -1;
-}
+	if (!dot)
+		return cmd;
 
-char choose_cmd (const char *cmd_str)
-{
-	if (!strcmp (cmd_str, "push")) {
-		return CMD_PUSH;
-	} else if (!strcmp (cmd_str, "pop")) {
-		return CMD_POP;
-	} else if (!strcmp (cmd_str, "add")) {
-		return CMD_ADD;
-	} else if (!strcmp (cmd_str, "sub")) {
-		return CMD_SUB;
-	} else if (!strcmp (cmd_str, "mul")) {
-		return CMD_MUL;
-	} else if (!strcmp (cmd_str, "div")) {
-		return CMD_DIV;
-	} else if (!strcmp (cmd_str, "in")) {
-		return CMD_IN;
-	} else if (!strcmp (cmd_str, "out")) {
-		return CMD_OUT;
-	} else if (!strcmp (cmd_str, "hlt")) {
-		return CMD_HLT;
-	} else if (!strcmp (cmd_str, "jmp")) {
-		return CMD_JMP;
-	} else if (!strcmp (cmd_str, "ja")) {
-		return CMD_JA;
-	} else if (!strcmp (cmd_str, "jae")) {
-		return CMD_JAE;
-	} else if (!strcmp (cmd_str, "jb")) {
-		return CMD_JB;
-	} else if (!strcmp (cmd_str, "jbe")) {
-		return CMD_JBE;
-	} else if (!strcmp (cmd_str, "je")) {
-		return CMD_JE;
-	} else if (!strcmp (cmd_str, "jne")) {
-		return CMD_JNE;
-	} else if (!strcmp (cmd_str, "call")) {
-		return CMD_CALL;
-	} else if (!strcmp (cmd_str, "ret")) {
-		return CMD_RET;
-	} else {
-		fprintf (stderr, "choose_cmd () error: unknown command: %s\n", cmd_str);
+	if (tok->len - len != 2 || (dot[1] != 'q' && dot[1] != 'd')) {
+		parse_error (lex, "unknown type suffix", tok);
+		return -1;
+	}
+	if (cmd == CMD_HLT || cmd == CMD_JMP || cmd == CMD_CALL || cmd == CMD_RET ||
+	    cmd == (CMD_VEC | (VEC_FILL << 5)) || (cmd & CMD) == CMD_TASK) {
+		parse_error (lex, "command has no typed form", tok);
 		return -1;
 	}
+	ins->type = (dot[1] == 'q') ? TYPE_INT64 : TYPE_DOUBLE;
+	return cmd;
 }
 
-
-static int parse_reg_and_arg (const char *str, char *reg_num_ptr, int *arg_ptr)
+/*
+ * Vector commands take registers only, the ranges and then the length:
+ * vadd cx, ax, bx, dx.  Register numbers are packed into arg a byte each.
+ */
+static int parse_vec_operands (struct lexer *lex, struct instr *ins)
 {
-	assert (str);
-	assert (reg_num_ptr);
-	assert (arg_ptr);
-	int reg_num = 0, arg = 0;
-	int ptr = 0;
-	int cmd = 0;
-	int scanf_ok = 0;
-	char reg_str[MAX_REG_LEN + 1];
-
-	while (isspace (str[ptr])) ptr++;
-	if (*(str + ptr) == '\0') return cmd;
-
-	if (isdigit (str[ptr])) {
-		if (sscanf (str + ptr, "%d%n", &arg, &scanf_ok) != 1) {
-			fprintf (stderr, "parse_reg_and_arg () failed: inccorrect syntax\n");
-			return -1;
-		}
-		ptr += scanf_ok;
-		*arg_ptr = arg;
-		cmd = cmd | IMM;
-
-		while (isspace (str[ptr])) ptr++;
-		if (*(str + ptr) == '\0') {
-			return cmd;
-		}
-
-		if (*(str + ptr) == '+') ptr++;
-
-		while (isspace (str[ptr])) ptr++;
-
-		if (!isalpha (str[ptr])) {
-			fprintf (stderr, "parse_reg_and_arg () failed: inccorrect syntax\n");
-			return -1;
-		}
-		if (sscanf (str + ptr, "%s", reg_str) != 1) {
-			fprintf (stderr, "parse_reg_and_arg () failed: inccorrect syntax\n");
-			return -1;
-		}
-		reg_num = get_reg_num (reg_str);
-		if (reg_num < 0) {
-			fprintf (stderr, "parse_reg_and_arg () failed: register not recognized\n");
-			return -1;
-		}
-		*reg_num_ptr = (char) reg_num;
-		cmd = cmd | REG;
-		return cmd;
-	} else if (isalpha (str[ptr])) {
-		int i = 0;
-		while ( isalpha (str[ptr]) &&
-			str[ptr] != '\0') {
-			reg_str[i] = str[ptr];
-			i++;
-			ptr++;
+	assert (lex);
+	assert (ins);
+	struct token tok = {};
+	const int num = get_vec_regs_num (VEC_OP (ins->cmd));
+	int reg_num = 0;
+
+	for (int i = 0; i < num; i++) {
+		lexer_next (lex, &tok);
+		if (i && tok.type != TOK_COMMA) {
+			parse_error (lex, "',' expected", &tok);
+			return 1;
 		}
-		reg_num = get_reg_num (reg_str);
+		if (i)
+			lexer_next (lex, &tok);
+		reg_num = (tok.type == TOK_IDENT) ? lexer_find_reg (tok.str, tok.len) : -1;
 		if (reg_num < 0) {
-			fprintf (stderr, "parse_reg_and_arg () failed: register not recognized\n");
-			return -1;
+			parse_error (lex, "register expected", &tok);
+			return 1;
 		}
-		*reg_num_ptr = (char) reg_num;
-		cmd = cmd | REG;
+		ins->arg |= reg_num << (8 * i);
+	}
 
-		while (isspace (str[ptr])) ptr++;
-		if (*(str + ptr) == '\0') return cmd;
+	return (expect_line_end (lex)) ? 0 : 1;
+}
+
+/*
+ * Only a typed push of a plain number takes a 64-bit or floating point
+ * value, anything else is a 32-bit integer.
+ */
+static int set_number (const struct lexer *lex, const struct token *num, struct instr *ins, const int mode)
+{
+	assert (lex);
+	assert (num);
+	assert (ins);
+	double val = num->fnum;
+
+	if (ins->type && ins->cmd == CMD_PUSH && mode == IMM) {
+		if (ins->type == TYPE_DOUBLE)
+			memcpy (&ins->imm, &val, sizeof (val));
+		else if (num->type == TOK_NUMBER)
+			ins->imm = num->num;
+		else
+			goto out_err;
+		return 0;
+	}
 
-		if (*(str + ptr) == '+') ptr++;
+	if (num->type != TOK_NUMBER || num->num < INT_MIN || num->num > INT_MAX)
+		goto out_err;
+	ins->arg = (int) num->num;
+	return 0;
 
-		while (isspace (str[ptr])) ptr++;
+out_err:
+	parse_error (lex, "number out of range", num);
+	return 1;
+}
 
-		if (isdigit (*(str + ptr))) {
-			if (sscanf (str + ptr, "%d", &arg) != 1) {
-				fprintf (stderr, "parse_reg_and_arg () failed: inccorrect syntax\n");
+/*
+ * Operand is a register, a number or their sum in any order.
+ * Returns IMM and REG bits of the command.
+ */
+static int parse_operand (struct lexer *lex, struct token *tok, struct instr *ins, struct token *num)
+{
+	assert (lex);
+	assert (tok);
+	assert (ins);
+	struct token next = {};
+	int mode = 0, reg_num = 0;
+
+	while (true) {
+		if (tok->type == TOK_IDENT && !(mode & REG)) {
+			reg_num = lexer_find_reg (tok->str, tok->len);
+			if (reg_num < 0) {
+				parse_error (lex, "register not recognized", tok);
 				return -1;
 			}
-			*arg_ptr = arg;
-			cmd = cmd | IMM;
-			return cmd;
+			ins->reg_num = (char) reg_num;
+			mode |= REG;
+		} else if ((tok->type == TOK_NUMBER || tok->type == TOK_FLOAT) && !(mode & IMM)) {
+			*num = *tok;
+			mode |= IMM;
 		} else {
-			fprintf (stderr, "parse_reg_and_arg () failed: inccorrect syntax\n");
+			parse_error (lex, "incorrect operand", tok);
 			return -1;
 		}
-	} else {
-		fprintf (stderr, "parse_reg_and_arg () failed: can't parse string \"%s\"\n", str);
-		return -1;
+
+		lexer_peek (lex, &next);
+		if (next.type != TOK_PLUS)
+			return mode;
+		lexer_next (lex, &next);
+		lexer_next (lex, tok);
 	}
 }
 
-int get_reg_num (const char *reg)
+static bool expect_line_end (struct lexer *lex)
+{
+	assert (lex);
+	struct token tok = {};
+
+	lexer_next (lex, &tok);
+	if (tok.type == TOK_NEWLINE || tok.type == TOK_EOF)
+		return true;
+	parse_error (lex, "unexpected text at the end of line", &tok);
+	return false;
+}
+
+static void parse_error (const struct lexer *lex, const char *msg, const struct token *tok)
+{
+	assert (lex);
+	assert (msg);
+	assert (tok);
+	int line = lex->line - (tok->type == TOK_NEWLINE);
+
+	if (tok->type == TOK_NEWLINE || tok->type == TOK_EOF)
+		fprintf (stderr, "%s:%d: error: %s at the end of line\n", lex->file_name, line, msg);
+	else
+		fprintf (stderr, "%s:%d: error: %s near \"%.*s\"\n", lex->file_name, line, msg,
+			 (int) tok->len, tok->str);
+}
+
+static int register_label_by_name (const char *label_name, const size_t len)
+{
+	int sym = symtab_lookup (&labels, label_name, len);
+	if (sym < 0)
+		fprintf (stderr, "register_label_by_name error: can't register label %.*s\n",
+			 (int) len, label_name);
+	return sym;
+}
+
+static int reserve_buf (char **buf, size_t *cap, const size_t len)
 {
-	if (!strncmp (reg, "ax", 2)) return 0;
-	if (!strncmp (reg, "bx", 2)) return 1;
-	if (!strncmp (reg, "cx", 2)) return 2;
-	if (!strncmp (reg, "dx", 2)) return 3;
-	return -1;
+	assert (buf);
+	assert (cap);
+	size_t new_cap = (*cap) ? *cap : 64;
+	char *new_buf = NULL;
+
+	if (len <= *cap)
+		return 0;
+
+	while (new_cap < len)
+		new_cap *= 2;
+
+	new_buf = (char *) realloc (*buf, new_cap);
+	if (!new_buf) {
+		fprintf (stderr, "Can't allocate memory\n");
+		return 1;
+	}
+	memset (new_buf + *cap, 0, new_cap - *cap);
+	*buf = new_buf;
+	*cap = new_cap;
+	return 0;
 }
 
 static bool is_jump (const char cmd)
@@ -465,7 +510,7 @@ static bool is_jump (const char cmd)
 		(cmd == CMD_JA)  ||
 		(cmd == CMD_JAE) ||
 		(cmd == CMD_JB)  ||
-		(cmd == CMD_JAE) ||
+		(cmd == CMD_JBE) ||
 		(cmd == CMD_JE)  ||
 		(cmd == CMD_JNE) ||
 		(cmd == CMD_CALL))
@@ -473,32 +518,298 @@ static bool is_jump (const char cmd)
 	return false;
 }
 
-static void dump_labels (void)
+static size_t queue_instr (char *byte_code, size_t pc, const struct instr *ins)
+{
+	assert (byte_code);
+	assert (ins);
+	enum match_result match = MATCH_NONE;
+
+	pending[pending_num++] = *ins;
+
+	while (pending_num > 0) {
+		match = match_pattern (pending, pending_num);
+		if (match == MATCH_PREFIX)
+			break;
+		if (match == MATCH_FULL) {
+			fuse_pattern (pending, &pending_num);
+			return flush_instrs (byte_code, pc);
+		}
+		pc = put_instr (byte_code, pc, &pending[0]);
+		pending_num--;
+		memmove (pending, pending + 1, (size_t) pending_num * sizeof (struct instr));
+	}
+
+	return pc;
+}
+
+static size_t flush_instrs (char *byte_code, size_t pc)
 {
-	printf ("Labels:\n{\n");
-	for (int i = 0; i < MAX_LABELS_NUM; i++) {
-		printf ("%d:\t{status: %d; shift: %d; name: %s}\n", i,
-				labels[i].status,
-				labels[i].shift,
-				(strlen (labels[i].name) != 0) ?
-					labels[i].name : "-");
-	}
-	printf ("}\n");
+	assert (byte_code);
+
+	for (int i = 0; i < pending_num; i++)
+		pc = put_instr (byte_code, pc, &pending[i]);
+	pending_num = 0;
+
+	return pc;
 }
 
-static int verify_labels (void)
+static size_t put_instr (char *byte_code, size_t pc, const struct instr *ins)
 {
-	int i = 0;
-	for (i = 0; i < MAX_LABELS_NUM; i++) {
-		if (	labels[i].status != LABEL_VALID &&
-			labels[i].status != LABEL_EMPTY ) {
-			printf ("%d:\t{status: %d; shift: %d; name: %s}\n", i,
-					labels[i].status,
-					labels[i].shift,
-					(strlen (labels[i].name) != 0) ?
-						labels[i].name : "-");
-			return -1;
+	assert (byte_code);
+	assert (ins);
+	struct instr *new_prog = NULL;
+	size_t new_cap = (prog_cap) ? 2 * prog_cap : 64;
+
+	if (!compact)
+		return emit_instr (byte_code, pc, ins);
+
+	if (prog_num == prog_cap) {
+		new_prog = (struct instr *) realloc (prog, new_cap * sizeof (struct instr));
+		if (!new_prog) {
+			fprintf (stderr, "Can't allocate memory\n");
+			emit_failed = true;
+			return pc;
 		}
+		prog = new_prog;
+		prog_cap = new_cap;
 	}
-	return 0;
+	prog[prog_num++] = *ins;
+
+	return pc + 1;
+}
+
+/*
+ * Operand sizes depend on the distances and the distances on the sizes.
+ * Every pass sizes the commands by the offsets of the previous one, so
+ * starting from MAX_INSTR_LEN per command the offsets only shrink and the
+ * passes stop once they are the same twice.  Returns the code length.
+ */
+static size_t layout_compact (char **byte_code, size_t *byte_code_cap)
+{
+	assert (byte_code);
+	assert (byte_code_cap);
+	size_t *offsets = (size_t *) calloc (prog_num + 1, sizeof (size_t));
+	int *label_idx = (int *) calloc ((size_t) labels.syms_num + 1, sizeof (int));
+	bool changed = true;
+	size_t pc = 0;
+
+	if (!offsets || !label_idx || reserve_buf (byte_code, byte_code_cap, (prog_num + 1) * MAX_INSTR_LEN)) {
+		fprintf (stderr, "Compiler: can't allocate memory for the layout\n");
+		emit_failed = true;
+		goto out;
+	}
+
+	for (int i = 0; i < labels.syms_num; i++)
+		label_idx[i] = labels.syms[i].shift;
+	for (size_t i = 0; i <= prog_num; i++)
+		offsets[i] = i * MAX_INSTR_LEN;
+
+	while (changed && !emit_failed) {
+		changed = false;
+		for (int i = 0; i < labels.syms_num; i++)
+			if (label_idx[i] >= 0)
+				labels.syms[i].shift = (int) offsets[label_idx[i]];
+		lines_len = 0;
+
+		pc = 0;
+		for (size_t i = 0; i < prog_num; i++) {
+			target_bias = (int) offsets[i] - (int) pc;
+			if (offsets[i] != pc)
+				changed = true;
+			offsets[i] = pc;
+			pc = emit_instr (*byte_code, pc, prog + i);
+		}
+		if (offsets[prog_num] != pc)
+			changed = true;
+		offsets[prog_num] = pc;
+	}
+
+out:
+	free (offsets);
+	free (label_idx);
+	return pc;
+}
+
+static size_t emit_instr (char *byte_code, size_t pc, const struct instr *ins)
+{
+	assert (byte_code);
+	assert (ins);
+	char cmd = ins->cmd;
+	struct line_entry entry = {(uint32_t) pc, (uint32_t) ins->line};
+
+	// A fused command is at every line it was made of, so each can be broken at
+	for (int i = 0; i < PEEPHOLE_WINDOW && entry.line; i++) {
+		if (reserve_buf (&lines, &lines_cap, lines_len + sizeof (entry))) {
+			emit_failed = true;
+			break;
+		}
+		memcpy (lines + lines_len, &entry, sizeof (entry));
+		lines_len += sizeof (entry);
+		entry.line = (i < PEEPHOLE_WINDOW - 1) ? (uint32_t) ins->fused_lines[i] : 0;
+	}
+
+	if (ins->type)
+		byte_code[pc++] = (char) (CMD_TYPE | (ins->type << 5));
+	byte_code[pc++] = cmd;
+
+	if (ins->type && cmd == (CMD_PUSH | IMM)) {
+		memcpy (byte_code + pc, &ins->imm, sizeof (int64_t));
+		return pc + sizeof (int64_t);
+	}
+
+	if ((cmd & CMD) == CMD_VEC) {
+		for (int i = 0; i < get_vec_regs_num (VEC_OP (cmd)); i++)
+			byte_code[pc++] = (char) (ins->arg >> (8 * i));
+		return pc;
+	}
+
+	if ((cmd & CMD) == CMD_TASK)
+		return (TASK_OP (cmd) == TASK_SPAWN) ? emit_target (byte_code, pc, ins->arg) : pc;
+
+	if ((cmd & CMD) == CMD_CMPJ) {
+		byte_code[pc++] = ins->reg_num;
+		pc = emit_int (byte_code, pc, ins->arg);
+		return emit_target (byte_code, pc, ins->label);
+	}
+
+	if ((cmd & CMD) == CMD_OPREG) {
+		byte_code[pc++] = ins->reg_num;
+		byte_code[pc++] = ins->src_reg;
+		if (cmd & IMM)
+			pc = emit_int (byte_code, pc, ins->arg);
+		else
+			byte_code[pc++] = ins->src_reg2;
+		return pc;
+	}
+
+	if (is_jump (cmd))
+		return emit_target (byte_code, pc, ins->arg);
+
+	if (cmd & IMM)
+		pc = emit_int (byte_code, pc, ins->arg);
+	if (cmd & REG) {
+		byte_code[pc] = ins->reg_num;
+		pc++;
+	}
+
+	return pc;
+}
+
+static size_t emit_int (char *byte_code, size_t pc, const int val)
+{
+	assert (byte_code);
+
+	if (compact)
+		return pc + put_varint (byte_code + pc, val);
+
+	memcpy (byte_code + pc, &val, sizeof (int));
+	return pc + sizeof (int);
+}
+
+/*
+ * In compact code the target is relative to where its operand starts,
+ * target_bias moves pc to the layout the label offsets come from.
+ */
+static size_t emit_target (char *byte_code, size_t pc, const int label)
+{
+	assert (byte_code);
+
+	if (label < 0) {
+		emit_failed = true;
+	} else if (object) {
+		memset (byte_code + pc, 0, sizeof (int));
+		if (symtab_add_fixup (&labels, label, pc))
+			emit_failed = true;
+	} else if (compact) {
+		if (labels.syms[label].shift < 0) {
+			fprintf (stderr, "Compiler: label \"%s\" is used but not defined\n", labels.syms[label].name);
+			emit_failed = true;
+			return pc;
+		}
+		return emit_int (byte_code, pc, labels.syms[label].shift - ((int) pc + target_bias));
+	} else if (labels.syms[label].shift >= 0) {
+		memcpy (byte_code + pc, &labels.syms[label].shift, sizeof (int));
+	} else if (symtab_add_fixup (&labels, label, pc)) {
+		emit_failed = true;
+	}
+
+	return pc + sizeof (int);
+}
+
+/*
+ * Superinstructions:
+ *	push reg; push imm; jcc label		-> CMD_CMPJ
+ *	push reg; push reg/imm; alu; pop reg	-> CMD_OPREG
+ *	call label; ret				-> jmp label; ret
+ */
+static enum match_result match_pattern (const struct instr *seq, const int len)
+{
+	assert (seq);
+	const char push_reg = (char) (CMD_PUSH | REG);
+	const char push_imm = (char) (CMD_PUSH | IMM);
+	const char pop_reg = (char) (CMD_POP | REG);
+
+	if (len < 1 || seq[len - 1].type)
+		return MATCH_NONE;
+
+	if (seq[0].cmd == CMD_CALL) {
+		if (len == 1)
+			return MATCH_PREFIX;
+		return (seq[1].cmd == CMD_RET) ? MATCH_FULL : MATCH_NONE;
+	}
+
+	if (seq[0].cmd != push_reg)
+		return MATCH_NONE;
+	if (len == 1)
+		return MATCH_PREFIX;
+
+	if (seq[1].cmd != push_reg && seq[1].cmd != push_imm)
+		return MATCH_NONE;
+	if (len == 2)
+		return MATCH_PREFIX;
+
+	if (seq[2].cmd >= CMD_JA && seq[2].cmd <= CMD_JNE)
+		return (seq[1].cmd == push_imm) ? MATCH_FULL : MATCH_NONE;
+
+	if (seq[2].cmd < CMD_ADD || seq[2].cmd > CMD_DIV)
+		return MATCH_NONE;
+	if (len == 3)
+		return MATCH_PREFIX;
+
+	return (seq[3].cmd == pop_reg) ? MATCH_FULL : MATCH_NONE;
+}
+
+static void fuse_pattern (struct instr *seq, int *len)
+{
+	assert (seq);
+	assert (len);
+	struct instr fused = {};
+
+	if (seq[0].cmd == CMD_CALL) {
+		seq[0].cmd = CMD_JMP;
+		return ;
+	}
+
+	if (*len == 3) {
+		fused.cmd = (char) (CMD_CMPJ | ((seq[2].cmd - CMD_JA) << 5));
+		fused.reg_num = seq[0].reg_num;
+		fused.arg = seq[1].arg;
+		fused.label = seq[2].arg;
+	} else {
+		fused.cmd = (char) (CMD_OPREG | ((seq[2].cmd - CMD_ADD) << 6));
+		fused.reg_num = seq[3].reg_num;
+		fused.src_reg = seq[0].reg_num;
+		if (seq[1].cmd & IMM) {
+			fused.cmd = (char) (fused.cmd | IMM);
+			fused.arg = seq[1].arg;
+		} else {
+			fused.src_reg2 = seq[1].reg_num;
+		}
+	}
+
+	fused.line = seq[0].line;
+	for (int i = 1; i < *len; i++)
+		fused.fused_lines[i - 1] = seq[i].line;
+	seq[0] = fused;
+	*len = 1;
 }
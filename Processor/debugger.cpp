@@ -0,0 +1,317 @@
+#include "vm.h"
+#include "task.h"
+#include "debugger.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define DEBUG_STACK_SHOWN 4
+
+static void watch_handler (int sig, siginfo_t *info, void *ctx);
+static int protect_watches (struct vm *vm, const int prot);
+static void report_watches (struct vm *vm, const struct byte_code_file *input, const uint32_t pc);
+static void report_break (const struct vm *vm, const struct byte_code_file *input, const struct insn *ip);
+static void print_place (const struct byte_code_file *input, const uint32_t pc);
+
+/* The SIGSEGV handler has nothing but these to find the RAM */
+static struct vm *volatile active_vm = NULL;
+static uintptr_t page_size = 0;
+
+int vm_debug_start (struct vm *vm)
+{
+	if (vm->reg_code) {
+		fprintf (stderr, "Processor: the register engine can't be debugged\n");
+		return 1;
+	}
+	if (vm->shared_code) {
+		fprintf (stderr, "Processor: a VM sharing its code can't be debugged\n");
+		return 1;
+	}
+	if (active_vm) {
+		fprintf (stderr, "Processor: another VM is being debugged\n");
+		return 1;
+	}
+
+	vm->debug = (struct vm_debug *) calloc (1, sizeof (struct vm_debug));
+	if (!vm->debug) {
+		fprintf (stderr, "Processor: can't allocate debugger\n");
+		return 1;
+	}
+	*vm->debug = {};
+	vm->debug->ops = (uint8_t *) calloc (vm->code_num + 1, sizeof (uint8_t));
+	if (!vm->debug->ops) {
+		fprintf (stderr, "Processor: can't allocate debugger\n");
+		free (vm->debug);
+		vm->debug = NULL;
+		return 1;
+	}
+
+	page_size = (uintptr_t) sysconf (_SC_PAGESIZE);
+	active_vm = vm;
+	return 0;
+}
+
+/* Puts the code back as it was loaded */
+void vm_debug_stop (struct vm *vm)
+{
+	struct vm_debug *dbg = vm->debug;
+
+	if (!dbg)
+		return;
+
+	for (size_t i = 0; i < vm->code_num; i++) {
+		if (vm->code[i].op == OP_TRAP)
+			vm->code[i].op = dbg->ops[i];
+	}
+	if (dbg->armed) {
+		protect_watches (vm, PROT_READ | PROT_WRITE);
+		sigaction (SIGSEGV, &dbg->old_action, NULL);
+	}
+
+	free (dbg->watches);
+	free (dbg->ops);
+	free (dbg);
+	vm->debug = NULL;
+	active_vm = NULL;
+}
+
+/* pc is a byte code offset, it has to be the start of a command */
+int vm_break_set (struct vm *vm, const uint32_t pc)
+{
+	int32_t idx = (pc < vm->byte_code_len) ? vm->pc_map[pc] : -1;
+
+	if (idx < 0) {
+		fprintf (stderr, "Processor: no command at pc %u to break at\n", pc);
+		return 1;
+	}
+	if (vm->code[idx].op != OP_TRAP) {
+		vm->debug->ops[idx] = vm->code[idx].op;
+		vm->code[idx].op = OP_TRAP;
+	}
+	return 0;
+}
+
+int vm_watch_set (struct vm *vm, const uint64_t addr)
+{
+	struct vm_debug *dbg = vm->debug;
+	struct vm_watch *watches = NULL;
+	struct sigaction action = {};
+
+	if (addr > vm->ram_mask) {
+		fprintf (stderr, "Processor: can't watch address %" PRIu64 ", RAM has %zu words\n",
+		         addr, vm->ram_words);
+		return 1;
+	}
+
+	watches = (struct vm_watch *) realloc (dbg->watches, (dbg->watches_num + 1) * sizeof (*watches));
+	if (!watches) {
+		fprintf (stderr, "Processor: can't allocate watchpoint\n");
+		return 1;
+	}
+	dbg->watches = watches;
+	dbg->watches[dbg->watches_num++] = {addr, vm->ram[addr]};
+
+	if (dbg->armed)
+		return 0;
+	action.sa_sigaction = watch_handler;
+	action.sa_flags = SA_SIGINFO;
+	sigemptyset (&action.sa_mask);
+	if (sigaction (SIGSEGV, &action, &dbg->old_action)) {
+		perror ("Processor: can't set SIGSEGV handler");
+		dbg->watches_num--;
+		return 1;
+	}
+	dbg->armed = true;
+	return 0;
+}
+
+/*
+ * A system call gets EFAULT instead of the signal, so the watched pages
+ * are opened before one writes to the RAM and the command is checked.
+ */
+void vm_debug_touch (struct vm *vm)
+{
+	if (!vm->debug->watches_num)
+		return;
+	protect_watches (vm, PROT_READ | PROT_WRITE);
+	vm->debug->hit = 1;
+}
+
+/*
+ * Runs to the end or until the budget is spent.  Breakpoints and changed
+ * watches are reported to stderr and the run goes on after them.
+ */
+enum vm_status vm_debug_run (struct vm *vm, const struct byte_code_file *input, const uint64_t budget)
+{
+	struct vm_debug *dbg = vm->debug;
+	const uint64_t fuel_start = vm->fuel_used;
+	uint64_t left = budget;
+	enum vm_status status = VM_HALTED;
+	const struct insn *ip = NULL;
+
+	while (true) {
+		dbg->hit = 0;
+		if (protect_watches (vm, PROT_READ))
+			return VM_ERR_MEMORY;
+		status = vm_run (vm, left);
+		protect_watches (vm, PROT_READ | PROT_WRITE);
+		if (status != VM_BREAK)
+			return status;
+
+		if (budget != VM_FUEL_UNLIMITED)
+			left = budget - (vm->fuel_used - fuel_start);
+		ip = (vm->sched && vm->sched->resume) ? vm->sched->resume->ip : vm->resume.ip;
+		if (!dbg->hit)
+			report_break (vm, input, ip);
+		else if (ip > vm->code)
+			report_watches (vm, input, vm->insn_pc[ip - 1 - vm->code]);
+		if (!left)
+			return VM_SUSPENDED;
+	}
+}
+
+/*
+ * A number is a source line, the first command of it or of the next line
+ * that has one.  Anything else is a label.
+ */
+int debug_find_pc (const struct byte_code_file *input, const char *where, uint32_t *pc)
+{
+	const char *lines = input->sections[SECT_LINES];
+	struct line_entry entry = {};
+	char *end = NULL;
+	unsigned long line = strtoul (where, &end, 10);
+	uint32_t best = UINT32_MAX;
+	bool found = false;
+
+	if (where[0] >= '0' && where[0] <= '9' && !*end) {
+		for (size_t pos = 0; pos + sizeof (entry) <= input->sections_len[SECT_LINES]; pos += sizeof (entry)) {
+			memcpy (&entry, lines + pos, sizeof (entry));
+			if (entry.line >= line && entry.line < best) {
+				best = entry.line;
+				*pc = entry.pc;
+				found = true;
+			}
+		}
+		if (!found)
+			fprintf (stderr, "Processor: no code at line %s or after it\n", where);
+		return !found;
+	}
+
+	for (uint32_t i = 0; i < input->symbols_num; i++) {
+		if (input->symbols[i].name < input->names_len &&
+		    !strcmp (input->names + input->symbols[i].name, where) && input->symbols[i].shift >= 0) {
+			*pc = (uint32_t) input->symbols[i].shift;
+			return 0;
+		}
+	}
+	fprintf (stderr, "Processor: no label %s\n", where);
+	return 1;
+}
+
+/* Runs in the signal handler: only mprotect and sigaction */
+static void watch_handler (int, siginfo_t *info, void *)
+{
+	struct vm *vm = active_vm;
+	const uintptr_t fault = (uintptr_t) info->si_addr;
+	const uintptr_t ram = (uintptr_t) vm->ram;
+
+	if (fault >= ram && fault < ram + vm->ram_words * sizeof (cell_t) &&
+	    !mprotect ((void *) (fault & ~(page_size - 1)), page_size, PROT_READ | PROT_WRITE)) {
+		vm->debug->hit = 1;
+		return;
+	}
+
+	// Not ours: the fault repeats with the handler there was before
+	sigaction (SIGSEGV, &vm->debug->old_action, NULL);
+	vm->debug->armed = false;
+}
+
+static int protect_watches (struct vm *vm, const int prot)
+{
+	const struct vm_debug *dbg = vm->debug;
+	uintptr_t start = 0;
+
+	for (size_t i = 0; i < dbg->watches_num; i++) {
+		start = (uintptr_t) (vm->ram + dbg->watches[i].addr) & ~(page_size - 1);
+		if (mprotect ((void *) start, page_size, prot)) {
+			perror ("Processor: can't protect watched RAM");
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* pc is the command that wrote, a watch that has not changed is quiet */
+static void report_watches (struct vm *vm, const struct byte_code_file *input, const uint32_t pc)
+{
+	struct vm_debug *dbg = vm->debug;
+
+	for (size_t i = 0; i < dbg->watches_num; i++) {
+		struct vm_watch *watch = &dbg->watches[i];
+		if (vm->ram[watch->addr] == watch->val)
+			continue;
+		fprintf (stderr, "Processor: watch [%" PRIu64 "]: %" PRId64 " -> %" PRId64 " at",
+		         watch->addr, watch->val, vm->ram[watch->addr]);
+		print_place (input, pc);
+		watch->val = vm->ram[watch->addr];
+	}
+}
+
+static void report_break (const struct vm *vm, const struct byte_code_file *input, const struct insn *ip)
+{
+	const struct task *cur = (vm->sched) ? vm->sched->resume : NULL;
+	const cell_t *regs = (cur) ? cur->regs : vm->regs;
+	const cell_t *stack = (cur) ? cur->stack : vm->stack;
+	const cell_t *sp = (cur) ? cur->sp : vm->resume.sp;
+	const cell_t tos = (cur) ? cur->tos : vm->resume.tos;
+	const size_t depth = (size_t) (sp - stack);
+
+	fprintf (stderr, "Processor: break at");
+	print_place (input, vm->insn_pc[ip - vm->code]);
+	fprintf (stderr, "\tax %" PRId64 ", bx %" PRId64 ", cx %" PRId64 ", dx %" PRId64 "\n",
+	         regs[0], regs[1], regs[2], regs[3]);
+	fprintf (stderr, "\tstack %zu:", depth);
+	for (size_t i = 0; i < depth && i < DEBUG_STACK_SHOWN; i++)
+		fprintf (stderr, " %" PRId64, (i) ? *(sp - i) : tos);
+	fprintf (stderr, (depth > DEBUG_STACK_SHOWN) ? " ...\n" : "\n");
+}
+
+/* " pc N, line L (label+off)\n", what the file knows of it */
+static void print_place (const struct byte_code_file *input, const uint32_t pc)
+{
+	const char *lines = input->sections[SECT_LINES];
+	struct line_entry entry = {};
+	uint32_t line = 0, line_pc = 0, left = 0, right = input->symbols_num;
+
+	// A fused command has an entry for each of its lines, the first is shown
+	fprintf (stderr, " pc %u", pc);
+	for (size_t pos = 0; pos + sizeof (entry) <= input->sections_len[SECT_LINES]; pos += sizeof (entry)) {
+		memcpy (&entry, lines + pos, sizeof (entry));
+		if (entry.pc > pc)
+			break;
+		if (!line || entry.pc != line_pc) {
+			line = entry.line;
+			line_pc = entry.pc;
+		}
+	}
+	if (line)
+		fprintf (stderr, ", line %u", line);
+
+	// The last label at or before pc
+	while (left < right) {
+		uint32_t mid = left + (right - left) / 2;
+		if (input->symbols[mid].shift <= (int32_t) pc)
+			left = mid + 1;
+		else
+			right = mid;
+	}
+	if (left && input->symbols[left - 1].name < input->names_len)
+		fprintf (stderr, " (%s+%u)", input->names + input->symbols[left - 1].name,
+		         pc - (uint32_t) input->symbols[left - 1].shift);
+	fprintf (stderr, "\n");
+}
@@ -0,0 +1,46 @@
+#ifndef DEBUGGER_H
+#define DEBUGGER_H
+
+#include "vm.h"
+#include "loader.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <signal.h>
+
+/*
+ * Breakpoints replace the op of their instruction with OP_TRAP, which
+ * only the debug copy of the dispatch loop handles: it stops the VM with
+ * VM_BREAK in front of the instruction and runs the saved op when it is
+ * resumed there.  Watchpoints write-protect the RAM pages of the watched
+ * words, the SIGSEGV handler lets the store through and the debug loop
+ * stops after the command that made it.  Without a debugger the plain
+ * loop runs and nothing is patched or protected.
+ */
+struct vm_watch
+{
+	uint64_t addr;
+	cell_t val;
+};
+
+struct vm_debug
+{
+	uint8_t *ops = NULL;
+	const struct insn *trap_ip = NULL;
+	struct vm_watch *watches = NULL;
+	size_t watches_num = 0;
+	volatile sig_atomic_t hit = 0;
+	bool armed = false;
+	struct sigaction old_action = {};
+};
+
+int vm_debug_start (struct vm *vm);
+void vm_debug_stop (struct vm *vm);
+int vm_break_set (struct vm *vm, const uint32_t pc);
+int vm_watch_set (struct vm *vm, const uint64_t addr);
+void vm_debug_touch (struct vm *vm);
+enum vm_status vm_debug_run (struct vm *vm, const struct byte_code_file *input, const uint64_t budget);
+
+int debug_find_pc (const struct byte_code_file *input, const char *where, uint32_t *pc);
+
+#endif // DEBUGGER_H
@@ -0,0 +1,271 @@
+#include "processor.h"
+#include "vm.h"
+#include "regvm.h"
+#include "opcodes.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int decode_insn (const char *byte_code, const size_t len, const uint32_t flags,
+			size_t *pc, struct insn *insn);
+static int typed_op (const int op, const int type);
+static int count_insns (const char *byte_code, const size_t len, const uint32_t flags, size_t *num);
+static int resolve_targets (struct vm *vm);
+static void eliminate_tail_calls (struct vm *vm);
+static int count_fuel_cost (struct vm *vm);
+
+int vm_load (struct vm *vm, const char *byte_code, const size_t len, const uint32_t flags)
+{
+	size_t pc = 0, num = 0, i = 0, growth = 0;
+
+	if (len >= INT32_MAX) {
+		fprintf (stderr, "Processor: byte code is too big\n");
+		return 1;
+	}
+	if (flags & FILE_OBJECT) {
+		fprintf (stderr, "Processor: byte code is an object, it has to be linked first\n");
+		return 1;
+	}
+
+	if (count_insns (byte_code, len, flags, &num))
+		return 1;
+
+	vm->code = (struct insn *) calloc (num + 1, sizeof (struct insn));
+	vm->insn_pc = (uint32_t *) calloc (num + 1, sizeof (uint32_t));
+	vm->pc_map = (int32_t *) malloc ((len + 1) * sizeof (int32_t));
+	if (!vm->code || !vm->insn_pc || !vm->pc_map) {
+		fprintf (stderr, "Processor: can't allocate memory for %zu instructions\n", num);
+		return 1;
+	}
+	vm->code_num = num;
+	vm->byte_code_len = len;
+	vm->code_hash = hash64 (byte_code, len, 0);
+
+	for (pc = 0; pc <= len; pc++)
+		vm->pc_map[pc] = -1;
+
+	for (i = 0, pc = 0; i < num; i++) {
+		vm->pc_map[pc] = (int32_t) i;
+		vm->insn_pc[i] = (uint32_t) pc;
+		decode_insn (byte_code, len, flags, &pc, &vm->code[i]);
+		if (vm->code[i].op >= OP_SPAWN && vm->code[i].op <= OP_RECV)
+			vm->uses_tasks = true;
+	}
+	vm->code[num].op = OP_HLT;
+	vm->insn_pc[num] = (uint32_t) len;
+	vm->pc_map[len] = (int32_t) num;
+
+	if (resolve_targets (vm))
+		return 1;
+	eliminate_tail_calls (vm);
+	if (count_fuel_cost (vm) || check_stack_depth (vm))
+		return 1;
+
+	growth = count_stack_growth (vm);
+	free (vm->stack);
+	vm->stack_cap = vm->config.stack_size + growth;
+	vm->stack = (cell_t *) malloc ((vm->stack_cap + 1) * sizeof (cell_t));
+	if (!vm->stack) {
+		fprintf (stderr, "Processor: can't allocate operand stack of %zu cells\n", vm->stack_cap);
+		return 1;
+	}
+	vm->stack_limit = vm->config.stack_size;
+
+	if (vm->config.engine == ENGINE_REG) {
+		if (reg_translate (vm)) {
+			fprintf (stderr, "Processor: running on the stack engine\n");
+			return 0;
+		}
+		return reg_attach (vm);
+	}
+
+	return 0;
+}
+
+/*
+ * Takes the decoded code of src, which has to outlive vm, and gives vm an
+ * operand stack of its own.  Nothing of the code is written at run time.
+ */
+int vm_share_code (struct vm *vm, const struct vm *src)
+{
+	vm->code = src->code;
+	vm->code_num = src->code_num;
+	vm->insn_pc = src->insn_pc;
+	vm->pc_map = src->pc_map;
+	vm->fuel_cost = src->fuel_cost;
+	vm->byte_code_len = src->byte_code_len;
+	vm->code_hash = src->code_hash;
+	vm->shared_code = true;
+	vm->uses_tasks = src->uses_tasks;
+
+	free (vm->stack);
+	vm->stack_cap = src->stack_cap - src->stack_limit + vm->config.stack_size;
+	vm->stack = (cell_t *) malloc ((vm->stack_cap + 1) * sizeof (cell_t));
+	if (!vm->stack) {
+		fprintf (stderr, "Processor: can't allocate operand stack of %zu cells\n", vm->stack_cap);
+		return 1;
+	}
+	vm->stack_limit = vm->config.stack_size;
+
+	vm->reg_code = src->reg_code;
+	if (vm->reg_code)
+		return reg_attach (vm);
+
+	return 0;
+}
+
+/*
+ * The entry of the opcode gives the op, a type prefix picks the handler
+ * family of it.  Vector commands get their registers packed into arg.
+ */
+static int decode_insn (const char *byte_code, const size_t len, const uint32_t flags,
+			size_t *pc, struct insn *insn)
+{
+	struct decoded_cmd dc = {};
+	int op = 0;
+
+	if (decode_cmd (byte_code, len, pc, flags, &dc))
+		return 1;
+
+	op = dc.desc->op;
+	if (dc.type != TYPE_INT) {
+		op = typed_op (op, dc.type);
+		if (op < 0)
+			return 1;
+	}
+
+	insn->op = (uint8_t) op;
+	insn->reg = dc.regs[0];
+	insn->reg2 = dc.regs[1];
+	insn->flags = 0;
+	insn->target = dc.target;
+	insn->arg = dc.arg;
+	if (op >= OP_VADD && op <= OP_VOUT) {
+		insn->flags = (uint8_t) dc.type;
+		insn->arg = 0;
+		for (int i = 0; i < dc.regs_num; i++)
+			insn->arg |= (int64_t) dc.regs[i] << (8 * i);
+	} else if (dc.regs_num == 3) {
+		insn->arg = dc.regs[2];
+	}
+
+	return 0;
+}
+
+static int typed_op (const int op, const int type)
+{
+	const int family = (type == TYPE_INT64) ? 0 : 1;
+
+	switch (op) {
+		case OP_PUSH_IMM:
+		case OP_PUSH_REG:
+		case OP_PUSH_MEM_IMM:
+		case OP_PUSH_MEM_REG:
+		case OP_POP_REG:
+		case OP_POP_MEM_IMM:
+		case OP_POP_MEM_REG:
+		case OP_VADD:
+		case OP_VMUL:
+		case OP_VSUM:
+		case OP_VDOT:
+		case OP_VIN:
+		case OP_VOUT:
+			return op;
+		case OP_POP:
+			return OP_POP_Q + family;
+		case OP_IN:
+			return OP_IN_Q + family;
+		case OP_OUT:
+			return OP_OUT_Q + family;
+		case OP_ADD:
+		case OP_SUB:
+		case OP_MUL:
+		case OP_DIV:
+			return ((family) ? OP_ADD_D : OP_ADD_Q) + (op - OP_ADD);
+		case OP_JA:
+		case OP_JAE:
+		case OP_JB:
+		case OP_JBE:
+		case OP_JE:
+		case OP_JNE:
+			return ((family) ? OP_JA_D : OP_JA_Q) + (op - OP_JA);
+		default:
+			return -1;
+	}
+}
+
+static int count_insns (const char *byte_code, const size_t len, const uint32_t flags, size_t *num)
+{
+	struct insn insn = {};
+	size_t pc = 0;
+
+	*num = 0;
+	while (pc < len) {
+		const size_t start = pc;
+
+		if (decode_insn (byte_code, len, flags, &pc, &insn)) {
+			fprintf (stderr, "Processor: malformed instruction 0x%02x at pc %zu\n",
+			         (unsigned char) byte_code[start], start);
+			return 1;
+		}
+		(*num)++;
+	}
+
+	return 0;
+}
+
+static int resolve_targets (struct vm *vm)
+{
+	size_t i = 0;
+
+	for (i = 0; i < vm->code_num; i++) {
+		struct insn *insn = &vm->code[i];
+
+		if (!op_has_target (insn->op))
+			continue;
+		if (insn->target < 0 || (size_t) insn->target > vm->byte_code_len ||
+		    vm->pc_map[insn->target] < 0) {
+			fprintf (stderr, "Processor: pc %u: jump to %d is not an instruction boundary\n",
+			         vm->insn_pc[i], insn->target);
+			return 1;
+		}
+		insn->target = vm->pc_map[insn->target];
+	}
+
+	return 0;
+}
+
+/*
+ * call immediately followed by ret returns straight to our caller,
+ * so it does not need a call stack entry.
+ */
+static void eliminate_tail_calls (struct vm *vm)
+{
+	size_t i = 0;
+
+	for (i = 0; i < vm->code_num; i++)
+		if (vm->code[i].op == OP_CALL && vm->code[i + 1].op == OP_RET)
+			vm->code[i].op = OP_JMP;
+}
+
+/*
+ * Commands from i up to the next control transfer always run together,
+ * fuel_cost[i] is their number.  Every run starts at the destination of
+ * a control transfer, so charging it there counts each command once.
+ */
+static int count_fuel_cost (struct vm *vm)
+{
+	size_t i = vm->code_num;
+
+	vm->fuel_cost = (uint32_t *) malloc ((vm->code_num + 1) * sizeof (uint32_t));
+	if (!vm->fuel_cost) {
+		fprintf (stderr, "Processor: can't allocate memory for %zu instructions\n", vm->code_num);
+		return 1;
+	}
+
+	vm->fuel_cost[i] = 1;
+	while (i-- > 0)
+		vm->fuel_cost[i] = (op_is_control (vm->code[i].op)) ? 1 : vm->fuel_cost[i + 1] + 1;
+	return 0;
+}
@@ -1,222 +1,147 @@
 #include "processor.h"
+#include "loader.h"
+#include "opcodes.h"
 
 #include <stdio.h>
-#include <string.h>
-#include <sys/stat.h>
-#include <sys/types.h>
-#include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define OUT_BUF_SIZE (1 << 20)
+
+/* Text is gathered here and written in large blocks */
+struct out_buf
+{
+	FILE *file;
+	char *data;
+	size_t len;
+};
 
+static int print_cmd (struct out_buf *out, const struct byte_code_file *file, const struct decoded_cmd *dc);
+static int print_labels (struct out_buf *out, const struct byte_code_file *file, uint32_t *sym, const size_t pc);
+static int put_text (struct out_buf *out, const char *text, const size_t len);
+static int flush_out (struct out_buf *out);
 
 int main (int argc, char *argv[])
 {
-	FILE *input = NULL, *output = NULL;
-	int arg = 0;
-	char cmd = 0, reg_num;
-	char *byte_code = NULL, *reg_name = NULL;
-	size_t byte_code_len = 0, pc = 0;
-	struct stat st = {};
-	int sign_and_ver_len = 0;
-	bool imm = false, reg = false, mem = false;
+	struct byte_code_file input = {};
+	struct decoded_cmd dc = {};
+	struct out_buf out = {};
+	size_t pc = 0;
+	uint32_t sym = 0;
+	int res = 1;
 
 	if (argc < 2 || argc > 3) {
 		fprintf (stderr, "Usage: %s input [output]\n", argv[0]);
 		return 1;
 	}
 
-	input = fopen (argv[1], "r");
-	if (!input) {
-		fprintf (stderr, "Can't open file %s\n", argv[1]);
+	if (load_byte_code (&input, argv[1], true))
 		return 2;
-	}
+	madvise (input.map, input.map_len, MADV_SEQUENTIAL);
 
 	if (argc == 3) {
-		output = fopen (argv[2], "w");
-		if (!output) {
+		out.file = fopen (argv[2], "w");
+		if (!out.file) {
 			fprintf (stderr, "Can't open file %s\n", argv[2]);
-			fclose (input);
+			unload_byte_code (&input);
 			return 3;
 		}
 	} else {
-		output = stdout;
+		out.file = stdout;
 	}
 
-	if (stat (argv[1], &st) < 0) {
-		fprintf (stderr, "Stat syscall failed\n");
-		fclose (input);
-		if (output != stdout) fclose (output);
-		return 1;
+	out.data = (char *) malloc (OUT_BUF_SIZE);
+	if (!out.data) {
+		fprintf (stderr, "Disassembler: can't allocate output buffer\n");
+		goto out;
 	}
 
-	byte_code_len = (size_t) st.st_size;
-
-	if ((sign_and_ver_len = check_sign_and_ver (input)) < 0) {
-		fprintf (stderr, "Input file type verification failed\n");
-		fclose (input);
-		if (output != stdout) fclose (output);
-		return 1;
+	while (pc < input.code_len) {
+		if (print_labels (&out, &input, &sym, pc))
+			goto out;
+		if (decode_cmd (input.code, input.code_len, &pc, input.flags, &dc)) {
+			fprintf (stderr, "Disassembler: malformed command 0x%02x at %zu\n",
+				 (unsigned char) input.code[pc], pc);
+			goto out;
+		}
+		if (print_cmd (&out, &input, &dc))
+			goto out;
 	}
 
-	byte_code_len -= (size_t) sign_and_ver_len;
+	if (print_labels (&out, &input, &sym, pc) || flush_out (&out))
+		goto out;
+	res = 0;
 
-	byte_code = (char *) calloc (byte_code_len, sizeof (char));
-	if (!byte_code) {
-		fprintf (stderr, "Can't allocate memory\n");
-		fclose (input);
-		if (output != stdout) fclose (output);
-		return 1;
+out:
+	free (out.data);
+	unload_byte_code (&input);
+	if (out.file != stdout && fclose (out.file))
+		res = 1;
+	return res;
+}
+
+/*
+ * Formats straight into the buffer, it is flushed and the command
+ * formatted again if the text does not fit in what is left.
+ */
+static int print_cmd (struct out_buf *out, const struct byte_code_file *file, const struct decoded_cmd *dc)
+{
+	int len = format_cmd (out->data + out->len, OUT_BUF_SIZE - out->len, file, dc, "\n", false);
+
+	if (len < 0) {
+		if (flush_out (out))
+			return 1;
+		len = format_cmd (out->data, OUT_BUF_SIZE, file, dc, "\n", false);
+		if (len < 0) {
+			fprintf (stderr, "Disassembler: text of the command at %zu is too long\n", dc->pc);
+			return 1;
+		}
 	}
 
-	if (fread (byte_code, sizeof (char), byte_code_len, input) < byte_code_len) {
-		fprintf (stderr, "Failed to read byte_code from %s\n", argv[1]);
-		free (byte_code);
-		fclose (input);
-		if (output != stdout) fclose (output);
-		return 1;
+	// format_cmd () leaves room for the terminating zero
+	out->len += (size_t) len;
+	out->data[out->len++] = '\n';
+	return 0;
+}
+
+static int print_labels (struct out_buf *out, const struct byte_code_file *file, uint32_t *sym, const size_t pc)
+{
+	const char *name = NULL;
+
+	for (; *sym < file->symbols_num && file->symbols[*sym].shift <= (int) pc; (*sym)++) {
+		if (file->symbols[*sym].shift != (int) pc || file->symbols[*sym].name >= file->names_len)
+			continue;
+		name = file->names + file->symbols[*sym].name;
+		if (put_text (out, name, strlen (name)) || put_text (out, ":\n", 2))
+			return 1;
 	}
+	return 0;
+}
 
-	while (pc < byte_code_len) {
-		cmd = byte_code[pc++];
-		imm = (cmd & IMM);
-		reg = (cmd & REG);
-		mem = (cmd & MEM);
-
-		switch (cmd & CMD) {
-			case CMD_PUSH:
-				if (imm) {
-					arg = *(int *)(byte_code + pc);
-					pc += sizeof (int);
-				}
-				if (reg) {
-					reg_num = byte_code[pc++];
-					reg_name = get_reg_name (reg_num);
-					if (!reg_name) {
-						fprintf (stderr, "Disassebler: wrong register #%d\n", reg_num);
-						free (byte_code);
-						fclose (input);
-						if (output != stdout) fclose (output);
-						return 1;
-					}
-				}
-				fprintf (output, "push ");
-				if (mem)
-					fprintf (output, "[");
-				if (reg)
-					fprintf (output, "%s", reg_name);
-				if (reg && imm)
-					fprintf (output, "+");
-				if (imm)
-					fprintf (output, "%d", arg);
-				if (mem)
-					fprintf (output, "]");
-				fprintf (output, "\n");
-				break;
-			case CMD_POP:
-				if (imm) {
-					arg = *(int *)(byte_code + pc);
-					pc += sizeof (int);
-				}
-				if (reg) {
-					reg_num = byte_code[pc++];
-					reg_name = get_reg_name (reg_num);
-					if (!reg_name) {
-						fprintf (stderr, "Disassebler: wrong register #%d\n", reg_num);
-						free (byte_code);
-						fclose (input);
-						if (output != stdout) fclose (output);
-						return 1;
-					}
-				}
-				fprintf (output, "pop ");
-				if (mem)
-					fprintf (output, "[");
-				if (reg)
-					fprintf (output, "%s", reg_name);
-				if (reg && imm)
-					fprintf (output, "+");
-				if (imm)
-					fprintf (output, "%d", arg);
-				if (mem)
-					fprintf (output, "]");
-				fprintf (output, "\n");
-				break;
-			case CMD_ADD:
-				fprintf (output, "%s\n", "add");
-				break;
-			case CMD_SUB:
-				fprintf (output, "%s\n", "sub");
-				break;
-			case CMD_MUL:
-				fprintf (output, "%s\n", "mul");
-				break;
-			case CMD_DIV:
-				fprintf (output, "%s\n", "div");
-				break;
-			case CMD_IN:
-				fprintf (output, "%s\n", "in");
-				break;
-			case CMD_OUT:
-				fprintf (output, "%s\n", "out");
-				break;
-			case CMD_HLT:
-				fprintf (output, "%s\n", "hlt");
-				break;
-			case CMD_JMP:
-				arg = *(int *)(byte_code + pc);
-				pc += sizeof (int);
-				fprintf (output, "%s %d\n", "jmp", arg);
-				break;
-			case CMD_JA:
-				arg = *(int *)(byte_code + pc);
-				pc += sizeof (int);
-				fprintf (output, "%s %d\n", "ja", arg);
-				break;
-			case CMD_JAE:
-				arg = *(int *)(byte_code + pc);
-				pc += sizeof (int);
-				fprintf (output, "%s %d\n", "jae", arg);
-				break;
-			case CMD_JB:
-				arg = *(int *)(byte_code + pc);
-				pc += sizeof (int);
-				fprintf (output, "%s %d\n", "jb", arg);
-				break;
-			case CMD_JBE:
-				arg = *(int *)(byte_code + pc);
-				pc += sizeof (int);
-				fprintf (output, "%s %d\n", "jbe", arg);
-				break;
-			case CMD_JE:
-				arg = *(int *)(byte_code + pc);
-				pc += sizeof (int);
-				fprintf (output, "%s %d\n", "je", arg);
-				break;
-			case CMD_JNE:
-				arg = *(int *)(byte_code + pc);
-				pc += sizeof (int);
-				fprintf (output, "%s %d\n", "jne", arg);
-				break;
-			case CMD_CALL:
-				arg = *(int *)(byte_code + pc);
-				pc += sizeof (int);
-				fprintf (output, "%s %d\n", "call", arg);
-				break;
-			case CMD_RET:
-				fprintf (output, "%s\n", "ret");
-				break;
-			default:
-				fprintf (stderr, "Disassebler: unknown command: %d\n", cmd);
-				free (byte_code);
-				fclose (input);
-				if (output != stdout) fclose (output);
-				return 1;
-				break;
+static int put_text (struct out_buf *out, const char *text, const size_t len)
+{
+	if (len > OUT_BUF_SIZE - out->len && flush_out (out))
+		return 1;
+	if (len > OUT_BUF_SIZE) {
+		if (fwrite (text, 1, len, out->file) != len) {
+			fprintf (stderr, "Disassembler: failed to write output\n");
+			return 1;
 		}
+		return 0;
 	}
 
-	free (byte_code);
-	fclose (input);
-	if (output != stdout) fclose (output);
+	memcpy (out->data + out->len, text, len);
+	out->len += len;
 	return 0;
 }
 
+static int flush_out (struct out_buf *out)
+{
+	if (out->len && fwrite (out->data, 1, out->len, out->file) != out->len) {
+		fprintf (stderr, "Disassembler: failed to write output\n");
+		return 1;
+	}
+	out->len = 0;
+	return 0;
+}
@@ -1,9 +1,9 @@
 in
-pop ax+1
+pop ax
 in
 pop [3 ]
 in
-pop 3
+pop cx
 push [ ax ]
 push [3+dx]
 mul
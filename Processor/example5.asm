@@ -27,14 +27,10 @@ loop:
 	push ax
 	push 1
 	jne loop
-	pop bx
 	push dx
-	push bx
 	ret
 known:
-	pop bx
 	push 1
-	push bx
 	ret
 error:
 	push 666
@@ -0,0 +1,393 @@
+#include "processor.h"
+#include "io.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+#define MAX_TEXT_LEN 64
+
+static int capture_output (struct vm_io *io);
+static int fill_input (struct vm_io *io);
+static int peek_char (struct vm_io *io);
+static void skip_spaces (struct vm_io *io);
+static int read_bytes (struct vm_io *io, void *data, const size_t len);
+static int write_bytes (struct vm_io *io, const void *data, const size_t len);
+static int read_number (struct vm_io *io, int64_t *val);
+static int read_double (struct vm_io *io, double *val);
+static size_t format_int (char *text, const int64_t val);
+static int write_text (struct vm_io *io, const char *prefix, const int type, const int64_t val);
+static void print_value (FILE *file, const char *prefix, const int type, const int64_t val);
+
+int io_open (struct vm_io *io, const enum io_mode mode, const int in_fd, const bool capture)
+{
+	*io = {};
+	io->mode = mode;
+	io->in_fd = in_fd;
+	io->capture = capture;
+	if (mode == IO_STDIO) {
+		if (in_fd != STDIN_FILENO || capture) {
+			fprintf (stderr, "Processor: stdio mode reads stdin and writes stdout only\n");
+			return 1;
+		}
+		return 0;
+	}
+
+	io->in_buf = (char *) malloc (IO_BUF_SIZE);
+	io->out_buf = (char *) malloc (IO_BUF_SIZE);
+	if (!io->in_buf || !io->out_buf) {
+		fprintf (stderr, "Processor: can't allocate I/O buffers\n");
+		return 1;
+	}
+	return 0;
+}
+
+void io_close (struct vm_io *io)
+{
+	io_flush (io);
+	free (io->in_buf);
+	free (io->out_buf);
+	free (io->captured);
+	*io = {};
+}
+
+int io_flush (struct vm_io *io)
+{
+	size_t done = 0;
+	ssize_t len = 0;
+
+	if (io->mode == IO_STDIO)
+		return (fflush (stdout)) ? 1 : 0;
+	if (io->capture)
+		return capture_output (io);
+
+	while (done < io->out_len) {
+		len = write (STDOUT_FILENO, io->out_buf + done, io->out_len - done);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len <= 0) {
+			fprintf (stderr, "Processor: can't write output: %s\n", strerror (errno));
+			io->out_len = 0;
+			return 1;
+		}
+		done += (size_t) len;
+	}
+	io->out_len = 0;
+	return 0;
+}
+
+/* Hands the captured output over to the caller, who frees it. */
+char *io_take_output (struct vm_io *io, size_t *len)
+{
+	char *text = io->captured;
+
+	*len = io->captured_len;
+	io->captured = NULL;
+	io->captured_len = io->captured_cap = 0;
+	return text;
+}
+
+/*
+ * Untyped values are 32-bit: text input wraps around like scanf ("%d")
+ * does, binary input takes 4 bytes.
+ */
+int io_read (struct vm_io *io, const int type, int64_t *val)
+{
+	int32_t num = 0;
+	double dval = 0;
+
+	switch (io->mode) {
+		case IO_STDIO:
+			if (type == TYPE_DOUBLE) {
+				if (scanf ("%lf", &dval) <= 0)
+					return 1;
+				memcpy (val, &dval, sizeof (dval));
+				return 0;
+			}
+			if (type == TYPE_INT64)
+				return (scanf ("%" SCNd64, val) <= 0) ? 1 : 0;
+			if (scanf ("%" SCNd32, &num) <= 0)
+				return 1;
+			*val = num;
+			return 0;
+		case IO_TEXT:
+			if (type == TYPE_DOUBLE) {
+				if (read_double (io, &dval))
+					return 1;
+				memcpy (val, &dval, sizeof (dval));
+				return 0;
+			}
+			if (read_number (io, val))
+				return 1;
+			if (type == TYPE_INT)
+				*val = (int32_t) (uint32_t) *val;
+			return 0;
+		case IO_BINARY:
+			if (type != TYPE_INT)
+				return read_bytes (io, val, sizeof (*val));
+			if (read_bytes (io, &num, sizeof (num)))
+				return 1;
+			*val = num;
+			return 0;
+		default:
+			return 1;
+	}
+}
+
+int io_write (struct vm_io *io, const int type, const int64_t val)
+{
+	const int32_t num = (int32_t) val;
+
+	switch (io->mode) {
+		case IO_STDIO:
+		case IO_TEXT:
+			return write_text (io, "out: ", type, val);
+		case IO_BINARY:
+			if (type != TYPE_INT)
+				return write_bytes (io, &val, sizeof (val));
+			return write_bytes (io, &num, sizeof (num));
+		default:
+			return 1;
+	}
+}
+
+/*
+ * pop without an operand prints the value, the binary stream only takes
+ * the values of out, so there it goes to stderr.
+ */
+int io_print_pop (struct vm_io *io, const int type, const int64_t val)
+{
+	if (io->mode == IO_BINARY) {
+		print_value (stderr, "Stack returned ", type, val);
+		return 0;
+	}
+	return write_text (io, "Stack returned ", type, val);
+}
+
+int io_read_block (struct vm_io *io, const int type, int64_t *dst, const size_t n)
+{
+	if (io->mode == IO_BINARY && type != TYPE_INT)
+		return read_bytes (io, dst, n * sizeof (*dst));
+
+	for (size_t i = 0; i < n; i++)
+		if (io_read (io, type, dst + i))
+			return 1;
+	return 0;
+}
+
+int io_write_block (struct vm_io *io, const int type, const int64_t *src, const size_t n)
+{
+	if (io->mode == IO_BINARY && type != TYPE_INT)
+		return write_bytes (io, src, n * sizeof (*src));
+
+	for (size_t i = 0; i < n; i++)
+		if (io_write (io, type, src[i]))
+			return 1;
+	return 0;
+}
+
+static int capture_output (struct vm_io *io)
+{
+	size_t cap = io->captured_cap;
+	char *text = NULL;
+
+	if (!io->out_len)
+		return 0;
+	if (io->captured_len + io->out_len > cap) {
+		while (io->captured_len + io->out_len > cap)
+			cap = (cap) ? cap * 2 : IO_BUF_SIZE;
+		text = (char *) realloc (io->captured, cap);
+		if (!text) {
+			fprintf (stderr, "Processor: can't keep %zu bytes of output\n", cap);
+			io->out_len = 0;
+			return 1;
+		}
+		io->captured = text;
+		io->captured_cap = cap;
+	}
+
+	memcpy (io->captured + io->captured_len, io->out_buf, io->out_len);
+	io->captured_len += io->out_len;
+	io->out_len = 0;
+	return 0;
+}
+
+/* Output written so far goes out before we wait for input. */
+static int fill_input (struct vm_io *io)
+{
+	ssize_t len = 0;
+
+	if (io_flush (io))
+		return 1;
+
+	do
+		len = read (io->in_fd, io->in_buf, IO_BUF_SIZE);
+	while (len < 0 && errno == EINTR);
+	if (len <= 0)
+		return 1;
+
+	io->in_pos = 0;
+	io->in_len = (size_t) len;
+	return 0;
+}
+
+/* Returns the next input character without taking it, -1 at the end. */
+static int peek_char (struct vm_io *io)
+{
+	if (io->in_pos == io->in_len && fill_input (io))
+		return -1;
+	return (unsigned char) io->in_buf[io->in_pos];
+}
+
+static void skip_spaces (struct vm_io *io)
+{
+	int c = 0;
+
+	while ((c = peek_char (io)) == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' || c == '\f')
+		io->in_pos++;
+}
+
+static int read_bytes (struct vm_io *io, void *data, const size_t len)
+{
+	char *dst = (char *) data;
+	size_t done = 0, part = 0;
+
+	while (done < len) {
+		if (io->in_pos == io->in_len && fill_input (io))
+			return 1;
+		part = io->in_len - io->in_pos;
+		if (part > len - done)
+			part = len - done;
+		memcpy (dst + done, io->in_buf + io->in_pos, part);
+		io->in_pos += part;
+		done += part;
+	}
+
+	return 0;
+}
+
+static int write_bytes (struct vm_io *io, const void *data, const size_t len)
+{
+	const char *src = (const char *) data;
+	size_t done = 0, part = 0;
+
+	while (done < len) {
+		if (io->out_len == IO_BUF_SIZE && io_flush (io))
+			return 1;
+		part = IO_BUF_SIZE - io->out_len;
+		if (part > len - done)
+			part = len - done;
+		memcpy (io->out_buf + io->out_len, src + done, part);
+		io->out_len += part;
+		done += part;
+	}
+
+	return 0;
+}
+
+static int read_number (struct vm_io *io, int64_t *val)
+{
+	uint64_t num = 0, limit = INT64_MAX;
+	bool neg = false, digits = false;
+	int c = 0;
+
+	skip_spaces (io);
+	c = peek_char (io);
+	if (c == '-' || c == '+') {
+		neg = (c == '-');
+		io->in_pos++;
+	}
+	if (neg)
+		limit++;
+
+	while ((c = peek_char (io)) >= '0' && c <= '9') {
+		if (num > (limit - (uint64_t) (c - '0')) / 10)
+			return 1;
+		num = num * 10 + (uint64_t) (c - '0');
+		digits = true;
+		io->in_pos++;
+	}
+	if (!digits)
+		return 1;
+
+	*val = (int64_t) ((neg) ? 0 - num : num);
+	return 0;
+}
+
+static int read_double (struct vm_io *io, double *val)
+{
+	char text[MAX_TEXT_LEN + 1];
+	char *end = NULL;
+	size_t len = 0;
+	int c = 0;
+
+	skip_spaces (io);
+	while ((c = peek_char (io)) >= 0 && c != ' ' && c != '\n' && c != '\t' && c != '\r') {
+		if (len == MAX_TEXT_LEN)
+			return 1;
+		text[len++] = (char) c;
+		io->in_pos++;
+	}
+	text[len] = '\0';
+
+	*val = strtod (text, &end);
+	return (!len || *end) ? 1 : 0;
+}
+
+/* Writes val in decimal and returns its length. */
+static size_t format_int (char *text, const int64_t val)
+{
+	char digits[24];
+	uint64_t num = (val < 0) ? 0 - (uint64_t) val : (uint64_t) val;
+	size_t len = 0, n = 0;
+
+	do {
+		digits[n++] = (char) ('0' + num % 10);
+		num /= 10;
+	} while (num);
+
+	if (val < 0)
+		text[len++] = '-';
+	while (n)
+		text[len++] = digits[--n];
+	return len;
+}
+
+static int write_text (struct vm_io *io, const char *prefix, const int type, const int64_t val)
+{
+	char text[MAX_TEXT_LEN];
+	size_t len = strlen (prefix);
+	double dval = 0;
+
+	if (io->mode == IO_STDIO) {
+		print_value (stdout, prefix, type, val);
+		return 0;
+	}
+
+	memcpy (text, prefix, len);
+	if (type == TYPE_DOUBLE) {
+		memcpy (&dval, &val, sizeof (dval));
+		len += (size_t) snprintf (text + len, sizeof (text) - len - 1, "%g", dval);
+	} else {
+		len += format_int (text + len, (type == TYPE_INT64) ? val : (int32_t) val);
+	}
+	text[len++] = '\n';
+
+	return write_bytes (io, text, len);
+}
+
+static void print_value (FILE *file, const char *prefix, const int type, const int64_t val)
+{
+	double dval = 0;
+
+	memcpy (&dval, &val, sizeof (dval));
+	if (type == TYPE_DOUBLE)
+		fprintf (file, "%s%g\n", prefix, dval);
+	else if (type == TYPE_INT64)
+		fprintf (file, "%s%" PRId64 "\n", prefix, val);
+	else
+		fprintf (file, "%s%d\n", prefix, (int32_t) val);
+}
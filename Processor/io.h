@@ -0,0 +1,51 @@
+#ifndef IO_H
+#define IO_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define IO_BUF_SIZE (1 << 16)
+
+/*
+ * IO_STDIO goes through scanf and printf.  IO_TEXT reads and writes the
+ * same text through buffers of its own, IO_BINARY reads and writes raw
+ * values in host byte order: 4 bytes for untyped ones, 8 for .q and .d.
+ */
+enum io_mode
+{
+	IO_STDIO,
+	IO_TEXT,
+	IO_BINARY
+};
+
+/*
+ * Input is read from in_fd.  With capture set the output is kept in
+ * captured instead of going to stdout, the buffered modes only.
+ */
+struct vm_io
+{
+	enum io_mode mode = IO_STDIO;
+	int in_fd = 0;
+	bool capture = false;
+	char *in_buf = NULL;
+	size_t in_pos = 0;
+	size_t in_len = 0;
+	char *out_buf = NULL;
+	size_t out_len = 0;
+	char *captured = NULL;
+	size_t captured_len = 0;
+	size_t captured_cap = 0;
+};
+
+int io_open (struct vm_io *io, const enum io_mode mode, const int in_fd, const bool capture);
+void io_close (struct vm_io *io);
+int io_flush (struct vm_io *io);
+char *io_take_output (struct vm_io *io, size_t *len);
+
+int io_read (struct vm_io *io, const int type, int64_t *val);
+int io_write (struct vm_io *io, const int type, const int64_t val);
+int io_print_pop (struct vm_io *io, const int type, const int64_t val);
+int io_read_block (struct vm_io *io, const int type, int64_t *dst, const size_t n);
+int io_write_block (struct vm_io *io, const int type, const int64_t *src, const size_t n);
+
+#endif // IO_H
@@ -0,0 +1,24 @@
+#ifndef KMVM_H
+#define KMVM_H
+
+/*
+ * libkmvm: the VM for programs that embed it.  Every VM keeps all of its
+ * state in struct vm, so a process can have any number of them:
+ *
+ *	vm = vm_create (&config);
+ *	load_byte_code (&file, name, false);
+ *	vm_load (vm, file.code, file.code_len, file.flags);
+ *	while ((status = vm_run (vm, budget)) == VM_SUSPENDED)
+ *		...
+ *	vm_destroy (vm);
+ *
+ * vm_snapshot and vm_restore save a VM to a file and start another one
+ * from it, config.engine picks the stack or the register engine.  The
+ * library is built with the flags of the processor.
+ */
+
+#include "vm.h"
+#include "loader.h"
+#include "snapshot.h"
+
+#endif // KMVM_H
@@ -0,0 +1,297 @@
+#include "lexer.h"
+#include "processor.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define CMD_TABLE_SIZE 64
+#define MAX_NUMBER_LEN 64
+
+struct mnemonic
+{
+	const char *name;
+	char cmd;
+};
+
+static const struct mnemonic mnemonics[] =
+{
+	{"hlt",  CMD_HLT},
+	{"push", CMD_PUSH},
+	{"pop",  CMD_POP},
+	{"add",  CMD_ADD},
+	{"sub",  CMD_SUB},
+	{"mul",  CMD_MUL},
+	{"div",  CMD_DIV},
+	{"in",   CMD_IN},
+	{"out",  CMD_OUT},
+	{"jmp",  CMD_JMP},
+	{"ja",   CMD_JA},
+	{"jae",  CMD_JAE},
+	{"jb",   CMD_JB},
+	{"jbe",  CMD_JBE},
+	{"je",   CMD_JE},
+	{"jne",  CMD_JNE},
+	{"call", CMD_CALL},
+	{"ret",  CMD_RET},
+	{"vadd", (char) (CMD_VEC | (VEC_ADD << 5))},
+	{"vmul", (char) (CMD_VEC | (VEC_MUL << 5))},
+	{"vsum", (char) (CMD_VEC | (VEC_SUM << 5))},
+	{"vdot", (char) (CMD_VEC | (VEC_DOT << 5))},
+	{"vfill", (char) (CMD_VEC | (VEC_FILL << 5))},
+	{"vin",  (char) (CMD_VEC | (VEC_IN << 5))},
+	{"vout", (char) (CMD_VEC | (VEC_OUT << 5))},
+	{"spawn", (char) (CMD_TASK | (TASK_SPAWN << 5))},
+	{"yield", (char) (CMD_TASK | (TASK_YIELD << 5))},
+	{"join", (char) (CMD_TASK | (TASK_JOIN << 5))},
+	{"chan", (char) (CMD_TASK | (TASK_CHAN << 5))},
+	{"send", (char) (CMD_TASK | (TASK_SEND << 5))},
+	{"recv", (char) (CMD_TASK | (TASK_RECV << 5))}
+};
+
+static const struct mnemonic *cmd_table[CMD_TABLE_SIZE] = {};
+static bool cmd_table_ready = false;
+
+static int init_cmd_table (void);
+static const char *scan_token (const char *cur, const char *end, struct token *tok);
+static const char *scan_number (const char *cur, const char *end, struct token *tok);
+
+/*
+ * Perfect hash over the mnemonics above: every mnemonic is at least
+ * two characters long and gets its own slot, init_cmd_table () checks it.
+ */
+static inline unsigned cmd_hash (const char *str, const size_t len)
+{
+	return ((unsigned) len + 5u * (unsigned char) str[0] + 29u * (unsigned char) str[1] +
+		15u * (unsigned char) str[len - 1]) & (CMD_TABLE_SIZE - 1);
+}
+
+static int init_cmd_table (void)
+{
+	for (size_t i = 0; i < sizeof (mnemonics) / sizeof (mnemonics[0]); i++) {
+		unsigned h = cmd_hash (mnemonics[i].name, strlen (mnemonics[i].name));
+		if (cmd_table[h]) {
+			fprintf (stderr, "init_cmd_table () error: mnemonics %s and %s collide\n",
+				 cmd_table[h]->name, mnemonics[i].name);
+			return 1;
+		}
+		cmd_table[h] = mnemonics + i;
+	}
+	cmd_table_ready = true;
+	return 0;
+}
+
+int lexer_find_cmd (const char *str, const size_t len)
+{
+	assert (str);
+	const struct mnemonic *m = NULL;
+
+	if (len < 2)
+		return -1;
+	m = cmd_table[cmd_hash (str, len)];
+	if (m && !strncmp (m->name, str, len) && m->name[len] == '\0')
+		return (unsigned char) m->cmd;
+	return -1;
+}
+
+int lexer_find_reg (const char *str, const size_t len)
+{
+	assert (str);
+
+	if (len == 2 && str[1] == 'x' && str[0] >= 'a' && str[0] <= 'd')
+		return str[0] - 'a';
+	return -1;
+}
+
+int lexer_open (struct lexer *lex, const char *file_name)
+{
+	assert (lex);
+	assert (file_name);
+	struct stat st = {};
+	void *map = NULL;
+	int fd = -1;
+
+	if (!cmd_table_ready && init_cmd_table ())
+		return 1;
+
+	fd = open (file_name, O_RDONLY);
+	if (fd < 0) {
+		fprintf (stderr, "Can't open file %s\n", file_name);
+		return 1;
+	}
+
+	if (fstat (fd, &st) < 0) {
+		fprintf (stderr, "Stat syscall failed\n");
+		close (fd);
+		return 1;
+	}
+
+	lex->size = (size_t) st.st_size;
+	if (lex->size) {
+		map = mmap (NULL, lex->size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			fprintf (stderr, "Can't map file %s\n", file_name);
+			close (fd);
+			return 1;
+		}
+		madvise (map, lex->size, MADV_SEQUENTIAL);
+	}
+	close (fd);
+
+	lex->file_name = file_name;
+	lex->map = map;
+	lex->begin = lex->cur = (const char *) map;
+	lex->end = lex->begin + lex->size;
+	lex->line = 1;
+	return 0;
+}
+
+void lexer_close (struct lexer *lex)
+{
+	assert (lex);
+
+	if (lex->map)
+		munmap (lex->map, lex->size);
+	lex->map = NULL;
+	lex->begin = lex->end = lex->cur = NULL;
+	lex->size = 0;
+}
+
+void lexer_next (struct lexer *lex, struct token *tok)
+{
+	assert (lex);
+	assert (tok);
+
+	lex->cur = scan_token (lex->cur, lex->end, tok);
+	if (tok->type == TOK_NEWLINE)
+		lex->line++;
+}
+
+void lexer_peek (const struct lexer *lex, struct token *tok)
+{
+	assert (lex);
+	assert (tok);
+
+	scan_token (lex->cur, lex->end, tok);
+}
+
+static inline bool is_ident_char (const char c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+	       (c >= '0' && c <= '9') || c == '_';
+}
+
+static const char *scan_token (const char *cur, const char *end, struct token *tok)
+{
+	while (cur < end && (*cur == ' ' || *cur == '\t' || *cur == '\r'))
+		cur++;
+	if (cur < end && *cur == ';')
+		while (cur < end && *cur != '\n')
+			cur++;
+
+	tok->str = cur;
+	tok->len = 1;
+	tok->num = 0;
+
+	if (cur == end) {
+		tok->type = TOK_EOF;
+		tok->len = 0;
+		return cur;
+	}
+
+	switch (*cur) {
+		case '\n':
+			tok->type = TOK_NEWLINE;
+			return cur + 1;
+		case '[':
+			tok->type = TOK_LBRACKET;
+			return cur + 1;
+		case ']':
+			tok->type = TOK_RBRACKET;
+			return cur + 1;
+		case '+':
+			tok->type = TOK_PLUS;
+			return cur + 1;
+		case ',':
+			tok->type = TOK_COMMA;
+			return cur + 1;
+		case ':':
+			tok->type = TOK_COLON;
+			return cur + 1;
+		default:
+			break;
+	}
+
+	if ((*cur >= 'a' && *cur <= 'z') || (*cur >= 'A' && *cur <= 'Z') || *cur == '_') {
+		const char *start = cur;
+		while (cur < end && (is_ident_char (*cur) || *cur == '.'))
+			cur++;
+		tok->type = TOK_IDENT;
+		tok->len = (size_t) (cur - start);
+		return cur;
+	}
+
+	if ((*cur >= '0' && *cur <= '9') ||
+	    (*cur == '-' && cur + 1 < end && cur[1] >= '0' && cur[1] <= '9'))
+		return scan_number (cur, end, tok);
+
+	tok->type = TOK_ERROR;
+	return cur + 1;
+}
+
+/*
+ * Integers are 64-bit, a number with '.' or an exponent is a TOK_FLOAT.
+ */
+static const char *scan_number (const char *cur, const char *end, struct token *tok)
+{
+	char buf[MAX_NUMBER_LEN + 1] = "";
+	const char *start = cur;
+	unsigned long long num = 0, limit = (unsigned long long) INT64_MAX;
+	bool neg = false, is_float = false;
+	char *buf_end = NULL;
+
+	if (*cur == '-') {
+		neg = true;
+		limit++;
+		cur++;
+	}
+	while (cur < end && *cur >= '0' && *cur <= '9') {
+		if (num > (limit - (unsigned long long) (*cur - '0')) / 10)
+			is_float = true;
+		num = num * 10 + (unsigned long long) (*cur - '0');
+		cur++;
+	}
+	if (cur < end && (*cur == '.' || *cur == 'e' || *cur == 'E'))
+		is_float = true;
+	while (is_float && cur < end && ((*cur >= '0' && *cur <= '9') || *cur == '.' ||
+	       *cur == 'e' || *cur == 'E' || ((*cur == '-' || *cur == '+') && (cur[-1] == 'e' || cur[-1] == 'E'))))
+		cur++;
+
+	tok->len = (size_t) (cur - start);
+	if ((cur < end && is_ident_char (*cur)) || tok->len > MAX_NUMBER_LEN) {
+		tok->type = TOK_ERROR;
+		return cur;
+	}
+
+	if (!is_float) {
+		tok->type = TOK_NUMBER;
+		tok->num = neg ? (int64_t) (0 - num) : (int64_t) num;
+		tok->fnum = (double) tok->num;
+		return cur;
+	}
+
+	memcpy (buf, start, tok->len);
+	tok->fnum = strtod (buf, &buf_end);
+	if (buf_end != buf + tok->len) {
+		tok->type = TOK_ERROR;
+		return cur;
+	}
+	tok->type = TOK_FLOAT;
+	return cur;
+}
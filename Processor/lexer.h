@@ -0,0 +1,51 @@
+#ifndef LEXER_H
+#define LEXER_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+enum token_type
+{
+	TOK_EOF,
+	TOK_NEWLINE,
+	TOK_IDENT,
+	TOK_NUMBER,
+	TOK_FLOAT,
+	TOK_LBRACKET,
+	TOK_RBRACKET,
+	TOK_PLUS,
+	TOK_COMMA,
+	TOK_COLON,
+	TOK_ERROR
+};
+
+struct token
+{
+	enum token_type type = TOK_EOF;
+	const char *str = NULL;
+	size_t len = 0;
+	int64_t num = 0;
+	double fnum = 0;
+};
+
+struct lexer
+{
+	const char *file_name = NULL;
+	void *map = NULL;
+	const char *begin = NULL;
+	const char *end = NULL;
+	const char *cur = NULL;
+	size_t size = 0;
+	int line = 1;
+};
+
+int lexer_open (struct lexer *lex, const char *file_name);
+void lexer_close (struct lexer *lex);
+
+void lexer_next (struct lexer *lex, struct token *tok);
+void lexer_peek (const struct lexer *lex, struct token *tok);
+
+int lexer_find_cmd (const char *str, const size_t len);
+int lexer_find_reg (const char *str, const size_t len);
+
+#endif // LEXER_H
@@ -0,0 +1,178 @@
+#include "processor.h"
+#include "loader.h"
+#include "symtab.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int link_object (const struct byte_code_file *obj, const size_t base);
+static int check_relocs (const struct byte_code_file *obj, const char *file_name);
+
+struct symtab labels = {};
+
+/*
+ * Joins objects of compiler -c into byte code: their code follows in the
+ * order of the command line, so the first one is entered, and every label
+ * may be defined by one object only.
+ */
+int main (int argc, char *argv[])
+{
+	struct byte_code_file *objs = NULL;
+	struct section_buf sections[SECT_NUM] = {};
+	char *code = NULL, *lines = NULL, *symbols = NULL;
+	size_t *base = NULL;
+	size_t code_len = 0, lines_len = 0, symbols_len = 0, num = 0;
+	uint64_t source_hash = 0;
+	FILE *output = NULL;
+	int res = 1;
+
+	if (argc < 3) {
+		fprintf (stderr, "Usage: %s output object...\n", argv[0]);
+		return 1;
+	}
+	num = (size_t) (argc - 2);
+
+	objs = (struct byte_code_file *) calloc (num, sizeof (struct byte_code_file));
+	base = (size_t *) calloc (num, sizeof (size_t));
+	if (!objs || !base || symtab_ctor (&labels)) {
+		fprintf (stderr, "Linker: can't allocate memory for %zu objects\n", num);
+		goto out;
+	}
+
+	for (size_t i = 0; i < num; i++) {
+		const char *name = argv[i + 2];
+
+		if (load_byte_code (&objs[i], name, true))
+			goto out;
+		if (objs[i].version != 5 || !(objs[i].flags & FILE_OBJECT) || check_relocs (&objs[i], name)) {
+			fprintf (stderr, "Linker: %s is not an object of compiler -c\n", name);
+			goto out;
+		}
+		base[i] = code_len;
+		code_len += objs[i].code_len;
+		lines_len += objs[i].sections_len[SECT_LINES];
+		source_hash = hash64 (&objs[i].source_hash, sizeof (objs[i].source_hash), source_hash);
+	}
+	if (code_len >= INT32_MAX) {
+		fprintf (stderr, "Linker: code is too big\n");
+		goto out;
+	}
+
+	code = (char *) malloc (code_len + 1);
+	lines = (char *) malloc (lines_len + 1);
+	if (!code || !lines) {
+		fprintf (stderr, "Linker: can't allocate memory for %zu bytes of code\n", code_len);
+		goto out;
+	}
+
+	lines_len = 0;
+	for (size_t i = 0; i < num; i++) {
+		const char *obj_lines = objs[i].sections[SECT_LINES];
+		struct line_entry entry = {};
+
+		memcpy (code + base[i], objs[i].code, objs[i].code_len);
+		for (size_t pos = 0; pos + sizeof (entry) <= objs[i].sections_len[SECT_LINES]; pos += sizeof (entry)) {
+			memcpy (&entry, obj_lines + pos, sizeof (entry));
+			entry.pc += (uint32_t) base[i];
+			memcpy (lines + lines_len, &entry, sizeof (entry));
+			lines_len += sizeof (entry);
+		}
+		if (link_object (&objs[i], base[i]))
+			goto out;
+	}
+
+	if (symtab_resolve (&labels, code)) {
+		fprintf (stderr, "Linker: failed to resolve labels\n");
+		goto out;
+	}
+	symbols = symtab_serialize (&labels, &symbols_len, false);
+	if (!symbols)
+		goto out;
+
+	sections[SECT_CODE].data = code;
+	sections[SECT_CODE].len = code_len;
+	sections[SECT_SYMBOLS].data = symbols;
+	sections[SECT_SYMBOLS].len = symbols_len;
+	sections[SECT_LINES].data = lines;
+	sections[SECT_LINES].len = lines_len;
+
+	output = fopen (argv[1], "w");
+	if (!output) {
+		fprintf (stderr, "Can't open file %s\n", argv[1]);
+		goto out;
+	}
+	if (write_byte_code (output, sections, source_hash, 0) || fclose (output)) {
+		fprintf (stderr, "Failed to write byte_code to %s\n", argv[1]);
+		output = NULL;
+		goto out;
+	}
+	output = NULL;
+	res = 0;
+
+out:
+	if (output)
+		fclose (output);
+	free (symbols);
+	free (lines);
+	free (code);
+	for (size_t i = 0; objs && i < num; i++)
+		unload_byte_code (&objs[i]);
+	free (objs);
+	free (base);
+	symtab_dtor (&labels);
+	return res;
+}
+
+/*
+ * Defines the labels of obj at base and turns its relocations into
+ * fixups, symtab_resolve () patches them once every object is in.
+ */
+static int link_object (const struct byte_code_file *obj, const size_t base)
+{
+	const struct reloc_entry *relocs = (const struct reloc_entry *) obj->sections[SECT_RELOCS];
+	const size_t relocs_num = obj->sections_len[SECT_RELOCS] / sizeof (struct reloc_entry);
+	const char *name = NULL;
+	int sym = 0;
+
+	for (uint32_t i = 0; i < obj->symbols_num; i++) {
+		name = obj->names + obj->symbols[i].name;
+		sym = symtab_lookup (&labels, name, strlen (name));
+		if (sym < 0 || (obj->symbols[i].shift >= 0 &&
+		                symtab_define (&labels, sym, (int) base + obj->symbols[i].shift)))
+			return 1;
+	}
+
+	for (size_t i = 0; i < relocs_num; i++) {
+		name = obj->names + relocs[i].name;
+		sym = symtab_lookup (&labels, name, strlen (name));
+		if (sym < 0 || symtab_add_fixup (&labels, sym, base + relocs[i].pos))
+			return 1;
+	}
+
+	return 0;
+}
+
+static int check_relocs (const struct byte_code_file *obj, const char *file_name)
+{
+	const struct reloc_entry *relocs = (const struct reloc_entry *) obj->sections[SECT_RELOCS];
+	const size_t len = obj->sections_len[SECT_RELOCS];
+
+	if (len % sizeof (struct reloc_entry)) {
+		fprintf (stderr, "Linker: relocations of %s are corrupted\n", file_name);
+		return 1;
+	}
+	for (size_t i = 0; i < len / sizeof (struct reloc_entry); i++)
+		if (relocs[i].name >= obj->names_len || obj->code_len < sizeof (int32_t) ||
+		    relocs[i].pos > obj->code_len - sizeof (int32_t)) {
+			fprintf (stderr, "Linker: relocation %zu of %s is corrupted\n", i, file_name);
+			return 1;
+		}
+	for (uint32_t i = 0; i < obj->symbols_num; i++)
+		if (obj->symbols[i].name >= obj->names_len || obj->symbols[i].shift > (int) obj->code_len) {
+			fprintf (stderr, "Linker: symbol %u of %s is corrupted\n", i, file_name);
+			return 1;
+		}
+
+	return 0;
+}
@@ -1,280 +1,275 @@
 #include "processor.h"
+#include "loader.h"
+#include "opcodes.h"
 
 #include <stdio.h>
-#include <string.h>
-#include <sys/stat.h>
-#include <sys/types.h>
-#include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
 
+#define HOT_SPOTS_NUM 10
+#define TEXT_MAX 1024
+
+/* Profile written by processor --profile, indexed by byte code offset */
+struct profile_data
+{
+	uint64_t *count = NULL;
+	uint64_t *ticks = NULL;
+	uint64_t *calls = NULL;
+	uint64_t *call_ticks = NULL;
+	uint64_t total = 0;
+	uint64_t total_ticks = 0;
+	char clock[16] = "";
+};
 
 static void print_listing (FILE *file,
-			   const size_t pc,
-			   const char cmd,
-			   const bool mem,
-			   const char *reg_num,
-			   const int *arg_ptr,
-			   const char *cmd_str);
+			   const char *byte_code,
+			   const struct decoded_cmd *dc,
+			   const char *text);
+static void print_fused_listing (FILE *file,
+				 const char *byte_code,
+				 const struct decoded_cmd *dc,
+				 const char *text);
+static int load_profile (struct profile_data *prof, const char *file_name, const size_t len);
+static void free_profile (struct profile_data *prof);
+static void print_hot_spots (FILE *file, const struct profile_data *prof,
+			     const struct byte_code_file *input);
+static void print_profile_column (FILE *file, const struct profile_data *prof, const size_t pc);
 
 int main (int argc, char *argv[])
 {
-	FILE *input = NULL, *output = NULL;
-	int arg = 0;
-	char cmd = 0, reg_num = 0;
-	char *byte_code = NULL, *reg_name = NULL;
-	size_t byte_code_len = 0, pc = 0, prev_pc = 0;
-	struct stat st = {};
-	int sign_and_ver_len = 0;
-	bool imm = false, reg = false, mem = false;
-
-	if (argc != 3) {
-		fprintf (stderr, "Usage: %s input output\n", argv[0]);
+	struct byte_code_file input = {};
+	struct profile_data prof = {};
+	struct decoded_cmd dc = {};
+	FILE *output = NULL;
+	const char *byte_code = NULL;
+	char text[TEXT_MAX];
+	size_t byte_code_len = 0, pc = 0;
+	uint32_t sym = 0;
+	int res = 1;
+
+	if (argc != 3 && argc != 4) {
+		fprintf (stderr, "Usage: %s input output [profile]\n", argv[0]);
 		return 1;
 	}
 
-	input = fopen (argv[1], "r");
-	if (!input) {
-		fprintf (stderr, "Can't open file %s\n", argv[1]);
+	if (load_byte_code (&input, argv[1], true))
+		return 2;
+	byte_code = input.code;
+	byte_code_len = input.code_len;
+
+	if (argc == 4 && load_profile (&prof, argv[3], byte_code_len)) {
+		unload_byte_code (&input);
 		return 2;
 	}
 
 	output = fopen (argv[2], "w");
 	if (!output) {
 		fprintf (stderr, "Can't open file %s\n", argv[2]);
-		fclose (input);
+		unload_byte_code (&input);
+		free_profile (&prof);
 		return 3;
 	}
 
-	if (stat (argv[1], &st) < 0) {
-		fprintf (stderr, "Stat syscall failed\n");
-		fclose (input);
-		fclose (output);
-		return 1;
+	if (prof.count)
+		print_hot_spots (output, &prof, &input);
+
+	while (pc < byte_code_len) {
+		for (; sym < input.symbols_num && input.symbols[sym].shift <= (int) pc; sym++) {
+			if (input.symbols[sym].shift != (int) pc)
+				continue;
+			fprintf (output, "%s:", find_label (&input, (int) pc));
+			if (prof.calls && prof.calls[pc])
+				fprintf (output, "\t; %" PRIu64 " calls, %" PRIu64 " %s ticks inclusive",
+					 prof.calls[pc], prof.call_ticks[pc], prof.clock);
+			fprintf (output, "\n");
+		}
+		if (prof.count)
+			print_profile_column (output, &prof, pc);
+
+		if (decode_cmd (byte_code, byte_code_len, &pc, input.flags, &dc)) {
+			fprintf (stderr, "Listing: malformed command 0x%02x at %zu\n",
+				 (unsigned char) byte_code[pc], pc);
+			goto out;
+		}
+		if (format_cmd (text, sizeof (text), &input, &dc, "; ", true) < 0) {
+			fprintf (stderr, "Listing: text of the command at %zu is too long\n", dc.pc);
+			goto out;
+		}
+
+		/* Fused, typed, vector and task commands show their bytes as they go */
+		if (dc.type == TYPE_INT && (dc.desc->cmd & CMD) <= CMD_RET)
+			print_listing (output, byte_code, &dc, text);
+		else
+			print_fused_listing (output, byte_code, &dc, text);
+	}
+	res = 0;
+
+out:
+	unload_byte_code (&input);
+	free_profile (&prof);
+	fclose (output);
+	return res;
+}
+
+/*
+ * Mode byte, then the operand bytes and the register byte in columns, in
+ * brackets if they make a RAM address.
+ */
+static void print_listing (FILE *file,
+			   const char *byte_code,
+			   const struct decoded_cmd *dc,
+			   const char *text)
+{
+	const bool mem = (dc->desc->flags & OPC_MEM);
+	char arg_print_arr[16] = "";
+	char reg_print_arr[3] = "  ";
+	size_t arg_len = dc->len - 1 - ((dc->regs_num) ? 1 : 0), arg_pos = 0;
+
+	if (!file) {
+		fprintf (stderr, "print_listing () error: file was not opened\n");
+		return ;
 	}
 
-	byte_code_len = (size_t) st.st_size;
+	/* The operand as it is encoded, 4 bytes or a varint of up to 5 */
+	for (size_t i = 0; i < arg_len && arg_pos + 4 <= sizeof (arg_print_arr); i++)
+		arg_pos += (size_t) sprintf (arg_print_arr + arg_pos, (i) ? " %02x" : "%02x",
+					    (unsigned char) byte_code[dc->pc + 1 + i]);
+	if (dc->regs_num)
+		sprintf (reg_print_arr, "%02x", (unsigned int) dc->regs[0]);
 
-	if ((sign_and_ver_len = check_sign_and_ver (input)) < 0) {
-		fprintf (stderr, "Input file type verification failed\n");
-		fclose (input);
-		fclose (output);
-		return 1;
+	fprintf (file, "%04lx  %02x  %c %-11s   %s %c   %s\n",
+		dc->pc,
+		(unsigned char) byte_code[dc->pc],
+		(mem) ? '[' : ' ',
+		arg_print_arr,
+		reg_print_arr,
+		(mem) ? ']' : ' ',
+		text);
+
+	return ;
+}
+
+static void print_fused_listing (FILE *file,
+				 const char *byte_code,
+				 const struct decoded_cmd *dc,
+				 const char *text)
+{
+	if (!file) {
+		fprintf (stderr, "print_fused_listing () error: file was not opened\n");
+		return ;
 	}
 
-	byte_code_len -= (size_t) sign_and_ver_len;
+	fprintf (file, "%04lx  %02x ", dc->pc, (unsigned char) byte_code[dc->pc]);
+	for (size_t i = 1; i < dc->len; i++)
+		fprintf (file, " %02x", (unsigned char) byte_code[dc->pc + i]);
+	fprintf (file, "   %s\n", text);
 
-	byte_code = (char *) calloc (byte_code_len, sizeof (char));
-	if (!byte_code) {
-		fprintf (stderr, "Can't allocate memory\n");
-		fclose (input);
-		fclose (output);
+	return ;
+}
+
+/*
+ * Records of unknown kinds are skipped, so are offsets out of the byte
+ * code: the profile may come from another build of the program.
+ */
+static int load_profile (struct profile_data *prof, const char *file_name, const size_t len)
+{
+	FILE *file = fopen (file_name, "r");
+	char line[256], kind[16];
+	unsigned long long pc = 0, count = 0, ticks = 0;
+
+	if (!file) {
+		fprintf (stderr, "Can't open file %s\n", file_name);
 		return 1;
 	}
 
-	if (fread (byte_code, sizeof (char), byte_code_len, input) < byte_code_len) {
-		fprintf (stderr, "Failed to read byte_code from %s\n", argv[1]);
-		free (byte_code);
-		fclose (input);
-		fclose (output);
+	prof->count = (uint64_t *) calloc (4 * len + 4, sizeof (uint64_t));
+	if (!prof->count) {
+		fprintf (stderr, "Listing: can't allocate profile\n");
+		fclose (file);
 		return 1;
 	}
+	prof->ticks = prof->count + len + 1;
+	prof->calls = prof->ticks + len + 1;
+	prof->call_ticks = prof->calls + len + 1;
 
-	while (pc < byte_code_len) {
-		prev_pc = pc;
-		cmd = byte_code[pc++];
-		imm = (cmd & IMM);
-		reg = (cmd & REG);
-		mem = (cmd & MEM);
-
-		switch (cmd & CMD) {
-			case CMD_PUSH:
-				if (imm) {
-					arg = *(int *)(byte_code + pc);
-					pc += sizeof (int);
-				}
-				if (reg) {
-					reg_num = byte_code[pc++];
-					reg_name = get_reg_name (reg_num);
-					if (!reg_name) {
-						fprintf (stderr, "Disassebler: wrong register #%d\n", reg_num);
-						free (byte_code);
-						fclose (input);
-						fclose (output);
-						return 1;
-					}
-				}
-				print_listing (output, prev_pc, cmd, mem, (reg) ? &reg_num : NULL, (imm) ? &arg : NULL, "PUSH");
-				break;
-			case CMD_POP:
-				if (imm) {
-					arg = *(int *)(byte_code + pc);
-					pc += sizeof (int);
-				}
-				if (reg) {
-					reg_num = byte_code[pc++];
-					reg_name = get_reg_name (reg_num);
-					if (!reg_name) {
-						fprintf (stderr, "Disassebler: wrong register #%d\n", reg_num);
-						free (byte_code);
-						fclose (input);
-						fclose (output);
-						return 1;
-					}
-				}
-				print_listing (output, prev_pc, cmd, mem, (reg) ? &reg_num : NULL, (imm) ? &arg : NULL, "POP");
-				break;
-			case CMD_ADD:
-				print_listing (output, prev_pc, cmd, false, NULL, NULL, "ADD");
-				break;
-			case CMD_SUB:
-				print_listing (output, prev_pc, cmd, false, NULL, NULL, "SUB");
-				break;
-			case CMD_MUL:
-				print_listing (output, prev_pc, cmd, false, NULL, NULL, "MUL");
-				break;
-			case CMD_DIV:
-				print_listing (output, prev_pc, cmd, false, NULL, NULL, "DIV");
-				break;
-			case CMD_IN:
-				print_listing (output, prev_pc, cmd, false, NULL, NULL, "IN");
-				break;
-			case CMD_OUT:
-				print_listing (output, prev_pc, cmd, false, NULL, NULL, "OUT");
-				break;
-			case CMD_HLT:
-				print_listing (output, prev_pc, cmd, false, NULL, NULL, "HLT");
-				break;
-			case CMD_JMP:
-				arg = *(int *)(byte_code + pc);
-				pc += sizeof (int);
-				print_listing (output, prev_pc, cmd, false, NULL, &arg, "JMP");
-				break;
-			case CMD_JA:
-				arg = *(int *)(byte_code + pc);
-				pc += sizeof (int);
-				print_listing (output, prev_pc, cmd, false, NULL, &arg, "JA");
-				break;
-			case CMD_JAE:
-				arg = *(int *)(byte_code + pc);
-				pc += sizeof (int);
-				print_listing (output, prev_pc, cmd, false, NULL, &arg, "JAE");
-				break;
-			case CMD_JB:
-				arg = *(int *)(byte_code + pc);
-				pc += sizeof (int);
-				print_listing (output, prev_pc, cmd, false, NULL, &arg, "JB");
-				break;
-			case CMD_JBE:
-				arg = *(int *)(byte_code + pc);
-				pc += sizeof (int);
-				print_listing (output, prev_pc, cmd, false, NULL, &arg, "JBE");
-				break;
-			case CMD_JE:
-				arg = *(int *)(byte_code + pc);
-				pc += sizeof (int);
-				print_listing (output, prev_pc, cmd, false, NULL, &arg, "JE");
-				break;
-			case CMD_JNE:
-				arg = *(int *)(byte_code + pc);
-				pc += sizeof (int);
-				print_listing (output, prev_pc, cmd, false, NULL, &arg, "JNE");
-				break;
-			case CMD_CALL:
-				arg = *(int *)(byte_code + pc);
-				pc += sizeof (int);
-				print_listing (output, prev_pc, cmd, false, NULL, &arg, "CALL");
-				break;
-			case CMD_RET:
-				print_listing (output, prev_pc, cmd, false, NULL, NULL, "RET");
-				break;
-			default:
-				fprintf (stderr, "Listing: unknown command: %d\n", cmd);
-				free (byte_code);
-				fclose (input);
-				fclose (output);
-				return 1;
-				break;
+	while (fgets (line, sizeof (line), file)) {
+		if (sscanf (line, "total %llu %llu %15s", &count, &ticks, prof->clock) == 3) {
+			prof->total = count;
+			prof->total_ticks = ticks;
+			continue;
+		}
+		if (sscanf (line, "%15s %llu %llu %llu", kind, &pc, &count, &ticks) != 4 || pc >= len)
+			continue;
+		if (!strcmp (kind, "pc")) {
+			prof->count[pc] = count;
+			prof->ticks[pc] = ticks;
+		} else if (!strcmp (kind, "call")) {
+			prof->calls[pc] = count;
+			prof->call_ticks[pc] = ticks;
 		}
 	}
 
-	free (byte_code);
-	fclose (input);
-	fclose (output);
+	fclose (file);
+	if (!prof->total_ticks) {
+		fprintf (stderr, "Listing: %s is not a profile\n", file_name);
+		free_profile (prof);
+		return 1;
+	}
 	return 0;
 }
 
-static void print_listing (FILE *file,
-			   const size_t pc,
-			   const char cmd,
-			   const bool mem,
-			   const char *reg_num,
-			   const int *arg_ptr,
-			   const char *cmd_str)
+static void free_profile (struct profile_data *prof)
 {
-	char *reg_name = NULL;
-	char arg_print_arr[12];
-	memset (arg_print_arr, ' ', 12);
-	arg_print_arr[2] = '\0';
-	arg_print_arr[5] = '\0';
-	arg_print_arr[8] = '\0';
-	arg_print_arr[11] = '\0';
-	char reg_print_arr[3];
-	memset (reg_print_arr, ' ', 3);
-	reg_print_arr[2] = '\0';
-	char arg_print_arr_decimal[20];
-	memset (arg_print_arr_decimal, '\0', 20);
-	char empty_string[1] = "";
-
-	if (arg_ptr) {
-		sprintf (arg_print_arr + 0, "%02x",
-				(((unsigned int) (*arg_ptr)) >> 0) & 0xff);
-		sprintf (arg_print_arr + 3, "%02x",
-				(((unsigned int) (*arg_ptr)) >> 8) & 0xff);
-		sprintf (arg_print_arr + 6, "%02x",
-				(((unsigned int) (*arg_ptr)) >> 16) & 0xff);
-		sprintf (arg_print_arr + 9, "%02x",
-				(((unsigned int) (*arg_ptr)) >> 24) & 0xff);
-		sprintf (arg_print_arr_decimal, "%d", *arg_ptr);
-	}
-	if (reg_num) {
-		sprintf (reg_print_arr, "%02x", (unsigned int) (*reg_num));
-	}
+	free (prof->count);
+	*prof = {};
+}
 
-	if (!cmd_str) {
-		fprintf (stderr, "print_listing () error: cmd_str parameter is NULL\n");
-		return ;
-	}
+/* The hottest commands by ticks with the label they follow. */
+static void print_hot_spots (FILE *file, const struct profile_data *prof,
+			     const struct byte_code_file *input)
+{
+	size_t hot[HOT_SPOTS_NUM] = {}, hot_num = 0, pos = 0;
+	const char *label = NULL;
+	int shift = 0;
 
-	if (!file) {
-		fprintf (stderr, "print_listing () error: file was not opened\n");
-		return ;
+	for (size_t pc = 0; pc < input->code_len; pc++) {
+		if (!prof->count[pc])
+			continue;
+		for (pos = hot_num; pos > 0 && prof->ticks[hot[pos - 1]] < prof->ticks[pc]; pos--)
+			if (pos < HOT_SPOTS_NUM)
+				hot[pos] = hot[pos - 1];
+		if (pos == HOT_SPOTS_NUM)
+			continue;
+		hot[pos] = pc;
+		if (hot_num < HOT_SPOTS_NUM)
+			hot_num++;
 	}
 
-	if (reg_num) {
-		reg_name = get_reg_name (*reg_num);
-		if (!reg_name) {
-			fprintf (stderr, "print_listing (): wrong register #%d\n", *reg_num);
-			return ;
+	fprintf (file, "; %" PRIu64 " commands executed, %" PRIu64 " %s ticks, hot spots:\n",
+		 prof->total, prof->total_ticks, prof->clock);
+	for (size_t i = 0; i < hot_num; i++) {
+		label = NULL;
+		shift = 0;
+		for (uint32_t sym = 0; sym < input->symbols_num && input->symbols[sym].shift <= (int) hot[i]; sym++) {
+			shift = input->symbols[sym].shift;
+			label = find_label (input, shift);
 		}
-	} else
-		reg_name = empty_string;
-
-	fprintf (file, "%04lx  %02x  %c %s %s %s %s   %s %c   %s %s%s%s%s%s\n",
-		pc,
-		(unsigned char) cmd,
-		(mem) ? '[' : ' ',
-		arg_print_arr + 0,
-		arg_print_arr + 3,
-		arg_print_arr + 6,
-		arg_print_arr + 9,
-		reg_print_arr,
-		(mem) ? ']' : ' ',
-		cmd_str,
-		(mem) ? "[" : "",
-		reg_name,
-		(reg_num && arg_ptr) ? "+" : empty_string,
-		(arg_ptr) ? arg_print_arr_decimal : empty_string,
-		(mem) ? "]" : "");
+		fprintf (file, ";   %04lx  %5.1f%%  %12" PRIu64 " runs", hot[i],
+			 100.0 * (double) prof->ticks[hot[i]] / (double) prof->total_ticks, prof->count[hot[i]]);
+		if (label)
+			fprintf (file, "  %s+%d", label, (int) hot[i] - shift);
+		fprintf (file, "\n");
+	}
+	fprintf (file, "\n");
+}
 
-	return ;
+static void print_profile_column (FILE *file, const struct profile_data *prof, const size_t pc)
+{
+	if (!prof->count[pc]) {
+		fprintf (file, "%21s", "");
+		return ;
+	}
+	fprintf (file, "%12" PRIu64 " %5.1f%%  ", prof->count[pc],
+		 100.0 * (double) prof->ticks[pc] / (double) prof->total_ticks);
 }
@@ -0,0 +1,195 @@
+#include "loader.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+static int parse_sections (struct byte_code_file *file, const bool verify);
+static int parse_symbols (struct byte_code_file *file);
+static int check_padding (const struct byte_code_file *file, const struct section_entry *table, const uint32_t num);
+
+int load_byte_code (struct byte_code_file *file, const char *file_name, const bool verify)
+{
+	assert (file);
+	assert (file_name);
+	struct stat st = {};
+	void *map = NULL;
+	int fd = -1;
+
+	fd = open (file_name, O_RDONLY);
+	if (fd < 0) {
+		fprintf (stderr, "Can't open file %s\n", file_name);
+		return 1;
+	}
+
+	if (fstat (fd, &st) < 0) {
+		fprintf (stderr, "Stat syscall failed\n");
+		close (fd);
+		return 1;
+	}
+
+	if (st.st_size <= 0) {
+		fprintf (stderr, "Input file type verification failed: %s is empty\n", file_name);
+		close (fd);
+		return 1;
+	}
+
+	map = mmap (NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close (fd);
+	if (map == MAP_FAILED) {
+		fprintf (stderr, "Can't map file %s\n", file_name);
+		return 1;
+	}
+
+	*file = {};
+	file->map = map;
+	file->map_len = (size_t) st.st_size;
+
+	file->version = check_sign_and_ver ((const char *) map, file->map_len);
+	if (file->version == 4) {
+		file->code = (const char *) map + 4;
+		file->code_len = file->map_len - 4;
+		return 0;
+	}
+
+	if (file->version < 0 || parse_sections (file, verify) || parse_symbols (file)) {
+		fprintf (stderr, "Input file type verification failed\n");
+		unload_byte_code (file);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int parse_sections (struct byte_code_file *file, const bool verify)
+{
+	assert (file);
+	const char *base = (const char *) file->map;
+	const struct file_header *header = (const struct file_header *) file->map;
+	const struct section_entry *table = NULL;
+	const char *data[SECT_NUM] = {};
+
+	if (file->map_len < sizeof (*header) ||
+	    header->header_size != sizeof (*header) ||
+	    header->sections_num < SECT_RELOCS || header->sections_num > SECT_NUM ||
+	    file->map_len < sizeof (*header) + header->sections_num * sizeof (*table)) {
+		fprintf (stderr, "parse_sections () error: header is corrupted\n");
+		return 1;
+	}
+	table = (const struct section_entry *) (base + sizeof (*header));
+
+	for (int i = 0; i < (int) header->sections_num; i++) {
+		if (table[i].type != (uint32_t) i ||
+		    table[i].offset % SECT_ALIGN ||
+		    table[i].offset > file->map_len ||
+		    table[i].size > file->map_len - table[i].offset) {
+			fprintf (stderr, "parse_sections () error: section %d is corrupted\n", i);
+			return 1;
+		}
+		data[i] = base + table[i].offset;
+		file->sections[i] = data[i];
+		file->sections_len[i] = table[i].size;
+	}
+
+	if (verify && count_checksum (header, table, data) != header->checksum) {
+		fprintf (stderr, "parse_sections () error: checksum mismatch\n");
+		return 1;
+	}
+	if (verify && check_padding (file, table, header->sections_num)) {
+		fprintf (stderr, "parse_sections () error: padding is corrupted\n");
+		return 1;
+	}
+
+	file->flags = header->flags;
+	file->source_hash = header->source_hash;
+	file->code = file->sections[SECT_CODE];
+	file->code_len = file->sections_len[SECT_CODE];
+	return 0;
+}
+
+/*
+ * The checksum does not cover the alignment padding, so it has to be zero
+ * and the sections have to follow each other up to the end of the file,
+ * as write_byte_code () puts them.
+ */
+static int check_padding (const struct byte_code_file *file, const struct section_entry *table, const uint32_t num)
+{
+	const char *base = (const char *) file->map;
+	size_t pos = sizeof (struct file_header) + num * sizeof (*table);
+
+	for (uint32_t i = 0; i < num; i++) {
+		if (table[i].offset < pos)
+			return 1;
+		for (; pos < table[i].offset; pos++)
+			if (base[pos])
+				return 1;
+		pos = table[i].offset + table[i].size;
+	}
+	return pos != file->map_len;
+}
+
+static int parse_symbols (struct byte_code_file *file)
+{
+	assert (file);
+	const char *sect = file->sections[SECT_SYMBOLS];
+	size_t len = file->sections_len[SECT_SYMBOLS];
+	uint32_t count = 0;
+	size_t entries_len = 0;
+
+	if (len == 0)
+		return 0;
+
+	if (len < 2 * sizeof (uint32_t)) {
+		fprintf (stderr, "parse_symbols () error: symbol section is corrupted\n");
+		return 1;
+	}
+	memcpy (&count, sect, sizeof (count));
+	entries_len = (size_t) count * sizeof (struct symbol_entry);
+	if (entries_len > len - 2 * sizeof (uint32_t)) {
+		fprintf (stderr, "parse_symbols () error: symbol section is corrupted\n");
+		return 1;
+	}
+
+	file->symbols = (const struct symbol_entry *) (sect + 2 * sizeof (uint32_t));
+	file->symbols_num = count;
+	file->names = sect + 2 * sizeof (uint32_t) + entries_len;
+	file->names_len = len - 2 * sizeof (uint32_t) - entries_len;
+
+	if (count && (file->names_len == 0 || file->names[file->names_len - 1] != '\0')) {
+		fprintf (stderr, "parse_symbols () error: symbol names are corrupted\n");
+		return 1;
+	}
+	return 0;
+}
+
+void unload_byte_code (struct byte_code_file *file)
+{
+	assert (file);
+
+	if (file->map)
+		munmap (file->map, file->map_len);
+	*file = {};
+}
+
+const char *find_label (const struct byte_code_file *file, const int shift)
+{
+	assert (file);
+	uint32_t left = 0, right = file->symbols_num;
+
+	while (left < right) {
+		uint32_t mid = left + (right - left) / 2;
+		if (file->symbols[mid].shift < shift)
+			left = mid + 1;
+		else
+			right = mid;
+	}
+
+	if (left < file->symbols_num && file->symbols[left].shift == shift &&
+	    file->symbols[left].name < file->names_len)
+		return file->names + file->symbols[left].name;
+	return NULL;
+}
@@ -0,0 +1,31 @@
+#ifndef LOADER_H
+#define LOADER_H
+
+#include "processor.h"
+
+#include <stdio.h>
+#include <stdint.h>
+
+struct byte_code_file
+{
+	void *map = NULL;
+	size_t map_len = 0;
+	int version = 0;
+	uint32_t flags = 0;
+	uint64_t source_hash = 0;
+	const char *sections[SECT_NUM] = {};
+	size_t sections_len[SECT_NUM] = {};
+	const char *code = NULL;
+	size_t code_len = 0;
+	const struct symbol_entry *symbols = NULL;
+	uint32_t symbols_num = 0;
+	const char *names = NULL;
+	size_t names_len = 0;
+};
+
+int load_byte_code (struct byte_code_file *file, const char *file_name, const bool verify);
+void unload_byte_code (struct byte_code_file *file);
+
+const char *find_label (const struct byte_code_file *file, const int shift);
+
+#endif // LOADER_H
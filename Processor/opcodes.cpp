@@ -0,0 +1,333 @@
+#include "opcodes.h"
+#include "vm.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+#define JCC (OPC_JUMP | OPC_COND | OPC_TYPED)
+#define CMPJ (OPC_JUMP | OPC_COND | OPC_FUSED)
+
+static constexpr struct opcode_desc opcode_list[] = {
+	{0, NULL, "", 0, 0, 0},	// not a command
+	{CMD_HLT, "hlt", "", 1, OPC_END, OP_HLT},
+	{CMD_PUSH | IMM, "push", "i", 5, OPC_TYPED, OP_PUSH_IMM},
+	{CMD_PUSH | REG, "push", "r", 2, OPC_TYPED, OP_PUSH_REG},
+	{CMD_PUSH | IMM | REG, "push", "ir", 6, OPC_TYPED, OP_PUSH_REG},
+	{CMD_PUSH | MEM | IMM, "push", "i", 5, OPC_TYPED | OPC_MEM, OP_PUSH_MEM_IMM},
+	{CMD_PUSH | MEM | REG, "push", "r", 2, OPC_TYPED | OPC_MEM, OP_PUSH_MEM_REG},
+	{CMD_PUSH | MEM | IMM | REG, "push", "ir", 6, OPC_TYPED | OPC_MEM, OP_PUSH_MEM_REG},
+	{CMD_POP, "pop", "", 1, OPC_TYPED, OP_POP},
+	{CMD_POP | REG, "pop", "r", 2, OPC_TYPED, OP_POP_REG},
+	{CMD_POP | MEM | IMM, "pop", "i", 5, OPC_TYPED | OPC_MEM, OP_POP_MEM_IMM},
+	{CMD_POP | MEM | REG, "pop", "r", 2, OPC_TYPED | OPC_MEM, OP_POP_MEM_REG},
+	{CMD_POP | MEM | IMM | REG, "pop", "ir", 6, OPC_TYPED | OPC_MEM, OP_POP_MEM_REG},
+	{CMD_ADD, "add", "", 1, OPC_TYPED, OP_ADD},
+	{CMD_SUB, "sub", "", 1, OPC_TYPED, OP_SUB},
+	{CMD_MUL, "mul", "", 1, OPC_TYPED, OP_MUL},
+	{CMD_DIV, "div", "", 1, OPC_TYPED, OP_DIV},
+	{CMD_IN, "in", "", 1, OPC_TYPED, OP_IN},
+	{CMD_OUT, "out", "", 1, OPC_TYPED, OP_OUT},
+	{CMD_JMP, "jmp", "t", 5, OPC_JUMP | OPC_END, OP_JMP},
+	{CMD_JA, "ja", "t", 5, JCC, OP_JA},
+	{CMD_JAE, "jae", "t", 5, JCC, OP_JAE},
+	{CMD_JB, "jb", "t", 5, JCC, OP_JB},
+	{CMD_JBE, "jbe", "t", 5, JCC, OP_JBE},
+	{CMD_JE, "je", "t", 5, JCC, OP_JE},
+	{CMD_JNE, "jne", "t", 5, JCC, OP_JNE},
+	{CMD_CALL, "call", "t", 5, OPC_JUMP, OP_CALL},
+	{CMD_RET, "ret", "", 1, OPC_END, OP_RET},
+	{CMD_CMPJ | 0 << 5, "ja", "rit", 10, CMPJ, OP_CMPJ_A},
+	{CMD_CMPJ | 1 << 5, "jae", "rit", 10, CMPJ, OP_CMPJ_AE},
+	{CMD_CMPJ | 2 << 5, "jb", "rit", 10, CMPJ, OP_CMPJ_B},
+	{CMD_CMPJ | 3 << 5, "jbe", "rit", 10, CMPJ, OP_CMPJ_BE},
+	{CMD_CMPJ | 4 << 5, "je", "rit", 10, CMPJ, OP_CMPJ_E},
+	{CMD_CMPJ | 5 << 5, "jne", "rit", 10, CMPJ, OP_CMPJ_NE},
+	{CMD_OPREG | 0 << 6, "add", "rrr", 4, OPC_FUSED, OP_ADD_RR},
+	{CMD_OPREG | 0 << 6 | IMM, "add", "rri", 7, OPC_FUSED, OP_ADD_RI},
+	{CMD_OPREG | 1 << 6, "sub", "rrr", 4, OPC_FUSED, OP_SUB_RR},
+	{CMD_OPREG | 1 << 6 | IMM, "sub", "rri", 7, OPC_FUSED, OP_SUB_RI},
+	{CMD_OPREG | 2 << 6, "mul", "rrr", 4, OPC_FUSED, OP_MUL_RR},
+	{CMD_OPREG | 2 << 6 | IMM, "mul", "rri", 7, OPC_FUSED, OP_MUL_RI},
+	{CMD_OPREG | 3 << 6, "div", "rrr", 4, OPC_FUSED, OP_DIV_RR},
+	{CMD_OPREG | 3 << 6 | IMM, "div", "rri", 7, OPC_FUSED, OP_DIV_RI},
+	{CMD_TYPE | TYPE_INT64 << 5, ".q", "", 1, OPC_PREFIX, 0},
+	{CMD_TYPE | TYPE_DOUBLE << 5, ".d", "", 1, OPC_PREFIX, 0},
+	{CMD_VEC | VEC_ADD << 5, "vadd", "rrrr", 5, OPC_TYPED, OP_VADD},
+	{CMD_VEC | VEC_MUL << 5, "vmul", "rrrr", 5, OPC_TYPED, OP_VMUL},
+	{CMD_VEC | VEC_SUM << 5, "vsum", "rr", 3, OPC_TYPED, OP_VSUM},
+	{CMD_VEC | VEC_DOT << 5, "vdot", "rrr", 4, OPC_TYPED, OP_VDOT},
+	{CMD_VEC | VEC_FILL << 5, "vfill", "rr", 3, 0, OP_VFILL},
+	{CMD_VEC | VEC_IN << 5, "vin", "rr", 3, OPC_TYPED, OP_VIN},
+	{CMD_VEC | VEC_OUT << 5, "vout", "rr", 3, OPC_TYPED, OP_VOUT},
+	{CMD_TASK | TASK_SPAWN << 5, "spawn", "t", 5, 0, OP_SPAWN},
+	{CMD_TASK | TASK_YIELD << 5, "yield", "", 1, 0, OP_YIELD},
+	{CMD_TASK | TASK_JOIN << 5, "join", "", 1, 0, OP_JOIN},
+	{CMD_TASK | TASK_CHAN << 5, "chan", "", 1, 0, OP_CHAN},
+	{CMD_TASK | TASK_SEND << 5, "send", "", 1, 0, OP_SEND},
+	{CMD_TASK | TASK_RECV << 5, "recv", "", 1, 0, OP_RECV},
+};
+
+#define OPCODES_NUM (sizeof (opcode_list) / sizeof (opcode_list[0]))
+
+static_assert (OPCODES_NUM <= UINT8_MAX, "opcode index has to fit a byte");
+
+struct opcode_map
+{
+	uint8_t index[256];
+};
+
+// Built by the compiler: the entry of every byte, 0 if it is not a command
+static constexpr struct opcode_map make_opcode_map ()
+{
+	struct opcode_map map = {};
+
+	for (size_t i = 1; i < OPCODES_NUM; i++)
+		map.index[opcode_list[i].cmd] = (uint8_t) i;
+	return map;
+}
+
+static constexpr struct opcode_map opcode_map = make_opcode_map ();
+
+static constexpr bool check_lengths ()
+{
+	for (size_t i = 1; i < OPCODES_NUM; i++) {
+		size_t len = 1;
+		for (const char *opnd = opcode_list[i].operands; *opnd; opnd++)
+			len += (*opnd == 'r') ? 1 : sizeof (int32_t);
+		if (len != opcode_list[i].len)
+			return false;
+	}
+	return true;
+}
+
+static_assert (check_lengths (), "len of an opcode does not match its operands");
+
+static const char *suffixes[] = {"", ".q", ".d"};
+
+struct text_buf
+{
+	char *text;
+	size_t size;
+	size_t len;
+};
+
+static int decode_operands (const char *code, const size_t len, size_t *pos, const uint32_t flags,
+			    const char *operands, struct decoded_cmd *dc);
+static void put_chars (struct text_buf *buf, const char *str, const size_t len, const bool upper);
+static void put_str (struct text_buf *buf, const char *str, const bool upper);
+static void put_int (struct text_buf *buf, const int64_t val);
+static void put_reg (struct text_buf *buf, const uint8_t reg);
+static void put_target (struct text_buf *buf, const struct byte_code_file *file, const int32_t target);
+static void put_operand (struct text_buf *buf, const struct decoded_cmd *dc);
+
+const struct opcode_desc *get_opcode (const char cmd)
+{
+	return &opcode_list[opcode_map.index[(unsigned char) cmd]];
+}
+
+/*
+ * Decodes the command at *pc along the operands of its entry and moves
+ * *pc past it.  Returns 1 for a byte that is no command, a command that
+ * can't be typed after a prefix, a wrong register or a truncated command.
+ */
+int decode_cmd (const char *code, const size_t len, size_t *pc, const uint32_t flags,
+		struct decoded_cmd *dc)
+{
+	const struct opcode_desc *desc = NULL;
+	size_t pos = *pc;
+
+	*dc = {};
+	if (pos >= len)
+		return 1;
+	desc = get_opcode (code[pos]);
+	if (desc->flags & OPC_PREFIX) {
+		dc->type = PREFIX_TYPE (code[pos]);
+		if (++pos >= len)
+			return 1;
+		desc = get_opcode (code[pos]);
+		if (!(desc->flags & OPC_TYPED))
+			return 1;
+	}
+	if (!desc->name)
+		return 1;
+	pos++;
+
+	if (dc->type != TYPE_INT && desc->cmd == (CMD_PUSH | IMM)) {
+		if (len - pos < sizeof (dc->arg))
+			return 1;
+		memcpy (&dc->arg, code + pos, sizeof (dc->arg));
+		pos += sizeof (dc->arg);
+	} else if (decode_operands (code, len, &pos, flags, desc->operands, dc)) {
+		return 1;
+	}
+
+	dc->desc = desc;
+	dc->pc = *pc;
+	dc->len = pos - *pc;
+	*pc = pos;
+	return 0;
+}
+
+/*
+ * Assembly text of a decoded command, fused ones are spelled out as the
+ * commands they stand for joined with sep.  Jumps show the label of their
+ * target if it has one.  Returns the length of the text or -1 if it does
+ * not fit in size.
+ */
+int format_cmd (char *text, const size_t size, const struct byte_code_file *file,
+		const struct decoded_cmd *dc, const char *sep, const bool upper)
+{
+	const struct opcode_desc *desc = dc->desc;
+	struct text_buf buf = {text, size, 0};
+
+	if ((desc->cmd & CMD) == CMD_CMPJ) {
+		put_str (&buf, "push ", upper);
+		put_reg (&buf, dc->regs[0]);
+		put_str (&buf, sep, false);
+		put_str (&buf, "push ", upper);
+		put_int (&buf, dc->arg);
+		put_str (&buf, sep, false);
+		put_str (&buf, desc->name, upper);
+		put_target (&buf, file, dc->target);
+	} else if (desc->flags & OPC_FUSED) {
+		put_str (&buf, "push ", upper);
+		put_reg (&buf, dc->regs[1]);
+		put_str (&buf, sep, false);
+		put_str (&buf, "push ", upper);
+		if (dc->regs_num == 3)
+			put_reg (&buf, dc->regs[2]);
+		else
+			put_int (&buf, dc->arg);
+		put_str (&buf, sep, false);
+		put_str (&buf, desc->name, upper);
+		put_str (&buf, sep, false);
+		put_str (&buf, "pop ", upper);
+		put_reg (&buf, dc->regs[0]);
+	} else {
+		put_str (&buf, desc->name, upper);
+		put_str (&buf, suffixes[dc->type], upper);
+		if (desc->operands[0] == 't')
+			put_target (&buf, file, dc->target);
+		else if (desc->operands[0])
+			put_operand (&buf, dc);
+	}
+
+	if (buf.len >= size)
+		return -1;
+	text[buf.len] = '\0';
+	return (int) buf.len;
+}
+
+static int decode_operands (const char *code, const size_t len, size_t *pos, const uint32_t flags,
+			    const char *operands, struct decoded_cmd *dc)
+{
+	int32_t val = 0;
+
+	for (const char *opnd = operands; *opnd; opnd++) {
+		if (*opnd == 'r') {
+			if (*pos >= len || (unsigned char) code[*pos] >= REGS_NUM)
+				return 1;
+			dc->regs[dc->regs_num++] = (uint8_t) code[(*pos)++];
+		} else if (*opnd == 'i') {
+			if (read_operand (code, len, pos, flags, &val))
+				return 1;
+			dc->arg = val;
+		} else if (read_target (code, len, pos, flags, &dc->target)) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static void put_chars (struct text_buf *buf, const char *str, const size_t len, const bool upper)
+{
+	if (buf->len + len >= buf->size) {
+		buf->len = buf->size;
+		return ;
+	}
+
+	if (upper)
+		for (size_t i = 0; i < len; i++)
+			buf->text[buf->len + i] = (char) toupper (str[i]);
+	else
+		memcpy (buf->text + buf->len, str, len);
+	buf->len += len;
+}
+
+static void put_str (struct text_buf *buf, const char *str, const bool upper)
+{
+	put_chars (buf, str, strlen (str), upper);
+}
+
+static void put_int (struct text_buf *buf, const int64_t val)
+{
+	char digits[24];
+	uint64_t u = (val < 0) ? 0 - (uint64_t) val : (uint64_t) val;
+	size_t n = sizeof (digits);
+
+	do {
+		digits[--n] = (char) ('0' + u % 10);
+		u /= 10;
+	} while (u);
+	if (val < 0)
+		digits[--n] = '-';
+
+	put_chars (buf, digits + n, sizeof (digits) - n, false);
+}
+
+static void put_reg (struct text_buf *buf, const uint8_t reg)
+{
+	put_str (buf, get_reg_name ((char) reg), false);
+}
+
+static void put_target (struct text_buf *buf, const struct byte_code_file *file, const int32_t target)
+{
+	const char *label = find_label (file, target);
+
+	put_chars (buf, " ", 1, false);
+	if (label)
+		put_str (buf, label, false);
+	else
+		put_int (buf, target);
+}
+
+/*
+ * Registers of a vector command, the address of push and pop or the
+ * value of a typed push.
+ */
+static void put_operand (struct text_buf *buf, const struct decoded_cmd *dc)
+{
+	const struct opcode_desc *desc = dc->desc;
+	char num[32] = "";
+	double dval = 0;
+
+	put_chars (buf, " ", 1, false);
+	if (dc->regs_num > 1) {
+		for (int i = 0; i < dc->regs_num; i++) {
+			if (i)
+				put_chars (buf, ", ", 2, false);
+			put_reg (buf, dc->regs[i]);
+		}
+		return ;
+	}
+
+	if (dc->type == TYPE_DOUBLE && desc->cmd == (CMD_PUSH | IMM)) {
+		memcpy (&dval, &dc->arg, sizeof (dval));
+		snprintf (num, sizeof (num), "%.17g", dval);
+		put_str (buf, num, false);
+		return ;
+	}
+
+	if (desc->flags & OPC_MEM)
+		put_chars (buf, "[", 1, false);
+	if (dc->regs_num)
+		put_reg (buf, dc->regs[0]);
+	if (dc->regs_num && desc->operands[0] == 'i')
+		put_chars (buf, "+", 1, false);
+	if (desc->operands[0] == 'i')
+		put_int (buf, dc->arg);
+	if (desc->flags & OPC_MEM)
+		put_chars (buf, "]", 1, false);
+}
@@ -0,0 +1,54 @@
+#ifndef OPCODES_H
+#define OPCODES_H
+
+#include "processor.h"
+#include "loader.h"
+
+#include <stdio.h>
+#include <stdint.h>
+
+// opcode_desc.flags
+#define OPC_JUMP   0x01	// transfers control to its target
+#define OPC_COND   0x02	// the jump may fall through
+#define OPC_END    0x04	// never falls through
+#define OPC_MEM    0x08	// the operand is a RAM address
+#define OPC_FUSED  0x10	// stands for several commands, name is the jcc or alu of them
+#define OPC_TYPED  0x20	// may follow a type prefix
+#define OPC_PREFIX 0x40	// type prefix, the command follows
+
+/*
+ * One entry for every opcode/mode byte.  operands lists them in the order
+ * they are encoded: r is a register byte, i a 32-bit operand and t a jump
+ * target, both take 4 bytes or a varint of up to 5 in compact code.  len
+ * is the length with 4-byte operands, a typed push of an immediate has 8
+ * bytes of it instead.  name is NULL if the byte is not a command.
+ */
+struct opcode_desc
+{
+	unsigned char cmd;
+	const char *name;
+	const char *operands;
+	uint8_t len;
+	uint8_t flags;
+	uint8_t op;	// enum vm_op
+};
+
+struct decoded_cmd
+{
+	const struct opcode_desc *desc;
+	int type;	// of the prefix, TYPE_INT if there is none
+	size_t pc;
+	size_t len;	// with the prefix
+	uint8_t regs[4];
+	int regs_num;
+	int64_t arg;
+	int32_t target;
+};
+
+const struct opcode_desc *get_opcode (const char cmd);
+int decode_cmd (const char *code, const size_t len, size_t *pc, const uint32_t flags,
+		struct decoded_cmd *dc);
+int format_cmd (char *text, const size_t size, const struct byte_code_file *file,
+		const struct decoded_cmd *dc, const char *sep, const bool upper);
+
+#endif // OPCODES_H
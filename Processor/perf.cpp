@@ -0,0 +1,186 @@
+#include "vm.h"
+#include "perf.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+struct perf_event
+{
+	const char *name;
+	uint32_t type;
+	uint64_t config;
+};
+
+/* Same order as enum perf_counter */
+static const struct perf_event events[PERF_COUNTERS] = {
+	{"cycles",		PERF_TYPE_HARDWARE,	PERF_COUNT_HW_CPU_CYCLES},
+	{"instructions",	PERF_TYPE_HARDWARE,	PERF_COUNT_HW_INSTRUCTIONS},
+	{"branch-misses",	PERF_TYPE_HARDWARE,	PERF_COUNT_HW_BRANCH_MISSES},
+	{"L1d misses",		PERF_TYPE_HW_CACHE,	PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+							(PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+};
+
+static int open_counter (const struct perf_event *event, const int group);
+static int read_group (const struct vm_perf *perf, uint64_t *val, double *share);
+
+/*
+ * Cycles lead a group the others join, so the kernel puts them on the CPU
+ * together and their ratios are of the same instructions.  A counter that
+ * can't join is left out, without cycles there are none.  The VM counts
+ * are there whatever the host allows.
+ */
+int vm_perf_start (struct vm *vm)
+{
+	struct vm_perf *perf = (struct vm_perf *) calloc (1, sizeof (*perf));
+	size_t i = vm->code_num;
+
+	if (!perf) {
+		fprintf (stderr, "Processor: can't allocate perf counters\n");
+		return 1;
+	}
+	*perf = {};
+	perf->stack_cost = (uint32_t *) malloc ((vm->code_num + 1) * sizeof (uint32_t));
+	if (!perf->stack_cost) {
+		fprintf (stderr, "Processor: can't allocate perf counters\n");
+		free (perf);
+		return 1;
+	}
+
+	// Blocks as in count_fuel_cost ()
+	perf->stack_cost[i] = 0;
+	while (i-- > 0)
+		perf->stack_cost[i] = (uint32_t) stack_cells (vm->code[i].op) +
+		                      ((op_is_control (vm->code[i].op)) ? 0 : perf->stack_cost[i + 1]);
+
+	for (int c = 0; c < PERF_COUNTERS; c++) {
+		if (c != PERF_CYCLES && perf->fd[PERF_CYCLES] < 0) {
+			perf->err[c] = perf->err[PERF_CYCLES];
+			continue;
+		}
+		perf->fd[c] = open_counter (&events[c], perf->fd[PERF_CYCLES]);
+		perf->err[c] = (perf->fd[c] < 0) ? errno : 0;
+	}
+	vm->perf = perf;
+	return 0;
+}
+
+void vm_perf_enable (struct vm_perf *perf)
+{
+	if (perf->fd[PERF_CYCLES] >= 0)
+		ioctl (perf->fd[PERF_CYCLES], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+void vm_perf_disable (struct vm_perf *perf)
+{
+	if (perf->fd[PERF_CYCLES] >= 0)
+		ioctl (perf->fd[PERF_CYCLES], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+}
+
+/* To stderr, like --count.  Commands are what vm->fuel_used counts. */
+void vm_perf_report (const struct vm *vm)
+{
+	const struct vm_perf *perf = vm->perf;
+	const double cmds = (vm->fuel_used) ? (double) vm->fuel_used : 1;
+	uint64_t val[PERF_COUNTERS] = {};
+	double share = 0;
+
+	if (perf->fd[PERF_CYCLES] < 0)
+		fprintf (stderr, "Processor: perf events are not available (%s), VM counts only\n",
+		         strerror (perf->err[PERF_CYCLES]));
+	fprintf (stderr, "Processor: perf stats\n");
+	fprintf (stderr, "\t%-16s%16" PRIu64 "\n", "commands", vm->fuel_used);
+	fprintf (stderr, "\t%-16s%16" PRIu64 "\t%.2f per command\n", "stack ops", perf->stack_ops,
+	         (double) perf->stack_ops / cmds);
+	if (perf->fd[PERF_CYCLES] < 0)
+		return;
+
+	if (read_group (perf, val, &share)) {
+		fprintf (stderr, "Processor: the perf counters can't be read, ratios are not available\n");
+		return;
+	}
+	if (share <= 0) {
+		fprintf (stderr, "Processor: the kernel never had the perf counters on the CPU, "
+		                 "ratios are not available\n");
+		return;
+	}
+	if (share < 1)
+		fprintf (stderr, "\t(on the CPU %.0f%% of the time, counts are scaled)\n", share * 100);
+
+	for (int c = 0; c < PERF_COUNTERS; c++) {
+		if (perf->fd[c] < 0) {
+			fprintf (stderr, "\t%-16s%16s\t(%s)\n", events[c].name, "n/a", strerror (perf->err[c]));
+			continue;
+		}
+		fprintf (stderr, "\t%-16s%16" PRIu64 "\t%.3f per command", events[c].name, val[c],
+		         (double) val[c] / cmds);
+		if (c == PERF_INSTRUCTIONS && val[PERF_CYCLES])
+			fprintf (stderr, ", %.2f per cycle", (double) val[c] / (double) val[PERF_CYCLES]);
+		fprintf (stderr, "\n");
+	}
+}
+
+void vm_perf_stop (struct vm *vm)
+{
+	struct vm_perf *perf = vm->perf;
+
+	if (!perf)
+		return;
+	for (int c = 0; c < PERF_COUNTERS; c++) {
+		if (perf->fd[c] >= 0)
+			close (perf->fd[c]);
+	}
+	free (perf->stack_cost);
+	free (perf);
+	vm->perf = NULL;
+}
+
+/*
+ * group is the fd of the leader, -1 for the leader itself: it is opened
+ * disabled and the others follow it.  -1 with errno set if it can't be had.
+ */
+static int open_counter (const struct perf_event *event, const int group)
+{
+	struct perf_event_attr attr = {};
+
+	attr.size = sizeof (attr);
+	attr.type = event->type;
+	attr.config = event->config;
+	attr.disabled = (group < 0);
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+	return (int) syscall (SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+/*
+ * One read gives every counter of the group in the order they joined,
+ * with the times of the group.  share is the part of the time it was on
+ * the CPU, all the counts are scaled up by the same factor.
+ */
+static int read_group (const struct vm_perf *perf, uint64_t *val, double *share)
+{
+	uint64_t buf[3 + PERF_COUNTERS] = {};
+	const ssize_t len = read (perf->fd[PERF_CYCLES], buf, sizeof (buf));
+	uint64_t n = 0;
+
+	if (len < (ssize_t) (3 * sizeof (uint64_t)) || buf[0] > PERF_COUNTERS ||
+	    len != (ssize_t) ((3 + buf[0]) * sizeof (uint64_t)))
+		return 1;
+
+	*share = (buf[1]) ? (double) buf[2] / (double) buf[1] : 0;
+	for (int c = 0; c < PERF_COUNTERS && n < buf[0]; c++) {
+		if (perf->fd[c] < 0)
+			continue;
+		val[c] = (*share > 0 && *share < 1) ? (uint64_t) ((double) buf[3 + n] / *share) : buf[3 + n];
+		n++;
+	}
+	return 0;
+}
@@ -0,0 +1,39 @@
+#ifndef PERF_H
+#define PERF_H
+
+#include "vm.h"
+
+#include <stdio.h>
+#include <stdint.h>
+
+enum perf_counter
+{
+	PERF_CYCLES,
+	PERF_INSTRUCTIONS,
+	PERF_BRANCH_MISSES,
+	PERF_L1D_MISSES,
+	PERF_COUNTERS
+};
+
+/*
+ * Hardware counters of the host, enabled while the perf copy of the
+ * dispatch loop runs and counting this thread in user space only.  fd is
+ * -1 for a counter the kernel or the CPU does not give, err is why.
+ * stack_cost[i] is the number of cells pushed and popped from instruction
+ * i to the end of its block, the loop adds it where it charges fuel.
+ */
+struct vm_perf
+{
+	int fd[PERF_COUNTERS] = {-1, -1, -1, -1};
+	int err[PERF_COUNTERS] = {};
+	uint32_t *stack_cost = NULL;
+	uint64_t stack_ops = 0;
+};
+
+int vm_perf_start (struct vm *vm);
+void vm_perf_enable (struct vm_perf *perf);
+void vm_perf_disable (struct vm_perf *perf);
+void vm_perf_report (const struct vm *vm);
+void vm_perf_stop (struct vm *vm);
+
+#endif // PERF_H
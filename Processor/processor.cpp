@@ -1,278 +1,380 @@
 #include "processor.h"
-#include "../Stack/stack.h"
+#include "kmvm.h"
+#include "batch.h"
+#include "debugger.h"
+#ifdef VM_PROFILE
+#include "profile.h"
+#include "perf.h"
+#define PROFILE_OPT "p:S:R:P"
+#define PROFILE_USAGE "[--profile file | --sample file [--sample-rate hz] | --perf-stats] "
+#else
+#define PROFILE_OPT ""
+#define PROFILE_USAGE ""
+#endif
 
 #include <stdio.h>
-#include <assert.h>
-#include <string.h>
-#include <sys/stat.h>
-#include <sys/types.h>
-#include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <getopt.h>
 
-#define RAM_SIZE 1024
-#define REGS_NUM 4
-
-char ram[RAM_SIZE];
-int regs[REGS_NUM];
+#define DEBUG_POINTS_MAX 64
 
-int print_int (const void *ptr);
+static int parse_size (const char *str, size_t *size);
+static int parse_addr (const char *str, uint64_t *addr);
+static int parse_io_mode (const char *str, enum io_mode *mode);
+static int parse_engine (const char *str, enum vm_engine *engine);
+static int start_debug (struct vm *vm, const struct byte_code_file *input, const char **breaks,
+			const size_t breaks_num, const uint64_t *watches, const size_t watches_num);
 
 int main (int argc, char *argv[])
 {
-	FILE *input = NULL;
-	enum error_type stack_error = OK;
-	Stack stack = {};
-	char cmd = 0;
-	int arg = 0, op1 = 0, op2 = 0;
-	char *byte_code = NULL;
-	size_t byte_code_len = 0, pc = 0;
-	struct stat st = {};
-	int sign_and_ver_len = 0;
-	bool imm = false, reg = false, mem = false;
+	static const struct option options[] = {
+		{"stack-size",	required_argument, NULL, 's'},
+		{"call-depth",	required_argument, NULL, 'c'},
+		{"ram-size",	required_argument, NULL, 'm'},
+		{"ram-file",	required_argument, NULL, 'f'},
+		{"simd",	required_argument, NULL, 'v'},
+		{"io",		required_argument, NULL, 'i'},
+		{"batch",	no_argument,	   NULL, 'b'},
+		{"jobs",	required_argument, NULL, 'j'},
+		{"task-stack",	required_argument, NULL, 't'},
+		{"workers",	required_argument, NULL, 'w'},
+		{"fuel",	required_argument, NULL, 'F'},
+		{"slice",	required_argument, NULL, 'L'},
+		{"snapshot",	required_argument, NULL, 'n'},
+		{"restore",	required_argument, NULL, 'r'},
+		{"engine",	required_argument, NULL, 'e'},
+		{"count",	no_argument,	   NULL, 'C'},
+		{"break",	required_argument, NULL, 'B'},
+		{"watch",	required_argument, NULL, 'W'},
+#ifdef VM_PROFILE
+		{"profile",	required_argument, NULL, 'p'},
+		{"sample",	required_argument, NULL, 'S'},
+		{"sample-rate",	required_argument, NULL, 'R'},
+		{"perf-stats",	no_argument,	   NULL, 'P'},
+#endif
+		{NULL,		0,		   NULL, 0}
+	};
+	struct byte_code_file input = {};
+	struct vm_config config = {};
+	struct vm *vm = NULL;
+	const char *snapshot_file = NULL, *restore_file = NULL;
+	enum vm_status status = VM_HALTED;
+	bool batch = false, count = false;
+	size_t jobs = 0, fuel = 0, slice = 0;
+	const char *breaks[DEBUG_POINTS_MAX] = {};
+	uint64_t watches[DEBUG_POINTS_MAX] = {};
+	size_t breaks_num = 0, watches_num = 0;
+#ifdef VM_PROFILE
+	const char *profile_file = NULL, *sample_file = NULL;
+	size_t sample_rate = SAMPLE_RATE;
+	bool perf_stats = false;
+#endif
+	int opt = 0;
 
+	while ((opt = getopt_long (argc, argv, "s:c:m:f:v:i:bj:t:w:F:L:n:r:e:CB:W:" PROFILE_OPT, options, NULL)) != -1) {
+		switch (opt) {
+			case 's':
+				if (parse_size (optarg, &config.stack_size))
+					return 1;
+				break;
+			case 'c':
+				if (parse_size (optarg, &config.call_depth))
+					return 1;
+				break;
+			case 'm':
+				if (parse_size (optarg, &config.ram_size))
+					return 1;
+				break;
+			case 'f':
+				config.ram_file = optarg;
+				break;
+			case 'v':
+				config.simd = optarg;
+				break;
+			case 'i':
+				if (parse_io_mode (optarg, &config.io))
+					return 1;
+				break;
+			case 'b':
+				batch = true;
+				break;
+			case 'j':
+				if (parse_size (optarg, &jobs))
+					return 1;
+				break;
+			case 't':
+				if (parse_size (optarg, &config.task_stack))
+					return 1;
+				break;
+			case 'w':
+				if (parse_size (optarg, &config.workers))
+					return 1;
+				break;
+			case 'F':
+				if (parse_size (optarg, &fuel))
+					return 1;
+				break;
+			case 'L':
+				if (parse_size (optarg, &slice))
+					return 1;
+				break;
+			case 'n':
+				snapshot_file = optarg;
+				break;
+			case 'r':
+				restore_file = optarg;
+				break;
+			case 'e':
+				if (parse_engine (optarg, &config.engine))
+					return 1;
+				break;
+			case 'C':
+				count = true;
+				break;
+			case 'B':
+			case 'W':
+				if (breaks_num + watches_num == DEBUG_POINTS_MAX) {
+					fprintf (stderr, "Processor: more than %d breakpoints and watchpoints\n",
+					         DEBUG_POINTS_MAX);
+					return 1;
+				}
+				if (opt == 'B')
+					breaks[breaks_num++] = optarg;
+				else if (parse_addr (optarg, &watches[watches_num++]))
+					return 1;
+				break;
+#ifdef VM_PROFILE
+			case 'p':
+				profile_file = optarg;
+				break;
+			case 'S':
+				sample_file = optarg;
+				break;
+			case 'R':
+				if (parse_size (optarg, &sample_rate))
+					return 1;
+				break;
+			case 'P':
+				perf_stats = true;
+				break;
+#endif
+			default:
+				optind = argc;
+				break;
+		}
+	}
 
-	if (argc != 2) {
-		fprintf (stderr, "Usage: %s filename\n", argv[0]);
+#ifdef VM_PROFILE
+	if ((profile_file != NULL) + (sample_file != NULL) + perf_stats > 1) {
+		fprintf (stderr, "Processor: --profile, --sample and --perf-stats can't be used together\n");
 		return 1;
 	}
-
-	input = fopen (argv[1], "r");
-	if (!input) {
-		fprintf (stderr, "Can't open file %s\n", argv[1]);
+	if (batch && (profile_file || sample_file || perf_stats)) {
+		fprintf (stderr, "Processor: --batch can't be profiled\n");
 		return 1;
 	}
-
-	if (stat (argv[1], &st) < 0) {
-		fprintf (stderr, "Stat syscall failed\n");
-		fclose (input);
+	if (config.workers > 1 && (profile_file || sample_file || perf_stats)) {
+		fprintf (stderr, "Processor: more than one worker can't be profiled\n");
 		return 1;
 	}
-
-	byte_code_len = (size_t) st.st_size;
-
-	if ((sign_and_ver_len = check_sign_and_ver (input)) < 0) {
-		fprintf (stderr, "Input file type verification failed\n");
-		fclose (input);
+	if (config.engine == ENGINE_REG && (profile_file || sample_file || perf_stats)) {
+		fprintf (stderr, "Processor: the register engine can't be profiled\n");
+		return 1;
+	}
+	if ((breaks_num || watches_num) && (profile_file || sample_file || perf_stats)) {
+		fprintf (stderr, "Processor: a debugged run can't be profiled\n");
+		return 1;
+	}
+#endif
+	if ((breaks_num || watches_num) && (batch || config.workers > 1 || config.engine == ENGINE_REG)) {
+		fprintf (stderr, "Processor: only a single stack engine run can be debugged\n");
+		return 1;
+	}
+	if (config.workers > 1 && (fuel || slice)) {
+		fprintf (stderr, "Processor: more than one worker can't run on --fuel\n");
+		return 1;
+	}
+	if (!batch && slice) {
+		fprintf (stderr, "Processor: --slice needs --batch\n");
+		return 1;
+	}
+	if (batch && (snapshot_file || restore_file)) {
+		fprintf (stderr, "Processor: --batch runs can't be saved or restored\n");
+		return 1;
+	}
+	if (config.engine == ENGINE_REG && (snapshot_file || restore_file)) {
+		fprintf (stderr, "Processor: the register engine can't be saved or restored\n");
+		return 1;
+	}
+	if (batch && config.ram_file) {
+		fprintf (stderr, "Processor: --batch runs can't share a RAM file\n");
 		return 1;
 	}
 
-	byte_code_len -= (size_t) sign_and_ver_len;
+	if ((!batch && optind != argc - 1) || (batch && optind >= argc - 1)) {
+		fprintf (stderr, "Usage: %s [--stack-size cells] [--call-depth calls] "
+		                 "[--ram-size words] [--ram-file file] [--simd auto|avx2|sse2|scalar] "
+		                 "[--io stdio|text|binary] [--task-stack cells] [--workers n] [--fuel commands] "
+		                 "[--snapshot file] [--restore file] [--engine stack|reg] [--count] "
+		                 "[--break label|line]... [--watch address]... " PROFILE_USAGE "filename\n"
+		                 "       %s --batch [--jobs n] [--slice commands] [options] filename input...\n",
+		                 argv[0], argv[0]);
+		return 1;
+	}
 
-	byte_code = (char *) calloc (byte_code_len, sizeof (char));
-	if (!byte_code) {
-		fprintf (stderr, "Can't allocate memory\n");
-		fclose (input);
+	if (load_byte_code (&input, argv[optind], false))
 		return 1;
+
+	/* Every run reads a file of its own, stdio has just one stdin */
+	if (batch) {
+		if (config.io == IO_STDIO)
+			config.io = IO_TEXT;
+		status = (run_batch (&config, input.code, input.code_len, input.flags, argv + optind + 1,
+		                     (size_t) (argc - optind - 1), jobs, (fuel) ? fuel : VM_FUEL_UNLIMITED,
+		                     (slice) ? slice : VM_FUEL_UNLIMITED)) ? VM_ERR_LOAD : VM_HALTED;
+		unload_byte_code (&input);
+		return (status == VM_HALTED) ? 0 : 1;
 	}
 
-	if (fread (byte_code, sizeof (char), byte_code_len, input) < byte_code_len) {
-		fprintf (stderr, "Failed to read byte_code from %s\n", argv[1]);
-		free (byte_code);
-		fclose (input);
+	vm = vm_create (&config);
+	if (!vm || vm_load (vm, input.code, input.code_len, input.flags) || (restore_file && vm_restore (vm, restore_file))) {
+		vm_destroy (vm);
+		unload_byte_code (&input);
 		return 1;
 	}
 
-	stack_error = stack_ctor (&stack, sizeof (int), "int", print_int);
-	if (stack_error != OK) {
-		fprintf (stderr, "Stack creator returned code %d\n", stack_error);
-		free (byte_code);
-		fclose (input);
+#ifdef VM_PROFILE
+	if ((profile_file && vm_profile_start (vm)) ||
+	    (sample_file && vm_sample_start (vm, sample_rate)) ||
+	    (perf_stats && vm_perf_start (vm))) {
+		vm_destroy (vm);
+		unload_byte_code (&input);
+		return 1;
+	}
+#endif
+	if ((breaks_num || watches_num) && start_debug (vm, &input, breaks, breaks_num, watches, watches_num)) {
+		vm_destroy (vm);
+		unload_byte_code (&input);
 		return 1;
 	}
 
-	while (pc < byte_code_len) {
-		cmd = byte_code[pc++];
-		imm = (cmd & IMM);
-		reg = (cmd & REG);
-		mem = (cmd & MEM);
+	/* With --snapshot a run out of fuel is saved to go on later */
+	if (vm->debug)
+		status = vm_debug_run (vm, &input, (fuel) ? fuel : VM_FUEL_UNLIMITED);
+	else
+		status = vm_run (vm, (fuel) ? fuel : VM_FUEL_UNLIMITED);
+	if (status == VM_SUSPENDED && !snapshot_file)
+		fprintf (stderr, "Processor: out of fuel after %" PRIu64 " commands\n", vm->fuel_used);
+	else if (count)
+		fprintf (stderr, "Processor: %" PRIu64 " commands\n", vm->fuel_used);
+#ifdef VM_PROFILE
+	if (perf_stats)
+		vm_perf_report (vm);
+#endif
+	if (snapshot_file && (status == VM_HALTED || status == VM_SUSPENDED))
+		status = (vm_snapshot (vm, snapshot_file)) ? VM_ERR_IO : VM_HALTED;
 
-		switch (cmd & CMD) {
-			case CMD_PUSH:
-				arg = 0;
-				if (!imm && !reg) {
-					fprintf (stderr, "Processor: push format error %d\n", cmd);
-					break;
-				}
-				if (imm) {
-					arg = *(int *)(byte_code + pc);
-					pc += sizeof (int);
-				}
-				if (reg)
-					arg += regs[(size_t) byte_code[pc++]];
-				if (mem)
-					arg = ram[arg];
-				stack_push (&stack, (void *) &arg);
-				break;
-			case CMD_POP:
-				arg = 0;
-				if ((imm && !mem) ||
-				    (mem && !imm && !reg)) {
-					fprintf (stderr, "Processor: pop format error %d\n", cmd);
-					break;
-				} else if (mem) {
-					if (imm) {
-						arg = *(int *)(byte_code + pc);
-						pc += sizeof (int);
-					}
-					if (reg)
-						arg += regs[(size_t) byte_code[pc++] - 1];
-					if (arg < 0 || arg >= RAM_SIZE)
-					{
-						fprintf (stderr, "Processor: segmantation fault, can't pop to address %d\n", arg);
-						break;
-					}
-					stack_pop (&stack, (void *) &ram[arg]);
-				} else if (reg && !imm && !mem) {
+#ifdef VM_PROFILE
+	if (profile_file && vm_profile_write (vm, profile_file, argv[optind]) && status == VM_HALTED)
+		status = VM_ERR_IO;
+	if (sample_file && vm_sample_write (vm, sample_file, &input, argv[optind]) && status == VM_HALTED)
+		status = VM_ERR_IO;
+#endif
+	vm_destroy (vm);
+	unload_byte_code (&input);
 
-					stack_pop (&stack, (void *) (regs + byte_code[pc++]));
-				} else {
-					stack_pop (&stack, (void *) &arg);
-					printf ("Stack returned %d\n", arg);
-				}
-				break;
-			case CMD_ADD:
-				stack_pop (&stack, (void *) &op2);
-				stack_pop (&stack, (void *) &op1);
-				arg = op1 + op2;
-				stack_push (&stack, (void *) &arg);
-				break;
-			case CMD_SUB:
-				stack_pop (&stack, (void *) &op2);
-				stack_pop (&stack, (void *) &op1);
-				arg = op1 - op2;
-				stack_push (&stack, (void *) &arg);
-				break;
-			case CMD_MUL:
-				stack_pop (&stack, (void *) &op2);
-				stack_pop (&stack, (void *) &op1);
-				arg = op1 * op2;
-				stack_push (&stack, (void *) &arg);
-				break;
-			case CMD_DIV:
-				stack_pop (&stack, (void *) &op2);
-				stack_pop (&stack, (void *) &op1);
-				if (op2 != 0) {
-					arg = op1 / op2;
-					stack_push (&stack, (void *) &arg);
-				} else {
-					fprintf (stderr, "Processor: zero division\n");
-					return 4;
-				}
-				break;
-			case CMD_IN:
-				if (scanf ("%d", &arg) > 0) {
-					stack_push (&stack, (void *) &arg);
-				} else {
-					fprintf (stderr, "Processor: \"in\" operation error\n");
-				}
-				break;
-			case CMD_OUT:
-				stack_pop (&stack, (void *) &arg);
-				printf ("out: %d\n", arg);
-				break;
-			case CMD_HLT:
-				goto out;
-				break;
-			case CMD_JMP:
-				arg = *(int *) (byte_code + pc);
-				pc = (size_t) arg;
-				break;
-			case CMD_JA:
-				stack_pop (&stack, (void *) &op2);
-				stack_pop (&stack, (void *) &op1);
-				if (op1 > op2) {
-					arg = *(int *) (byte_code + pc);
-					pc = (size_t) arg;
-				} else {
-					pc += sizeof (int);
-				}
-				break;
-			case CMD_JAE:
-				stack_pop (&stack, (void *) &op2);
-				stack_pop (&stack, (void *) &op1);
-				if (op1 >= op2) {
-					arg = *(int *) (byte_code + pc);
-					pc = (size_t) arg;
-				} else {
-					pc += sizeof (int);
-				}
-				break;
-			case CMD_JB:
-				stack_pop (&stack, (void *) &op2);
-				stack_pop (&stack, (void *) &op1);
-				if (op1 < op2) {
-					arg = *(int *) (byte_code + pc);
-					pc = (size_t) arg;
-				} else {
-					pc += sizeof (int);
-				}
-				break;
-			case CMD_JBE:
-				stack_pop (&stack, (void *) &op2);
-				stack_pop (&stack, (void *) &op1);
-				if (op1 <= op2) {
-					arg = *(int *) (byte_code + pc);
-					pc = (size_t) arg;
-				} else {
-					pc += sizeof (int);
-				}
-				break;
-			case CMD_JE:
-				stack_pop (&stack, (void *) &op2);
-				stack_pop (&stack, (void *) &op1);
-				if (op1 == op2) {
-					arg = *(int *) (byte_code + pc);
-					pc = (size_t) arg;
-				} else {
-					pc += sizeof (int);
-				}
-				break;
-			case CMD_JNE:
-				stack_pop (&stack, (void *) &op2);
-				stack_pop (&stack, (void *) &op1);
-				if (op1 != op2) {
-					arg = *(int *) (byte_code + pc);
-					pc = (size_t) arg;
-				} else {
-					pc += sizeof (int);
-				}
-				break;
-			case CMD_CALL:
-				arg = (int) (pc + 4);
-				stack_push (&stack, (void *) &arg);
-				arg = *(int *) (byte_code + pc);
-				pc = (size_t) arg;
-				break;
-			case CMD_RET:
-				stack_pop (&stack, (void *) &arg);
-				pc = (size_t) arg;
-				break;
-			default:
-				fprintf (stderr, "Processor: unknown command: %d\n", cmd);
-				goto out;
-				break;
+	if (status == VM_ERR_ZERO_DIV)
+		return 4;
+	return (status == VM_HALTED) ? 0 : 1;
+}
+
+/*
+ * Accepts an optional K, M or G suffix.
+ */
+static int parse_size (const char *str, size_t *size)
+{
+	char *end = NULL;
+	unsigned long long val = strtoull (str, &end, 10);
+	int shift = 0;
+
+	if (end != str && end[0] && !end[1]) {
+		shift = (*end == 'K' || *end == 'k') ? 10 :
+		        (*end == 'M' || *end == 'm') ? 20 :
+		        (*end == 'G' || *end == 'g') ? 30 : -1;
+		if (shift > 0 && val <= (1ULL << 32)) {
+			val <<= shift;
+			end++;
 		}
 	}
-out:
 
-	stack_error = stack_dtor (&stack);
-	if (stack_error != OK) {
-		fprintf (stderr, "Stack destructor returned code %d\n", stack_error);
-		fclose (input);
-		free (byte_code);
+	if (end == str || *end || val == 0 || val > (1ULL << 32)) {
+		fprintf (stderr, "Processor: invalid size \"%s\"\n", str);
 		return 1;
 	}
 
-	fclose (input);
-	free (byte_code);
+	*size = (size_t) val;
 	return 0;
 }
 
-int print_int (const void *ptr)
+/* A RAM word, 0 is one too */
+static int parse_addr (const char *str, uint64_t *addr)
 {
-	assert (ptr);
+	char *end = NULL;
+	unsigned long long val = strtoull (str, &end, 0);
+
+	if (end == str || *end || str[0] == '-') {
+		fprintf (stderr, "Processor: invalid address \"%s\"\n", str);
+		return 1;
+	}
+
+	*addr = (uint64_t) val;
+	return 0;
+}
 
-	printf ("%d\n", *((const int *) ptr));
+static int parse_io_mode (const char *str, enum io_mode *mode)
+{
+	if (!strcmp (str, "stdio"))
+		*mode = IO_STDIO;
+	else if (!strcmp (str, "text"))
+		*mode = IO_TEXT;
+	else if (!strcmp (str, "binary"))
+		*mode = IO_BINARY;
+	else {
+		fprintf (stderr, "Processor: unknown I/O mode \"%s\"\n", str);
+		return 1;
+	}
 	return 0;
 }
 
+static int parse_engine (const char *str, enum vm_engine *engine)
+{
+	if (!strcmp (str, "stack"))
+		*engine = ENGINE_STACK;
+	else if (!strcmp (str, "reg"))
+		*engine = ENGINE_REG;
+	else {
+		fprintf (stderr, "Processor: unknown engine \"%s\"\n", str);
+		return 1;
+	}
+	return 0;
+}
+
+static int start_debug (struct vm *vm, const struct byte_code_file *input, const char **breaks,
+			const size_t breaks_num, const uint64_t *watches, const size_t watches_num)
+{
+	uint32_t pc = 0;
+
+	if (vm_debug_start (vm))
+		return 1;
+	for (size_t i = 0; i < breaks_num; i++) {
+		if (debug_find_pc (input, breaks[i], &pc) || vm_break_set (vm, pc))
+			return 1;
+	}
+	for (size_t i = 0; i < watches_num; i++) {
+		if (vm_watch_set (vm, watches[i]))
+			return 1;
+	}
+	return 0;
+}
@@ -2,12 +2,19 @@
 #define PROCESSOR_H
 
 #include <stdio.h>
+#include <stdint.h>
 
 #define IMM 0x20
 #define REG 0x40
 #define MEM 0x80
 #define CMD 0x1F
 
+#define FUSED_COND(cmd) (((unsigned char) (cmd) >> 5) & 0x07)
+#define FUSED_ALU(cmd)  (((unsigned char) (cmd) >> 6) & 0x03)
+#define PREFIX_TYPE(cmd) (((unsigned char) (cmd) >> 5) & 0x07)
+#define VEC_OP(cmd)     (((unsigned char) (cmd) >> 5) & 0x07)
+#define TASK_OP(cmd)    (((unsigned char) (cmd) >> 5) & 0x07)
+
 enum commands
 {
 	CMD_HLT,
@@ -27,12 +34,146 @@ enum commands
 	CMD_JE,
 	CMD_JNE,
 	CMD_CALL,
-	CMD_RET
+	CMD_RET,
+	CMD_CMPJ,	// push reg; push imm; jcc label
+	CMD_OPREG,	// push reg; push reg/imm; add/sub/mul/div; pop reg
+	CMD_TYPE,	// type prefix of the next command
+	CMD_VEC,	// vector command on RAM ranges
+	CMD_TASK	// task and channel command
+};
+
+/*
+ * Vector commands take a register with the base address of every range
+ * and a length register: vadd dst, a, b, len.  vsum and vdot push the
+ * result, vfill pops the value to store.  vin and vout read and write
+ * len values like in and out do.
+ */
+enum vec_ops
+{
+	VEC_ADD,
+	VEC_MUL,
+	VEC_SUM,
+	VEC_DOT,
+	VEC_FILL,
+	VEC_IN,
+	VEC_OUT,
+	VEC_NUM
+};
+
+/*
+ * spawn label pops an argument and pushes the id of a new task, which
+ * starts at label with the argument as its only stack element and a copy
+ * of the registers.  join replaces a task id with the value the task left
+ * on top at hlt, chan replaces a capacity with a channel id.  send pops a
+ * value and a channel id, recv replaces a channel id with a value.
+ */
+enum task_ops
+{
+	TASK_SPAWN,
+	TASK_YIELD,
+	TASK_JOIN,
+	TASK_CHAN,
+	TASK_SEND,
+	TASK_RECV,
+	TASK_NUM
+};
+
+/*
+ * Value types of the type prefix.  A typed push of a plain immediate
+ * carries a 64-bit value, addresses stay 32-bit.
+ */
+enum value_type
+{
+	TYPE_INT,
+	TYPE_INT64,	// .q
+	TYPE_DOUBLE,	// .d
+	TYPE_NUM
+};
+
+#define SECT_ALIGN 64
+
+enum section_type
+{
+	SECT_CODE,
+	SECT_CONST,
+	SECT_SYMBOLS,
+	SECT_LINES,
+	SECT_RELOCS,
+	SECT_NUM
+};
+
+/*
+ * v5 file: header, section table, then sections aligned to SECT_ALIGN.
+ * checksum covers the header (with checksum = 0), the table and every section.
+ * Files written before SECT_RELOCS was added have no entry for it.
+ */
+struct file_header
+{
+	char sign_and_ver[4];
+	uint32_t header_size;
+	uint32_t sections_num;
+	uint32_t flags;
+	uint64_t source_hash;
+	uint64_t checksum;
+};
+
+/*
+ * file_header.flags.  FILE_COMPACT: 32-bit operands are zigzag varints and
+ * targets are relative to the byte their operand starts at.  FILE_OBJECT:
+ * output of compiler -c, every target is 0 and has an entry in
+ * SECT_RELOCS, labels used but not defined have shift -1 in SECT_SYMBOLS.
+ */
+#define FILE_COMPACT 0x1
+#define FILE_OBJECT 0x2
+
+struct section_entry
+{
+	uint32_t type;
+	uint32_t reserved;
+	uint64_t offset;
+	uint64_t size;
+};
+
+// SECT_SYMBOLS: uint32_t count, uint32_t reserved, symbol_entry[count] sorted by shift, names
+struct symbol_entry
+{
+	int32_t shift;
+	uint32_t name;
+};
+
+// SECT_LINES: line_entry[] sorted by pc
+struct line_entry
+{
+	uint32_t pc;
+	uint32_t line;
+};
+
+// SECT_RELOCS: reloc_entry[] sorted by pos, name is an offset in the names of SECT_SYMBOLS
+struct reloc_entry
+{
+	uint32_t pos;
+	uint32_t name;
+};
+
+struct section_buf
+{
+	const void *data;
+	size_t len;
 };
 
 char *get_reg_name (const char reg_num);
+int get_vec_regs_num (const int op);
+
+uint64_t hash64 (const void *data, const size_t len, const uint64_t seed);
+uint64_t count_checksum (const struct file_header *header,
+			 const struct section_entry *table,
+			 const char *const *sections);
+int write_byte_code (FILE *file, const struct section_buf *sections, const uint64_t source_hash,
+		     const uint32_t flags);
+int check_sign_and_ver (const char *data, const size_t len);
 
-int write_sign_and_ver (FILE * file);
-int check_sign_and_ver (FILE * file);
+size_t put_varint (char *buf, const int32_t val);
+int read_operand (const char *code, const size_t len, size_t *pc, const uint32_t flags, int32_t *val);
+int read_target (const char *code, const size_t len, size_t *pc, const uint32_t flags, int32_t *target);
 
 #endif // PROCESSOR_H
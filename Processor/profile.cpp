@@ -0,0 +1,398 @@
+#include "vm.h"
+#include "profile.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <sys/time.h>
+
+struct op_stat
+{
+	int op;
+	uint64_t count;
+	uint64_t ticks;
+};
+
+static int cmp_op_stat (const void *a, const void *b);
+static void sample_handler (int);
+static int cmp_lines (const void *a, const void *b);
+static char *fold_sample (const struct vm *vm, const uint32_t *sample, const struct byte_code_file *input,
+			  const char *root);
+static size_t add_frame (char **text, size_t *cap, size_t len, const char *frame);
+
+static struct vm_sampler *volatile active_sampler = NULL;
+
+/* Same order as enum vm_op */
+static const char *op_names[OP_NUM] = {
+	"HLT", "PUSH_IMM", "PUSH_REG", "PUSH_MEM_IMM", "PUSH_MEM_REG",
+	"POP", "POP_REG", "POP_MEM_IMM", "POP_MEM_REG",
+	"ADD", "SUB", "MUL", "DIV", "IN", "OUT",
+	"JMP", "JA", "JAE", "JB", "JBE", "JE", "JNE", "CALL", "RET",
+	"CMPJ_A", "CMPJ_AE", "CMPJ_B", "CMPJ_BE", "CMPJ_E", "CMPJ_NE",
+	"ADD_RR", "ADD_RI", "SUB_RR", "SUB_RI", "MUL_RR", "MUL_RI", "DIV_RR", "DIV_RI",
+	"POP_Q", "POP_D", "IN_Q", "IN_D", "OUT_Q", "OUT_D",
+	"ADD_Q", "SUB_Q", "MUL_Q", "DIV_Q", "ADD_D", "SUB_D", "MUL_D", "DIV_D",
+	"JA_Q", "JAE_Q", "JB_Q", "JBE_Q", "JE_Q", "JNE_Q",
+	"JA_D", "JAE_D", "JB_D", "JBE_D", "JE_D", "JNE_D",
+	"VADD", "VMUL", "VSUM", "VDOT", "VFILL", "VIN", "VOUT",
+	"SPAWN", "YIELD", "JOIN", "CHAN", "SEND", "RECV", "TRAP"
+};
+
+int vm_profile_start (struct vm *vm)
+{
+	struct vm_profile *prof = NULL;
+	const size_t num = vm->code_num + 1, depth = vm->config.call_depth;
+
+	prof = (struct vm_profile *) calloc (1, sizeof (*prof));
+	if (!prof)
+		goto out_err;
+	vm->profile = prof;
+
+	prof->count = (uint64_t *) calloc (num, sizeof (uint64_t));
+	prof->ticks = (uint64_t *) calloc (num, sizeof (uint64_t));
+	prof->leader = (uint8_t *) calloc (num, sizeof (uint8_t));
+	prof->calls = (uint64_t *) calloc (num, sizeof (uint64_t));
+	prof->call_ticks = (uint64_t *) calloc (num, sizeof (uint64_t));
+	prof->frame_func = (int32_t *) calloc (depth, sizeof (int32_t));
+	prof->frame_start = (uint64_t *) calloc (depth, sizeof (uint64_t));
+	prof->active = (uint32_t *) calloc (num, sizeof (uint32_t));
+	if (!prof->count || !prof->ticks || !prof->leader || !prof->calls || !prof->call_ticks ||
+	    !prof->frame_func || !prof->frame_start || !prof->active)
+		goto out_err;
+
+	prof->leader[0] = 1;
+	for (size_t i = 0; i < vm->code_num; i++) {
+		if (op_has_target (vm->code[i].op))
+			prof->leader[vm->code[i].target] = 1;
+		if (op_is_control (vm->code[i].op))
+			prof->leader[i + 1] = 1;
+	}
+
+	prof->last = profile_clock ();
+	return 0;
+
+out_err:
+	fprintf (stderr, "Processor: can't allocate profile of %zu instructions\n", vm->code_num);
+	vm_profile_free (vm);
+	return 1;
+}
+
+/*
+ * Charges the last block and splits the ticks of every block over its
+ * instructions by their counts, they run the same number of times unless
+ * the block was left by a fault.
+ */
+void vm_profile_stop (struct vm *vm)
+{
+	struct vm_profile *prof = vm->profile;
+	const uint64_t now = profile_clock ();
+	uint64_t ticks = 0, count = 0, left = 0;
+	size_t start = 0, end = 0;
+
+	prof->ticks[prof->prev] += now - prof->last;
+	prof->last = now;
+
+	for (start = 0; start < vm->code_num; start = end) {
+		count = 0;
+		for (end = start; end < vm->code_num && (end == start || !prof->leader[end]); end++)
+			count += prof->count[end];
+		if (!count)
+			continue;
+
+		ticks = left = prof->ticks[start];
+		for (size_t i = start; i < end; i++) {
+			prof->ticks[i] = (uint64_t) ((double) ticks * (double) prof->count[i] / (double) count);
+			left -= prof->ticks[i];
+		}
+		prof->ticks[start] += left;
+	}
+}
+
+/*
+ * Text report, one record per line: "total <insns> <ticks> <clock>",
+ * "op <name> <count> <ticks>" hottest first, then "pc <offset> <count>
+ * <ticks>" and "call <target offset> <calls> <inclusive ticks>" in byte
+ * code order.  Lines starting with '#' are comments.
+ */
+int vm_profile_write (const struct vm *vm, const char *file_name, const char *code_name)
+{
+	const struct vm_profile *prof = vm->profile;
+	struct op_stat ops[OP_NUM] = {};
+	uint64_t total = 0, total_ticks = 0;
+	FILE *file = NULL;
+	int op = 0;
+
+	file = fopen (file_name, "w");
+	if (!file) {
+		fprintf (stderr, "Processor: can't open profile file %s\n", file_name);
+		return 1;
+	}
+
+	for (op = 0; op < OP_NUM; op++)
+		ops[op].op = op;
+	for (size_t i = 0; i < vm->code_num; i++) {
+		ops[vm->code[i].op].count += prof->count[i];
+		ops[vm->code[i].op].ticks += prof->ticks[i];
+		total += prof->count[i];
+		total_ticks += prof->ticks[i];
+	}
+	qsort (ops, OP_NUM, sizeof (ops[0]), cmp_op_stat);
+
+	fprintf (file, "# profile of %s\n", code_name);
+	fprintf (file, "total %" PRIu64 " %" PRIu64 " " PROFILE_CLOCK_NAME "\n", total, total_ticks);
+
+	for (op = 0; op < OP_NUM && ops[op].count; op++)
+		fprintf (file, "op %s %" PRIu64 " %" PRIu64 "\n", op_names[ops[op].op], ops[op].count, ops[op].ticks);
+
+	for (size_t i = 0; i < vm->code_num; i++)
+		if (prof->count[i])
+			fprintf (file, "pc %u %" PRIu64 " %" PRIu64 "\n", vm->insn_pc[i], prof->count[i], prof->ticks[i]);
+
+	for (size_t i = 0; i < vm->code_num; i++)
+		if (prof->calls[i])
+			fprintf (file, "call %u %" PRIu64 " %" PRIu64 "\n", vm->insn_pc[i], prof->calls[i], prof->call_ticks[i]);
+
+	if (fclose (file)) {
+		fprintf (stderr, "Processor: can't write profile file %s\n", file_name);
+		return 1;
+	}
+	return 0;
+}
+
+void vm_profile_free (struct vm *vm)
+{
+	struct vm_profile *prof = vm->profile;
+
+	if (!prof)
+		return;
+	free (prof->count);
+	free (prof->ticks);
+	free (prof->leader);
+	free (prof->calls);
+	free (prof->call_ticks);
+	free (prof->frame_func);
+	free (prof->frame_start);
+	free (prof->active);
+	free (prof);
+	vm->profile = NULL;
+}
+
+/* rate is in samples per second of CPU time */
+int vm_sample_start (struct vm *vm, const size_t rate)
+{
+	struct vm_sampler *smp = NULL;
+	struct sigaction action = {};
+	struct itimerval timer = {};
+
+	if (rate > 1000000) {
+		fprintf (stderr, "Processor: sampling rate %zu is above 1000000\n", rate);
+		return 1;
+	}
+
+	smp = (struct vm_sampler *) calloc (1, sizeof (*smp));
+	if (!smp || !(smp->buf = (uint32_t *) malloc (SAMPLE_BUF_WORDS * sizeof (uint32_t)))) {
+		fprintf (stderr, "Processor: can't allocate sample buffer\n");
+		free (smp);
+		return 1;
+	}
+	smp->code = vm->code;
+	smp->calls = vm->calls;
+	smp->csp = vm->calls;
+	vm->sampler = smp;
+	active_sampler = smp;
+
+	action.sa_handler = sample_handler;
+	action.sa_flags = SA_RESTART;
+	sigemptyset (&action.sa_mask);
+	if (sigaction (SIGPROF, &action, &smp->old_action)) {
+		perror ("Processor: can't set SIGPROF handler");
+		vm_sample_stop (vm);
+		return 1;
+	}
+	smp->armed = true;
+
+	timer.it_interval.tv_sec = (time_t) (1 / rate);
+	timer.it_interval.tv_usec = (suseconds_t) ((rate > 1) ? 1000000 / rate : 0);
+	timer.it_value = timer.it_interval;
+	if (setitimer (ITIMER_PROF, &timer, NULL)) {
+		perror ("Processor: can't start profiling timer");
+		vm_sample_stop (vm);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Folded stacks, one line per distinct stack: the program, the called
+ * functions outermost first and the command with its pc, then the number
+ * of samples.  flamegraph.pl and speedscope read them as they are.
+ */
+int vm_sample_write (const struct vm *vm, const char *file_name, const struct byte_code_file *input,
+		     const char *code_name)
+{
+	const struct vm_sampler *smp = vm->sampler;
+	const char *root = strrchr (code_name, '/');
+	char **lines = NULL;
+	size_t num = 0, count = 0;
+	FILE *file = NULL;
+	int res = 1;
+
+	root = (root) ? root + 1 : code_name;
+	if (smp->dropped)
+		fprintf (stderr, "Processor: %zu samples dropped, the buffer is full\n", smp->dropped);
+
+	lines = (char **) calloc (smp->samples + 1, sizeof (char *));
+	if (!lines)
+		goto out_mem;
+	for (size_t pos = 0; pos < smp->len; pos += smp->buf[pos] + 3) {
+		lines[num] = fold_sample (vm, smp->buf + pos, input, root);
+		if (!lines[num])
+			goto out_mem;
+		num++;
+	}
+	qsort (lines, num, sizeof (lines[0]), cmp_lines);
+
+	file = fopen (file_name, "w");
+	if (!file) {
+		fprintf (stderr, "Processor: can't open sample file %s\n", file_name);
+		goto out;
+	}
+	for (size_t i = 0; i < num; i += count) {
+		for (count = 1; i + count < num && !strcmp (lines[i], lines[i + count]); count++)
+			;
+		fprintf (file, "%s %zu\n", lines[i], count);
+	}
+	if (fclose (file)) {
+		fprintf (stderr, "Processor: can't write sample file %s\n", file_name);
+		goto out;
+	}
+	res = 0;
+	goto out;
+
+out_mem:
+	fprintf (stderr, "Processor: can't allocate folded stacks\n");
+out:
+	for (size_t i = 0; lines && i < num; i++)
+		free (lines[i]);
+	free (lines);
+	return res;
+}
+
+void vm_sample_stop (struct vm *vm)
+{
+	struct vm_sampler *smp = vm->sampler;
+	struct itimerval timer = {};
+
+	if (!smp)
+		return;
+	if (smp->armed) {
+		setitimer (ITIMER_PROF, &timer, NULL);
+		sigaction (SIGPROF, &smp->old_action, NULL);
+	}
+	active_sampler = NULL;
+	free (smp->buf);
+	free (smp);
+	vm->sampler = NULL;
+}
+
+/* Runs in the signal handler: no locks, no allocation. */
+static void sample_handler (int)
+{
+	struct vm_sampler *smp = active_sampler;
+	const struct insn *ip = NULL, **calls = NULL;
+	size_t depth = 0, first = 0;
+
+	if (!smp || !(ip = smp->ip))
+		return;
+
+	calls = smp->calls;
+	depth = (size_t) (smp->csp - calls);
+	if (depth > SAMPLE_DEPTH)
+		first = depth - SAMPLE_DEPTH;
+	if (smp->len + (depth - first) + 3 > SAMPLE_BUF_WORDS) {
+		smp->dropped++;
+		return;
+	}
+
+	smp->buf[smp->len++] = (uint32_t) (depth - first);
+	smp->buf[smp->len++] = (first) ? 1 : 0;
+	for (size_t i = first; i < depth; i++)
+		smp->buf[smp->len++] = (uint32_t) (calls[i] - smp->code);
+	smp->buf[smp->len++] = (uint32_t) (ip - smp->code);
+	smp->samples++;
+}
+
+/* A return address follows its call, the frame is named by the call target. */
+static char *fold_sample (const struct vm *vm, const uint32_t *sample, const struct byte_code_file *input,
+			  const char *root)
+{
+	char frame[64];
+	char *text = NULL;
+	size_t cap = 0, len = 0;
+	const struct insn *call = NULL;
+	const char *label = NULL;
+	uint32_t pc = 0, idx = 0;
+
+	len = add_frame (&text, &cap, len, root);
+	if (sample[1])
+		len = add_frame (&text, &cap, len, "[truncated]");
+	for (uint32_t i = 0; i < sample[0] && len; i++) {
+		call = vm->code + sample[2 + i] - 1;
+		pc = vm->insn_pc[call->target];
+		label = find_label (input, (int) pc);
+		if (!label) {
+			snprintf (frame, sizeof (frame), "sub_%04x", pc);
+			label = frame;
+		}
+		len = add_frame (&text, &cap, len, label);
+	}
+
+	idx = sample[2 + sample[0]];
+	snprintf (frame, sizeof (frame), "%s@%04x", op_names[vm->code[idx].op], vm->insn_pc[idx]);
+	if (len)
+		len = add_frame (&text, &cap, len, frame);
+
+	if (!len) {
+		free (text);
+		return NULL;
+	}
+	return text;
+}
+
+/* Appends ";frame", the first frame without ';'.  Returns 0 on failure. */
+static size_t add_frame (char **text, size_t *cap, size_t len, const char *frame)
+{
+	const size_t frame_len = strlen (frame);
+	char *new_text = NULL;
+
+	if (len + frame_len + 2 > *cap) {
+		*cap = (len + frame_len + 2) * 2;
+		new_text = (char *) realloc (*text, *cap);
+		if (!new_text)
+			return 0;
+		*text = new_text;
+	}
+
+	if (len)
+		(*text)[len++] = ';';
+	memcpy (*text + len, frame, frame_len + 1);
+	return len + frame_len;
+}
+
+static int cmp_lines (const void *a, const void *b)
+{
+	return strcmp (*(char *const *) a, *(char *const *) b);
+}
+
+static int cmp_op_stat (const void *a, const void *b)
+{
+	const struct op_stat *x = (const struct op_stat *) a, *y = (const struct op_stat *) b;
+
+	if (x->ticks != y->ticks)
+		return (x->ticks < y->ticks) ? 1 : -1;
+	if (x->count != y->count)
+		return (x->count < y->count) ? 1 : -1;
+	return x->op - y->op;
+}
@@ -0,0 +1,129 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "vm.h"
+
+#include "loader.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <signal.h>
+#if defined (__x86_64__) || defined (__i386__)
+#include <x86intrin.h>
+#define PROFILE_CLOCK_NAME "tsc"
+#else
+#define PROFILE_CLOCK_NAME "ns"
+#endif
+
+/*
+ * Execution counts and ticks of every pre-decoded instruction, calls and
+ * inclusive ticks of every call target.  Ticks are TSC cycles on x86 and
+ * nanoseconds elsewhere.  The clock is read when a basic block is entered
+ * only, the block is charged the ticks up to the next one and they are
+ * split over its instructions when the profile stops.  active counts the
+ * frames of each target on the call stack, only the outermost one adds
+ * its ticks, so recursion is not counted again.
+ */
+struct vm_profile
+{
+	uint64_t *count = NULL;
+	uint64_t *ticks = NULL;
+	uint8_t *leader = NULL;
+	uint64_t *calls = NULL;
+	uint64_t *call_ticks = NULL;
+	int32_t *frame_func = NULL;
+	uint64_t *frame_start = NULL;
+	uint32_t *active = NULL;
+	size_t enter = 0;
+	size_t leave = 0;
+	size_t prev = 0;
+	uint64_t last = 0;
+};
+
+static inline uint64_t profile_clock (void)
+{
+#if defined (__x86_64__) || defined (__i386__)
+	return __rdtsc ();
+#else
+	struct timespec ts = {};
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+#endif
+}
+
+static inline void profile_step (struct vm_profile *prof, const size_t idx)
+{
+	uint64_t now = 0;
+
+	prof->count[idx]++;
+	if (!prof->leader[idx])
+		return;
+
+	now = profile_clock ();
+	prof->ticks[prof->prev] += now - prof->last;
+	prof->prev = idx;
+	prof->last = now;
+
+	if (prof->enter || prof->leave) {
+		if (prof->enter)
+			prof->frame_start[prof->enter - 1] = now;
+		if (prof->leave && !--prof->active[prof->frame_func[prof->leave - 1]])
+			prof->call_ticks[prof->frame_func[prof->leave - 1]] += now - prof->frame_start[prof->leave - 1];
+		prof->enter = prof->leave = 0;
+	}
+}
+
+/*
+ * Call targets and return addresses start blocks, so frames are timed by
+ * the clock read there.  depth is the call stack depth before the call.
+ */
+static inline void profile_call (struct vm_profile *prof, const size_t depth, const int32_t target)
+{
+	prof->calls[target]++;
+	prof->active[target]++;
+	prof->frame_func[depth] = target;
+	prof->enter = depth + 1;
+}
+
+static inline void profile_ret (struct vm_profile *prof, const size_t depth)
+{
+	prof->leave = depth + 1;
+}
+
+#define SAMPLE_RATE 1000
+#define SAMPLE_DEPTH 256
+#define SAMPLE_BUF_WORDS (1 << 22)
+
+/*
+ * Statistical profile: the SIGPROF handler takes the command the sampled
+ * copy of the dispatch loop is at and the return addresses on the call
+ * stack.  A sample is stored in buf as its depth, a flag of a truncated
+ * stack, the return addresses outermost first and the command, all as
+ * indices of pre-decoded instructions.
+ */
+struct vm_sampler
+{
+	const struct insn *volatile ip = NULL;
+	const struct insn **volatile csp = NULL;
+	const struct insn *code = NULL;
+	const struct insn **volatile calls = NULL;
+	uint32_t *buf = NULL;
+	size_t len = 0;
+	size_t samples = 0;
+	size_t dropped = 0;
+	bool armed = false;
+	struct sigaction old_action = {};
+};
+
+int vm_profile_start (struct vm *vm);
+void vm_profile_stop (struct vm *vm);
+int vm_profile_write (const struct vm *vm, const char *file_name, const char *code_name);
+void vm_profile_free (struct vm *vm);
+
+int vm_sample_start (struct vm *vm, const size_t rate);
+int vm_sample_write (const struct vm *vm, const char *file_name, const struct byte_code_file *input,
+		     const char *code_name);
+void vm_sample_stop (struct vm *vm);
+
+#endif // PROFILE_H
@@ -0,0 +1,97 @@
+#include "vm.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static size_t round_up_pow2 (size_t size);
+static int map_ram_file (struct vm *vm, const int fd, const size_t size);
+
+/*
+ * RAM is reserved with MAP_NORESERVE, pages are allocated when touched.
+ * Its size in words is a power of two, so an address is checked with a mask.
+ */
+int vm_map_ram (struct vm *vm)
+{
+	size_t words = vm->config.ram_size;
+	struct stat st = {};
+	int fd = -1;
+
+	if (vm->config.ram_file) {
+		fd = open (vm->config.ram_file, O_RDWR);
+		if (fd < 0 || fstat (fd, &st)) {
+			fprintf (stderr, "Processor: can't open RAM file %s: %s\n",
+			         vm->config.ram_file, strerror (errno));
+			goto out_err;
+		}
+		if (((size_t) st.st_size + sizeof (cell_t) - 1) / sizeof (cell_t) > words)
+			words = ((size_t) st.st_size + sizeof (cell_t) - 1) / sizeof (cell_t);
+	}
+
+	if (words > VM_RAM_MAX) {
+		fprintf (stderr, "Processor: RAM size %zu words is too big, the limit is %zu\n",
+		         words, VM_RAM_MAX);
+		goto out_err;
+	}
+	words = round_up_pow2 (words);
+
+	vm->ram = (cell_t *) mmap (NULL, words * sizeof (cell_t), PROT_READ | PROT_WRITE,
+	                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (vm->ram == MAP_FAILED) {
+		fprintf (stderr, "Processor: can't map %zu words of RAM: %s\n", words, strerror (errno));
+		vm->ram = NULL;
+		goto out_err;
+	}
+	vm->ram_words = words;
+	vm->ram_mask = words - 1;
+
+	if (fd >= 0) {
+		if (map_ram_file (vm, fd, (size_t) st.st_size))
+			goto out_err;
+		close (fd);
+	}
+
+	return 0;
+
+out_err:
+	if (fd >= 0)
+		close (fd);
+	return 1;
+}
+
+void vm_unmap_ram (struct vm *vm)
+{
+	if (vm->ram)
+		munmap (vm->ram, vm->ram_words * sizeof (cell_t));
+	vm->ram = NULL;
+	vm->ram_words = 0;
+}
+
+static size_t round_up_pow2 (size_t size)
+{
+	size_t res = 1;
+
+	while (res < size)
+		res <<= 1;
+	return res;
+}
+
+/*
+ * The file is mapped shared over the beginning of the anonymous region,
+ * so stores go to the file and the rest of RAM stays zero-filled.
+ */
+static int map_ram_file (struct vm *vm, const int fd, const size_t size)
+{
+	if (size > 0 && mmap (vm->ram, size, PROT_READ | PROT_WRITE,
+	                      MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		fprintf (stderr, "Processor: can't map RAM file %s: %s\n",
+		         vm->config.ram_file, strerror (errno));
+		return 1;
+	}
+
+	return 0;
+}
@@ -14,3 +14,11 @@ char *get_reg_name (const char reg_num)
 	return NULL;
 }
 
+
+int get_vec_regs_num (const int op)
+{
+	if (op == VEC_ADD || op == VEC_MUL) return 4;
+	if (op == VEC_DOT) return 3;
+	if (op == VEC_SUM || op == VEC_FILL || op == VEC_IN || op == VEC_OUT) return 2;
+	return 0;
+}
@@ -0,0 +1,352 @@
+#include "processor.h"
+#include "vm.h"
+#include "regvm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+int reg_attach (struct vm *vm)
+{
+	const struct reg_code *rc = vm->reg_code;
+	struct reg_state *st = (struct reg_state *) calloc (1, sizeof (struct reg_state));
+
+	if (st) {
+		st->glob = (cell_t *) calloc (REGS_NUM + rc->consts_num, sizeof (cell_t));
+		st->frames = (struct reg_frame *) malloc (vm->config.call_depth * sizeof (struct reg_frame));
+	}
+	vm->reg = st;
+	if (!st || !st->glob || !st->frames) {
+		fprintf (stderr, "Processor: can't allocate memory for the register engine\n");
+		return 1;
+	}
+	if (rc->consts_num)
+		memcpy (st->glob + REGS_NUM, rc->consts, rc->consts_num * sizeof (cell_t));
+
+	return 0;
+}
+
+void reg_free (struct vm *vm)
+{
+	struct reg_code *rc = vm->reg_code;
+
+	if (vm->reg) {
+		free (vm->reg->glob);
+		free (vm->reg->frames);
+		free (vm->reg);
+	}
+	if (rc && !vm->shared_code) {
+		free (rc->code);
+		free (rc->pc);
+		free (rc->consts);
+		free (rc);
+	}
+	vm->reg = NULL;
+	vm->reg_code = NULL;
+}
+
+/* Odd operands are globals, even ones slots of the frame */
+#define OPND(x)	(base[(x) & 1][(x) >> 1])
+
+#define FAULT(err)		\
+	do {			\
+		res = (err);	\
+		goto out;	\
+	} while (0)
+
+/* Slots start at stack + 1 like the elements under tos do */
+#define CHECK_STACK()						\
+	do {							\
+		if (fp + ip->depth > stack_end)		\
+			FAULT (VM_ERR_STACK_OVERFLOW);		\
+	} while (0)
+
+#define CHECK_ADDR(addr)				\
+	do {						\
+		if ((addr) & ~ram_mask)			\
+			FAULT (VM_ERR_SEGFAULT);	\
+	} while (0)
+
+#define ALU_OP(expr)				\
+	do {					\
+		op1 = OPND (ip->a);		\
+		op2 = OPND (ip->b);		\
+		OPND (ip->d) = (expr);		\
+		ip++;				\
+	} while (0)
+
+#define INT_OP(oper)	ALU_OP (wrap32 ((uint64_t) op1 oper (uint64_t) op2))
+#define INT64_OP(oper)	ALU_OP ((cell_t) ((uint64_t) op1 oper (uint64_t) op2))
+#define DOUBLE_OP(oper)	ALU_OP (from_double (to_double (op1) oper to_double (op2)))
+
+#define CHARGE()							\
+	do {								\
+		fuel = (int64_t) ((uint64_t) fuel - ip->fuel_cost);	\
+		if (fuel < 0)						\
+			goto suspend;					\
+	} while (0)
+
+#define JUMP_IF(cond)						\
+	do {							\
+		CHECK_STACK ();					\
+		op1 = OPND (ip->a);				\
+		op2 = OPND (ip->b);				\
+		ip = (cond) ? code + ip->target : ip + 1;	\
+		CHARGE ();					\
+	} while (0)
+
+#define INT_JUMP(oper)		JUMP_IF ((int32_t) op1 oper (int32_t) op2)
+#define INT64_JUMP(oper)	JUMP_IF (op1 oper op2)
+#define DOUBLE_JUMP(cond)	JUMP_IF (cond (to_double (op1), to_double (op2)))
+
+#define IS_EQUAL(a, b)		(!isunordered (a, b) && !islessgreater (a, b))
+#define IS_NOT_EQUAL(a, b)	(isunordered (a, b) || islessgreater (a, b))
+
+/*
+ * The register engine runs the code of reg_translate ().  The stack of
+ * every function is a frame of slots in vm->stack, a call moves the frame
+ * up by the depth of the caller at the call, so arguments and results
+ * stay where they are.  The VM registers and the constants are globals,
+ * the registers are copied in and out around the run.
+ *
+ * Fuel works like in vm_run () but counts register commands, which are
+ * fewer: pushes of registers and constants cost nothing.
+ */
+enum vm_status reg_run (struct vm *vm, const uint64_t budget)
+{
+	const struct reg_code *const rc = vm->reg_code;
+	const struct rinsn *const code = rc->code;
+	const struct rinsn *ip = code;
+	struct reg_state *const st = vm->reg;
+	cell_t *const glob = st->glob;
+	cell_t *const stack = vm->stack;
+	cell_t *fp = stack + 1;
+	cell_t *base[2] = {};
+	struct reg_frame *const frames = st->frames;
+	struct reg_frame *csp = frames;
+	struct reg_frame *const frames_end = frames + vm->config.call_depth;
+	cell_t *const ram = vm->ram;
+	const uint64_t ram_mask = vm->ram_mask;
+	const cell_t *const stack_end = stack + vm->stack_limit + 1;
+	cell_t op1 = 0, op2 = 0;
+	struct vm_io *const io = &vm->io;
+	const struct insn *insn = NULL;
+	cell_t *vec_base[3] = {};
+	uint64_t addr = 0, vec_len = 0;
+	enum vm_status res = VM_HALTED;
+	int64_t fuel = (budget > INT64_MAX) ? INT64_MAX : (int64_t) budget;
+	const int64_t fuel_start = fuel;
+
+	if (st->ip) {
+		ip = st->ip;
+		fp = st->fp;
+		csp = st->csp;
+	}
+	memcpy (glob, vm->regs, sizeof (vm->regs));
+	base[0] = fp;
+	base[1] = glob;
+	fuel -= ip->fuel_cost;
+
+	while (true) {
+		switch (ip->op) {
+			case ROP_HLT:
+				goto out;
+			case ROP_MOV:
+				OPND (ip->d) = OPND (ip->a);
+				ip++;
+				break;
+			case ROP_ADD:
+				INT_OP (+);
+				break;
+			case ROP_SUB:
+				INT_OP (-);
+				break;
+			case ROP_MUL:
+				INT_OP (*);
+				break;
+			case ROP_DIV:
+				if ((int32_t) OPND (ip->b) == 0)
+					FAULT (VM_ERR_ZERO_DIV);
+				ALU_OP (int_div (op1, op2));
+				break;
+			case ROP_ADD_Q:
+				INT64_OP (+);
+				break;
+			case ROP_SUB_Q:
+				INT64_OP (-);
+				break;
+			case ROP_MUL_Q:
+				INT64_OP (*);
+				break;
+			case ROP_DIV_Q:
+				if (OPND (ip->b) == 0)
+					FAULT (VM_ERR_ZERO_DIV);
+				ALU_OP (int64_div (op1, op2));
+				break;
+			case ROP_ADD_D:
+				DOUBLE_OP (+);
+				break;
+			case ROP_SUB_D:
+				DOUBLE_OP (-);
+				break;
+			case ROP_MUL_D:
+				DOUBLE_OP (*);
+				break;
+			case ROP_DIV_D:
+				DOUBLE_OP (/);
+				break;
+			case ROP_LOAD:
+				addr = (uint64_t) OPND (ip->a) + (uint64_t) (int64_t) ip->target;
+				CHECK_ADDR (addr);
+				OPND (ip->d) = ram[addr];
+				ip++;
+				break;
+			case ROP_STORE:
+				addr = (uint64_t) OPND (ip->a) + (uint64_t) (int64_t) ip->target;
+				CHECK_ADDR (addr);
+				ram[addr] = OPND (ip->b);
+				ip++;
+				break;
+			case ROP_IN:
+				if (io_read (io, ip->type, &op1))
+					FAULT (VM_ERR_IO);
+				OPND (ip->d) = op1;
+				ip++;
+				break;
+			case ROP_OUT:
+				if (io_write (io, ip->type, OPND (ip->a)))
+					FAULT (VM_ERR_IO);
+				ip++;
+				break;
+			case ROP_PRINT:
+				if (io_print_pop (io, ip->type, OPND (ip->a)))
+					FAULT (VM_ERR_IO);
+				ip++;
+				break;
+			case ROP_VEC:
+				insn = vm->code + ip->target;
+				op1 = (insn->op == OP_VFILL) ? OPND (ip->a) : 0;
+				if (vm_run_vec (vm, glob, insn, &op1, &addr))
+					FAULT (VM_ERR_SEGFAULT);
+				if (insn->op == OP_VSUM || insn->op == OP_VDOT)
+					OPND (ip->d) = op1;
+				ip++;
+				break;
+			case ROP_VIO:
+				insn = vm->code + ip->target;
+				if (vm_vec_ranges (vm, glob, insn, vec_base, &vec_len, &addr))
+					FAULT (VM_ERR_SEGFAULT);
+				if ((insn->op == OP_VIN) ? io_read_block (io, insn->flags, vec_base[0], vec_len) :
+				                           io_write_block (io, insn->flags, vec_base[0], vec_len))
+					FAULT (VM_ERR_IO);
+				ip++;
+				break;
+			case ROP_JMP:
+				CHECK_STACK ();
+				ip = code + ip->target;
+				CHARGE ();
+				break;
+			case ROP_TAIL:
+				CHECK_STACK ();
+				fp += ip->depth;
+				base[0] = fp;
+				ip = code + ip->target;
+				CHARGE ();
+				break;
+			case ROP_JA:
+				INT_JUMP (>);
+				break;
+			case ROP_JAE:
+				INT_JUMP (>=);
+				break;
+			case ROP_JB:
+				INT_JUMP (<);
+				break;
+			case ROP_JBE:
+				INT_JUMP (<=);
+				break;
+			case ROP_JE:
+				INT_JUMP (==);
+				break;
+			case ROP_JNE:
+				INT_JUMP (!=);
+				break;
+			case ROP_JA_Q:
+				INT64_JUMP (>);
+				break;
+			case ROP_JAE_Q:
+				INT64_JUMP (>=);
+				break;
+			case ROP_JB_Q:
+				INT64_JUMP (<);
+				break;
+			case ROP_JBE_Q:
+				INT64_JUMP (<=);
+				break;
+			case ROP_JE_Q:
+				INT64_JUMP (==);
+				break;
+			case ROP_JNE_Q:
+				INT64_JUMP (!=);
+				break;
+			case ROP_JA_D:
+				DOUBLE_JUMP (isgreater);
+				break;
+			case ROP_JAE_D:
+				DOUBLE_JUMP (isgreaterequal);
+				break;
+			case ROP_JB_D:
+				DOUBLE_JUMP (isless);
+				break;
+			case ROP_JBE_D:
+				DOUBLE_JUMP (islessequal);
+				break;
+			case ROP_JE_D:
+				DOUBLE_JUMP (IS_EQUAL);
+				break;
+			case ROP_JNE_D:
+				DOUBLE_JUMP (IS_NOT_EQUAL);
+				break;
+			case ROP_CALL:
+				CHECK_STACK ();
+				if (csp == frames_end)
+					FAULT (VM_ERR_CALL_OVERFLOW);
+				*csp++ = {ip + 1, fp};
+				fp += ip->depth;
+				base[0] = fp;
+				ip = code + ip->target;
+				CHARGE ();
+				break;
+			case ROP_RET:
+				CHECK_STACK ();
+				csp--;
+				ip = csp->ip;
+				fp = csp->fp;
+				base[0] = fp;
+				CHARGE ();
+				break;
+			default:
+				fprintf (stderr, "Processor: unknown register instruction %d\n", ip->op);
+				FAULT (VM_ERR_LOAD);
+		}
+	}
+
+suspend:
+	fuel += ip->fuel_cost;
+	res = VM_SUSPENDED;
+	st->ip = ip;
+	st->fp = fp;
+	st->csp = csp;
+
+out:
+	vm->fuel_used += (uint64_t) (fuel_start - fuel);
+	memcpy (vm->regs, glob, sizeof (vm->regs));
+	if (res != VM_SUSPENDED)
+		st->ip = NULL;
+	if (io_flush (io) && res == VM_HALTED)
+		res = VM_ERR_IO;
+
+	vm_report_error (res, rc->pc[ip - code], addr);
+	return res;
+}
@@ -0,0 +1,128 @@
+#ifndef REGVM_H
+#define REGVM_H
+
+#include "vm.h"
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Operands of register code are stack slots relative to the frame of the
+ * function or globals: the VM registers followed by the constants.  The
+ * low bit tells them apart.
+ */
+static inline int32_t opnd_slot (const int depth)
+{
+	return depth * 2;
+}
+
+static inline int32_t opnd_global (const size_t idx)
+{
+	return (int32_t) (idx * 2 + 1);
+}
+
+enum reg_op
+{
+	ROP_HLT,
+	ROP_MOV,
+	ROP_ADD,
+	ROP_SUB,
+	ROP_MUL,
+	ROP_DIV,
+	ROP_ADD_Q,
+	ROP_SUB_Q,
+	ROP_MUL_Q,
+	ROP_DIV_Q,
+	ROP_ADD_D,
+	ROP_SUB_D,
+	ROP_MUL_D,
+	ROP_DIV_D,
+	ROP_LOAD,
+	ROP_STORE,
+	ROP_IN,
+	ROP_OUT,
+	ROP_PRINT,
+	ROP_VEC,
+	ROP_VIO,
+	ROP_JMP,
+	ROP_TAIL,
+	ROP_JA,
+	ROP_JAE,
+	ROP_JB,
+	ROP_JBE,
+	ROP_JE,
+	ROP_JNE,
+	ROP_JA_Q,
+	ROP_JAE_Q,
+	ROP_JB_Q,
+	ROP_JBE_Q,
+	ROP_JE_Q,
+	ROP_JNE_Q,
+	ROP_JA_D,
+	ROP_JAE_D,
+	ROP_JB_D,
+	ROP_JBE_D,
+	ROP_JE_D,
+	ROP_JNE_D,
+	ROP_CALL,
+	ROP_RET,
+	ROP_NUM
+};
+
+/*
+ * Three-address command: d = a op b.  target is a command index for
+ * jumps, the address offset for loads and stores and the stack command
+ * for vector commands.  Control transfers carry the stack depth at them
+ * for the overflow check, calls and tail jumps move the frame by it.
+ * fuel_cost is kept in the command, like vm->fuel_cost for stack code.
+ */
+struct rinsn
+{
+	uint8_t op;
+	uint8_t type;
+	uint16_t pad;
+	int32_t d;
+	int32_t a;
+	int32_t b;
+	int32_t target;
+	int32_t depth;
+	uint32_t fuel_cost;
+};
+
+/* Read-only once translated, shared like the stack code */
+struct reg_code
+{
+	struct rinsn *code;
+	size_t num;
+	uint32_t *pc;
+	cell_t *consts;
+	size_t consts_num;
+};
+
+struct reg_frame
+{
+	const struct rinsn *ip;
+	cell_t *fp;
+};
+
+/* Per VM: the globals and frames, and where a suspended run goes on */
+struct reg_state
+{
+	cell_t *glob;
+	struct reg_frame *frames;
+	const struct rinsn *ip;
+	cell_t *fp;
+	struct reg_frame *csp;
+};
+
+static inline bool rop_is_control (const int op)
+{
+	return op == ROP_HLT || (op >= ROP_JMP && op <= ROP_RET);
+}
+
+int reg_translate (struct vm *vm);
+int reg_attach (struct vm *vm);
+void reg_free (struct vm *vm);
+enum vm_status reg_run (struct vm *vm, const uint64_t budget);
+
+#endif // REGVM_H
@@ -0,0 +1,329 @@
+#include "processor.h"
+#include "vm.h"
+#include "snapshot.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const char zero_page[SNAPSHOT_PAGE] = {};
+
+static size_t page_words (const struct vm *vm, const uint64_t page);
+static int find_runs (const struct vm *vm, struct snapshot_run **runs, size_t *runs_num);
+static uint64_t count_checksum (const struct snapshot_header *header, const void *meta, const size_t meta_len);
+static int restore_ram (struct vm *vm, const int fd, const struct snapshot_header *header,
+			const struct snapshot_run *runs, const char *file_name);
+
+/*
+ * Saves the registers, stacks and RAM of a VM that has not run yet, has
+ * halted or is suspended.  A restored VM goes on where this one would:
+ * a suspended one from where it stopped, the others from the beginning.
+ * Programs with tasks can't be saved.  The file is written aside and
+ * renamed over file_name, a VM restored from it keeps its pages mapped.
+ */
+int vm_snapshot (const struct vm *vm, const char *file_name)
+{
+	const struct vm_context *ctx = &vm->resume;
+	struct snapshot_header header = {};
+	struct snapshot_run *runs = NULL;
+	size_t runs_num = 0, meta_len = 0, pad = 0, pos = 0;
+	char *meta = NULL;
+	char tmp[PATH_MAX];
+	FILE *file = NULL;
+	int res = 1, tmp_len = 0;
+
+	if (vm->uses_tasks) {
+		fprintf (stderr, "Processor: programs with tasks can't be saved\n");
+		return 1;
+	}
+	if (vm->reg_code) {
+		fprintf (stderr, "Processor: the register engine can't be saved\n");
+		return 1;
+	}
+	if (find_runs (vm, &runs, &runs_num))
+		return 1;
+
+	header.magic = SNAPSHOT_MAGIC;
+	header.version = SNAPSHOT_VERSION;
+	header.code_hash = vm->code_hash;
+	header.code_num = vm->code_num;
+	header.ram_words = vm->ram_words;
+	header.ip = (ctx->ip) ? ctx->ip - vm->code : -1;
+	header.tos = (ctx->ip) ? ctx->tos : 0;
+	memcpy (header.regs, vm->regs, sizeof (header.regs));
+	header.fuel_used = vm->fuel_used;
+	header.stack_num = (ctx->ip) ? (uint64_t) (ctx->sp - vm->stack) : 0;
+	header.calls_num = (ctx->ip) ? (uint64_t) (ctx->csp - vm->calls) : 0;
+	header.runs_num = runs_num;
+
+	meta_len = header.stack_num * sizeof (cell_t) + header.calls_num * sizeof (uint32_t) +
+	           runs_num * sizeof (struct snapshot_run);
+	header.data_offset = (sizeof (header) + meta_len + SNAPSHOT_PAGE - 1) / SNAPSHOT_PAGE * SNAPSHOT_PAGE;
+	pad = header.data_offset - sizeof (header) - meta_len;
+	meta = (char *) malloc (meta_len + 1);
+	if (!meta) {
+		fprintf (stderr, "Processor: can't allocate a snapshot\n");
+		goto out;
+	}
+
+	memcpy (meta, vm->stack, header.stack_num * sizeof (cell_t));
+	pos = header.stack_num * sizeof (cell_t);
+	for (size_t i = 0; i < header.calls_num; i++, pos += sizeof (uint32_t)) {
+		const uint32_t idx = (uint32_t) (vm->calls[i] - vm->code);
+		memcpy (meta + pos, &idx, sizeof (idx));
+	}
+	if (runs_num)
+		memcpy (meta + pos, runs, runs_num * sizeof (struct snapshot_run));
+	header.checksum = count_checksum (&header, meta, meta_len);
+
+	tmp_len = snprintf (tmp, sizeof (tmp), "%s.%ld.tmp", file_name, (long) getpid ());
+	if (tmp_len < 0 || (size_t) tmp_len >= sizeof (tmp)) {
+		fprintf (stderr, "Processor: snapshot file name %s is too long\n", file_name);
+		goto out;
+	}
+	file = fopen (tmp, "w");
+	if (!file) {
+		fprintf (stderr, "Processor: can't open snapshot file %s: %s\n", tmp, strerror (errno));
+		goto out;
+	}
+	if (fwrite (&header, sizeof (header), 1, file) != 1 ||
+	    (meta_len && fwrite (meta, meta_len, 1, file) != 1) ||
+	    (pad && fwrite (zero_page, pad, 1, file) != 1))
+		goto out_write;
+
+	for (size_t r = 0; r < runs_num; r++)
+		for (uint64_t page = runs[r].page; page < runs[r].page + runs[r].pages; page++) {
+			const size_t len = page_words (vm, page) * sizeof (cell_t);
+
+			if (fwrite (vm->ram + page * SNAPSHOT_PAGE_WORDS, len, 1, file) != 1 ||
+			    (len < SNAPSHOT_PAGE && fwrite (zero_page, SNAPSHOT_PAGE - len, 1, file) != 1))
+				goto out_write;
+		}
+
+	if (fclose (file)) {
+		file = NULL;
+		goto out_write;
+	}
+	file = NULL;
+	if (rename (tmp, file_name))
+		goto out_write;
+	res = 0;
+	goto out;
+
+out_write:
+	fprintf (stderr, "Processor: can't write snapshot file %s\n", file_name);
+	if (file)
+		fclose (file);
+	unlink (tmp);
+out:
+	free (meta);
+	free (runs);
+	return res;
+}
+
+/*
+ * vm has to have loaded the same code and not run yet.  Pages are mapped
+ * copy-on-write from the file when they can be, so a restore costs about
+ * the same whatever the size of RAM.  The file must not change while
+ * the VM is alive then.
+ */
+int vm_restore (struct vm *vm, const char *file_name)
+{
+	struct snapshot_header header = {};
+	struct stat st = {};
+	char *meta = NULL;
+	size_t meta_len = 0, pos = 0;
+	uint32_t idx = 0;
+	int fd = -1, res = 1;
+
+	if (vm->reg_code) {
+		fprintf (stderr, "Processor: the register engine can't be restored\n");
+		return 1;
+	}
+	fd = open (file_name, O_RDONLY);
+	if (fd < 0 || fstat (fd, &st)) {
+		fprintf (stderr, "Processor: can't open snapshot file %s: %s\n", file_name, strerror (errno));
+		goto out;
+	}
+	if (pread (fd, &header, sizeof (header), 0) != (ssize_t) sizeof (header) ||
+	    header.magic != SNAPSHOT_MAGIC || header.version != SNAPSHOT_VERSION) {
+		fprintf (stderr, "Processor: %s is not a snapshot\n", file_name);
+		goto out;
+	}
+	if (vm->uses_tasks || header.code_hash != vm->code_hash || header.code_num != vm->code_num) {
+		fprintf (stderr, "Processor: snapshot %s is of another program\n", file_name);
+		goto out;
+	}
+	if (header.ram_words > vm->ram_words || header.stack_num > vm->stack_limit ||
+	    header.calls_num > vm->config.call_depth) {
+		fprintf (stderr, "Processor: snapshot %s needs a bigger RAM or stack\n", file_name);
+		goto out;
+	}
+
+	meta_len = header.stack_num * sizeof (cell_t) + header.calls_num * sizeof (uint32_t);
+	if (header.runs_num > header.ram_words / SNAPSHOT_PAGE_WORDS + 1 ||
+	    header.ip < -1 || header.ip > (int64_t) vm->code_num ||
+	    (header.ip < 0 && (header.stack_num || header.calls_num)))
+		goto out_bad;
+	meta_len += header.runs_num * sizeof (struct snapshot_run);
+	if (header.data_offset < sizeof (header) + meta_len || header.data_offset % SNAPSHOT_PAGE ||
+	    header.data_offset > (uint64_t) st.st_size)
+		goto out_bad;
+
+	meta = (char *) malloc (meta_len + 1);
+	if (!meta) {
+		fprintf (stderr, "Processor: can't allocate a snapshot\n");
+		goto out;
+	}
+	if (pread (fd, meta, meta_len, sizeof (header)) != (ssize_t) meta_len ||
+	    count_checksum (&header, meta, meta_len) != header.checksum)
+		goto out_bad;
+
+	pos = header.stack_num * sizeof (cell_t);
+	for (size_t i = 0; i < header.calls_num; i++) {
+		memcpy (&idx, meta + pos + i * sizeof (uint32_t), sizeof (idx));
+		if (idx == 0 || idx > vm->code_num)
+			goto out_bad;
+		vm->calls[i] = vm->code + idx;
+	}
+	pos += header.calls_num * sizeof (uint32_t);
+	if (restore_ram (vm, fd, &header, (const struct snapshot_run *) (meta + pos), file_name))
+		goto out;
+
+	memcpy (vm->stack, meta, header.stack_num * sizeof (cell_t));
+	memcpy (vm->regs, header.regs, sizeof (vm->regs));
+	vm->fuel_used = header.fuel_used;
+	if (header.ip >= 0)
+		vm->resume = {vm->code + header.ip, vm->stack + header.stack_num, header.tos,
+		              vm->calls + header.calls_num};
+	res = 0;
+	goto out;
+
+out_bad:
+	fprintf (stderr, "Processor: snapshot %s is damaged\n", file_name);
+out:
+	if (fd >= 0)
+		close (fd);
+	free (meta);
+	return res;
+}
+
+static size_t page_words (const struct vm *vm, const uint64_t page)
+{
+	const size_t left = vm->ram_words - page * SNAPSHOT_PAGE_WORDS;
+
+	return (left < SNAPSHOT_PAGE_WORDS) ? left : SNAPSHOT_PAGE_WORDS;
+}
+
+/* Pages never touched are not resident and are skipped without a read */
+static int find_runs (const struct vm *vm, struct snapshot_run **runs, size_t *runs_num)
+{
+	const size_t pages = (vm->ram_words + SNAPSHOT_PAGE_WORDS - 1) / SNAPSHOT_PAGE_WORDS;
+	const long sys_page = sysconf (_SC_PAGESIZE);
+	unsigned char *resident = NULL;
+	size_t cap = 0, sys_pages = 0;
+	int res = 1;
+
+	if (sys_page >= SNAPSHOT_PAGE) {
+		sys_pages = (vm->ram_words * sizeof (cell_t) + (size_t) sys_page - 1) / (size_t) sys_page;
+		resident = (unsigned char *) malloc (sys_pages);
+		if (resident && mincore (vm->ram, vm->ram_words * sizeof (cell_t), resident)) {
+			free (resident);
+			resident = NULL;
+		}
+	}
+
+	*runs = NULL;
+	*runs_num = 0;
+	for (uint64_t page = 0; page < pages; page++) {
+		const cell_t *words = vm->ram + page * SNAPSHOT_PAGE_WORDS;
+		const size_t num = page_words (vm, page);
+		cell_t any = 0;
+
+		if (resident && !(resident[page * SNAPSHOT_PAGE / (size_t) sys_page] & 1))
+			continue;
+		for (size_t i = 0; i < num; i++)
+			any |= words[i];
+		if (!any)
+			continue;
+
+		if (*runs_num && (*runs)[*runs_num - 1].page + (*runs)[*runs_num - 1].pages == page) {
+			(*runs)[*runs_num - 1].pages++;
+			continue;
+		}
+		if (*runs_num == cap) {
+			struct snapshot_run *grown = NULL;
+
+			cap = (cap) ? cap * 2 : 16;
+			grown = (struct snapshot_run *) realloc (*runs, cap * sizeof (struct snapshot_run));
+			if (!grown) {
+				fprintf (stderr, "Processor: can't allocate a snapshot\n");
+				goto out;
+			}
+			*runs = grown;
+		}
+		(*runs)[(*runs_num)++] = {page, 1};
+	}
+	res = 0;
+
+out:
+	free (resident);
+	return res;
+}
+
+static uint64_t count_checksum (const struct snapshot_header *header, const void *meta, const size_t meta_len)
+{
+	struct snapshot_header tmp = *header;
+
+	tmp.checksum = 0;
+	return hash64 (meta, meta_len, hash64 (&tmp, sizeof (tmp), 0));
+}
+
+static int restore_ram (struct vm *vm, const int fd, const struct snapshot_header *header,
+			const struct snapshot_run *runs, const char *file_name)
+{
+	const size_t pages = (header->ram_words + SNAPSHOT_PAGE_WORDS - 1) / SNAPSHOT_PAGE_WORDS;
+	const bool can_map = !vm->config.ram_file && sysconf (_SC_PAGESIZE) == SNAPSHOT_PAGE &&
+	                     header->ram_words % SNAPSHOT_PAGE_WORDS == 0;
+	struct stat st = {};
+	uint64_t offset = header->data_offset;
+	struct snapshot_run run = {};
+
+	if (fstat (fd, &st))
+		return 1;
+
+	for (size_t r = 0; r < header->runs_num; r++, offset += run.pages * SNAPSHOT_PAGE) {
+		memcpy (&run, &runs[r], sizeof (run));
+		if (run.page >= pages || run.pages > pages - run.page || offset > (uint64_t) st.st_size ||
+		    run.pages * SNAPSHOT_PAGE > (uint64_t) st.st_size - offset) {
+			fprintf (stderr, "Processor: snapshot %s is damaged\n", file_name);
+			return 1;
+		}
+
+		if (can_map) {
+			if (mmap (vm->ram + run.page * SNAPSHOT_PAGE_WORDS, run.pages * SNAPSHOT_PAGE,
+			          PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, (off_t) offset) == MAP_FAILED) {
+				fprintf (stderr, "Processor: can't map snapshot %s: %s\n", file_name, strerror (errno));
+				return 1;
+			}
+			continue;
+		}
+		for (uint64_t page = run.page; page < run.page + run.pages; page++) {
+			const size_t len = page_words (vm, page) * sizeof (cell_t);
+
+			if (pread (fd, vm->ram + page * SNAPSHOT_PAGE_WORDS, len,
+			           (off_t) (offset + (page - run.page) * SNAPSHOT_PAGE)) != (ssize_t) len) {
+				fprintf (stderr, "Processor: can't read snapshot %s\n", file_name);
+				return 1;
+			}
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,47 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "vm.h"
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define SNAPSHOT_MAGIC 0x53564d4bu	// "KMVS"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_PAGE 4096
+#define SNAPSHOT_PAGE_WORDS (SNAPSHOT_PAGE / sizeof (cell_t))
+
+/*
+ * Snapshot file: the header, the operand stack, the call stack as
+ * instruction indices and a table of runs of RAM pages, then the pages
+ * themselves from data_offset on, page aligned.  Pages of zeroes are
+ * left out.  checksum covers everything but the pages.
+ */
+struct snapshot_header
+{
+	uint32_t magic;
+	uint32_t version;
+	uint64_t checksum;
+	uint64_t code_hash;
+	uint64_t code_num;
+	uint64_t ram_words;
+	int64_t ip;
+	cell_t tos;
+	cell_t regs[REGS_NUM];
+	uint64_t fuel_used;
+	uint64_t stack_num;
+	uint64_t calls_num;
+	uint64_t runs_num;
+	uint64_t data_offset;
+};
+
+struct snapshot_run
+{
+	uint64_t page;
+	uint64_t pages;
+};
+
+int vm_snapshot (const struct vm *vm, const char *file_name);
+int vm_restore (struct vm *vm, const char *file_name);
+
+#endif // SNAPSHOT_H
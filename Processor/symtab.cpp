@@ -0,0 +1,296 @@
+#include "symtab.h"
+#include "processor.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int grow_slots (struct symtab *tab);
+static int cmp_symbol_entries (const void *a, const void *b);
+static int cmp_reloc_entries (const void *a, const void *b);
+static bool is_serialized (const struct symbol *sym, const bool object);
+
+int symtab_ctor (struct symtab *tab)
+{
+	assert (tab);
+
+	tab->slots = (int *) malloc (SYMTAB_MIN_CAP * sizeof (int));
+	if (!tab->slots) {
+		fprintf (stderr, "symtab_ctor (): failed to allocate memory\n");
+		return 1;
+	}
+	memset (tab->slots, 0xff, SYMTAB_MIN_CAP * sizeof (int));
+	tab->slots_cap = SYMTAB_MIN_CAP;
+
+	tab->syms = NULL;
+	tab->syms_num = tab->syms_cap = 0;
+	tab->fixups = NULL;
+	tab->fixups_num = tab->fixups_cap = 0;
+
+	return 0;
+}
+
+void symtab_dtor (struct symtab *tab)
+{
+	assert (tab);
+
+	for (int i = 0; i < tab->syms_num; i++)
+		free (tab->syms[i].name);
+	free (tab->syms);
+	free (tab->fixups);
+	free (tab->slots);
+
+	tab->syms = NULL;
+	tab->fixups = NULL;
+	tab->slots = NULL;
+	tab->slots_cap = 0;
+	tab->syms_num = tab->syms_cap = 0;
+	tab->fixups_num = tab->fixups_cap = 0;
+}
+
+uint32_t symtab_hash (const char *name, const size_t len)
+{
+	uint32_t hash = 2166136261u;
+
+	for (size_t i = 0; i < len; i++) {
+		hash ^= (unsigned char) name[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+int symtab_lookup (struct symtab *tab, const char *name, const size_t len)
+{
+	assert (tab);
+	assert (name);
+	uint32_t hash = symtab_hash (name, len);
+	size_t mask = tab->slots_cap - 1;
+	size_t slot = hash & mask;
+	struct symbol *sym = NULL;
+
+	while (tab->slots[slot] >= 0) {
+		sym = tab->syms + tab->slots[slot];
+		if (sym->hash == hash && sym->name_len == len && !memcmp (sym->name, name, len))
+			return tab->slots[slot];
+		slot = (slot + 1) & mask;
+	}
+
+	if (tab->syms_num == tab->syms_cap) {
+		int new_cap = (tab->syms_cap) ? 2 * tab->syms_cap : SYMTAB_MIN_CAP;
+		sym = (struct symbol *) realloc (tab->syms, (size_t) new_cap * sizeof (struct symbol));
+		if (!sym) {
+			fprintf (stderr, "symtab_lookup (): failed to allocate memory\n");
+			return -1;
+		}
+		tab->syms = sym;
+		tab->syms_cap = new_cap;
+	}
+
+	sym = tab->syms + tab->syms_num;
+	sym->name = (char *) malloc (len + 1);
+	if (!sym->name) {
+		fprintf (stderr, "symtab_lookup (): failed to allocate memory\n");
+		return -1;
+	}
+	memcpy (sym->name, name, len);
+	sym->name[len] = '\0';
+	sym->name_len = len;
+	sym->hash = hash;
+	sym->shift = -1;
+	sym->fixups = -1;
+
+	tab->slots[slot] = tab->syms_num++;
+
+	if (2 * (size_t) tab->syms_num > tab->slots_cap && grow_slots (tab))
+		return -1;
+
+	return tab->syms_num - 1;
+}
+
+static int grow_slots (struct symtab *tab)
+{
+	assert (tab);
+	size_t new_cap = 2 * tab->slots_cap;
+	size_t mask = new_cap - 1;
+	size_t slot = 0;
+	int *new_slots = (int *) malloc (new_cap * sizeof (int));
+
+	if (!new_slots) {
+		fprintf (stderr, "symtab: failed to allocate memory for %zu slots\n", new_cap);
+		return 1;
+	}
+	memset (new_slots, 0xff, new_cap * sizeof (int));
+
+	for (int i = 0; i < tab->syms_num; i++) {
+		slot = tab->syms[i].hash & mask;
+		while (new_slots[slot] >= 0)
+			slot = (slot + 1) & mask;
+		new_slots[slot] = i;
+	}
+
+	free (tab->slots);
+	tab->slots = new_slots;
+	tab->slots_cap = new_cap;
+	return 0;
+}
+
+int symtab_define (struct symtab *tab, const int sym, const int shift)
+{
+	assert (tab);
+	assert (sym >= 0 && sym < tab->syms_num);
+
+	if (tab->syms[sym].shift >= 0) {
+		fprintf (stderr, "symtab_define () error: label \"%s\" is defined twice\n",
+			 tab->syms[sym].name);
+		return 1;
+	}
+	tab->syms[sym].shift = shift;
+	return 0;
+}
+
+int symtab_add_fixup (struct symtab *tab, const int sym, const size_t pos)
+{
+	assert (tab);
+	assert (sym >= 0 && sym < tab->syms_num);
+
+	if (tab->fixups_num == tab->fixups_cap) {
+		int new_cap = (tab->fixups_cap) ? 2 * tab->fixups_cap : SYMTAB_MIN_CAP;
+		struct fixup *new_fixups = (struct fixup *) realloc (tab->fixups,
+								     (size_t) new_cap * sizeof (struct fixup));
+		if (!new_fixups) {
+			fprintf (stderr, "symtab_add_fixup (): failed to allocate memory\n");
+			return 1;
+		}
+		tab->fixups = new_fixups;
+		tab->fixups_cap = new_cap;
+	}
+
+	tab->fixups[tab->fixups_num].pos = pos;
+	tab->fixups[tab->fixups_num].next = tab->syms[sym].fixups;
+	tab->syms[sym].fixups = tab->fixups_num++;
+	return 0;
+}
+
+int symtab_resolve (struct symtab *tab, char *byte_code)
+{
+	assert (tab);
+	assert (byte_code);
+	int undefined = 0;
+
+	for (int i = 0; i < tab->syms_num; i++) {
+		struct symbol *sym = tab->syms + i;
+		if (sym->fixups < 0)
+			continue;
+		if (sym->shift < 0) {
+			fprintf (stderr, "symtab_resolve () error: label \"%s\" is used but not defined\n",
+				 sym->name);
+			undefined++;
+			continue;
+		}
+		for (int f = sym->fixups; f >= 0; f = tab->fixups[f].next)
+			memcpy (byte_code + tab->fixups[f].pos, &sym->shift, sizeof (int));
+	}
+
+	return undefined;
+}
+
+/*
+ * Builds SECT_SYMBOLS contents out of the defined labels, for an object
+ * also out of the used ones, which have shift -1.
+ */
+char *symtab_serialize (const struct symtab *tab, size_t *len, const bool object)
+{
+	assert (tab);
+	assert (len);
+	uint32_t count = 0, name_pos = 0;
+	size_t names_len = 0, entries_len = 0;
+	struct symbol_entry *entries = NULL;
+	char *buf = NULL, *names = NULL;
+
+	for (int i = 0; i < tab->syms_num; i++) {
+		if (!is_serialized (tab->syms + i, object))
+			continue;
+		count++;
+		names_len += tab->syms[i].name_len + 1;
+	}
+
+	entries_len = count * sizeof (struct symbol_entry);
+	*len = 2 * sizeof (uint32_t) + entries_len + names_len;
+	buf = (char *) calloc (1, *len);
+	if (!buf) {
+		fprintf (stderr, "symtab_serialize (): failed to allocate memory\n");
+		return NULL;
+	}
+	memcpy (buf, &count, sizeof (count));
+	entries = (struct symbol_entry *) (buf + 2 * sizeof (uint32_t));
+	names = buf + 2 * sizeof (uint32_t) + entries_len;
+
+	count = 0;
+	for (int i = 0; i < tab->syms_num; i++) {
+		if (!is_serialized (tab->syms + i, object))
+			continue;
+		entries[count].shift = tab->syms[i].shift;
+		entries[count].name = name_pos;
+		memcpy (names + name_pos, tab->syms[i].name, tab->syms[i].name_len + 1);
+		name_pos += (uint32_t) tab->syms[i].name_len + 1;
+		count++;
+	}
+	qsort (entries, count, sizeof (struct symbol_entry), cmp_symbol_entries);
+
+	return buf;
+}
+
+/*
+ * Builds SECT_RELOCS of an object out of the fixups, names are the ones
+ * symtab_serialize (tab, len, true) gives the labels.
+ */
+char *symtab_relocs (const struct symtab *tab, size_t *len)
+{
+	assert (tab);
+	assert (len);
+	struct reloc_entry *relocs = NULL;
+	uint32_t name_pos = 0;
+	size_t num = 0;
+
+	*len = (size_t) tab->fixups_num * sizeof (struct reloc_entry);
+	relocs = (struct reloc_entry *) malloc (*len + 1);
+	if (!relocs) {
+		fprintf (stderr, "symtab_relocs (): failed to allocate memory\n");
+		return NULL;
+	}
+
+	for (int i = 0; i < tab->syms_num; i++) {
+		if (!is_serialized (tab->syms + i, true))
+			continue;
+		for (int f = tab->syms[i].fixups; f >= 0; f = tab->fixups[f].next)
+			relocs[num++] = {(uint32_t) tab->fixups[f].pos, name_pos};
+		name_pos += (uint32_t) tab->syms[i].name_len + 1;
+	}
+	qsort (relocs, num, sizeof (struct reloc_entry), cmp_reloc_entries);
+
+	return (char *) relocs;
+}
+
+static bool is_serialized (const struct symbol *sym, const bool object)
+{
+	return sym->shift >= 0 || (object && sym->fixups >= 0);
+}
+
+static int cmp_reloc_entries (const void *a, const void *b)
+{
+	const struct reloc_entry *ra = (const struct reloc_entry *) a;
+	const struct reloc_entry *rb = (const struct reloc_entry *) b;
+
+	return (ra->pos < rb->pos) ? -1 : (ra->pos > rb->pos);
+}
+
+static int cmp_symbol_entries (const void *a, const void *b)
+{
+	const struct symbol_entry *sa = (const struct symbol_entry *) a;
+	const struct symbol_entry *sb = (const struct symbol_entry *) b;
+
+	if (sa->shift != sb->shift)
+		return (sa->shift < sb->shift) ? -1 : 1;
+	return (sa->name < sb->name) ? -1 : (sa->name > sb->name);
+}
@@ -0,0 +1,48 @@
+#ifndef SYMTAB_H
+#define SYMTAB_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define SYMTAB_MIN_CAP 64
+
+struct symbol
+{
+	char *name = NULL;
+	size_t name_len = 0;
+	uint32_t hash = 0;
+	int shift = -1;
+	int fixups = -1;
+};
+
+struct fixup
+{
+	size_t pos = 0;
+	int next = -1;
+};
+
+struct symtab
+{
+	int *slots = NULL;
+	size_t slots_cap = 0;
+	struct symbol *syms = NULL;
+	int syms_num = 0;
+	int syms_cap = 0;
+	struct fixup *fixups = NULL;
+	int fixups_num = 0;
+	int fixups_cap = 0;
+};
+
+int symtab_ctor (struct symtab *tab);
+void symtab_dtor (struct symtab *tab);
+
+int symtab_lookup (struct symtab *tab, const char *name, const size_t len);
+int symtab_define (struct symtab *tab, const int sym, const int shift);
+int symtab_add_fixup (struct symtab *tab, const int sym, const size_t pos);
+int symtab_resolve (struct symtab *tab, char *byte_code);
+char *symtab_serialize (const struct symtab *tab, size_t *len, const bool object);
+char *symtab_relocs (const struct symtab *tab, size_t *len);
+
+uint32_t symtab_hash (const char *name, const size_t len);
+
+#endif // SYMTAB_H
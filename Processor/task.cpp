@@ -0,0 +1,541 @@
+#include "vm.h"
+#include "task.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+static void *worker_thread (void *arg);
+static void sched_lock (struct sched *sched, pthread_mutex_t *lock);
+static void sched_unlock (struct sched *sched, pthread_mutex_t *lock);
+static void list_push (struct task_list *list, struct task *task);
+static struct task *list_pop (struct task_list *list);
+static void runq_push (struct task_worker *worker, struct task *task);
+static struct task *runq_pop (struct sched *sched, struct task_worker *victim);
+static bool idle_wait (struct sched *sched);
+static void deadlock (struct sched *sched);
+static void **table_slot (struct sched *sched, struct task_table *table, cell_t *id);
+static void *table_get (struct task_table *table, const cell_t id);
+
+/*
+ * The program becomes task 0 on the stacks of the VM and the workers
+ * but the first start waiting for tasks.
+ */
+int task_start (struct vm *vm)
+{
+	struct sched *sched = (struct sched *) calloc (1, sizeof (struct sched));
+	const size_t workers = (vm->config.workers) ? vm->config.workers : 1;
+	struct task *main_task = (struct task *) calloc (1, sizeof (struct task));
+	void *mem = NULL, **slot = NULL;
+	size_t started = 1;
+	cell_t id = 0;
+
+	if (!sched || !main_task || posix_memalign (&mem, 64, workers * sizeof (struct task_worker))) {
+		fprintf (stderr, "Processor: can't allocate a scheduler of %zu workers\n", workers);
+		free (sched);
+		free (main_task);
+		return 1;
+	}
+	vm->sched = sched;
+	sched->vm = vm;
+	sched->workers = (struct task_worker *) mem;
+	sched->workers_num = workers;
+	sched->threaded = (workers > 1);
+	sched->stack_cells = (vm->config.task_stack) ? vm->config.task_stack : VM_TASK_STACK;
+	sched->stack_cap = sched->stack_cells + (vm->stack_cap - vm->stack_limit);
+	sched->call_depth = (sched->stack_cells / 4) ? sched->stack_cells / 4 : 1;
+	sched->status = VM_HALTED;
+	pthread_mutex_init (&sched->lock, NULL);
+	pthread_cond_init (&sched->cond, NULL);
+	pthread_mutex_init (&sched->io_lock, NULL);
+
+	memset (mem, 0, workers * sizeof (struct task_worker));
+	for (size_t i = 0; i < workers; i++) {
+		sched->workers[i].sched = sched;
+		sched->workers[i].id = i;
+		pthread_mutex_init (&sched->workers[i].lock, NULL);
+	}
+
+	main_task->ip = vm->code;
+	main_task->stack = vm->stack;
+	main_task->sp = vm->stack;
+	main_task->calls = vm->calls;
+	main_task->csp = vm->calls;
+	main_task->calls_end = vm->calls + vm->config.call_depth;
+	main_task->limit = vm->stack_limit;
+	main_task->regs = vm->regs;
+	pthread_mutex_init (&main_task->lock, NULL);
+	slot = table_slot (sched, &sched->tasks, &id);
+	if (!slot) {
+		pthread_mutex_destroy (&main_task->lock);
+		free (main_task);
+		return 1;
+	}
+	*slot = main_task;
+
+	for (started = 1; started < workers; started++)
+		if (pthread_create (&sched->workers[started].thread, NULL, worker_thread, &sched->workers[started]))
+			break;
+	if (started == workers)
+		return 0;
+
+	fprintf (stderr, "Processor: can't start worker thread\n");
+	pthread_mutex_lock (&sched->lock);
+	__atomic_store_n (&sched->stop, true, __ATOMIC_RELEASE);
+	pthread_cond_broadcast (&sched->cond);
+	pthread_mutex_unlock (&sched->lock);
+	for (size_t i = 1; i < started; i++)
+		pthread_join (sched->workers[i].thread, NULL);
+	sched->workers_num = 1;
+	return 1;
+}
+
+void task_free (struct vm *vm)
+{
+	struct sched *sched = vm->sched;
+
+	if (!sched)
+		return;
+
+	for (size_t i = 0; i < TASK_CHUNKS; i++) {
+		for (size_t j = 0; sched->tasks.chunks[i] && j < TASK_CHUNK; j++) {
+			struct task *task = (struct task *) sched->tasks.chunks[i][j];
+			if (!task)
+				continue;
+			free (task->mem);
+			pthread_mutex_destroy (&task->lock);
+			free (task);
+		}
+		free (sched->tasks.chunks[i]);
+	}
+	for (size_t i = 0; i < TASK_CHUNKS; i++) {
+		for (size_t j = 0; sched->chans.chunks[i] && j < TASK_CHUNK; j++) {
+			struct channel *chan = (struct channel *) sched->chans.chunks[i][j];
+			if (!chan)
+				continue;
+			free (chan->buf);
+			pthread_mutex_destroy (&chan->lock);
+			free (chan);
+		}
+		free (sched->chans.chunks[i]);
+	}
+
+	for (size_t i = 0; i < sched->workers_num; i++)
+		pthread_mutex_destroy (&sched->workers[i].lock);
+	pthread_mutex_destroy (&sched->io_lock);
+	pthread_cond_destroy (&sched->cond);
+	pthread_mutex_destroy (&sched->lock);
+	free (sched->workers);
+	free (sched);
+	vm->sched = NULL;
+}
+
+/*
+ * Called by every worker leaving the dispatch loop.  The first one to get
+ * here decides the status, *stopped is set for the rest so that a single
+ * error is reported.  Worker 0 waits for the others and returns the status.
+ */
+enum vm_status task_stop (struct task_worker *worker, enum vm_status res, bool *stopped)
+{
+	struct sched *sched = worker->sched;
+
+	sched_lock (sched, &sched->lock);
+	if (!*stopped && __atomic_load_n (&sched->stop, __ATOMIC_ACQUIRE)) {
+		*stopped = true;
+	} else if (!*stopped) {
+		sched->status = res;
+		__atomic_store_n (&sched->stop, true, __ATOMIC_RELEASE);
+	}
+	if (sched->threaded)
+		pthread_cond_broadcast (&sched->cond);
+	sched_unlock (sched, &sched->lock);
+
+	if (worker->id)
+		return res;
+	for (size_t i = 1; i < sched->workers_num; i++)
+		pthread_join (sched->workers[i].thread, NULL);
+	return sched->status;
+}
+
+/* NULL when the program is over: task 0 halted, a task failed or a deadlock */
+struct task *task_next (struct task_worker *worker)
+{
+	struct sched *sched = worker->sched;
+	struct task *task = NULL;
+
+	while (!__atomic_load_n (&sched->stop, __ATOMIC_ACQUIRE)) {
+		task = runq_pop (sched, worker);
+		for (size_t i = 1; !task && i < sched->workers_num; i++)
+			task = runq_pop (sched, &sched->workers[(worker->id + i) % sched->workers_num]);
+		if (task)
+			return task;
+
+		if (!sched->threaded) {
+			deadlock (sched);
+			return NULL;
+		}
+		if (idle_wait (sched))
+			return NULL;
+	}
+
+	return NULL;
+}
+
+/* cur goes behind the tasks queued on this worker, if there are any */
+struct task *task_yield (struct task_worker *worker, struct task *cur)
+{
+	struct task *next = NULL;
+
+	sched_lock (worker->sched, &worker->lock);
+	next = list_pop (&worker->runq);
+	if (next)
+		list_push (&worker->runq, cur);
+	sched_unlock (worker->sched, &worker->lock);
+
+	return (next) ? next : cur;
+}
+
+/* The task itself stays for join until task_free () */
+void task_exit (struct task_worker *worker, struct task *cur, const cell_t result)
+{
+	struct task_list joiners = {};
+	struct task *task = NULL;
+
+	free (cur->mem);
+	cur->mem = NULL;
+
+	sched_lock (worker->sched, &cur->lock);
+	cur->result = result;
+	cur->done = true;
+	joiners = cur->joiners;
+	cur->joiners = {};
+	sched_unlock (worker->sched, &cur->lock);
+
+	while ((task = list_pop (&joiners)))
+		runq_push (worker, task);
+}
+
+/*
+ * The stack and call stack of a task are one allocation, the stack gets
+ * the same room for pushes between checks as the one of the program.
+ */
+int task_spawn (struct task_worker *worker, const struct insn *ip, const cell_t *regs, cell_t *tos)
+{
+	struct sched *sched = worker->sched;
+	struct task *task = (struct task *) calloc (1, sizeof (struct task));
+	void **slot = NULL;
+	cell_t id = 0;
+
+	if (task)
+		task->mem = malloc ((sched->stack_cap + 1) * sizeof (cell_t) + sched->call_depth * sizeof (struct insn *));
+	if (!task || !task->mem) {
+		fprintf (stderr, "Processor: can't allocate a task\n");
+		free (task);
+		return 1;
+	}
+
+	task->ip = ip;
+	task->stack = (cell_t *) task->mem;
+	task->stack[0] = 0;
+	task->sp = task->stack + 1;
+	task->tos = *tos;
+	task->calls = (const struct insn **) (task->stack + sched->stack_cap + 1);
+	task->csp = task->calls;
+	task->calls_end = task->calls + sched->call_depth;
+	task->limit = sched->stack_cells;
+	memcpy (task->own_regs, regs, sizeof (task->own_regs));
+	task->regs = task->own_regs;
+	pthread_mutex_init (&task->lock, NULL);
+
+	slot = table_slot (sched, &sched->tasks, &id);
+	if (!slot) {
+		pthread_mutex_destroy (&task->lock);
+		free (task->mem);
+		free (task);
+		return 1;
+	}
+	task->id = id;
+	__atomic_store_n (slot, task, __ATOMIC_RELEASE);
+
+	*tos = id;
+	runq_push (worker, task);
+	return 0;
+}
+
+int task_chan (struct task_worker *worker, cell_t *tos)
+{
+	struct sched *sched = worker->sched;
+	struct channel *chan = NULL;
+	void **slot = NULL;
+	cell_t id = 0;
+
+	if (*tos > CHAN_MAX_CAP) {
+		fprintf (stderr, "Processor: channel capacity %" PRId64 " is above %d\n", *tos, CHAN_MAX_CAP);
+		return 1;
+	}
+
+	chan = (struct channel *) calloc (1, sizeof (struct channel));
+	if (chan) {
+		chan->cap = (*tos > 1) ? (size_t) *tos : 1;
+		chan->buf = (cell_t *) malloc (chan->cap * sizeof (cell_t));
+	}
+	if (!chan || !chan->buf) {
+		fprintf (stderr, "Processor: can't allocate a channel\n");
+		free (chan);
+		return 1;
+	}
+	pthread_mutex_init (&chan->lock, NULL);
+
+	slot = table_slot (sched, &sched->chans, &id);
+	if (!slot) {
+		pthread_mutex_destroy (&chan->lock);
+		free (chan->buf);
+		free (chan);
+		return 1;
+	}
+	__atomic_store_n (slot, chan, __ATOMIC_RELEASE);
+
+	*tos = id;
+	return 0;
+}
+
+/*
+ * The blocking commands return 1 with cur put on a wait list when they
+ * can't go on.  The dispatch loop saved cur on the command beforehand, so
+ * once woken up it runs the command again.  They return -1 on a bad id.
+ */
+int task_join (struct task_worker *worker, struct task *cur, cell_t *tos)
+{
+	struct task *task = (struct task *) table_get (&worker->sched->tasks, *tos);
+	int res = 0;
+
+	if (!task) {
+		fprintf (stderr, "Processor: there is no task %" PRId64 "\n", *tos);
+		return -1;
+	}
+
+	sched_lock (worker->sched, &task->lock);
+	if (task->done) {
+		*tos = task->result;
+	} else {
+		list_push (&task->joiners, cur);
+		res = 1;
+	}
+	sched_unlock (worker->sched, &task->lock);
+
+	return res;
+}
+
+int task_send (struct task_worker *worker, struct task *cur, const cell_t ch, const cell_t val)
+{
+	struct channel *chan = (struct channel *) table_get (&worker->sched->chans, ch);
+	struct task *waiter = NULL;
+
+	if (!chan) {
+		fprintf (stderr, "Processor: there is no channel %" PRId64 "\n", ch);
+		return -1;
+	}
+
+	sched_lock (worker->sched, &chan->lock);
+	if (chan->len == chan->cap) {
+		list_push (&chan->senders, cur);
+		sched_unlock (worker->sched, &chan->lock);
+		return 1;
+	}
+	chan->buf[(chan->head + chan->len) % chan->cap] = val;
+	chan->len++;
+	waiter = list_pop (&chan->receivers);
+	sched_unlock (worker->sched, &chan->lock);
+
+	if (waiter)
+		runq_push (worker, waiter);
+	return 0;
+}
+
+int task_recv (struct task_worker *worker, struct task *cur, cell_t *tos)
+{
+	struct channel *chan = (struct channel *) table_get (&worker->sched->chans, *tos);
+	struct task *waiter = NULL;
+
+	if (!chan) {
+		fprintf (stderr, "Processor: there is no channel %" PRId64 "\n", *tos);
+		return -1;
+	}
+
+	sched_lock (worker->sched, &chan->lock);
+	if (!chan->len) {
+		list_push (&chan->receivers, cur);
+		sched_unlock (worker->sched, &chan->lock);
+		return 1;
+	}
+	*tos = chan->buf[chan->head];
+	chan->head = (chan->head + 1) % chan->cap;
+	chan->len--;
+	waiter = list_pop (&chan->senders);
+	sched_unlock (worker->sched, &chan->lock);
+
+	if (waiter)
+		runq_push (worker, waiter);
+	return 0;
+}
+
+static void *worker_thread (void *arg)
+{
+	struct task_worker *worker = (struct task_worker *) arg;
+
+	vm_run_worker (worker->sched->vm, worker);
+	return NULL;
+}
+
+static void sched_lock (struct sched *sched, pthread_mutex_t *lock)
+{
+	if (sched->threaded)
+		pthread_mutex_lock (lock);
+}
+
+static void sched_unlock (struct sched *sched, pthread_mutex_t *lock)
+{
+	if (sched->threaded)
+		pthread_mutex_unlock (lock);
+}
+
+static void list_push (struct task_list *list, struct task *task)
+{
+	task->next = NULL;
+	if (list->tail)
+		list->tail->next = task;
+	else
+		list->head = task;
+	list->tail = task;
+}
+
+static struct task *list_pop (struct task_list *list)
+{
+	struct task *task = list->head;
+
+	if (task) {
+		list->head = task->next;
+		if (!list->head)
+			list->tail = NULL;
+	}
+	return task;
+}
+
+/*
+ * ready is raised after the task is queued and idle is read after that,
+ * idle_wait () does the same the other way round, so either the pusher
+ * sees an idle worker or the worker sees the task.
+ */
+static void runq_push (struct task_worker *worker, struct task *task)
+{
+	struct sched *sched = worker->sched;
+
+	sched_lock (sched, &worker->lock);
+	list_push (&worker->runq, task);
+	sched_unlock (sched, &worker->lock);
+
+	if (!sched->threaded)
+		return;
+	__atomic_add_fetch (&sched->ready, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n (&sched->idle, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock (&sched->lock);
+		pthread_cond_signal (&sched->cond);
+		pthread_mutex_unlock (&sched->lock);
+	}
+}
+
+static struct task *runq_pop (struct sched *sched, struct task_worker *victim)
+{
+	struct task *task = NULL;
+
+	sched_lock (sched, &victim->lock);
+	task = list_pop (&victim->runq);
+	sched_unlock (sched, &victim->lock);
+
+	if (task && sched->threaded)
+		__atomic_sub_fetch (&sched->ready, 1, __ATOMIC_SEQ_CST);
+	return task;
+}
+
+/*
+ * Returns true if the program is over.  Only running tasks make others
+ * ready, so the last worker to go idle with nothing ready finds a deadlock.
+ */
+static bool idle_wait (struct sched *sched)
+{
+	bool stop = false;
+
+	pthread_mutex_lock (&sched->lock);
+	__atomic_add_fetch (&sched->idle, 1, __ATOMIC_SEQ_CST);
+	while (!__atomic_load_n (&sched->stop, __ATOMIC_ACQUIRE) &&
+	       __atomic_load_n (&sched->ready, __ATOMIC_SEQ_CST) <= 0) {
+		if (__atomic_load_n (&sched->idle, __ATOMIC_SEQ_CST) == sched->workers_num) {
+			deadlock (sched);
+			break;
+		}
+		pthread_cond_wait (&sched->cond, &sched->lock);
+	}
+	__atomic_sub_fetch (&sched->idle, 1, __ATOMIC_SEQ_CST);
+	stop = __atomic_load_n (&sched->stop, __ATOMIC_ACQUIRE);
+	pthread_mutex_unlock (&sched->lock);
+
+	return stop;
+}
+
+/* sched->lock is held when threaded */
+static void deadlock (struct sched *sched)
+{
+	if (__atomic_load_n (&sched->stop, __ATOMIC_ACQUIRE))
+		return;
+
+	fprintf (stderr, "Processor: deadlock, every task is blocked\n");
+	sched->status = VM_ERR_DEADLOCK;
+	__atomic_store_n (&sched->stop, true, __ATOMIC_RELEASE);
+	if (sched->threaded)
+		pthread_cond_broadcast (&sched->cond);
+}
+
+/*
+ * Reserves the next id of table, the entry is published by a release
+ * store to the slot once it is ready.
+ */
+static void **table_slot (struct sched *sched, struct task_table *table, cell_t *id)
+{
+	const size_t num = __atomic_fetch_add (&table->num, 1, __ATOMIC_RELAXED);
+	void **chunk = NULL;
+
+	if (num >= (size_t) TASK_CHUNK * TASK_CHUNKS) {
+		fprintf (stderr, "Processor: more than %d tasks or channels\n", TASK_CHUNK * TASK_CHUNKS);
+		return NULL;
+	}
+
+	chunk = __atomic_load_n (&table->chunks[num / TASK_CHUNK], __ATOMIC_ACQUIRE);
+	if (!chunk) {
+		sched_lock (sched, &sched->lock);
+		chunk = __atomic_load_n (&table->chunks[num / TASK_CHUNK], __ATOMIC_ACQUIRE);
+		if (!chunk) {
+			chunk = (void **) calloc (TASK_CHUNK, sizeof (void *));
+			__atomic_store_n (&table->chunks[num / TASK_CHUNK], chunk, __ATOMIC_RELEASE);
+		}
+		sched_unlock (sched, &sched->lock);
+	}
+	if (!chunk) {
+		fprintf (stderr, "Processor: can't allocate a task table\n");
+		return NULL;
+	}
+
+	*id = (cell_t) num;
+	return &chunk[num % TASK_CHUNK];
+}
+
+static void *table_get (struct task_table *table, const cell_t id)
+{
+	void **chunk = NULL;
+
+	if (id < 0 || id >= (cell_t) TASK_CHUNK * TASK_CHUNKS)
+		return NULL;
+	chunk = __atomic_load_n (&table->chunks[id / TASK_CHUNK], __ATOMIC_ACQUIRE);
+	return (chunk) ? __atomic_load_n (&chunk[id % TASK_CHUNK], __ATOMIC_ACQUIRE) : NULL;
+}
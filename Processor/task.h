@@ -0,0 +1,136 @@
+#ifndef TASK_H
+#define TASK_H
+
+#include "vm.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define TASK_CHUNK 4096
+#define TASK_CHUNKS 4096
+#define CHAN_MAX_CAP (1 << 20)
+
+struct task_list
+{
+	struct task *head;
+	struct task *tail;
+};
+
+/*
+ * Context of a task: what the dispatch loop keeps in its locals.  A task
+ * is on one list at a time through next: a run queue or a wait list.
+ * Task 0 runs the program on the stacks and registers of the VM, the
+ * others have theirs in mem, which is freed once the task is done.
+ */
+struct task
+{
+	const struct insn *ip;
+	cell_t *stack;
+	cell_t *sp;
+	cell_t tos;
+	const struct insn **calls;
+	const struct insn **csp;
+	const struct insn **calls_end;
+	size_t limit;
+	cell_t *regs;
+	cell_t own_regs[REGS_NUM];
+	void *mem;
+	cell_t id;
+	cell_t result;
+	bool done;
+	struct task *next;
+	struct task_list joiners;
+	pthread_mutex_t lock;
+};
+
+struct channel
+{
+	cell_t *buf;
+	size_t cap;
+	size_t head;
+	size_t len;
+	struct task_list senders;
+	struct task_list receivers;
+	pthread_mutex_t lock;
+};
+
+/* Ids index a directory of chunks, so entries never move once published */
+struct task_table
+{
+	void **chunks[TASK_CHUNKS];
+	size_t num;
+};
+
+struct task_worker
+{
+	struct sched *sched;
+	size_t id;
+	pthread_t thread;
+	struct task_list runq;
+	pthread_mutex_t lock;
+	enum vm_status res;
+} __attribute__ ((aligned (64)));
+
+/*
+ * Every worker runs the dispatch loop on tasks from its own run queue and
+ * steals from the others when it is empty.  Worker 0 is the thread that
+ * called vm_run.  ready counts the queued tasks and idle the workers
+ * waiting for one, all of them idle with nothing ready is a deadlock.
+ * Locks are taken only when there is more than one worker.  A run out
+ * of fuel leaves its current task in resume for the next vm_run.
+ */
+struct sched
+{
+	struct vm *vm;
+	struct task_worker *workers;
+	size_t workers_num;
+	bool threaded;
+	size_t stack_cells;
+	size_t stack_cap;
+	size_t call_depth;
+	struct task_table tasks;
+	struct task_table chans;
+	long ready;
+	size_t idle;
+	bool stop;
+	enum vm_status status;
+	struct task *resume;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_mutex_t io_lock;
+};
+
+int task_start (struct vm *vm);
+void task_free (struct vm *vm);
+enum vm_status task_stop (struct task_worker *worker, enum vm_status res, bool *stopped);
+
+struct task *task_next (struct task_worker *worker);
+struct task *task_yield (struct task_worker *worker, struct task *cur);
+void task_exit (struct task_worker *worker, struct task *cur, const cell_t result);
+
+int task_spawn (struct task_worker *worker, const struct insn *ip, const cell_t *regs, cell_t *tos);
+int task_chan (struct task_worker *worker, cell_t *tos);
+int task_join (struct task_worker *worker, struct task *cur, cell_t *tos);
+int task_send (struct task_worker *worker, struct task *cur, const cell_t ch, const cell_t val);
+int task_recv (struct task_worker *worker, struct task *cur, cell_t *tos);
+
+/* Running tasks notice that the program is over at task commands */
+static inline bool task_stopping (const struct sched *sched)
+{
+	return __atomic_load_n (&sched->stop, __ATOMIC_RELAXED);
+}
+
+static inline void task_io_lock (struct sched *sched)
+{
+	if (sched->threaded)
+		pthread_mutex_lock (&sched->io_lock);
+}
+
+static inline void task_io_unlock (struct sched *sched)
+{
+	if (sched->threaded)
+		pthread_mutex_unlock (&sched->io_lock);
+}
+
+#endif // TASK_H
@@ -0,0 +1,550 @@
+#include "processor.h"
+#include "vm.h"
+#include "regvm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+
+#define DEPTH_NONE INT_MIN
+
+/*
+ * The stack depth at every command relative to the entry of the function
+ * it belongs to has to be the same on all paths, then stack slots become
+ * frame-relative registers.  ent is the stack of the block being
+ * translated above base: an entry is either its own slot or a register or
+ * constant not pushed yet.  last is the command that wrote the top slot
+ * and may write a register instead.
+ */
+struct translator
+{
+	struct vm *vm;
+	struct reg_code *rc;
+	size_t cap;
+	size_t consts_cap;
+	size_t num;
+	int *depth;
+	int *owner;
+	bool *leader;
+	int *func;
+	size_t *entry;
+	int *ret;
+	size_t funcs_num;
+	size_t *work;
+	size_t work_num;
+	int32_t *rmap;
+	int base;
+	int32_t *ent;
+	size_t ent_num;
+	long last;
+	bool changed;
+};
+
+static int find_depths (struct translator *tr);
+static int walk_func (struct translator *tr, const size_t f);
+static int visit (struct translator *tr, const size_t f, const size_t i, const int depth);
+static int translate_insn (struct translator *tr, const size_t i);
+static uint8_t io_type (const int op);
+static bool rop_writes (const int op, const int stack_op);
+static int emit (struct translator *tr, const int op, const int32_t d, const int32_t a, const int32_t b,
+		 const int32_t target, const size_t i);
+static int constant (struct translator *tr, const cell_t val, int32_t *opnd);
+static int push_opnd (struct translator *tr, const int32_t opnd);
+static int32_t pop_opnd (struct translator *tr);
+static int flush (struct translator *tr, const int32_t reg, const size_t i);
+static int pop_to_reg (struct translator *tr, const int reg, const size_t i);
+
+static inline int cur_depth (const struct translator *tr)
+{
+	return tr->base + (int) tr->ent_num;
+}
+
+/*
+ * Translates vm->code into register code for reg_run ().  Programs with
+ * task commands, with stack depths that differ between paths or with
+ * code shared by functions are rejected, they run on the stack engine.
+ */
+int reg_translate (struct vm *vm)
+{
+	struct translator tr = {};
+	struct reg_code *rc = (struct reg_code *) calloc (1, sizeof (struct reg_code));
+	size_t i = 0;
+	int res = 1;
+
+	tr.vm = vm;
+	tr.rc = rc;
+	tr.num = vm->code_num + 1;
+	tr.depth = (int *) malloc (tr.num * sizeof (int));
+	tr.owner = (int *) malloc (tr.num * sizeof (int));
+	tr.leader = (bool *) calloc (tr.num, sizeof (bool));
+	tr.func = (int *) malloc (tr.num * sizeof (int));
+	tr.entry = (size_t *) calloc (tr.num, sizeof (size_t));
+	tr.ret = (int *) malloc (tr.num * sizeof (int));
+	tr.work = (size_t *) calloc (tr.num, sizeof (size_t));
+	tr.rmap = (int32_t *) calloc (tr.num, sizeof (int32_t));
+	tr.ent = (int32_t *) calloc (tr.num + count_stack_growth (vm), sizeof (int32_t));
+	if (!rc || !tr.depth || !tr.owner || !tr.leader || !tr.func || !tr.entry || !tr.ret ||
+	    !tr.work || !tr.rmap || !tr.ent) {
+		fprintf (stderr, "Processor: can't allocate memory for the register code\n");
+		goto out;
+	}
+
+	if (find_depths (&tr))
+		goto out;
+
+	/* Everything a block is entered with is in its slots */
+	for (i = 0; i < tr.funcs_num; i++)
+		tr.leader[tr.entry[i]] = true;
+	for (i = 0; i < tr.num - 1; i++) {
+		if (op_has_target (vm->code[i].op))
+			tr.leader[vm->code[i].target] = true;
+		if (op_is_control (vm->code[i].op))
+			tr.leader[i + 1] = true;
+	}
+
+	for (i = 0; i < tr.num; i++) {
+		if (tr.owner[i] < 0)
+			continue;
+		if (tr.leader[i]) {
+			if (i > 0 && tr.owner[i - 1] >= 0 && !op_is_control (vm->code[i - 1].op) && flush (&tr, -1, i))
+				goto out;
+			tr.base = tr.depth[i];
+			tr.ent_num = 0;
+			tr.last = -1;
+		}
+		tr.rmap[i] = (int32_t) rc->num;
+		if (translate_insn (&tr, i))
+			goto out;
+	}
+	if (emit (&tr, ROP_HLT, 0, 0, 0, 0, tr.num - 1))
+		goto out;
+
+	for (i = 0; i < rc->num; i++)
+		if ((rc->code[i].op >= ROP_JMP && rc->code[i].op <= ROP_CALL))
+			rc->code[i].target = tr.rmap[rc->code[i].target];
+
+	i = rc->num - 1;
+	rc->code[i].fuel_cost = 1;
+	while (i-- > 0)
+		rc->code[i].fuel_cost = (rop_is_control (rc->code[i].op)) ? 1 : rc->code[i + 1].fuel_cost + 1;
+	vm->reg_code = rc;
+	res = 0;
+
+out:
+	free (tr.depth);
+	free (tr.owner);
+	free (tr.leader);
+	free (tr.func);
+	free (tr.entry);
+	free (tr.ret);
+	free (tr.work);
+	free (tr.rmap);
+	free (tr.ent);
+	if (res && rc) {
+		free (rc->code);
+		free (rc->pc);
+		free (rc->consts);
+		free (rc);
+	}
+	return res;
+}
+
+/*
+ * Call targets are functions.  A function returns with the depth it has
+ * at ret, which calls to it need first, so the walk is repeated until no
+ * new return depth turns up.
+ */
+static int find_depths (struct translator *tr)
+{
+	const struct insn *code = tr->vm->code;
+	size_t i = 0, f = 0;
+
+	for (i = 0; i < tr->num; i++) {
+		tr->func[i] = -1;
+		tr->ret[i] = DEPTH_NONE;
+	}
+	tr->func[0] = 0;
+	tr->funcs_num = 1;
+	for (i = 0; i < tr->num - 1; i++) {
+		if (code[i].op >= OP_SPAWN && code[i].op <= OP_RECV) {
+			fprintf (stderr, "Processor: the register engine can't run task commands\n");
+			return 1;
+		}
+		if (code[i].op == OP_CALL && tr->func[code[i].target] < 0) {
+			tr->func[code[i].target] = (int) tr->funcs_num;
+			tr->entry[tr->funcs_num++] = (size_t) code[i].target;
+		}
+	}
+
+	tr->changed = true;
+	while (tr->changed) {
+		tr->changed = false;
+		for (i = 0; i < tr->num; i++) {
+			tr->depth[i] = DEPTH_NONE;
+			tr->owner[i] = -1;
+		}
+		for (f = 0; f < tr->funcs_num; f++)
+			if (walk_func (tr, f))
+				return 1;
+	}
+
+	return 0;
+}
+
+static int walk_func (struct translator *tr, const size_t f)
+{
+	const struct insn *code = tr->vm->code;
+
+	tr->work_num = 0;
+	if (visit (tr, f, tr->entry[f], 0))
+		return 1;
+
+	while (tr->work_num) {
+		const size_t i = tr->work[--tr->work_num];
+		const struct insn *insn = &code[i];
+		const int out = tr->depth[i] + stack_effect (insn->op);
+		int callee = -1, ret = DEPTH_NONE;
+
+		switch (insn->op) {
+			case OP_HLT:
+				break;
+			case OP_RET:
+				ret = tr->depth[i];
+				break;
+			case OP_CALL:
+				callee = tr->func[insn->target];
+				if (tr->ret[callee] != DEPTH_NONE && visit (tr, f, i + 1, out + tr->ret[callee]))
+					return 1;
+				break;
+			case OP_JMP:
+				/* A tail call moves the frame and returns for us */
+				callee = tr->func[insn->target];
+				if (callee >= 0 && (size_t) callee != f) {
+					if (tr->ret[callee] != DEPTH_NONE)
+						ret = out + tr->ret[callee];
+					break;
+				}
+				if (visit (tr, f, (size_t) insn->target, out))
+					return 1;
+				break;
+			default:
+				if (op_is_jump (insn->op) && visit (tr, f, (size_t) insn->target, out))
+					return 1;
+				if (visit (tr, f, i + 1, out))
+					return 1;
+				break;
+		}
+
+		if (ret == DEPTH_NONE)
+			continue;
+		if (tr->ret[f] == DEPTH_NONE) {
+			tr->ret[f] = ret;
+			tr->changed = true;
+		} else if (tr->ret[f] != ret) {
+			fprintf (stderr, "Processor: pc %u: the register engine needs the same stack depth "
+			                 "at every return\n", tr->vm->insn_pc[i]);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int visit (struct translator *tr, const size_t f, const size_t i, const int depth)
+{
+	if (tr->owner[i] < 0) {
+		tr->owner[i] = (int) f;
+		tr->depth[i] = depth;
+		tr->work[tr->work_num++] = i;
+		return 0;
+	}
+	if ((size_t) tr->owner[i] == f && tr->depth[i] == depth)
+		return 0;
+
+	fprintf (stderr, "Processor: pc %u: the register engine needs the same stack depth "
+	                 "on every path\n", tr->vm->insn_pc[i]);
+	return 1;
+}
+
+static int translate_insn (struct translator *tr, const size_t i)
+{
+	const struct insn *insn = &tr->vm->code[i];
+	const int op = insn->op;
+	int32_t a = 0, b = 0, c = 0;
+	int depth = 0;
+
+	switch (op) {
+		case OP_HLT:
+			return emit (tr, ROP_HLT, 0, 0, 0, 0, i);
+		case OP_PUSH_IMM:
+			return constant (tr, insn->arg, &a) || push_opnd (tr, a);
+		case OP_PUSH_REG:
+			if (!insn->arg)
+				return push_opnd (tr, opnd_global (insn->reg));
+			return constant (tr, insn->arg, &b) ||
+			       emit (tr, ROP_ADD_Q, opnd_slot (cur_depth (tr)), opnd_global (insn->reg), b, 0, i) ||
+			       push_opnd (tr, opnd_slot (cur_depth (tr)));
+		case OP_PUSH_MEM_IMM:
+		case OP_PUSH_MEM_REG:
+			if (op == OP_PUSH_MEM_IMM && constant (tr, 0, &a))
+				return 1;
+			if (op == OP_PUSH_MEM_REG)
+				a = opnd_global (insn->reg);
+			return emit (tr, ROP_LOAD, opnd_slot (cur_depth (tr)), a, 0, (int32_t) insn->arg, i) ||
+			       push_opnd (tr, opnd_slot (cur_depth (tr)));
+		case OP_POP_REG:
+			return pop_to_reg (tr, insn->reg, i);
+		case OP_POP_MEM_IMM:
+		case OP_POP_MEM_REG:
+			b = pop_opnd (tr);
+			if (op == OP_POP_MEM_IMM && constant (tr, 0, &a))
+				return 1;
+			if (op == OP_POP_MEM_REG)
+				a = opnd_global (insn->reg);
+			return emit (tr, ROP_STORE, 0, a, b, (int32_t) insn->arg, i);
+		case OP_POP:
+		case OP_POP_Q:
+		case OP_POP_D:
+			a = pop_opnd (tr);
+			return emit (tr, ROP_PRINT, 0, a, 0, 0, i);
+		case OP_IN:
+		case OP_IN_Q:
+		case OP_IN_D:
+			return emit (tr, ROP_IN, opnd_slot (cur_depth (tr)), 0, 0, 0, i) ||
+			       push_opnd (tr, opnd_slot (cur_depth (tr)));
+		case OP_OUT:
+		case OP_OUT_Q:
+		case OP_OUT_D:
+			a = pop_opnd (tr);
+			return emit (tr, ROP_OUT, 0, a, 0, 0, i);
+		case OP_ADD:
+		case OP_SUB:
+		case OP_MUL:
+		case OP_DIV:
+		case OP_ADD_Q:
+		case OP_SUB_Q:
+		case OP_MUL_Q:
+		case OP_DIV_Q:
+		case OP_ADD_D:
+		case OP_SUB_D:
+		case OP_MUL_D:
+		case OP_DIV_D:
+			b = pop_opnd (tr);
+			a = pop_opnd (tr);
+			c = (op <= OP_DIV) ? ROP_ADD + (op - OP_ADD) : ROP_ADD_Q + (op - OP_ADD_Q);
+			return emit (tr, c, opnd_slot (cur_depth (tr)), a, b, 0, i) ||
+			       push_opnd (tr, opnd_slot (cur_depth (tr)));
+		case OP_ADD_RR:
+		case OP_ADD_RI:
+		case OP_SUB_RR:
+		case OP_SUB_RI:
+		case OP_MUL_RR:
+		case OP_MUL_RI:
+		case OP_DIV_RR:
+		case OP_DIV_RI:
+			if ((op - OP_ADD_RR) % 2)
+				c = constant (tr, insn->arg, &b);
+			else
+				b = opnd_global ((size_t) insn->arg);
+			return c || flush (tr, insn->reg, i) ||
+			       emit (tr, ROP_ADD + (op - OP_ADD_RR) / 2, opnd_global (insn->reg),
+			             opnd_global (insn->reg2), b, 0, i);
+		case OP_JMP:
+			if (flush (tr, -1, i))
+				return 1;
+			c = (tr->func[insn->target] >= 0 && tr->func[insn->target] != tr->owner[i]) ? ROP_TAIL : ROP_JMP;
+			return emit (tr, c, 0, 0, 0, insn->target, i);
+		case OP_JA:
+		case OP_JAE:
+		case OP_JB:
+		case OP_JBE:
+		case OP_JE:
+		case OP_JNE:
+		case OP_JA_Q:
+		case OP_JAE_Q:
+		case OP_JB_Q:
+		case OP_JBE_Q:
+		case OP_JE_Q:
+		case OP_JNE_Q:
+		case OP_JA_D:
+		case OP_JAE_D:
+		case OP_JB_D:
+		case OP_JBE_D:
+		case OP_JE_D:
+		case OP_JNE_D:
+			/* Overflow is checked with the operands still on the stack */
+			depth = cur_depth (tr);
+			b = pop_opnd (tr);
+			a = pop_opnd (tr);
+			c = (op <= OP_JNE) ? ROP_JA + (op - OP_JA) : ROP_JA_Q + (op - OP_JA_Q);
+			if (flush (tr, -1, i) || emit (tr, c, 0, a, b, insn->target, i))
+				return 1;
+			tr->rc->code[tr->rc->num - 1].depth = depth;
+			return 0;
+		case OP_CMPJ_A:
+		case OP_CMPJ_AE:
+		case OP_CMPJ_B:
+		case OP_CMPJ_BE:
+		case OP_CMPJ_E:
+		case OP_CMPJ_NE:
+			return constant (tr, insn->arg, &b) || flush (tr, -1, i) ||
+			       emit (tr, ROP_JA + (op - OP_CMPJ_A), 0, opnd_global (insn->reg), b, insn->target, i);
+		case OP_CALL:
+			return flush (tr, -1, i) || emit (tr, ROP_CALL, 0, 0, 0, insn->target, i);
+		case OP_RET:
+			return flush (tr, -1, i) || emit (tr, ROP_RET, 0, 0, 0, 0, i);
+		case OP_VADD:
+		case OP_VMUL:
+			return emit (tr, ROP_VEC, 0, 0, 0, (int32_t) i, i);
+		case OP_VSUM:
+		case OP_VDOT:
+			return emit (tr, ROP_VEC, opnd_slot (cur_depth (tr)), 0, 0, (int32_t) i, i) ||
+			       push_opnd (tr, opnd_slot (cur_depth (tr)));
+		case OP_VFILL:
+			a = pop_opnd (tr);
+			return emit (tr, ROP_VEC, 0, a, 0, (int32_t) i, i);
+		case OP_VIN:
+		case OP_VOUT:
+			return emit (tr, ROP_VIO, 0, 0, 0, (int32_t) i, i);
+		default:
+			fprintf (stderr, "Processor: the register engine can't run instruction %d\n", op);
+			return 1;
+	}
+}
+
+static uint8_t io_type (const int op)
+{
+	switch (op) {
+		case OP_POP_Q:
+		case OP_IN_Q:
+		case OP_OUT_Q:
+			return TYPE_INT64;
+		case OP_POP_D:
+		case OP_IN_D:
+		case OP_OUT_D:
+			return TYPE_DOUBLE;
+		default:
+			return TYPE_INT;
+	}
+}
+
+static bool rop_writes (const int op, const int stack_op)
+{
+	switch (op) {
+		case ROP_STORE:
+		case ROP_OUT:
+		case ROP_PRINT:
+		case ROP_VIO:
+			return false;
+		case ROP_VEC:
+			return stack_op == OP_VSUM || stack_op == OP_VDOT;
+		default:
+			return !rop_is_control (op);
+	}
+}
+
+/* Commands that write a slot are remembered in last, the others clear it */
+static int emit (struct translator *tr, const int op, const int32_t d, const int32_t a, const int32_t b,
+		 const int32_t target, const size_t i)
+{
+	struct reg_code *rc = tr->rc;
+
+	if (rc->num == tr->cap) {
+		const size_t cap = (tr->cap) ? tr->cap * 2 : 256;
+		struct rinsn *code = (struct rinsn *) realloc (rc->code, cap * sizeof (struct rinsn));
+		uint32_t *pc = (uint32_t *) realloc (rc->pc, cap * sizeof (uint32_t));
+
+		if (code)
+			rc->code = code;
+		if (pc)
+			rc->pc = pc;
+		if (!code || !pc || cap > INT32_MAX) {
+			fprintf (stderr, "Processor: can't allocate memory for the register code\n");
+			return 1;
+		}
+		tr->cap = cap;
+	}
+
+	rc->code[rc->num] = {(uint8_t) op, io_type (tr->vm->code[i].op), 0, d, a, b, target, cur_depth (tr), 0};
+	rc->pc[rc->num] = tr->vm->insn_pc[i];
+	tr->last = (rop_writes (op, tr->vm->code[i].op) && !(d & 1)) ? (long) rc->num : -1;
+	rc->num++;
+	return 0;
+}
+
+static int constant (struct translator *tr, const cell_t val, int32_t *opnd)
+{
+	struct reg_code *rc = tr->rc;
+
+	if (rc->consts_num == tr->consts_cap) {
+		const size_t cap = (tr->consts_cap) ? tr->consts_cap * 2 : 64;
+		cell_t *consts = (cell_t *) realloc (rc->consts, cap * sizeof (cell_t));
+
+		if (!consts || cap > INT32_MAX / 2) {
+			fprintf (stderr, "Processor: can't allocate memory for the register code\n");
+			return 1;
+		}
+		rc->consts = consts;
+		tr->consts_cap = cap;
+	}
+
+	rc->consts[rc->consts_num] = val;
+	*opnd = opnd_global (REGS_NUM + rc->consts_num);
+	rc->consts_num++;
+	return 0;
+}
+
+static int push_opnd (struct translator *tr, const int32_t opnd)
+{
+	tr->ent[tr->ent_num++] = opnd;
+	return 0;
+}
+
+/* Entries below the block are in their slots */
+static int32_t pop_opnd (struct translator *tr)
+{
+	if (!tr->ent_num) {
+		tr->base--;
+		return opnd_slot (tr->base);
+	}
+	return tr->ent[--tr->ent_num];
+}
+
+/* Puts the entries holding reg, or all of them with -1, into their slots */
+static int flush (struct translator *tr, const int32_t reg, const size_t i)
+{
+	for (size_t k = 0; k < tr->ent_num; k++) {
+		const int32_t slot = opnd_slot (tr->base + (int) k);
+
+		if (tr->ent[k] == slot || (reg >= 0 && tr->ent[k] != opnd_global ((size_t) reg)))
+			continue;
+		if (emit (tr, ROP_MOV, slot, tr->ent[k], 0, 0, i))
+			return 1;
+		tr->ent[k] = slot;
+	}
+	tr->last = -1;
+	return 0;
+}
+
+/* push ... op ... pop reg computes into reg with no copy */
+static int pop_to_reg (struct translator *tr, const int reg, const size_t i)
+{
+	const int32_t opnd = pop_opnd (tr);
+	const int32_t slot = opnd_slot (cur_depth (tr));
+	bool held = false;
+
+	for (size_t k = 0; k < tr->ent_num; k++)
+		if (tr->ent[k] == opnd_global ((size_t) reg))
+			held = true;
+
+	if (!held && opnd == slot && tr->last >= 0 && tr->rc->code[tr->last].d == slot) {
+		tr->rc->code[tr->last].d = opnd_global ((size_t) reg);
+		tr->last = -1;
+		return 0;
+	}
+	if (held && flush (tr, reg, i))
+		return 1;
+	if (opnd == opnd_global ((size_t) reg))
+		return 0;
+	return emit (tr, ROP_MOV, opnd_global ((size_t) reg), opnd, 0, 0, i);
+}
@@ -0,0 +1,489 @@
+#include "processor.h"
+#include "vm.h"
+#include "vec.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+/*
+ * Double sums are accumulated in four lanes: element i goes to lane i % 4,
+ * the lanes are added as (0 + 2) + (1 + 3) and the tail is added after
+ * that.  Every kernel set follows this order, so results do not depend on
+ * the CPU, but they may differ in rounding from a loop of scalar commands.
+ */
+
+static void add_q_scalar (cell_t *dst, const cell_t *a, const cell_t *b, const size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		dst[i] = (cell_t) ((uint64_t) a[i] + (uint64_t) b[i]);
+}
+
+static void mul_q_scalar (cell_t *dst, const cell_t *a, const cell_t *b, const size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		dst[i] = (cell_t) ((uint64_t) a[i] * (uint64_t) b[i]);
+}
+
+static void add_d_scalar (cell_t *dst, const cell_t *a, const cell_t *b, const size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		dst[i] = from_double (to_double (a[i]) + to_double (b[i]));
+}
+
+static void mul_d_scalar (cell_t *dst, const cell_t *a, const cell_t *b, const size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		dst[i] = from_double (to_double (a[i]) * to_double (b[i]));
+}
+
+static cell_t sum_q_scalar (const cell_t *a, const size_t n)
+{
+	uint64_t sum = 0;
+
+	for (size_t i = 0; i < n; i++)
+		sum += (uint64_t) a[i];
+	return (cell_t) sum;
+}
+
+static cell_t dot_q_scalar (const cell_t *a, const cell_t *b, const size_t n)
+{
+	uint64_t sum = 0;
+
+	for (size_t i = 0; i < n; i++)
+		sum += (uint64_t) a[i] * (uint64_t) b[i];
+	return (cell_t) sum;
+}
+
+static double sum_d_tail (const cell_t *a, const size_t n, double sum)
+{
+	for (size_t i = 0; i < n; i++)
+		sum += to_double (a[i]);
+	return sum;
+}
+
+static double dot_d_tail (const cell_t *a, const cell_t *b, const size_t n, double sum)
+{
+	for (size_t i = 0; i < n; i++)
+		sum += to_double (a[i]) * to_double (b[i]);
+	return sum;
+}
+
+static double sum_d_scalar (const cell_t *a, const size_t n)
+{
+	double lane[4] = {};
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4)
+		for (size_t j = 0; j < 4; j++)
+			lane[j] += to_double (a[i + j]);
+	return sum_d_tail (a + i, n - i, (lane[0] + lane[2]) + (lane[1] + lane[3]));
+}
+
+static double dot_d_scalar (const cell_t *a, const cell_t *b, const size_t n)
+{
+	double lane[4] = {};
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4)
+		for (size_t j = 0; j < 4; j++)
+			lane[j] += to_double (a[i + j]) * to_double (b[i + j]);
+	return dot_d_tail (a + i, b + i, n - i, (lane[0] + lane[2]) + (lane[1] + lane[3]));
+}
+
+static void fill_scalar (cell_t *dst, const cell_t val, const size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		dst[i] = val;
+}
+
+static void wrap32_scalar (cell_t *dst, const size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		dst[i] = wrap32 ((uint64_t) dst[i]);
+}
+
+static const struct vec_kernels scalar_kernels = {
+	"scalar",
+	add_q_scalar, mul_q_scalar, add_d_scalar, mul_d_scalar,
+	sum_q_scalar, sum_d_scalar, dot_q_scalar, dot_d_scalar,
+	fill_scalar, wrap32_scalar
+};
+
+#if defined(__x86_64__)
+
+#define LOAD128(p)	_mm_loadu_si128 ((const __m128i *) (p))
+#define STORE128(p, v)	_mm_storeu_si128 ((__m128i *) (p), (v))
+#define LOAD256(p)	_mm256_loadu_si256 ((const __m256i *) (p))
+#define STORE256(p, v)	_mm256_storeu_si256 ((__m256i *) (p), (v))
+
+/* low 64 bits of the product: lo * lo + ((hi * lo + lo * hi) << 32) */
+static inline __m128i mul_epi64_sse2 (const __m128i x, const __m128i y)
+{
+	const __m128i cross = _mm_add_epi64 (_mm_mul_epu32 (_mm_srli_epi64 (x, 32), y),
+	                                     _mm_mul_epu32 (x, _mm_srli_epi64 (y, 32)));
+	return _mm_add_epi64 (_mm_mul_epu32 (x, y), _mm_slli_epi64 (cross, 32));
+}
+
+static void add_q_sse2 (cell_t *dst, const cell_t *a, const cell_t *b, const size_t n)
+{
+	size_t i = 0;
+
+	for (; i + 2 <= n; i += 2)
+		STORE128 (dst + i, _mm_add_epi64 (LOAD128 (a + i), LOAD128 (b + i)));
+	add_q_scalar (dst + i, a + i, b + i, n - i);
+}
+
+static void mul_q_sse2 (cell_t *dst, const cell_t *a, const cell_t *b, const size_t n)
+{
+	size_t i = 0;
+
+	for (; i + 2 <= n; i += 2)
+		STORE128 (dst + i, mul_epi64_sse2 (LOAD128 (a + i), LOAD128 (b + i)));
+	mul_q_scalar (dst + i, a + i, b + i, n - i);
+}
+
+static void add_d_sse2 (cell_t *dst, const cell_t *a, const cell_t *b, const size_t n)
+{
+	size_t i = 0;
+
+	for (; i + 2 <= n; i += 2)
+		STORE128 (dst + i, _mm_castpd_si128 (_mm_add_pd (_mm_castsi128_pd (LOAD128 (a + i)),
+		                                                 _mm_castsi128_pd (LOAD128 (b + i)))));
+	add_d_scalar (dst + i, a + i, b + i, n - i);
+}
+
+static void mul_d_sse2 (cell_t *dst, const cell_t *a, const cell_t *b, const size_t n)
+{
+	size_t i = 0;
+
+	for (; i + 2 <= n; i += 2)
+		STORE128 (dst + i, _mm_castpd_si128 (_mm_mul_pd (_mm_castsi128_pd (LOAD128 (a + i)),
+		                                                 _mm_castsi128_pd (LOAD128 (b + i)))));
+	mul_d_scalar (dst + i, a + i, b + i, n - i);
+}
+
+static cell_t sum_q_sse2 (const cell_t *a, const size_t n)
+{
+	__m128i acc = _mm_setzero_si128 ();
+	cell_t lane[2] = {};
+	size_t i = 0;
+
+	for (; i + 2 <= n; i += 2)
+		acc = _mm_add_epi64 (acc, LOAD128 (a + i));
+	STORE128 (lane, acc);
+	return (cell_t) ((uint64_t) sum_q_scalar (lane, 2) + (uint64_t) sum_q_scalar (a + i, n - i));
+}
+
+static cell_t dot_q_sse2 (const cell_t *a, const cell_t *b, const size_t n)
+{
+	__m128i acc = _mm_setzero_si128 ();
+	cell_t lane[2] = {};
+	size_t i = 0;
+
+	for (; i + 2 <= n; i += 2)
+		acc = _mm_add_epi64 (acc, mul_epi64_sse2 (LOAD128 (a + i), LOAD128 (b + i)));
+	STORE128 (lane, acc);
+	return (cell_t) ((uint64_t) sum_q_scalar (lane, 2) + (uint64_t) dot_q_scalar (a + i, b + i, n - i));
+}
+
+/* acc0 holds lanes 0 and 1, acc1 lanes 2 and 3 */
+static double reduce_pd_sse2 (const __m128d acc0, const __m128d acc1)
+{
+	const __m128d half = _mm_add_pd (acc0, acc1);
+	return _mm_cvtsd_f64 (half) + _mm_cvtsd_f64 (_mm_unpackhi_pd (half, half));
+}
+
+static double sum_d_sse2 (const cell_t *a, const size_t n)
+{
+	__m128d acc0 = _mm_setzero_pd (), acc1 = _mm_setzero_pd ();
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4) {
+		acc0 = _mm_add_pd (acc0, _mm_castsi128_pd (LOAD128 (a + i)));
+		acc1 = _mm_add_pd (acc1, _mm_castsi128_pd (LOAD128 (a + i + 2)));
+	}
+	return sum_d_tail (a + i, n - i, reduce_pd_sse2 (acc0, acc1));
+}
+
+static double dot_d_sse2 (const cell_t *a, const cell_t *b, const size_t n)
+{
+	__m128d acc0 = _mm_setzero_pd (), acc1 = _mm_setzero_pd ();
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4) {
+		acc0 = _mm_add_pd (acc0, _mm_mul_pd (_mm_castsi128_pd (LOAD128 (a + i)),
+		                                     _mm_castsi128_pd (LOAD128 (b + i))));
+		acc1 = _mm_add_pd (acc1, _mm_mul_pd (_mm_castsi128_pd (LOAD128 (a + i + 2)),
+		                                     _mm_castsi128_pd (LOAD128 (b + i + 2))));
+	}
+	return dot_d_tail (a + i, b + i, n - i, reduce_pd_sse2 (acc0, acc1));
+}
+
+static void fill_sse2 (cell_t *dst, const cell_t val, const size_t n)
+{
+	const __m128i v = _mm_set1_epi64x (val);
+	size_t i = 0;
+
+	for (; i + 2 <= n; i += 2)
+		STORE128 (dst + i, v);
+	fill_scalar (dst + i, val, n - i);
+}
+
+/* sign of every low half is put next to it */
+static void wrap32_sse2 (cell_t *dst, const size_t n)
+{
+	size_t i = 0;
+
+	for (; i + 2 <= n; i += 2) {
+		const __m128i low = _mm_shuffle_epi32 (LOAD128 (dst + i), _MM_SHUFFLE (3, 1, 2, 0));
+		STORE128 (dst + i, _mm_unpacklo_epi32 (low, _mm_srai_epi32 (low, 31)));
+	}
+	wrap32_scalar (dst + i, n - i);
+}
+
+static const struct vec_kernels sse2_kernels = {
+	"sse2",
+	add_q_sse2, mul_q_sse2, add_d_sse2, mul_d_sse2,
+	sum_q_sse2, sum_d_sse2, dot_q_sse2, dot_d_sse2,
+	fill_sse2, wrap32_sse2
+};
+
+#define AVX2 __attribute__ ((target ("avx2")))
+
+AVX2 static inline __m256i mul_epi64_avx2 (const __m256i x, const __m256i y)
+{
+	const __m256i cross = _mm256_add_epi64 (_mm256_mul_epu32 (_mm256_srli_epi64 (x, 32), y),
+	                                        _mm256_mul_epu32 (x, _mm256_srli_epi64 (y, 32)));
+	return _mm256_add_epi64 (_mm256_mul_epu32 (x, y), _mm256_slli_epi64 (cross, 32));
+}
+
+AVX2 static void add_q_avx2 (cell_t *dst, const cell_t *a, const cell_t *b, const size_t n)
+{
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4)
+		STORE256 (dst + i, _mm256_add_epi64 (LOAD256 (a + i), LOAD256 (b + i)));
+	add_q_scalar (dst + i, a + i, b + i, n - i);
+}
+
+AVX2 static void mul_q_avx2 (cell_t *dst, const cell_t *a, const cell_t *b, const size_t n)
+{
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4)
+		STORE256 (dst + i, mul_epi64_avx2 (LOAD256 (a + i), LOAD256 (b + i)));
+	mul_q_scalar (dst + i, a + i, b + i, n - i);
+}
+
+AVX2 static void add_d_avx2 (cell_t *dst, const cell_t *a, const cell_t *b, const size_t n)
+{
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4)
+		STORE256 (dst + i, _mm256_castpd_si256 (_mm256_add_pd (_mm256_castsi256_pd (LOAD256 (a + i)),
+		                                                       _mm256_castsi256_pd (LOAD256 (b + i)))));
+	add_d_scalar (dst + i, a + i, b + i, n - i);
+}
+
+AVX2 static void mul_d_avx2 (cell_t *dst, const cell_t *a, const cell_t *b, const size_t n)
+{
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4)
+		STORE256 (dst + i, _mm256_castpd_si256 (_mm256_mul_pd (_mm256_castsi256_pd (LOAD256 (a + i)),
+		                                                       _mm256_castsi256_pd (LOAD256 (b + i)))));
+	mul_d_scalar (dst + i, a + i, b + i, n - i);
+}
+
+AVX2 static cell_t sum_q_avx2 (const cell_t *a, const size_t n)
+{
+	__m256i acc = _mm256_setzero_si256 ();
+	cell_t lane[4] = {};
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4)
+		acc = _mm256_add_epi64 (acc, LOAD256 (a + i));
+	STORE256 (lane, acc);
+	return (cell_t) ((uint64_t) sum_q_scalar (lane, 4) + (uint64_t) sum_q_scalar (a + i, n - i));
+}
+
+AVX2 static cell_t dot_q_avx2 (const cell_t *a, const cell_t *b, const size_t n)
+{
+	__m256i acc = _mm256_setzero_si256 ();
+	cell_t lane[4] = {};
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4)
+		acc = _mm256_add_epi64 (acc, mul_epi64_avx2 (LOAD256 (a + i), LOAD256 (b + i)));
+	STORE256 (lane, acc);
+	return (cell_t) ((uint64_t) sum_q_scalar (lane, 4) + (uint64_t) dot_q_scalar (a + i, b + i, n - i));
+}
+
+AVX2 static double reduce_pd_avx2 (const __m256d acc)
+{
+	const __m128d half = _mm_add_pd (_mm256_castpd256_pd128 (acc), _mm256_extractf128_pd (acc, 1));
+	return _mm_cvtsd_f64 (half) + _mm_cvtsd_f64 (_mm_unpackhi_pd (half, half));
+}
+
+AVX2 static double sum_d_avx2 (const cell_t *a, const size_t n)
+{
+	__m256d acc = _mm256_setzero_pd ();
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4)
+		acc = _mm256_add_pd (acc, _mm256_castsi256_pd (LOAD256 (a + i)));
+	return sum_d_tail (a + i, n - i, reduce_pd_avx2 (acc));
+}
+
+AVX2 static double dot_d_avx2 (const cell_t *a, const cell_t *b, const size_t n)
+{
+	__m256d acc = _mm256_setzero_pd ();
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4)
+		acc = _mm256_add_pd (acc, _mm256_mul_pd (_mm256_castsi256_pd (LOAD256 (a + i)),
+		                                         _mm256_castsi256_pd (LOAD256 (b + i))));
+	return dot_d_tail (a + i, b + i, n - i, reduce_pd_avx2 (acc));
+}
+
+AVX2 static void fill_avx2 (cell_t *dst, const cell_t val, const size_t n)
+{
+	const __m256i v = _mm256_set1_epi64x (val);
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4)
+		STORE256 (dst + i, v);
+	fill_scalar (dst + i, val, n - i);
+}
+
+/* low halves are gathered and sign extended back to 64 bits */
+AVX2 static void wrap32_avx2 (cell_t *dst, const size_t n)
+{
+	const __m256i idx = _mm256_setr_epi32 (0, 2, 4, 6, 0, 2, 4, 6);
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4) {
+		const __m256i low = _mm256_permutevar8x32_epi32 (LOAD256 (dst + i), idx);
+		STORE256 (dst + i, _mm256_cvtepi32_epi64 (_mm256_castsi256_si128 (low)));
+	}
+	wrap32_scalar (dst + i, n - i);
+}
+
+static const struct vec_kernels avx2_kernels = {
+	"avx2",
+	add_q_avx2, mul_q_avx2, add_d_avx2, mul_d_avx2,
+	sum_q_avx2, sum_d_avx2, dot_q_avx2, dot_d_avx2,
+	fill_avx2, wrap32_avx2
+};
+
+#endif // __x86_64__
+
+/*
+ * NULL or "auto" picks the best kernels the CPU supports.  Returns NULL
+ * if the named kernels are unknown or not supported.
+ */
+const struct vec_kernels *vec_select (const char *name)
+{
+#if defined(__x86_64__)
+	const struct vec_kernels *best = (__builtin_cpu_supports ("avx2")) ? &avx2_kernels : &sse2_kernels;
+
+	if (name && !strcmp (name, "sse2"))
+		return &sse2_kernels;
+	if (name && !strcmp (name, "avx2"))
+		return (best == &avx2_kernels) ? best : NULL;
+#else
+	const struct vec_kernels *best = &scalar_kernels;
+#endif
+
+	if (!name || !strcmp (name, "auto"))
+		return best;
+	if (!strcmp (name, "scalar"))
+		return &scalar_kernels;
+	return NULL;
+}
+
+static bool overlaps (const cell_t *dst, const cell_t *src, const uint64_t n)
+{
+	return dst > src && dst < src + n;
+}
+
+/*
+ * Every range of vector command insn must lie in RAM, otherwise *addr is
+ * set to the first word out of it and 1 is returned.
+ */
+int vm_vec_ranges (const struct vm *vm, const cell_t *regs, const struct insn *insn, cell_t **base,
+		   uint64_t *len, uint64_t *addr)
+{
+	const int ranges = get_vec_regs_num (insn->op - OP_VADD) - 1;
+
+	*len = (uint64_t) regs[VEC_REG (insn, ranges)];
+	for (int i = 0; i < ranges; i++) {
+		*addr = (*len) ? (uint64_t) regs[VEC_REG (insn, i)] : 0;
+		if (*addr & ~vm->ram_mask)
+			return 1;
+		if (*len > vm->ram_words - *addr) {
+			*addr = vm->ram_words;
+			return 1;
+		}
+		base[i] = vm->ram + *addr;
+	}
+
+	return 0;
+}
+
+/*
+ * vfill takes its value from *val, vsum and vdot put their result there.
+ * A destination running ahead of its source within the length is left to
+ * the scalar kernels, which give the same result as a loop of scalar
+ * commands.
+ */
+int vm_run_vec (struct vm *vm, const cell_t *regs, const struct insn *insn, cell_t *val, uint64_t *addr)
+{
+	const struct vec_kernels *vec = vm->vec;
+	const int type = insn->flags;
+	cell_t *base[3] = {};
+	uint64_t len = 0;
+
+	if (vm_vec_ranges (vm, regs, insn, base, &len, addr))
+		return 1;
+
+	switch (insn->op) {
+		case OP_VADD:
+		case OP_VMUL:
+			if (overlaps (base[0], base[1], len) || overlaps (base[0], base[2], len))
+				vec = &scalar_kernels;
+			if (type == TYPE_DOUBLE) {
+				(insn->op == OP_VADD ? vec->add_d : vec->mul_d) (base[0], base[1], base[2], len);
+				break;
+			}
+			(insn->op == OP_VADD ? vec->add_q : vec->mul_q) (base[0], base[1], base[2], len);
+			if (type == TYPE_INT)
+				vec->wrap32 (base[0], len);
+			break;
+		case OP_VSUM:
+			if (type == TYPE_DOUBLE)
+				*val = from_double (vec->sum_d (base[0], len));
+			else
+				*val = vec->sum_q (base[0], len);
+			break;
+		case OP_VDOT:
+			if (type == TYPE_DOUBLE)
+				*val = from_double (vec->dot_d (base[0], base[1], len));
+			else
+				*val = vec->dot_q (base[0], base[1], len);
+			break;
+		case OP_VFILL:
+			vec->fill (base[0], *val, len);
+			break;
+		default:
+			break;
+	}
+
+	if (type == TYPE_INT && (insn->op == OP_VSUM || insn->op == OP_VDOT))
+		*val = wrap32 ((uint64_t) *val);
+	return 0;
+}
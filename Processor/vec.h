@@ -0,0 +1,28 @@
+#ifndef VEC_H
+#define VEC_H
+
+#include "vm.h"
+
+/*
+ * Kernels of the vector commands for one instruction set.  Integer kernels
+ * work on 64-bit cells, untyped commands wrap the result to 32 bits
+ * afterwards.  Double kernels keep their operands as cell bits.
+ */
+struct vec_kernels
+{
+	const char *name;
+	void (*add_q) (cell_t *dst, const cell_t *a, const cell_t *b, const size_t n);
+	void (*mul_q) (cell_t *dst, const cell_t *a, const cell_t *b, const size_t n);
+	void (*add_d) (cell_t *dst, const cell_t *a, const cell_t *b, const size_t n);
+	void (*mul_d) (cell_t *dst, const cell_t *a, const cell_t *b, const size_t n);
+	cell_t (*sum_q) (const cell_t *a, const size_t n);
+	double (*sum_d) (const cell_t *a, const size_t n);
+	cell_t (*dot_q) (const cell_t *a, const cell_t *b, const size_t n);
+	double (*dot_d) (const cell_t *a, const cell_t *b, const size_t n);
+	void (*fill) (cell_t *dst, const cell_t val, const size_t n);
+	void (*wrap32) (cell_t *dst, const size_t n);
+};
+
+const struct vec_kernels *vec_select (const char *name);
+
+#endif // VEC_H
@@ -0,0 +1,421 @@
+#include "processor.h"
+#include "vm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+struct stack_effect
+{
+	int pops;
+	int pushes;
+};
+
+static const struct stack_effect effects[OP_NUM] = {
+	{0, 0},	// OP_HLT
+	{0, 1},	// OP_PUSH_IMM
+	{0, 1},	// OP_PUSH_REG
+	{0, 1},	// OP_PUSH_MEM_IMM
+	{0, 1},	// OP_PUSH_MEM_REG
+	{1, 0},	// OP_POP
+	{1, 0},	// OP_POP_REG
+	{1, 0},	// OP_POP_MEM_IMM
+	{1, 0},	// OP_POP_MEM_REG
+	{2, 1},	// OP_ADD
+	{2, 1},	// OP_SUB
+	{2, 1},	// OP_MUL
+	{2, 1},	// OP_DIV
+	{0, 1},	// OP_IN
+	{1, 0},	// OP_OUT
+	{0, 0},	// OP_JMP
+	{2, 0},	// OP_JA
+	{2, 0},	// OP_JAE
+	{2, 0},	// OP_JB
+	{2, 0},	// OP_JBE
+	{2, 0},	// OP_JE
+	{2, 0},	// OP_JNE
+	{0, 0},	// OP_CALL
+	{0, 0},	// OP_RET
+	{0, 0},	// OP_CMPJ_A
+	{0, 0},	// OP_CMPJ_AE
+	{0, 0},	// OP_CMPJ_B
+	{0, 0},	// OP_CMPJ_BE
+	{0, 0},	// OP_CMPJ_E
+	{0, 0},	// OP_CMPJ_NE
+	{0, 0},	// OP_ADD_RR
+	{0, 0},	// OP_ADD_RI
+	{0, 0},	// OP_SUB_RR
+	{0, 0},	// OP_SUB_RI
+	{0, 0},	// OP_MUL_RR
+	{0, 0},	// OP_MUL_RI
+	{0, 0},	// OP_DIV_RR
+	{0, 0},	// OP_DIV_RI
+	{1, 0},	// OP_POP_Q
+	{1, 0},	// OP_POP_D
+	{0, 1},	// OP_IN_Q
+	{0, 1},	// OP_IN_D
+	{1, 0},	// OP_OUT_Q
+	{1, 0},	// OP_OUT_D
+	{2, 1},	// OP_ADD_Q
+	{2, 1},	// OP_SUB_Q
+	{2, 1},	// OP_MUL_Q
+	{2, 1},	// OP_DIV_Q
+	{2, 1},	// OP_ADD_D
+	{2, 1},	// OP_SUB_D
+	{2, 1},	// OP_MUL_D
+	{2, 1},	// OP_DIV_D
+	{2, 0},	// OP_JA_Q
+	{2, 0},	// OP_JAE_Q
+	{2, 0},	// OP_JB_Q
+	{2, 0},	// OP_JBE_Q
+	{2, 0},	// OP_JE_Q
+	{2, 0},	// OP_JNE_Q
+	{2, 0},	// OP_JA_D
+	{2, 0},	// OP_JAE_D
+	{2, 0},	// OP_JB_D
+	{2, 0},	// OP_JBE_D
+	{2, 0},	// OP_JE_D
+	{2, 0},	// OP_JNE_D
+	{0, 0},	// OP_VADD
+	{0, 0},	// OP_VMUL
+	{0, 1},	// OP_VSUM
+	{0, 1},	// OP_VDOT
+	{1, 0},	// OP_VFILL
+	{0, 0},	// OP_VIN
+	{0, 0},	// OP_VOUT
+	{1, 1},	// OP_SPAWN
+	{0, 0},	// OP_YIELD
+	{1, 1},	// OP_JOIN
+	{1, 1},	// OP_CHAN
+	{2, 0},	// OP_SEND
+	{1, 1},	// OP_RECV
+	{0, 0},	// OP_TRAP
+};
+
+struct func_summary
+{
+	int ret;
+	int low;
+	uint32_t ret_pc;
+	uint32_t low_pc;
+	bool reached;
+	bool task;
+};
+
+/*
+ * Stack depths are relative to the entry of the function being analysed.
+ * ret is the depth change from call to return (INT_MAX if the function never
+ * returns), low is the lowest depth the function and its callees reach.
+ */
+struct verifier
+{
+	struct vm *vm;
+	size_t num;
+	size_t blocks_num;
+	size_t *block;
+	size_t *start;
+	int *need;
+	int *delta;
+	int *depth;
+	bool *queued;
+	size_t *worklist;
+	size_t work_num;
+	size_t *visited;
+	size_t visited_num;
+	int *func;
+	size_t *entry;
+	struct func_summary *funcs;
+	size_t funcs_num;
+	int bound;
+};
+
+static int find_blocks (struct verifier *ver);
+static int analyse_func (struct verifier *ver, const size_t f);
+static void succ_push (struct verifier *ver, const size_t b, const int out);
+
+
+/*
+ * Every function (call target, plus the program itself) is analysed with
+ * the summaries of its callees until nothing changes.  The program must
+ * never go below its empty stack and must not reach ret.  A spawned task
+ * starts with its argument on the stack and must not reach ret either.
+ */
+int check_stack_depth (struct vm *vm)
+{
+	struct verifier ver = {};
+	size_t f = 0;
+	bool changed = true;
+	int res = 1;
+
+	ver.vm = vm;
+	ver.num = vm->code_num + 1;
+	ver.bound = (vm->config.stack_size < INT_MAX / 2) ? (int) vm->config.stack_size : INT_MAX / 2;
+
+	if (find_blocks (&ver))
+		goto out;
+
+	ver.funcs[0].reached = true;
+	while (changed) {
+		changed = false;
+		for (f = 0; f < ver.funcs_num; f++) {
+			int ret = 0;
+
+			if (!ver.funcs[f].reached)
+				continue;
+			ret = analyse_func (&ver, f);
+			if (ret < 0)
+				goto out;
+			if (ret > 0)
+				changed = true;
+		}
+	}
+
+	if (ver.funcs[0].low < 0) {
+		fprintf (stderr, "Processor: stack underflow is possible at pc %u\n", ver.funcs[0].low_pc);
+		goto out;
+	}
+	if (ver.funcs[0].ret != INT_MAX) {
+		fprintf (stderr, "Processor: ret outside of a function at pc %u\n", ver.funcs[0].ret_pc);
+		goto out;
+	}
+	for (f = 1; f < ver.funcs_num; f++) {
+		if (!ver.funcs[f].task || !ver.funcs[f].reached)
+			continue;
+		if (ver.funcs[f].low < -1) {
+			fprintf (stderr, "Processor: stack underflow is possible at pc %u\n", ver.funcs[f].low_pc);
+			goto out;
+		}
+		if (ver.funcs[f].ret != INT_MAX) {
+			fprintf (stderr, "Processor: ret outside of a function at pc %u\n", ver.funcs[f].ret_pc);
+			goto out;
+		}
+	}
+	res = 0;
+
+out:
+	free (ver.block);
+	free (ver.start);
+	free (ver.need);
+	free (ver.delta);
+	free (ver.depth);
+	free (ver.queued);
+	free (ver.worklist);
+	free (ver.visited);
+	free (ver.func);
+	free (ver.entry);
+	free (ver.funcs);
+	return res;
+}
+
+static int find_blocks (struct verifier *ver)
+{
+	const struct insn *code = ver->vm->code;
+	const size_t num = ver->num;
+	size_t i = 0, b = 0;
+
+	ver->block = (size_t *) calloc (num, sizeof (size_t));
+	ver->start = (size_t *) calloc (num + 1, sizeof (size_t));
+	ver->need = (int *) calloc (num, sizeof (int));
+	ver->delta = (int *) calloc (num, sizeof (int));
+	ver->depth = (int *) calloc (num, sizeof (int));
+	ver->queued = (bool *) calloc (num, sizeof (bool));
+	ver->worklist = (size_t *) calloc (num, sizeof (size_t));
+	ver->visited = (size_t *) calloc (num, sizeof (size_t));
+	ver->func = (int *) calloc (num, sizeof (int));
+	ver->entry = (size_t *) calloc (num + 1, sizeof (size_t));
+	ver->funcs = (struct func_summary *) calloc (num + 1, sizeof (struct func_summary));
+	if (!ver->block || !ver->start || !ver->need || !ver->delta || !ver->depth || !ver->queued ||
+	    !ver->worklist || !ver->visited || !ver->func || !ver->entry || !ver->funcs) {
+		fprintf (stderr, "Processor: can't allocate memory for the verifier\n");
+		return 1;
+	}
+
+	for (i = 0; i < num; i++) {
+		ver->func[i] = -1;
+		ver->funcs[i].ret = INT_MAX;
+	}
+	ver->funcs_num = 1;
+
+	ver->block[0] = 1;
+	for (i = 0; i < num - 1; i++) {
+		if (op_has_target (code[i].op))
+			ver->block[code[i].target] = 1;
+		if (op_is_control (code[i].op))
+			ver->block[i + 1] = 1;
+		if ((code[i].op == OP_CALL || code[i].op == OP_SPAWN) && ver->func[code[i].target] < 0) {
+			ver->func[code[i].target] = (int) ver->funcs_num;
+			ver->funcs[ver->funcs_num].task = (code[i].op == OP_SPAWN);
+			ver->entry[ver->funcs_num++] = (size_t) code[i].target;
+		}
+		if ((code[i].op == OP_CALL || code[i].op == OP_SPAWN) &&
+		    ver->funcs[ver->func[code[i].target]].task != (code[i].op == OP_SPAWN)) {
+			fprintf (stderr, "Processor: pc %u: %u is both called and spawned\n",
+			         ver->vm->insn_pc[i], ver->vm->insn_pc[code[i].target]);
+			return 1;
+		}
+	}
+
+	/* block[i] becomes the number of the block holding instruction i */
+	for (i = 0; i < num; i++) {
+		if (ver->block[i])
+			ver->start[ver->blocks_num++] = i;
+		ver->block[i] = ver->blocks_num - 1;
+	}
+	ver->start[ver->blocks_num] = num;
+
+	for (i = 0; i < num; i++) {
+		const struct stack_effect *eff = &effects[code[i].op];
+		b = ver->block[i];
+		if (ver->delta[b] - eff->pops < ver->need[b])
+			ver->need[b] = ver->delta[b] - eff->pops;
+		ver->delta[b] += eff->pushes - eff->pops;
+	}
+
+	for (b = 0; b < ver->blocks_num; b++)
+		ver->depth[b] = INT_MAX;
+	for (i = 0; i < ver->funcs_num; i++)
+		ver->entry[i] = ver->block[ver->entry[i]];
+
+	return 0;
+}
+
+/*
+ * Returns 1 if the summary of function f or the set of reached functions
+ * changed, 0 if not and -1 if the function is rejected.
+ */
+static int analyse_func (struct verifier *ver, const size_t f)
+{
+	const struct insn *code = ver->vm->code;
+	struct func_summary sum = {INT_MAX, 0, 0, ver->vm->insn_pc[ver->start[ver->entry[f]]], true,
+				   ver->funcs[f].task};
+	size_t i = 0;
+	int changed = 0;
+
+	ver->work_num = 0;
+	ver->visited_num = 0;
+	succ_push (ver, ver->entry[f], 0);
+
+	while (ver->work_num) {
+		const size_t b = ver->worklist[--ver->work_num];
+		const struct insn *last = &code[ver->start[b + 1] - 1];
+		struct func_summary *callee = NULL;
+		const int out = ver->depth[b] + ver->delta[b];
+
+		ver->queued[b] = false;
+		if (ver->depth[b] + ver->need[b] < sum.low) {
+			sum.low = ver->depth[b] + ver->need[b];
+			sum.low_pc = ver->vm->insn_pc[ver->start[b]];
+		}
+		if (sum.low < -ver->bound) {
+			fprintf (stderr, "Processor: unbounded stack use at pc %u\n", sum.low_pc);
+			changed = -1;
+			goto out;
+		}
+
+		switch (last->op) {
+			case OP_HLT:
+				break;
+			case OP_RET:
+				if (out < sum.ret) {
+					sum.ret = out;
+					sum.ret_pc = ver->vm->insn_pc[last - code];
+				}
+				break;
+			case OP_SPAWN:
+				callee = &ver->funcs[ver->func[last->target]];
+				if (!callee->reached) {
+					callee->reached = true;
+					callee->ret = INT_MAX;
+					changed = 1;
+				}
+				succ_push (ver, b + 1, out);
+				break;
+			case OP_CALL:
+				callee = &ver->funcs[ver->func[last->target]];
+				if (!callee->reached) {
+					callee->reached = true;
+					callee->ret = INT_MAX;
+					changed = 1;
+				}
+				if (out + callee->low < sum.low) {
+					sum.low = out + callee->low;
+					sum.low_pc = ver->vm->insn_pc[last - code];
+				}
+				if (callee->ret != INT_MAX)
+					succ_push (ver, b + 1, out + callee->ret);
+				break;
+			case OP_JMP:
+				succ_push (ver, ver->block[last->target], out);
+				break;
+			default:
+				if (op_is_jump (last->op))
+					succ_push (ver, ver->block[last->target], out);
+				succ_push (ver, b + 1, out);
+				break;
+		}
+	}
+
+	if (sum.ret != ver->funcs[f].ret || sum.low != ver->funcs[f].low)
+		changed = 1;
+	ver->funcs[f] = sum;
+
+out:
+	for (i = 0; i < ver->visited_num; i++) {
+		ver->depth[ver->visited[i]] = INT_MAX;
+		ver->queued[ver->visited[i]] = false;
+	}
+	return changed;
+}
+
+static void succ_push (struct verifier *ver, const size_t b, const int out)
+{
+	if (out >= ver->depth[b])
+		return;
+
+	if (ver->depth[b] == INT_MAX)
+		ver->visited[ver->visited_num++] = b;
+	ver->depth[b] = out;
+	if (!ver->queued[b]) {
+		ver->queued[b] = true;
+		ver->worklist[ver->work_num++] = b;
+	}
+}
+
+
+int stack_effect (const int op)
+{
+	return effects[op].pushes - effects[op].pops;
+}
+
+/* Cells the command moves: what it pops and what it pushes */
+int stack_cells (const int op)
+{
+	return effects[op].pushes + effects[op].pops;
+}
+
+/*
+ * Stack overflow is checked only by control transfer handlers, so the stack
+ * must have room for the longest push sequence between two of them.
+ */
+size_t count_stack_growth (const struct vm *vm)
+{
+	size_t max = 0, cur = 0, i = vm->code_num + 1;
+	int eff = 0;
+
+	while (i-- > 0) {
+		if (op_is_control (vm->code[i].op)) {
+			cur = 0;
+			continue;
+		}
+		eff = effects[vm->code[i].op].pushes - effects[vm->code[i].op].pops;
+		if (eff >= 0)
+			cur += (size_t) eff;
+		else
+			cur = (cur > (size_t) -eff) ? cur - (size_t) -eff : 0;
+		if (cur > max)
+			max = cur;
+	}
+
+	return max + 1;
+}
@@ -2,71 +2,230 @@
 
 #include <stdio.h>
 #include <string.h>
-#include <stdlib.h>
 
 #define SIGNATURE "KM"
-#define VERSION "v4"
+#define VERSION "v5"
+#define VERSION_V4 "v4"
 
+#define SIGN_AND_VER_LEN (sizeof (SIGNATURE) - 1 + sizeof (VERSION) - 1)
 
-int write_sign_and_ver (FILE * file)
+static const char zero_padding[SECT_ALIGN] = {};
+
+static inline uint64_t mix64 (uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ull;
+	h ^= h >> 33;
+	return h;
+}
+
+uint64_t hash64 (const void *data, const size_t len, const uint64_t seed)
+{
+	const char *ptr = (const char *) data;
+	uint64_t h = seed ^ (len * 0x9e3779b97f4a7c15ull);
+	uint64_t word = 0;
+	size_t i = 0;
+
+	for (i = 0; i + sizeof (word) <= len; i += sizeof (word)) {
+		memcpy (&word, ptr + i, sizeof (word));
+		h = (h ^ mix64 (word)) * 0x9e3779b97f4a7c15ull;
+	}
+	if (i < len) {
+		word = 0;
+		memcpy (&word, ptr + i, len - i);
+		h = (h ^ mix64 (word)) * 0x9e3779b97f4a7c15ull;
+	}
+
+	return mix64 (h);
+}
+
+uint64_t count_checksum (const struct file_header *header,
+			 const struct section_entry *table,
+			 const char *const *sections)
+{
+	struct file_header tmp = *header;
+	uint64_t h = 0;
+
+	tmp.checksum = 0;
+	h = hash64 (&tmp, sizeof (tmp), 0);
+	h = hash64 (table, header->sections_num * sizeof (struct section_entry), h);
+	for (uint32_t i = 0; i < header->sections_num; i++)
+		h = hash64 (sections[i], table[i].size, h);
+
+	return h;
+}
+
+static size_t align_up (const size_t value)
 {
+	return (value + SECT_ALIGN - 1) & ~((size_t) SECT_ALIGN - 1);
+}
+
+int write_byte_code (FILE *file, const struct section_buf *sections, const uint64_t source_hash,
+		     const uint32_t flags)
+{
+	struct file_header header = {};
+	struct section_entry table[SECT_NUM] = {};
+	const char *data[SECT_NUM] = {};
+	size_t offset = 0, pos = 0;
+
 	if (!file) {
-		fprintf (stderr, "write_sign_ans_ver () error: file was not opened\n");
+		fprintf (stderr, "write_byte_code () error: file was not opened\n");
 		return 1;
 	}
 
 	if (ftell (file) != 0) {
-		fprintf (stderr, "write_sign_ans_ver () warning: file position was rewinded\n");
+		fprintf (stderr, "write_byte_code () warning: file position was rewinded\n");
 		rewind (file);
 	}
 
-	if (fprintf (file, "%s%s", SIGNATURE, VERSION) <
-		(int) (sizeof (SIGNATURE) - 1 + sizeof (VERSION) - 1)) {
-		fprintf (stderr, "write_sign_ans_ver () error: failed to write\n");
+	memcpy (header.sign_and_ver, SIGNATURE VERSION, SIGN_AND_VER_LEN);
+	header.header_size = sizeof (header);
+	header.sections_num = SECT_NUM;
+	header.flags = flags;
+	header.source_hash = source_hash;
+
+	offset = align_up (sizeof (header) + sizeof (table));
+	for (int i = 0; i < SECT_NUM; i++) {
+		table[i].type = (uint32_t) i;
+		table[i].offset = offset;
+		table[i].size = sections[i].len;
+		data[i] = (const char *) sections[i].data;
+		offset = align_up (offset + sections[i].len);
+	}
+	header.checksum = count_checksum (&header, table, data);
+
+	if (fwrite (&header, sizeof (header), 1, file) != 1 ||
+	    fwrite (table, sizeof (table), 1, file) != 1) {
+		fprintf (stderr, "write_byte_code () error: failed to write header\n");
 		return 1;
 	}
+	pos = sizeof (header) + sizeof (table);
+
+	for (int i = 0; i < SECT_NUM; i++) {
+		if (fwrite (zero_padding, 1, table[i].offset - pos, file) != table[i].offset - pos ||
+		    (sections[i].len && fwrite (data[i], 1, sections[i].len, file) != sections[i].len)) {
+			fprintf (stderr, "write_byte_code () error: failed to write section %d\n", i);
+			return 1;
+		}
+		pos = table[i].offset + sections[i].len;
+	}
 
 	return 0;
 }
 
-int check_sign_and_ver (FILE * file)
+/*
+ * Returns the format version (4 or 5) or -1.
+ */
+int check_sign_and_ver (const char *data, const size_t len)
 {
-	size_t len = sizeof (SIGNATURE) - 1 + sizeof (VERSION) - 1;
-	char *sign_and_ver = NULL;
-
-	sign_and_ver = (char *) calloc (len + 1, sizeof (char));
-	if (!sign_and_ver) {
-		fprintf (stderr, "write_sign_ans_ver () error: failed to allocate memory\n");
+	if (!data) {
+		fprintf (stderr, "check_sign_ans_ver () error: no data\n");
 		return -1;
 	}
 
-	if (!file) {
-		fprintf (stderr, "write_sign_ans_ver () error: file was not opened\n");
-		free (sign_and_ver);
+	if (len < SIGN_AND_VER_LEN) {
+		fprintf (stderr, "check_sign_ans_ver () error: file is too short\n");
 		return -1;
 	}
 
-	rewind (file);
-
-	if (fread (sign_and_ver, sizeof (char), len, file) < len) {
-		fprintf (stderr, "check_sign_ans_ver () error: failed to read\n");
-		free (sign_and_ver);
-		return -1;
-	}
-
-	if (strncmp (sign_and_ver, SIGNATURE, sizeof (SIGNATURE) - 1)) {
+	if (strncmp (data, SIGNATURE, sizeof (SIGNATURE) - 1)) {
 		fprintf (stderr, "check_sign_ans_ver () error: signature is not correct\n");
-		free (sign_and_ver);
 		return -1;
 	}
 
-	if (strncmp (sign_and_ver + sizeof (SIGNATURE) - 1, VERSION, sizeof (VERSION) - 1)) {
-		fprintf (stderr, "check_sign_ans_ver () error: version is not correct\n");
-		free (sign_and_ver);
-		return -1;
+	if (!strncmp (data + sizeof (SIGNATURE) - 1, VERSION, sizeof (VERSION) - 1))
+		return 5;
+	if (!strncmp (data + sizeof (SIGNATURE) - 1, VERSION_V4, sizeof (VERSION_V4) - 1))
+		return 4;
+
+	fprintf (stderr, "check_sign_ans_ver () error: version is not correct\n");
+	return -1;
+}
+
+/*
+ * Zigzag LEB128: 1 to 5 bytes, small values of either sign are short.
+ */
+size_t put_varint (char *buf, const int32_t val)
+{
+	uint32_t u = ((uint32_t) val << 1) ^ (0u - ((uint32_t) val >> 31));
+	size_t n = 0;
+
+	while (u >= 0x80) {
+		buf[n++] = (char) (u | 0x80);
+		u >>= 7;
 	}
+	buf[n++] = (char) u;
+
+	return n;
+}
 
-	free (sign_and_ver);
-	return (int) len;
+/*
+ * Reads the five bytes a varint can take at once, the length is where the
+ * first clear high bit is, and the 7-bit groups are gathered with fixed
+ * shifts, so there is no loop over the bytes.
+ */
+static int get_varint (const char *code, const size_t len, size_t *pc, int32_t *val)
+{
+	const size_t left = len - *pc;
+	uint64_t word = 0, stops = 0, raw = 0;
+	size_t n = 0;
+
+	memcpy (&word, code + *pc, (left < sizeof (word)) ? left : sizeof (word));
+	stops = ~word & 0x8080808080ull;
+	if (!stops)
+		return 1;
+	n = ((size_t) __builtin_ctzll (stops) + 1) / 8;
+	if (n > left)
+		return 1;
+
+	word &= ~0ull >> (64 - 8 * n);
+	raw = (word & 0x7f) | ((word >> 1) & 0x3f80) | ((word >> 2) & 0x1fc000) |
+	      ((word >> 3) & 0xfe00000) | ((word >> 4) & 0x7f0000000ull);
+	if (raw >> 32)
+		return 1;
+
+	*val = (int32_t) ((uint32_t) (raw >> 1) ^ (0u - (uint32_t) (raw & 1)));
+	*pc += n;
+	return 0;
 }
 
+/*
+ * 32-bit operand at *pc, four bytes or a varint; moves *pc past it.
+ * Returns 1 if it runs out of the code.
+ */
+int read_operand (const char *code, const size_t len, size_t *pc, const uint32_t flags, int32_t *val)
+{
+	if (flags & FILE_COMPACT)
+		return get_varint (code, len, pc, val);
+
+	if (len - *pc < sizeof (*val))
+		return 1;
+	memcpy (val, code + *pc, sizeof (*val));
+	*pc += sizeof (*val);
+	return 0;
+}
+
+/*
+ * Jump target as an absolute offset in the code
+ */
+int read_target (const char *code, const size_t len, size_t *pc, const uint32_t flags, int32_t *target)
+{
+	const size_t start = *pc;
+	int32_t rel = 0;
+	int64_t abs = 0;
+
+	if (read_operand (code, len, pc, flags, &rel))
+		return 1;
+	if (!(flags & FILE_COMPACT)) {
+		*target = rel;
+		return 0;
+	}
+
+	abs = (int64_t) start + rel;
+	if (abs < 0 || abs > INT32_MAX)
+		return 1;
+	*target = (int32_t) abs;
+	return 0;
+}
@@ -0,0 +1,851 @@
+#include "processor.h"
+#include "vm.h"
+#include "vec.h"
+#include "task.h"
+#include "regvm.h"
+#include "debugger.h"
+#ifdef VM_PROFILE
+#include "profile.h"
+#include "perf.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <math.h>
+
+int vm_ctor (struct vm *vm, const struct vm_config *config)
+{
+	*vm = {};
+	vm->config = *config;
+	if (!vm->config.stack_size)
+		vm->config.stack_size = VM_STACK_SIZE;
+	if (!vm->config.call_depth)
+		vm->config.call_depth = VM_CALL_DEPTH;
+	if (!vm->config.ram_size)
+		vm->config.ram_size = VM_RAM_SIZE;
+
+	vm->calls = (const struct insn **) malloc (vm->config.call_depth * sizeof (struct insn *));
+	if (!vm->calls) {
+		fprintf (stderr, "Processor: can't allocate call stack of depth %zu\n", vm->config.call_depth);
+		return 1;
+	}
+
+	vm->vec = vec_select (vm->config.simd);
+	if (!vm->vec) {
+		fprintf (stderr, "Processor: SIMD kernels \"%s\" are not supported\n", vm->config.simd);
+		return 1;
+	}
+
+	if (io_open (&vm->io, vm->config.io, vm->config.in_fd, vm->config.capture))
+		return 1;
+
+	return vm_map_ram (vm);
+}
+
+void vm_dtor (struct vm *vm)
+{
+	vm_debug_stop (vm);
+#ifdef VM_PROFILE
+	vm_sample_stop (vm);
+	vm_profile_free (vm);
+	vm_perf_stop (vm);
+#endif
+	task_free (vm);
+	reg_free (vm);
+	io_close (&vm->io);
+	if (!vm->shared_code) {
+		free (vm->code);
+		free (vm->insn_pc);
+		free (vm->pc_map);
+		free (vm->fuel_cost);
+	}
+	free (vm->stack);
+	free (vm->calls);
+	vm_unmap_ram (vm);
+	*vm = {};
+}
+
+/* The same on a VM of its own, for hosts that keep many of them */
+struct vm *vm_create (const struct vm_config *config)
+{
+	struct vm *vm = (struct vm *) calloc (1, sizeof (struct vm));
+
+	if (!vm) {
+		fprintf (stderr, "Processor: can't allocate a VM\n");
+		return NULL;
+	}
+	if (vm_ctor (vm, config)) {
+		vm_destroy (vm);
+		return NULL;
+	}
+	return vm;
+}
+
+void vm_destroy (struct vm *vm)
+{
+	if (!vm)
+		return;
+	vm_dtor (vm);
+	free (vm);
+}
+
+#define PUSH(val)		\
+	do {			\
+		*sp++ = tos;	\
+		tos = (val);	\
+	} while (0)
+
+#define POP(var)		\
+	do {			\
+		(var) = tos;	\
+		tos = *--sp;	\
+	} while (0)
+
+#define FAULT(err)		\
+	do {			\
+		res = (err);	\
+		goto out;	\
+	} while (0)
+
+#define CHECK_STACK()					\
+	do {						\
+		if ((size_t) (sp - stack) > limit)	\
+			FAULT (VM_ERR_STACK_OVERFLOW);	\
+	} while (0)
+
+#define CHECK_ADDR(addr)				\
+	do {						\
+		if ((addr) & ~ram_mask)			\
+			FAULT (VM_ERR_SEGFAULT);	\
+	} while (0)
+
+/* op1 is the second element, tos the first one */
+#define BINARY_OP(expr)			\
+	do {				\
+		op1 = *--sp;		\
+		tos = (expr);		\
+		ip++;			\
+	} while (0)
+
+#define INT_OP(oper)	BINARY_OP (wrap32 ((uint64_t) op1 oper (uint64_t) tos))
+#define INT64_OP(oper)	BINARY_OP ((cell_t) ((uint64_t) op1 oper (uint64_t) tos))
+#define DOUBLE_OP(oper)	BINARY_OP (from_double (to_double (op1) oper to_double (tos)))
+
+/*
+ * A run of commands up to the next control transfer is paid for when it
+ * is entered, one that does not fit suspends the VM in front of it.
+ */
+#define CHARGE()							\
+	do {								\
+		fuel = (int64_t) ((uint64_t) fuel - fuel_cost[ip - code]);	\
+		PERF_CHARGE ();						\
+		if (fuel < 0)						\
+			goto suspend;					\
+	} while (0)
+
+#define JUMP_IF(cond)						\
+	do {							\
+		CHECK_STACK ();					\
+		op2 = tos;					\
+		op1 = *--sp;					\
+		tos = *--sp;					\
+		ip = (cond) ? code + ip->target : ip + 1;	\
+		CHARGE ();					\
+	} while (0)
+
+#define INT_JUMP(oper)		JUMP_IF ((int32_t) op1 oper (int32_t) op2)
+#define INT64_JUMP(oper)	JUMP_IF (op1 oper op2)
+#define DOUBLE_JUMP(cond)	JUMP_IF (cond (to_double (op1), to_double (op2)))
+
+#define CMPJ_IF(oper)								\
+	do {									\
+		CHECK_STACK ();							\
+		ip = ((int32_t) regs[ip->reg] oper (int32_t) ip->arg) ? code + ip->target : ip + 1;	\
+		CHARGE ();							\
+	} while (0)
+
+#define REG_OP(src2, oper)							\
+	do {									\
+		regs[ip->reg] = wrap32 ((uint64_t) regs[ip->reg2] oper (uint64_t) (src2));	\
+		ip++;								\
+	} while (0)
+
+/* Tasks on other workers share io */
+#define IO_CALL(call)					\
+	do {						\
+		if (sched)				\
+			task_io_lock (sched);		\
+		op2 = (call);				\
+		if (sched)				\
+			task_io_unlock (sched);		\
+		if (op2)				\
+			FAULT (VM_ERR_IO);		\
+	} while (0)
+
+#define READ(type)					\
+	do {						\
+		IO_CALL (io_read (io, (type), &op1));	\
+		PUSH (op1);				\
+		ip++;					\
+	} while (0)
+
+#define WRITE(func, type)				\
+	do {						\
+		POP (op1);				\
+		IO_CALL (func (io, (type), op1));	\
+		ip++;					\
+	} while (0)
+
+/*
+ * Only the per task part of the context changes between the commands of
+ * a task, the rest is set once when the task is switched to.
+ */
+#define SAVE_TASK()			\
+	do {				\
+		cur->ip = ip;		\
+		cur->sp = sp;		\
+		cur->tos = tos;		\
+		cur->csp = csp;		\
+	} while (0)
+
+#define LOAD_TASK()				\
+	do {					\
+		ip = cur->ip;			\
+		stack = cur->stack;		\
+		sp = cur->sp;			\
+		tos = cur->tos;			\
+		calls = cur->calls;		\
+		csp = cur->csp;			\
+		calls_end = cur->calls_end;	\
+		limit = cur->limit;		\
+		regs = cur->regs;		\
+		PROFILE_SWITCH ();		\
+	} while (0)
+
+/* A blocked task was saved on the command and runs it again when woken up */
+#define BLOCKING(call)				\
+	do {					\
+		SAVE_TASK ();			\
+		op2 = (call);			\
+		if (op2 < 0)			\
+			FAULT (VM_ERR_TASK);	\
+		if (op2)			\
+			goto next_task;		\
+	} while (0)
+
+#define CHECK_STOP()				\
+	do {					\
+		if (task_stopping (sched)) {	\
+			stopped = true;		\
+			goto out;		\
+		}				\
+	} while (0)
+
+/*
+ * The dispatch loop is instantiated for every mode.  The profiled copy
+ * counts and times commands, the sampled one publishes ip and csp for
+ * the SIGPROF handler, csp once the call stack is consistent.  The perf
+ * copy has the host counters on and counts stack cells.  Without
+ * VM_PROFILE only the plain and the debug copies exist.
+ */
+enum run_mode
+{
+	RUN_PLAIN,
+	RUN_PROFILE,
+	RUN_SAMPLE,
+	RUN_PERF,
+	RUN_DEBUG
+};
+
+#ifdef VM_PROFILE
+#define PROFILE_STEP()							\
+	do {								\
+		if (mode == RUN_PROFILE)				\
+			profile_step (prof, (size_t) (ip - code));	\
+		if (mode == RUN_SAMPLE)					\
+			smp->ip = ip;					\
+	} while (0)
+#define PROFILE_CALL()								\
+	do {									\
+		if (mode == RUN_PROFILE)					\
+			profile_call (prof, (size_t) (csp - calls) - 1, ip->target);	\
+		if (mode == RUN_SAMPLE)						\
+			smp->csp = csp;						\
+	} while (0)
+#define PROFILE_RET()								\
+	do {									\
+		if (mode == RUN_PROFILE)					\
+			profile_ret (prof, (size_t) (csp - calls));		\
+		if (mode == RUN_SAMPLE)						\
+			smp->csp = csp;						\
+	} while (0)
+#define PROFILE_SWITCH()					\
+	do {							\
+		if (mode == RUN_SAMPLE) {			\
+			smp->ip = NULL;				\
+			smp->calls = calls;			\
+			smp->csp = csp;				\
+		}						\
+	} while (0)
+
+/* The perf copy counts stack cells a block at a time, as fuel is charged */
+#define PERF_CHARGE()						\
+	do {							\
+		if (mode == RUN_PERF)				\
+			stack_ops += stack_cost[ip - code];	\
+	} while (0)
+#define PERF_REFUND()						\
+	do {							\
+		if (mode == RUN_PERF)				\
+			stack_ops -= stack_cost[ip - code];	\
+	} while (0)
+#else
+#define PROFILE_STEP()	do { } while (0)
+#define PROFILE_CALL()	do { } while (0)
+#define PROFILE_RET()	do { } while (0)
+#define PROFILE_SWITCH()	do { } while (0)
+#define PERF_CHARGE()	do { } while (0)
+#define PERF_REFUND()	do { } while (0)
+#endif
+
+/* The debug copy stops after a command that stored to a watched page */
+#define WATCH_CHECK()					\
+	do {						\
+		if (mode == RUN_DEBUG && dbg->hit) {	\
+			res = VM_BREAK;			\
+			goto suspend;			\
+		}					\
+	} while (0)
+
+#define IS_EQUAL(a, b)		(!isunordered (a, b) && !islessgreater (a, b))
+#define IS_NOT_EQUAL(a, b)	(isunordered (a, b) || islessgreater (a, b))
+
+template <enum run_mode mode> __attribute__ ((noinline, aligned (64)))
+static enum vm_status run (struct vm *vm, struct task_worker *worker, const uint64_t budget);
+
+/*
+ * Operand stack lives in vm->stack, the top element is kept in tos and
+ * stack[0] is a scratch cell for the value of tos when the stack is empty.
+ * The verifier guarantees there is no underflow, overflow is checked on
+ * control transfers only.  Return addresses live on a separate call stack.
+ *
+ * Cells are 64-bit.  Untyped commands work on their low 32 bits, .q
+ * commands on the whole cell and .d commands on its double value.
+ *
+ * With a profile, sampling or perf counters started or a debugger attached
+ * the matching copy of the loop runs instead.  A program with task
+ * commands runs as task 0 on worker 0, the other workers enter the loop
+ * through vm_run_worker ().
+ *
+ * At most about budget commands run before vm_run returns VM_SUSPENDED,
+ * the next call goes on from there.  The first run of commands is let in
+ * whatever it costs, so every call makes progress.  vm->fuel_used sums
+ * what the calls were charged.
+ *
+ * A VM loaded with config.engine ENGINE_REG runs reg_run () on the
+ * translated code instead, without tasks and profiles.
+ */
+enum vm_status vm_run (struct vm *vm, const uint64_t budget)
+{
+	struct task_worker *worker = NULL;
+
+	if (budget != VM_FUEL_UNLIMITED && vm->config.workers > 1) {
+		fprintf (stderr, "Processor: more than one worker can't run on a budget\n");
+		return VM_ERR_LOAD;
+	}
+	if (vm->reg_code)
+		return reg_run (vm, budget);
+	if (vm->uses_tasks) {
+		if (!vm->sched && task_start (vm))
+			return VM_ERR_MEMORY;
+		worker = &vm->sched->workers[0];
+	}
+	if (vm->debug)
+		return run<RUN_DEBUG> (vm, worker, budget);
+#ifdef VM_PROFILE
+	if (vm->profile)
+		return run<RUN_PROFILE> (vm, worker, budget);
+	if (vm->sampler)
+		return run<RUN_SAMPLE> (vm, worker, budget);
+	if (vm->perf)
+		return run<RUN_PERF> (vm, worker, budget);
+#endif
+	return run<RUN_PLAIN> (vm, worker, budget);
+}
+
+enum vm_status vm_run_worker (struct vm *vm, struct task_worker *worker)
+{
+	return run<RUN_PLAIN> (vm, worker, VM_FUEL_UNLIMITED);
+}
+
+template <enum run_mode mode>
+static enum vm_status run (struct vm *vm, struct task_worker *worker, const uint64_t budget)
+{
+	const struct insn *const code = vm->code;
+	const struct insn *ip = code;
+	cell_t *stack = vm->stack;
+	cell_t *sp = stack;
+	const struct insn **calls = vm->calls;
+	const struct insn **csp = calls;
+	const struct insn **calls_end = calls + vm->config.call_depth;
+	cell_t *regs = vm->regs;
+	cell_t *const ram = vm->ram;
+	const uint64_t ram_mask = vm->ram_mask;
+	size_t limit = vm->stack_limit;
+	cell_t tos = 0, op1 = 0, op2 = 0;
+	struct vm_io *const io = &vm->io;
+	cell_t *vec_base[3] = {};
+	uint64_t addr = 0, vec_len = 0;
+	enum vm_status res = VM_HALTED;
+	struct sched *const sched = vm->sched;
+	struct task *cur = NULL;
+	bool stopped = false;
+	const uint32_t *const fuel_cost = vm->fuel_cost;
+	int64_t fuel = (budget > INT64_MAX) ? INT64_MAX : (int64_t) budget;
+	const int64_t fuel_start = fuel;
+	struct vm_debug *const dbg = vm->debug;
+	uint8_t op = 0;
+#ifdef VM_PROFILE
+	struct vm_profile *const prof = vm->profile;
+	struct vm_sampler *const smp = vm->sampler;
+	struct vm_perf *const perf = vm->perf;
+	const uint32_t *const stack_cost = (perf) ? perf->stack_cost : NULL;
+	uint64_t stack_ops = 0;
+
+	if (mode == RUN_PERF)
+		vm_perf_enable (perf);
+#endif
+
+	if (worker && worker->id)
+		goto next_task;
+	if (worker) {
+		cur = (sched->resume) ? sched->resume : (struct task *) sched->tasks.chunks[0][0];
+		sched->resume = NULL;
+		LOAD_TASK ();
+	} else if (vm->resume.ip) {
+		ip = vm->resume.ip;
+		sp = vm->resume.sp;
+		tos = vm->resume.tos;
+		csp = vm->resume.csp;
+	}
+	fuel -= fuel_cost[ip - code];
+	PERF_CHARGE ();
+
+	while (true) {
+		PROFILE_STEP ();
+		op = ip->op;
+dispatch:
+		switch (op) {
+			case OP_HLT:
+				if (cur && cur->id) {
+					task_exit (worker, cur, tos);
+					goto next_task;
+				}
+				goto out;
+			case OP_PUSH_IMM:
+				PUSH (ip->arg);
+				ip++;
+				break;
+			case OP_PUSH_REG:
+				PUSH ((cell_t) ((uint64_t) regs[ip->reg] + (uint64_t) ip->arg));
+				ip++;
+				break;
+			case OP_PUSH_MEM_IMM:
+				addr = (uint64_t) ip->arg;
+				CHECK_ADDR (addr);
+				PUSH (ram[addr]);
+				ip++;
+				break;
+			case OP_PUSH_MEM_REG:
+				addr = (uint64_t) regs[ip->reg] + (uint64_t) ip->arg;
+				CHECK_ADDR (addr);
+				PUSH (ram[addr]);
+				ip++;
+				break;
+			case OP_POP:
+				WRITE (io_print_pop, TYPE_INT);
+				break;
+			case OP_POP_Q:
+				WRITE (io_print_pop, TYPE_INT64);
+				break;
+			case OP_POP_D:
+				WRITE (io_print_pop, TYPE_DOUBLE);
+				break;
+			case OP_POP_REG:
+				POP (regs[ip->reg]);
+				ip++;
+				break;
+			case OP_POP_MEM_IMM:
+				addr = (uint64_t) ip->arg;
+				CHECK_ADDR (addr);
+				POP (ram[addr]);
+				ip++;
+				WATCH_CHECK ();
+				break;
+			case OP_POP_MEM_REG:
+				addr = (uint64_t) regs[ip->reg] + (uint64_t) ip->arg;
+				CHECK_ADDR (addr);
+				POP (ram[addr]);
+				ip++;
+				WATCH_CHECK ();
+				break;
+			case OP_ADD:
+				INT_OP (+);
+				break;
+			case OP_SUB:
+				INT_OP (-);
+				break;
+			case OP_MUL:
+				INT_OP (*);
+				break;
+			case OP_DIV:
+				if ((int32_t) tos == 0)
+					FAULT (VM_ERR_ZERO_DIV);
+				BINARY_OP (int_div (op1, tos));
+				break;
+			case OP_ADD_Q:
+				INT64_OP (+);
+				break;
+			case OP_SUB_Q:
+				INT64_OP (-);
+				break;
+			case OP_MUL_Q:
+				INT64_OP (*);
+				break;
+			case OP_DIV_Q:
+				if (tos == 0)
+					FAULT (VM_ERR_ZERO_DIV);
+				BINARY_OP (int64_div (op1, tos));
+				break;
+			case OP_ADD_D:
+				DOUBLE_OP (+);
+				break;
+			case OP_SUB_D:
+				DOUBLE_OP (-);
+				break;
+			case OP_MUL_D:
+				DOUBLE_OP (*);
+				break;
+			case OP_DIV_D:
+				DOUBLE_OP (/);
+				break;
+			case OP_IN:
+				READ (TYPE_INT);
+				break;
+			case OP_IN_Q:
+				READ (TYPE_INT64);
+				break;
+			case OP_IN_D:
+				READ (TYPE_DOUBLE);
+				break;
+			case OP_OUT:
+				WRITE (io_write, TYPE_INT);
+				break;
+			case OP_OUT_Q:
+				WRITE (io_write, TYPE_INT64);
+				break;
+			case OP_OUT_D:
+				WRITE (io_write, TYPE_DOUBLE);
+				break;
+			case OP_JMP:
+				CHECK_STACK ();
+				ip = code + ip->target;
+				CHARGE ();
+				break;
+			case OP_JA:
+				INT_JUMP (>);
+				break;
+			case OP_JAE:
+				INT_JUMP (>=);
+				break;
+			case OP_JB:
+				INT_JUMP (<);
+				break;
+			case OP_JBE:
+				INT_JUMP (<=);
+				break;
+			case OP_JE:
+				INT_JUMP (==);
+				break;
+			case OP_JNE:
+				INT_JUMP (!=);
+				break;
+			case OP_JA_Q:
+				INT64_JUMP (>);
+				break;
+			case OP_JAE_Q:
+				INT64_JUMP (>=);
+				break;
+			case OP_JB_Q:
+				INT64_JUMP (<);
+				break;
+			case OP_JBE_Q:
+				INT64_JUMP (<=);
+				break;
+			case OP_JE_Q:
+				INT64_JUMP (==);
+				break;
+			case OP_JNE_Q:
+				INT64_JUMP (!=);
+				break;
+			case OP_JA_D:
+				DOUBLE_JUMP (isgreater);
+				break;
+			case OP_JAE_D:
+				DOUBLE_JUMP (isgreaterequal);
+				break;
+			case OP_JB_D:
+				DOUBLE_JUMP (isless);
+				break;
+			case OP_JBE_D:
+				DOUBLE_JUMP (islessequal);
+				break;
+			case OP_JE_D:
+				DOUBLE_JUMP (IS_EQUAL);
+				break;
+			case OP_JNE_D:
+				DOUBLE_JUMP (IS_NOT_EQUAL);
+				break;
+			case OP_CALL:
+				CHECK_STACK ();
+				if (csp == calls_end)
+					FAULT (VM_ERR_CALL_OVERFLOW);
+				*csp++ = ip + 1;
+				PROFILE_CALL ();
+				ip = code + ip->target;
+				CHARGE ();
+				break;
+			case OP_RET:
+				CHECK_STACK ();
+				ip = *--csp;
+				PROFILE_RET ();
+				CHARGE ();
+				break;
+			case OP_CMPJ_A:
+				CMPJ_IF (>);
+				break;
+			case OP_CMPJ_AE:
+				CMPJ_IF (>=);
+				break;
+			case OP_CMPJ_B:
+				CMPJ_IF (<);
+				break;
+			case OP_CMPJ_BE:
+				CMPJ_IF (<=);
+				break;
+			case OP_CMPJ_E:
+				CMPJ_IF (==);
+				break;
+			case OP_CMPJ_NE:
+				CMPJ_IF (!=);
+				break;
+			case OP_ADD_RR:
+				REG_OP (regs[ip->arg], +);
+				break;
+			case OP_ADD_RI:
+				REG_OP (ip->arg, +);
+				break;
+			case OP_SUB_RR:
+				REG_OP (regs[ip->arg], -);
+				break;
+			case OP_SUB_RI:
+				REG_OP (ip->arg, -);
+				break;
+			case OP_MUL_RR:
+				REG_OP (regs[ip->arg], *);
+				break;
+			case OP_MUL_RI:
+				REG_OP (ip->arg, *);
+				break;
+			case OP_DIV_RR:
+			case OP_DIV_RI:
+				op2 = (ip->op == OP_DIV_RR) ? regs[ip->arg] : ip->arg;
+				if ((int32_t) op2 == 0)
+					FAULT (VM_ERR_ZERO_DIV);
+				regs[ip->reg] = int_div (regs[ip->reg2], op2);
+				ip++;
+				break;
+			case OP_VADD:
+			case OP_VMUL:
+				if (vm_run_vec (vm, regs, ip, &op1, &addr))
+					FAULT (VM_ERR_SEGFAULT);
+				ip++;
+				WATCH_CHECK ();
+				break;
+			case OP_VSUM:
+			case OP_VDOT:
+				if (vm_run_vec (vm, regs, ip, &op1, &addr))
+					FAULT (VM_ERR_SEGFAULT);
+				PUSH (op1);
+				ip++;
+				break;
+			case OP_VFILL:
+				POP (op1);
+				if (vm_run_vec (vm, regs, ip, &op1, &addr))
+					FAULT (VM_ERR_SEGFAULT);
+				ip++;
+				WATCH_CHECK ();
+				break;
+			case OP_VIN:
+			case OP_VOUT:
+				if (vm_vec_ranges (vm, regs, ip, vec_base, &vec_len, &addr))
+					FAULT (VM_ERR_SEGFAULT);
+				if (mode == RUN_DEBUG && ip->op == OP_VIN)
+					vm_debug_touch (vm);
+				IO_CALL ((ip->op == OP_VIN) ? io_read_block (io, ip->flags, vec_base[0], vec_len) :
+				                              io_write_block (io, ip->flags, vec_base[0], vec_len));
+				ip++;
+				WATCH_CHECK ();
+				break;
+			case OP_SPAWN:
+				CHECK_STACK ();
+				if (task_spawn (worker, code + ip->target, regs, &tos))
+					FAULT (VM_ERR_TASK);
+				CHECK_STOP ();
+				ip++;
+				CHARGE ();
+				break;
+			case OP_YIELD:
+				CHECK_STACK ();
+				ip++;
+				SAVE_TASK ();
+				cur = task_yield (worker, cur);
+				LOAD_TASK ();
+				CHECK_STOP ();
+				CHARGE ();
+				break;
+			case OP_JOIN:
+				CHECK_STACK ();
+				BLOCKING (task_join (worker, cur, &tos));
+				CHECK_STOP ();
+				ip++;
+				CHARGE ();
+				break;
+			case OP_CHAN:
+				CHECK_STACK ();
+				if (task_chan (worker, &tos))
+					FAULT (VM_ERR_TASK);
+				CHECK_STOP ();
+				ip++;
+				CHARGE ();
+				break;
+			case OP_SEND:
+				CHECK_STACK ();
+				BLOCKING (task_send (worker, cur, sp[-1], tos));
+				sp -= 2;
+				tos = *sp;
+				CHECK_STOP ();
+				ip++;
+				CHARGE ();
+				break;
+			case OP_RECV:
+				CHECK_STACK ();
+				BLOCKING (task_recv (worker, cur, &tos));
+				CHECK_STOP ();
+				ip++;
+				CHARGE ();
+				break;
+			case OP_TRAP:
+				if (mode != RUN_DEBUG)
+					FAULT (VM_ERR_LOAD);
+				if (ip != dbg->trap_ip) {
+					dbg->trap_ip = ip;
+					res = VM_BREAK;
+					goto suspend;
+				}
+				dbg->trap_ip = NULL;
+				op = dbg->ops[ip - code];
+				goto dispatch;
+			default:
+				fprintf (stderr, "Processor: unknown instruction %d\n", ip->op);
+				FAULT (VM_ERR_LOAD);
+		}
+		continue;
+
+next_task:
+		cur = task_next (worker);
+		if (!cur) {
+			stopped = true;
+			goto out;
+		}
+		LOAD_TASK ();
+		CHARGE ();
+	}
+
+suspend:
+	fuel += fuel_cost[ip - code];
+	PERF_REFUND ();
+	if (res != VM_BREAK)
+		res = VM_SUSPENDED;
+	if (cur) {
+		SAVE_TASK ();
+		sched->resume = cur;
+	} else {
+		vm->resume = {ip, sp, tos, csp};
+	}
+
+out:
+#ifdef VM_PROFILE
+	if (mode == RUN_PROFILE)
+		vm_profile_stop (vm);
+	if (mode == RUN_SAMPLE)
+		smp->ip = NULL;
+	if (mode == RUN_PERF) {
+		vm_perf_disable (perf);
+		perf->stack_ops += stack_ops;
+	}
+#endif
+	// Only worker 0 owns the VM, the others share its code and RAM
+	if (!worker || !worker->id) {
+		vm->fuel_used += (uint64_t) (fuel_start - fuel);
+		if (res != VM_SUSPENDED && res != VM_BREAK)
+			vm->resume = {};
+	}
+	if (sched && res != VM_SUSPENDED && res != VM_BREAK)
+		res = task_stop (worker, res, &stopped);
+	if ((!worker || !worker->id) && io_flush (io) && res == VM_HALTED) {
+		res = VM_ERR_IO;
+		stopped = false;
+	}
+	if (stopped)
+		return res;
+
+	vm_report_error (res, vm->insn_pc[ip - code], addr);
+	return res;
+}
+
+/* The messages of both engines, pc is a byte code offset */
+void vm_report_error (const enum vm_status res, const uint32_t pc, const uint64_t addr)
+{
+	switch (res) {
+		case VM_ERR_ZERO_DIV:
+			fprintf (stderr, "Processor: zero division at pc %u\n", pc);
+			break;
+		case VM_ERR_STACK_OVERFLOW:
+			fprintf (stderr, "Processor: stack overflow at pc %u\n", pc);
+			break;
+		case VM_ERR_CALL_OVERFLOW:
+			fprintf (stderr, "Processor: call stack overflow at pc %u\n", pc);
+			break;
+		case VM_ERR_SEGFAULT:
+			fprintf (stderr, "Processor: segmentation fault at pc %u, address %" PRId64 "\n",
+			         pc, (int64_t) addr);
+			break;
+		case VM_ERR_IO:
+			fprintf (stderr, "Processor: I/O error at pc %u\n", pc);
+			break;
+		case VM_ERR_TASK:
+			fprintf (stderr, "Processor: task command failed at pc %u\n", pc);
+			break;
+		case VM_HALTED:
+		case VM_SUSPENDED:
+		case VM_ERR_LOAD:
+		case VM_ERR_MEMORY:
+		case VM_ERR_DEADLOCK:
+		case VM_BREAK:
+		default:
+			break;
+	}
+}
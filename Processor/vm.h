@@ -0,0 +1,294 @@
+#ifndef VM_H
+#define VM_H
+
+#include "io.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#define REGS_NUM 4
+
+#define VM_STACK_SIZE (1 << 16)
+#define VM_CALL_DEPTH (1 << 16)
+#define VM_RAM_SIZE (1 << 20)
+#define VM_RAM_MAX (1UL << 31)
+#define VM_TASK_STACK 64
+#define VM_FUEL_UNLIMITED UINT64_MAX
+
+typedef int64_t cell_t;
+
+enum vm_op
+{
+	OP_HLT,
+	OP_PUSH_IMM,
+	OP_PUSH_REG,
+	OP_PUSH_MEM_IMM,
+	OP_PUSH_MEM_REG,
+	OP_POP,
+	OP_POP_REG,
+	OP_POP_MEM_IMM,
+	OP_POP_MEM_REG,
+	OP_ADD,
+	OP_SUB,
+	OP_MUL,
+	OP_DIV,
+	OP_IN,
+	OP_OUT,
+	OP_JMP,
+	OP_JA,
+	OP_JAE,
+	OP_JB,
+	OP_JBE,
+	OP_JE,
+	OP_JNE,
+	OP_CALL,
+	OP_RET,
+	OP_CMPJ_A,
+	OP_CMPJ_AE,
+	OP_CMPJ_B,
+	OP_CMPJ_BE,
+	OP_CMPJ_E,
+	OP_CMPJ_NE,
+	OP_ADD_RR,
+	OP_ADD_RI,
+	OP_SUB_RR,
+	OP_SUB_RI,
+	OP_MUL_RR,
+	OP_MUL_RI,
+	OP_DIV_RR,
+	OP_DIV_RI,
+	OP_POP_Q,
+	OP_POP_D,
+	OP_IN_Q,
+	OP_IN_D,
+	OP_OUT_Q,
+	OP_OUT_D,
+	OP_ADD_Q,
+	OP_SUB_Q,
+	OP_MUL_Q,
+	OP_DIV_Q,
+	OP_ADD_D,
+	OP_SUB_D,
+	OP_MUL_D,
+	OP_DIV_D,
+	OP_JA_Q,
+	OP_JAE_Q,
+	OP_JB_Q,
+	OP_JBE_Q,
+	OP_JE_Q,
+	OP_JNE_Q,
+	OP_JA_D,
+	OP_JAE_D,
+	OP_JB_D,
+	OP_JBE_D,
+	OP_JE_D,
+	OP_JNE_D,
+	OP_VADD,
+	OP_VMUL,
+	OP_VSUM,
+	OP_VDOT,
+	OP_VFILL,
+	OP_VIN,
+	OP_VOUT,
+	OP_SPAWN,
+	OP_YIELD,
+	OP_JOIN,
+	OP_CHAN,
+	OP_SEND,
+	OP_RECV,
+	OP_TRAP,	// breakpoint, see debugger.h
+	OP_NUM
+};
+
+/*
+ * Pre-decoded instruction: byte code is translated into an array of these
+ * at load time, jump targets become indices into the same array.
+ * Byte code offsets are kept apart in vm->insn_pc.
+ * Vector commands keep their registers in the bytes of arg and the value
+ * type in flags.
+ */
+struct insn
+{
+	uint8_t op;
+	uint8_t reg;
+	uint8_t reg2;
+	uint8_t flags;
+	int32_t target;
+	int64_t arg;
+};
+
+#define VEC_REG(insn, i) ((int) (((uint64_t) (insn)->arg >> (8 * (i))) & 0xff))
+
+enum vm_status
+{
+	VM_HALTED,
+	VM_SUSPENDED,
+	VM_ERR_LOAD,
+	VM_ERR_MEMORY,
+	VM_ERR_SEGFAULT,
+	VM_ERR_ZERO_DIV,
+	VM_ERR_STACK_OVERFLOW,
+	VM_ERR_CALL_OVERFLOW,
+	VM_ERR_IO,
+	VM_ERR_TASK,
+	VM_ERR_DEADLOCK,
+	VM_BREAK	// stopped by the debugger, vm_run goes on from there
+};
+
+/* The register engine translates the code at load time, see regvm.h */
+enum vm_engine
+{
+	ENGINE_STACK,
+	ENGINE_REG
+};
+
+struct vm_config
+{
+	size_t stack_size;
+	size_t call_depth;
+	size_t ram_size;
+	const char *ram_file;
+	const char *simd;
+	enum io_mode io;
+	int in_fd;
+	bool capture;
+	size_t task_stack;
+	size_t workers;
+	enum vm_engine engine;
+};
+
+/* Where a suspended run goes on, ip is NULL when there is none */
+struct vm_context
+{
+	const struct insn *ip;
+	cell_t *sp;
+	cell_t tos;
+	const struct insn **csp;
+};
+
+struct vec_kernels;
+struct vm_profile;
+struct vm_sampler;
+struct vm_perf;
+struct vm_debug;
+struct sched;
+struct task_worker;
+struct reg_code;
+struct reg_state;
+
+struct vm
+{
+	struct vm_config config = {};
+
+	struct insn *code = NULL;
+	size_t code_num = 0;
+	uint32_t *insn_pc = NULL;
+	int32_t *pc_map = NULL;
+	uint32_t *fuel_cost = NULL;
+	struct reg_code *reg_code = NULL;
+	size_t byte_code_len = 0;
+	uint64_t code_hash = 0;
+	bool shared_code = false;
+	bool uses_tasks = false;
+
+	cell_t *stack = NULL;
+	size_t stack_cap = 0;
+	size_t stack_limit = 0;
+
+	const struct insn **calls = NULL;
+	struct vm_context resume = {};
+	uint64_t fuel_used = 0;
+
+	cell_t regs[REGS_NUM] = {};
+	cell_t *ram = NULL;
+	size_t ram_words = 0;
+	uint64_t ram_mask = 0;
+
+	const struct vec_kernels *vec = NULL;
+	struct vm_io io = {};
+
+	struct vm_profile *profile = NULL;
+	struct vm_sampler *sampler = NULL;
+	struct vm_perf *perf = NULL;
+	struct vm_debug *debug = NULL;
+
+	struct sched *sched = NULL;
+	struct reg_state *reg = NULL;
+};
+
+static inline cell_t wrap32 (const uint64_t val)
+{
+	return (int32_t) (uint32_t) val;
+}
+
+static inline double to_double (const cell_t val)
+{
+	double res = 0;
+	memcpy (&res, &val, sizeof (res));
+	return res;
+}
+
+static inline cell_t from_double (const double val)
+{
+	cell_t res = 0;
+	memcpy (&res, &val, sizeof (res));
+	return res;
+}
+
+/* INT_MIN / -1 wraps around instead of trapping */
+static inline cell_t int_div (const cell_t op1, const cell_t op2)
+{
+	if ((int32_t) op2 == -1)
+		return wrap32 (0 - (uint64_t) op1);
+	return (int32_t) op1 / (int32_t) op2;
+}
+
+static inline cell_t int64_div (const cell_t op1, const cell_t op2)
+{
+	if (op2 == -1)
+		return (cell_t) (0 - (uint64_t) op1);
+	return op1 / op2;
+}
+
+static inline bool op_is_jump (const int op)
+{
+	return (op >= OP_JMP && op <= OP_CALL) || (op >= OP_CMPJ_A && op <= OP_CMPJ_NE) ||
+	       (op >= OP_JA_Q && op <= OP_JNE_D);
+}
+
+static inline bool op_has_target (const int op)
+{
+	return op_is_jump (op) || op == OP_SPAWN;
+}
+
+/* Task commands may switch to another task, so they end blocks too */
+static inline bool op_is_control (const int op)
+{
+	return op == OP_HLT || op == OP_RET || op_is_jump (op) || (op >= OP_SPAWN && op <= OP_RECV);
+}
+
+int vm_ctor (struct vm *vm, const struct vm_config *config);
+void vm_dtor (struct vm *vm);
+struct vm *vm_create (const struct vm_config *config);
+void vm_destroy (struct vm *vm);
+
+int vm_load (struct vm *vm, const char *byte_code, const size_t len, const uint32_t flags);
+int vm_share_code (struct vm *vm, const struct vm *src);
+enum vm_status vm_run (struct vm *vm, const uint64_t budget);
+enum vm_status vm_run_worker (struct vm *vm, struct task_worker *worker);
+
+int vm_vec_ranges (const struct vm *vm, const cell_t *regs, const struct insn *insn, cell_t **base,
+		   uint64_t *len, uint64_t *addr);
+int vm_run_vec (struct vm *vm, const cell_t *regs, const struct insn *insn, cell_t *val, uint64_t *addr);
+void vm_report_error (const enum vm_status res, const uint32_t pc, const uint64_t addr);
+
+int vm_map_ram (struct vm *vm);
+void vm_unmap_ram (struct vm *vm);
+
+int check_stack_depth (struct vm *vm);
+size_t count_stack_growth (const struct vm *vm);
+int stack_effect (const int op);
+int stack_cells (const int op);
+
+#endif // VM_H